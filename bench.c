@@ -0,0 +1,127 @@
+/* Copyright (c) 2009 River Tarnell <river@loreley.flyingparchment.org.uk>. */
+/*
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely. This software is provided 'as-is', without any express or implied
+ * warranty.
+ */
+
+/*
+ * Helpers for pdnsbench, farmbench, pdnsreplay and witasim.  None of
+ * this is part of wita.
+ */
+
+#include	<stdlib.h>
+#include	<stdio.h>
+#include	<string.h>
+
+#include	"bench.h"
+
+static char const *const bnames[] = {
+	"greet", "silent", "refuse", "blackhole", "mixed"
+};
+
+/*
+ * The behaviour called name, for -b or a schedule.  Exits if there's no
+ * such behaviour.
+ */
+behaviour_t
+bparse(prog, name)
+	char const	*prog, *name;
+{
+int	i;
+
+	for (i = 0; i <= B_MIXED; i++)
+		if (strcmp(name, bnames[i]) == 0)
+			return (behaviour_t) i;
+
+	(void) fprintf(stderr, "%s: unknown behaviour %s\n", prog, name);
+	exit(1);
+	/*NOTREACHED*/
+}
+
+/*
+ * Read a schedule of changes to n servers (called what, in messages)
+ * from file:
+ *
+ *	# seconds  behaviour  servers
+ *	10	refuse	0-99
+ *	20	greet	0-99
+ *
+ * Returns the changes in order, and their number in *nsched.  Exits if
+ * the file can't be read or is wrong.
+ */
+schedule_t *
+read_schedule(prog, file, what, n, nsched)
+	char const	*prog, *file, *what;
+	int		 n, *nsched;
+{
+FILE		*f;
+char		 line[256], *when, *how, *which, *p;
+int		 lineno = 0;
+schedule_t	*sched = NULL, *ev;
+
+	*nsched = 0;
+	if ((f = fopen(file, "r")) == NULL) {
+		perror(file);
+		exit(1);
+	}
+
+	while (fgets(line, sizeof line, f) != NULL) {
+		lineno++;
+		if ((when = strtok(line, " \t\n")) == NULL || *when == '#')
+			continue;
+
+		if ((how = strtok(NULL, " \t\n")) == NULL ||
+		    (which = strtok(NULL, " \t\n")) == NULL) {
+			(void) fprintf(stderr, "%s:%d: expected "
+					"<seconds> <behaviour> <%ss>\n",
+					file, lineno, what);
+			exit(1);
+		}
+
+		if ((sched = realloc(sched, (*nsched + 1) * sizeof(*sched))) == NULL) {
+			(void) fprintf(stderr, "%s: out of memory\n", prog);
+			exit(1);
+		}
+		ev = &sched[(*nsched)++];
+
+		ev->ev_when = (hrtime_t) (strtod(when, NULL) * NANOSEC);
+		if ((ev->ev_behaviour = bparse(prog, how)) == B_MIXED) {
+			(void) fprintf(stderr, "%s:%d: a %s can't be mixed\n",
+					file, lineno, what);
+			exit(1);
+		}
+
+		ev->ev_first = ev->ev_last = (int) strtol(which, &p, 10);
+		if (*p == '-')
+			ev->ev_last = (int) strtol(p + 1, &p, 10);
+		if (*p || ev->ev_first < 0 || ev->ev_last < ev->ev_first ||
+		    ev->ev_last >= n) {
+			(void) fprintf(stderr, "%s:%d: bad %ss %s "
+					"(there are %d)\n", file, lineno, what,
+					which, n);
+			exit(1);
+		}
+
+		if (*nsched > 1 && ev->ev_when < ev[-1].ev_when) {
+			(void) fprintf(stderr, "%s:%d: out of order\n", file, lineno);
+			exit(1);
+		}
+	}
+
+	(void) fclose(f);
+	return sched;
+}
+
+/*
+ * For qsort(), on latencies.
+ */
+int
+hrcmp(a, b)
+	void const	*a, *b;
+{
+hrtime_t	x = *(hrtime_t const *) a, y = *(hrtime_t const *) b;
+
+	return x < y ? -1 : x > y;
+}
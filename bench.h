@@ -0,0 +1,40 @@
+/* Copyright (c) 2009 River Tarnell <river@loreley.flyingparchment.org.uk>. */
+/*
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely. This software is provided 'as-is', without any express or implied
+ * warranty.
+ */
+
+/*
+ * What the benchmarks and the simulator share (see bench.c): how a
+ * simulated server behaves, the schedule of changes farmbench and
+ * witasim read with -f, and sorting latencies.
+ */
+
+#ifndef	BENCH_H
+#define	BENCH_H
+
+#include	<sys/types.h>
+#include	<sys/time.h>
+
+typedef enum {
+	B_GREET,
+	B_SILENT,
+	B_REFUSE,
+	B_BLACKHOLE,
+	B_MIXED		/* Only for -b */
+} behaviour_t;
+
+typedef struct {
+	hrtime_t	 ev_when;	/* After startup */
+	behaviour_t	 ev_behaviour;
+	int		 ev_first, ev_last;
+} schedule_t;
+
+behaviour_t	 bparse(char const *prog, char const *name);
+schedule_t	*read_schedule(char const *prog, char const *file,
+			char const *what, int n, int *nsched);
+int		 hrcmp(void const *, void const *);
+
+#endif	/* !BENCH_H */
@@ -6,25 +6,112 @@
  * warranty.
  */
   
+#include	<sys/resource.h>
+
 #include	<stdio.h>
 #include	<assert.h>
 #include	<errno.h>
 #include	<string.h>
 #include	<stdlib.h>
+#include	<stddef.h>
+#include	<limits.h>
 #include	<syslog.h>
 
 #include	"wita.h"
 
 config_t	*curconf;
 
+/*
+ * Configurations replaced by a reload.  Their servers are stopped at once,
+ * but events for them may still be waiting in the main loop's current
+ * batch, so we only free them from config_reap() once the batch is done.
+ */
+static config_t	*retired;
+
+static int	config_load(char const *);
 static void	free_configuration(config_t *);
+static void	retire_configuration(config_t *);
+static int	config_set(config_t *);
+static int	config_group_option(group_t *, char *);
+static int	config_fallbacks(config_t *);
+static int	fallback_loop(group_t *);
+static int	config_probes(config_t *);
+
+/*
+ * Tunables that can be changed with "set <name> <value>" in the
+ * configuration file.
+ */
+static struct {
+	char const	*name;
+	size_t		 offset;	/* Location in config_t */
+	int		 min, max;
+} intopts[] = {
+	{ "maxprobes",		offsetof(config_t, maxprobes),		0, INT_MAX },
+	{ "rise",		offsetof(config_t, rise),		1, INT_MAX },
+	{ "fall",		offsetof(config_t, fall),		1, INT_MAX },
+	{ "dampen-halflife",	offsetof(config_t, dampen_halflife),	0, INT_MAX },
+	{ "dampen-suppress",	offsetof(config_t, dampen_suppress),	1, INT_MAX },
+	{ "dampen-reuse",	offsetof(config_t, dampen_reuse),	1, INT_MAX },
+	{ "ttl-min",		offsetof(config_t, ttlmin),		0, INT_MAX },
+	{ "ttl-max",		offsetof(config_t, ttlmax),		0, INT_MAX },
+	{ "max-answers",	offsetof(config_t, maxanswers),		0, MAXANSWERS },
+	{ "report-threshold",	offsetof(config_t, report_threshold),	0, INT_MAX },
+	{ "quorum",		offsetof(config_t, quorum),		1, MAXPEERS },
+	{ "history",		offsetof(config_t, history),		0, HISTORY_MAX },
+};
+
+static struct {
+	char const	*name;
+	size_t		 offset;	/* Location of the (char *) in config_t */
+} stropts[] = {
+	{ "zone",		offsetof(config_t, zone) },
+	{ "soa-mname",		offsetof(config_t, soa_mname) },
+	{ "soa-rname",		offsetof(config_t, soa_rname) },
+	{ "serial-file",	offsetof(config_t, serial_file) },
+};
 
+/*
+ * Per-group settings, given as "<name>=<value>" on the group's line.
+ */
+static struct {
+	char const	*name;
+	size_t		 offset;	/* Location in group_t */
+	int		 min, max;
+} groupopts[] = {
+	{ "ttl-min",		offsetof(group_t, gr_ttlmin),		0, INT_MAX },
+	{ "ttl-max",		offsetof(group_t, gr_ttlmax),		0, INT_MAX },
+	{ "max-answers",	offsetof(group_t, gr_maxanswers),	0, MAXANSWERS },
+};
+
+/*
+ * File descriptors we keep back from the probe budget for stdin/stdout,
+ * syslog and anything else the process needs.
+ */
+#define	FD_RESERVE	32
+
+/*
+ * Load the configuration from file and make it current.  On error, the
+ * current configuration (if any) is left alone.
+ */
 int
 load_configuration(char const *file)
 {
+int	ret;
+
+	WITA_RELOAD_START((char *) file);
+	ret = config_load(file);
+	WITA_RELOAD_DONE((char *) file, ret);
+	return ret;
+}
+
+static int
+config_load(char const *file)
+{
 FILE		*f;
 char		 line[1024];
 config_t	*newconf;
+zone_t		*zone = NULL;
+int		 i;
 
 	assert(file);
 
@@ -39,10 +126,21 @@ config_t	*newconf;
 		return -1;
 	}
 
+	newconf->rise = 2;
+	newconf->fall = 2;
+	newconf->dampen_suppress = 3000;
+	newconf->dampen_reuse = 1500;
+	newconf->ttlmin = 5;
+	newconf->ttlmax = 60;
+	newconf->report_threshold = 3;
+	newconf->quorum = 1;
+	newconf->history = HISTORY_DEFAULT;
+
 	while (fgets(line, sizeof line, f) != NULL) {
 	char	*grname;
 	char	*sname;
-	int	 backup;
+	char	*p;
+	int	 backup, weight;
 	group_t	*group;
 
 		if (line[strlen(line) - 1] != '\n') {
@@ -60,22 +158,80 @@ config_t	*newconf;
 		if ((grname = strtok(line, " \t")) == NULL)
 			continue;
 
+		if (strcmp(grname, "set") == 0) {
+			if (config_set(newconf) == -1) {
+				(void) fclose(f);
+				free_configuration(newconf);
+				return -1;
+			}
+			continue;
+		}
+
+		if (strcmp(grname, "probe") == 0) {
+			if (config_probe(newconf) == -1) {
+				(void) fclose(f);
+				free_configuration(newconf);
+				return -1;
+			}
+			continue;
+		}
+
+		/*
+		 * "zone <name>": the groups that follow are in this zone.
+		 */
+		if (strcmp(grname, "zone") == 0) {
+			if ((p = strtok(NULL, " \t")) == NULL ||
+			    strtok(NULL, " \t") != NULL) {
+				syslog(LOG_ERR, "\"zone\" requires a zone name");
+				(void) fclose(f);
+				free_configuration(newconf);
+				return -1;
+			}
+
+			if ((zone = new_zone(newconf, p)) == NULL) {
+				(void) fclose(f);
+				free_configuration(newconf);
+				return -1;
+			}
+			continue;
+		}
+
 		if ((group = new_group(newconf, grname)) == NULL) {
 			syslog(LOG_ERR, "cannot allocate group: %m");
 			(void) fclose(f);
 			free_configuration(newconf);
 			return -1;
 		}
+		group->gr_zone = zone;
 
 		while ((sname = strtok(NULL, " \t")) != NULL) {
 		server_t	*sr;
 
+			if (strchr(sname, '=') != NULL) {
+				if (config_group_option(group, sname) == -1) {
+					(void) fclose(f);
+					free_configuration(newconf);
+					return -1;
+				}
+				continue;
+			}
+
 			if (*sname == '!') {
 				sname++;
 				backup = 1;
 			} else
 				backup = 0;
 
+			weight = 1;
+			if ((p = strchr(sname, '/')) != NULL) {
+				*p++ = 0;
+				if (parse_int("weight", p, 0, 65535, &weight) == -1) {
+					(void) fclose(f);
+					free_configuration(newconf);
+					return -1;
+				}
+			}
+
 			if ((sr = new_server(newconf, sname)) == NULL) {
 				syslog(LOG_ERR, "cannot allocate server: %m");
 				(void) fclose(f);
@@ -83,22 +239,422 @@ config_t	*newconf;
 				return -1;
 			}
 
-			if (add_server_to_group(group, sr, backup) == -1) {
-				syslog(LOG_ERR, "cannot add server to group: %m");
-				(void) fclose(f);
-				free_configuration(newconf);
-				return -1;
-			}
+			for (; sr; sr = sr->sr_nextaddr)
+				if (add_server_to_group(group, sr, backup, weight) == -1) {
+					syslog(LOG_ERR, "cannot add server to group: %m");
+					(void) fclose(f);
+					free_configuration(newconf);
+					return -1;
+				}
 		}
 	}
 
 	(void) fclose(f);
+	WITA_RELOAD_PARSED((char *) file);
 
-	free_configuration(curconf);
+	/*
+	 * If no probe limit was configured, derive one from the descriptor
+	 * limit so that probing can never exhaust it.
+	 */
+	if (newconf->maxprobes == 0) {
+	struct rlimit	rl;
+		if (getrlimit(RLIMIT_NOFILE, &rl) == -1 ||
+		    rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur > INT_MAX)
+			newconf->maxprobes = 1024;
+		else if (rl.rlim_cur > FD_RESERVE * 2)
+			newconf->maxprobes = (int) rl.rlim_cur - FD_RESERVE;
+		else
+			newconf->maxprobes = (int) rl.rlim_cur / 2;
+	}
+
+	if (newconf->dampen_reuse >= newconf->dampen_suppress) {
+		syslog(LOG_ERR, "dampen-reuse must be less than dampen-suppress");
+		free_configuration(newconf);
+		return -1;
+	}
+
+	/* Otherwise the capped penalty could never reach it. */
+	if ((double) newconf->dampen_suppress >
+	    (double) newconf->dampen_reuse * (1 << FLAP_MAXHOLD)) {
+		syslog(LOG_ERR, "dampen-suppress (%d) is more than %d times "
+				"dampen-reuse (%d), so a server would never be "
+				"held down", newconf->dampen_suppress,
+				1 << FLAP_MAXHOLD, newconf->dampen_reuse);
+		free_configuration(newconf);
+		return -1;
+	}
+
+	for (i = 0; i < newconf->ngroups; i++) {
+	group_t	*gr = newconf->groups[i];
+		if ((gr->gr_ttlmin != -1 ? gr->gr_ttlmin : newconf->ttlmin) >
+		    (gr->gr_ttlmax != -1 ? gr->gr_ttlmax : newconf->ttlmax)) {
+			syslog(LOG_ERR, "group %s: ttl-min is greater than ttl-max",
+					gr->gr_name);
+			free_configuration(newconf);
+			return -1;
+		}
+	}
+
+	/*
+	 * Groups from before the first "zone" line are in the default zone,
+	 * if there is one.
+	 */
+	if (newconf->zone) {
+	size_t	len = strlen(newconf->zone);
+		if (len > 1 && newconf->zone[len - 1] == '.')
+			newconf->zone[len - 1] = 0;
+
+		if ((zone = new_zone(newconf, newconf->zone)) == NULL) {
+			free_configuration(newconf);
+			return -1;
+		}
+
+		for (i = 0; i < newconf->ngroups; i++)
+			if (newconf->groups[i]->gr_zone == NULL)
+				newconf->groups[i]->gr_zone = zone;
+	}
+
+	/*
+	 * Fill in the SOA names if they weren't given.
+	 */
+	if (newconf->nzones > 0 && newconf->soa_mname == NULL &&
+	    (newconf->soa_mname = strdup("localhost.")) == NULL) {
+		syslog(LOG_ERR, "out of memory");
+		free_configuration(newconf);
+		return -1;
+	}
+
+	for (i = 0; i < newconf->nzones; i++) {
+	size_t	len;
+		zone = newconf->zones[i];
+		if (newconf->soa_rname) {
+			zone->zn_rname = strdup(newconf->soa_rname);
+		} else {
+			len = strlen(zone->zn_name) + sizeof "hostmaster..";
+			if ((zone->zn_rname = malloc(len)) != NULL)
+				(void) snprintf(zone->zn_rname, len, "hostmaster.%s.",
+						zone->zn_name);
+		}
+
+		if (zone->zn_rname == NULL) {
+			syslog(LOG_ERR, "out of memory");
+			free_configuration(newconf);
+			return -1;
+		}
+	}
+
+	if (config_fallbacks(newconf) == -1) {
+		free_configuration(newconf);
+		return -1;
+	}
+
+	if (config_probes(newconf) == -1) {
+		free_configuration(newconf);
+		return -1;
+	}
+
+	if (compile_qnames(newconf) == -1) {
+		free_configuration(newconf);
+		return -1;
+	}
+
+	if (history_start(newconf, curconf) == -1) {
+		free_configuration(newconf);
+		return -1;
+	}
+
+	/*
+	 * The new configuration may well answer differently.
+	 */
+	if (zone_serial == 0)
+		zone_serial_start(newconf->serial_file);
+	else
+		zone_serial_bump();
+
+	retire_configuration(curconf);
 	curconf = newconf;
 	return 0;
 }
 
+/*
+ * Stop all activity for an old configuration, and queue it to be freed.
+ */
+static void
+retire_configuration(conf)
+	config_t	*conf;
+{
+int	i;
+
+	if (conf == NULL)
+		return;
+
+	for (i = 0; i < conf->nservers; ++i)
+		server_stop_check(conf->servers[i]);
+
+	conf->retired_next = retired;
+	retired = conf;
+}
+
+/*
+ * Free any retired configurations.  Called by the main loop when it has
+ * no events left that could refer to them.
+ */
+void
+config_reap()
+{
+config_t	*conf;
+
+	while ((conf = retired) != NULL) {
+		retired = conf->retired_next;
+		free_configuration(conf);
+	}
+}
+
+/*
+ * Handle a "set <name> <value>" line.  The "set" itself has already been
+ * consumed by strtok().
+ */
+static int
+config_set(conf)
+	config_t	*conf;
+{
+char	*name, *value;
+size_t	 i;
+
+	if ((name = strtok(NULL, " \t")) == NULL ||
+	    (value = strtok(NULL, " \t")) == NULL) {
+		syslog(LOG_ERR, "\"set\" requires an option name and a value");
+		return -1;
+	}
+
+	for (i = 0; i < sizeof intopts / sizeof *intopts; i++) {
+		if (strcmp(name, intopts[i].name) != 0)
+			continue;
+
+		return parse_int(name, value, intopts[i].min, intopts[i].max,
+				(int *) ((char *) conf + intopts[i].offset));
+	}
+
+	for (i = 0; i < sizeof stropts / sizeof *stropts; i++) {
+	char	**p;
+		if (strcmp(name, stropts[i].name) != 0)
+			continue;
+
+		p = (char **) ((char *) conf + stropts[i].offset);
+		free(*p);
+		if ((*p = strdup(value)) == NULL) {
+			syslog(LOG_ERR, "out of memory");
+			return -1;
+		}
+		return 0;
+	}
+
+	syslog(LOG_ERR, "unknown option \"%s\"", name);
+	return -1;
+}
+
+/*
+ * Handle a "<name>=<value>" option on a group line.
+ */
+static int
+config_group_option(group, opt)
+	group_t	*group;
+	char	*opt;
+{
+char	*value;
+size_t	 i;
+
+	value = strchr(opt, '=');
+	*value++ = 0;
+
+	/*
+	 * fallback=<group>[,<group>...]; the groups may not have been
+	 * defined yet, so they're looked up once the file has been read.
+	 */
+	if (strcmp(opt, "fallback") == 0) {
+		free(group->gr_fallback_names);
+		if ((group->gr_fallback_names = strdup(value)) == NULL) {
+			syslog(LOG_ERR, "out of memory");
+			return -1;
+		}
+		return 0;
+	}
+
+	if (strcmp(opt, "probe") == 0) {
+		free(group->gr_probe_name);
+		if ((group->gr_probe_name = strdup(value)) == NULL) {
+			syslog(LOG_ERR, "out of memory");
+			return -1;
+		}
+		return 0;
+	}
+
+	for (i = 0; i < sizeof groupopts / sizeof *groupopts; i++) {
+		if (strcmp(opt, groupopts[i].name) != 0)
+			continue;
+
+		return parse_int(opt, value, groupopts[i].min, groupopts[i].max,
+				(int *) ((char *) group + groupopts[i].offset));
+	}
+
+	syslog(LOG_ERR, "group %s: unknown option \"%s\"", group->gr_name, opt);
+	return -1;
+}
+
+/*
+ * Resolve the "probe=" options, and give each group's servers its probe.
+ * A server in several groups has to be checked the same way in all of
+ * them.
+ */
+static int
+config_probes(conf)
+	config_t	*conf;
+{
+int		 i, j;
+group_t		*gr;
+server_t	*sr;
+
+	for (i = 0; i < conf->ngroups; i++) {
+		gr = conf->groups[i];
+		if (gr->gr_probe_name == NULL)
+			continue;
+
+		if ((gr->gr_probe = find_probe(conf, gr->gr_probe_name)) == NULL) {
+			syslog(LOG_ERR, "group %s: probe %s does not exist",
+					gr->gr_name, gr->gr_probe_name);
+			return -1;
+		}
+
+		for (j = 0; j < gr->gr_nservers; j++) {
+			sr = gr->gr_servers[j]->sg_server;
+			if (sr->sr_probe && sr->sr_probe != gr->gr_probe) {
+				syslog(LOG_ERR, "group %s: server %s already uses "
+						"probe %s", gr->gr_name, sr->sr_spec,
+						sr->sr_probe->pr_name);
+				return -1;
+			}
+			if (server_set_probe(sr, gr->gr_probe) == -1)
+				return -1;
+		}
+	}
+
+	/*
+	 * A server with a probe in one group and none in another would
+	 * be checked with the probe; that's more likely a mistake.
+	 */
+	for (i = 0; i < conf->ngroups; i++) {
+		gr = conf->groups[i];
+		if (gr->gr_probe)
+			continue;
+
+		for (j = 0; j < gr->gr_nservers; j++) {
+			sr = gr->gr_servers[j]->sg_server;
+			if (sr->sr_probe) {
+				syslog(LOG_ERR, "group %s: server %s uses probe %s "
+						"in another group", gr->gr_name,
+						sr->sr_spec, sr->sr_probe->pr_name);
+				return -1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Resolve the "fallback=" options, now that every group is known.  A
+ * fallback must be in the same zone as the group, and no group may
+ * (even indirectly) fall back to itself.
+ */
+static int
+config_fallbacks(conf)
+	config_t	*conf;
+{
+int	 i;
+group_t	*gr, *fb;
+char	*name;
+
+	for (i = 0; i < conf->ngroups; i++) {
+		gr = conf->groups[i];
+		if (gr->gr_fallback_names == NULL)
+			continue;
+
+		for (name = strtok(gr->gr_fallback_names, ","); name;
+		     name = strtok(NULL, ",")) {
+			if ((fb = find_group(conf, gr->gr_zone, name)) == NULL) {
+				syslog(LOG_ERR, "group %s: fallback group %s "
+						"does not exist", gr->gr_name, name);
+				return -1;
+			}
+
+			if (add_group_fallback(gr, fb) == -1)
+				return -1;
+		}
+
+		free(gr->gr_fallback_names);
+		gr->gr_fallback_names = NULL;
+	}
+
+	for (i = 0; i < conf->ngroups; i++)
+		if (fallback_loop(conf->groups[i]))
+			return -1;
+
+	return 0;
+}
+
+/*
+ * Depth-first search for a loop in the fallbacks reachable from gr.
+ * gr_mark is 1 while a group is on the current path, 2 once it's known
+ * not to lead to a loop.
+ */
+static int
+fallback_loop(gr)
+	group_t	*gr;
+{
+int	i;
+
+	if (gr->gr_mark == 2)
+		return 0;
+
+	if (gr->gr_mark == 1) {
+		syslog(LOG_ERR, "group %s: fallback groups form a loop",
+				gr->gr_name);
+		return 1;
+	}
+
+	gr->gr_mark = 1;
+	for (i = 0; i < gr->gr_nfallbacks; i++)
+		if (fallback_loop(gr->gr_fallbacks[i]))
+			return 1;
+	gr->gr_mark = 2;
+
+	return 0;
+}
+
+/*
+ * Parse the value of an integer option.
+ */
+int
+parse_int(name, value, min, max, res)
+	char const	*name, *value;
+	int		 min, max;
+	int		*res;
+{
+char	*ep;
+long	 v;
+
+	errno = 0;
+	v = strtol(value, &ep, 10);
+	if (errno != 0 || *ep != 0 || ep == value || v < min || v > max) {
+		syslog(LOG_ERR, "invalid value \"%s\" for option %s",
+				value, name);
+		return -1;
+	}
+
+	*res = (int) v;
+	return 0;
+}
+
 void
 free_configuration(conf)
 	config_t	*conf;
@@ -112,7 +668,28 @@ int	i;
 		free_group(conf->groups[i]);
 	free(conf->groups);
 
+	for (i = 0; i < conf->nservers; ++i) {
+		server_stop_check(conf->servers[i]);
+		free_server(conf->servers[i]);
+	}
 	free(conf->servers);
+	free(conf->hosthash);
+	free(conf->targethash);
+	free(conf->addrhash);
+	free(conf->checkrecs);
+
+	for (i = 0; i < conf->nprobes; ++i)
+		free_probe(conf->probes[i]);
+	free(conf->probes);
+
+	free_qnames(conf);
+	for (i = 0; i < conf->nzones; ++i)
+		free_zone(conf->zones[i]);
+	free(conf->zones);
 
+	free(conf->zone);
+	free(conf->soa_mname);
+	free(conf->soa_rname);
+	free(conf->serial_file);
 	free(conf);
 }
@@ -0,0 +1,447 @@
+/* Copyright (c) 2009 River Tarnell <river@loreley.flyingparchment.org.uk>. */
+/*
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely. This software is provided 'as-is', without any express or implied
+ * warranty.
+ */
+
+/*
+ * The control socket, given with -C, for changing the running
+ * configuration without a reload.  Each command is a line, and its reply
+ * ends with a line that's either "ok" or "error <reason>":
+ *
+ *	drain <server>		stop handing the server out
+ *	undrain <server>	hand it out again (if it's up)
+ *	check <server>		check it now
+ *	add <group> <server>	add a server to a group; "!server" makes it
+ *				a backup, and "server/10" gives its weight
+ *	remove <group> <server>	take a server out of a group
+ *	dump [<name>]		show the state of every server and group,
+ *				or of one
+ *	history <server> [<n>]	the server's last n checks (all we have,
+ *				by default), oldest first
+ *	latency <server> [<s>]	percentiles of how long the server's
+ *				successful checks took in the last s
+ *				seconds (or all we have), and how many
+ *				failed
+ *
+ * A server can be named as in the configuration (meaning all of its
+ * addresses) or by one address, as in failure reports (see report.c).
+ * A group is named as it would be in a query.  A server that's added
+ * but isn't in the configuration yet is resolved, which blocks until the
+ * lookup is done, and checked straight away.
+ *
+ * Everything here changes the live configuration in place, so nothing
+ * else is disturbed: no other server loses its state.  None of it is
+ * saved, though; a reload goes back to what the configuration file says.
+ *
+ * history gives a line for each address of the server, then one for each
+ * check:
+ *
+ *	check time=1255000000.250 age=12.040 took=0.312 phase=read result=ok
+ *	check time=1255000005.251 age=7.039 took=0.101 phase=connect
+ *	    result=fail error=Connection refused
+ *
+ * where time is when the check finished (seconds since the epoch), age
+ * is how long ago that was, took is in milliseconds and phase is how far
+ * the check got.  error is only there for failures, and always last.
+ * latency's times are in milliseconds too.
+ */
+
+#include	<sys/time.h>
+
+#include	<limits.h>
+#include	<stdlib.h>
+#include	<stdio.h>
+#include	<string.h>
+#include	<strings.h>
+#include	<syslog.h>
+
+#include	"wita.h"
+
+#define	CTL_MAXOUT	(64 * 1024 * 1024)	/* Room for a dump of a large farm */
+
+static void	ctl_line(uclient_t *, char *);
+static void	ctl_server(uclient_t *, char const *, char *);
+static void	ctl_add(uclient_t *, group_t *, char *);
+static void	ctl_remove(uclient_t *, group_t *, char *);
+static void	ctl_dump(uclient_t *, char const *);
+static void	ctl_dump_server(uclient_t *, server_t *);
+static void	ctl_dump_group(uclient_t *, group_t *);
+static void	ctl_history(uclient_t *, char const *, char const *);
+static void	ctl_latency(uclient_t *, char const *, char const *);
+
+static char const *const statenames[] = {
+	"idle", "queued", "connect", "write", "read", "stopped"
+};
+
+static char const *const resultnames[NPROBE_RESULTS] = {
+	"ok", "fail", "timeout"
+};
+
+/*
+ * Start accepting commands on a unix socket.
+ */
+int
+ctl_listen(path)
+	char const	*path;
+{
+	if (ulisten(path, ctl_line, NULL, CTL_MAXOUT) == NULL)
+		return -1;
+
+	syslog(LOG_INFO, "accepting control commands on %s", path);
+	return 0;
+}
+
+static void
+ctl_line(uc, line)
+	uclient_t	*uc;
+	char		*line;
+{
+char	*cmd, *arg, *arg2, *last;
+group_t	*group;
+
+	if ((cmd = strtok_r(line, " \t", &last)) == NULL)
+		return;
+	arg = strtok_r(NULL, " \t", &last);
+	arg2 = strtok_r(NULL, " \t", &last);
+
+	if (strcmp(cmd, "dump") == 0) {
+		ctl_dump(uc, arg);
+		return;
+	}
+
+	if (strcmp(cmd, "drain") == 0 || strcmp(cmd, "undrain") == 0 ||
+	    strcmp(cmd, "check") == 0) {
+		if (arg == NULL) {
+			uclient_printf(uc, "error missing server\n");
+			return;
+		}
+		ctl_server(uc, cmd, arg);
+		return;
+	}
+
+	if (strcmp(cmd, "history") == 0 || strcmp(cmd, "latency") == 0) {
+		if (arg == NULL) {
+			uclient_printf(uc, "error missing server\n");
+			return;
+		}
+		if (*cmd == 'h')
+			ctl_history(uc, arg, arg2);
+		else
+			ctl_latency(uc, arg, arg2);
+		return;
+	}
+
+	if (strcmp(cmd, "add") == 0 || strcmp(cmd, "remove") == 0) {
+		if (arg == NULL || arg2 == NULL) {
+			uclient_printf(uc, "error usage: %s <group> <server>\n", cmd);
+			return;
+		}
+
+		if ((group = find_group_qname(curconf, arg)) == NULL) {
+			uclient_printf(uc, "error no such group %s\n", arg);
+			return;
+		}
+
+		if (*cmd == 'a')
+			ctl_add(uc, group, arg2);
+		else
+			ctl_remove(uc, group, arg2);
+		return;
+	}
+
+	uclient_printf(uc, "error unknown command\n");
+}
+
+/*
+ * drain, undrain or check every server that name matches.
+ */
+static void
+ctl_server(uc, cmd, name)
+	uclient_t	*uc;
+	char const	*cmd;
+	char		*name;
+{
+server_t	*sr;
+int		 n = 0, busy = 0;
+
+	for (sr = NULL; (sr = find_server_report(curconf, name, sr)) != NULL; n++) {
+		switch (*cmd) {
+		case 'd':
+			server_drain(sr, 1);
+			break;
+		case 'u':
+			server_drain(sr, 0);
+			break;
+		case 'c':
+			if (server_check_now(sr) == -1)
+				busy++;
+			break;
+		}
+	}
+
+	if (n == 0)
+		uclient_printf(uc, "error no such server %s\n", name);
+	else if (busy)
+		uclient_printf(uc, "ok %d servers, %d already being checked\n",
+				n, busy);
+	else
+		uclient_printf(uc, "ok %d servers\n", n);
+}
+
+static void
+ctl_add(uc, group, name)
+	uclient_t	*uc;
+	group_t		*group;
+	char		*name;
+{
+server_t	*sr, *first, *added;
+char		*p;
+int		 backup = 0, weight = 1, isnew, i, n = 0;
+
+	if (*name == '!') {
+		backup = 1;
+		name++;
+	}
+
+	if ((p = strchr(name, '/')) != NULL) {
+		*p++ = 0;
+		if (parse_int("weight", p, 0, 65535, &weight) == -1) {
+			uclient_printf(uc, "error bad weight %s\n", p);
+			return;
+		}
+	}
+
+	isnew = (first = find_server(curconf, name)) == NULL;
+	if (isnew && (first = new_server(curconf, name)) == NULL) {
+		uclient_printf(uc, "error cannot add server %s\n", name);
+		return;
+	}
+
+	for (sr = first; sr; sr = sr->sr_nextaddr) {
+		for (i = 0; i < sr->sr_ngroups; i++)
+			if (sr->sr_groups[i]->sg_group == group) {
+				uclient_printf(uc, "error %s is already in %s\n",
+						name, group->gr_name);
+				goto fail;
+			}
+
+		/* A server is checked the same way in every group. */
+		if (isnew && group->gr_probe) {
+			if (server_set_probe(sr, group->gr_probe) == -1) {
+				uclient_printf(uc, "error out of memory\n");
+				goto fail;
+			}
+		} else if (sr->sr_probe != group->gr_probe) {
+			uclient_printf(uc, "error %s is checked with a different "
+					"probe from %s\n", name, group->gr_name);
+			goto fail;
+		}
+	}
+
+	for (sr = first; sr; sr = sr->sr_nextaddr, n++)
+		if (add_server_to_group(group, sr, backup, weight) == -1) {
+			uclient_printf(uc, "error cannot add server %s\n", name);
+			for (added = first; added != sr; added = added->sr_nextaddr)
+				(void) remove_server_from_group(group, added);
+			goto fail;
+		}
+
+	if (isnew)
+		for (sr = first; sr; sr = sr->sr_nextaddr)
+			server_start_connect_check(sr);
+
+	syslog(LOG_NOTICE, "%s: added to group %s%s", name, group->gr_name,
+			backup ? " as a backup" : "");
+	uclient_printf(uc, "ok %d servers\n", n);
+	return;
+
+fail:
+	/*
+	 * Don't leave a server we've just made in the configuration, in
+	 * no group and never checked.
+	 */
+	if (isnew)
+		forget_server(curconf, first);
+}
+
+static void
+ctl_remove(uc, group, name)
+	uclient_t	*uc;
+	group_t		*group;
+	char		*name;
+{
+server_t	*sr;
+int		 n = 0;
+
+	for (sr = NULL; (sr = find_server_report(curconf, name, sr)) != NULL; )
+		if (remove_server_from_group(group, sr) == 0)
+			n++;
+
+	if (n == 0) {
+		uclient_printf(uc, "error %s is not in %s\n", name, group->gr_name);
+		return;
+	}
+
+	syslog(LOG_NOTICE, "%s: removed from group %s", name, group->gr_name);
+	uclient_printf(uc, "ok %d servers\n", n);
+}
+
+/*
+ * Show every server and group, or only those name matches.
+ */
+static void
+ctl_dump(uc, name)
+	uclient_t	*uc;
+	char const	*name;
+{
+server_t	*sr;
+group_t		*group;
+int		 i;
+
+	if (name == NULL) {
+		for (i = 0; i < curconf->nservers; i++)
+			ctl_dump_server(uc, curconf->servers[i]);
+		for (i = 0; i < curconf->ngroups; i++)
+			ctl_dump_group(uc, curconf->groups[i]);
+		uclient_printf(uc, "ok\n");
+		return;
+	}
+
+	for (sr = NULL; (sr = find_server_report(curconf, name, sr)) != NULL; )
+		ctl_dump_server(uc, sr);
+
+	if ((group = find_group_qname(curconf, name)) != NULL) {
+		ctl_dump_group(uc, group);
+		for (i = 0; i < group->gr_nservers; i++)
+			ctl_dump_server(uc, group->gr_servers[i]->sg_server);
+	}
+
+	uclient_printf(uc, "ok\n");
+}
+
+static void
+ctl_dump_server(uc, sr)
+	uclient_t	*uc;
+	server_t	*sr;
+{
+int	ndown, nvotes;
+
+	server_votes(sr, &ndown, &nvotes);
+	uclient_printf(uc, "server %s address=%s port=%s state=%s online=%d "
+			"healthy=%d drained=%d suppressed=%d suspect=%d "
+			"succ=%d fail=%d penalty=%.0f reports=%d groups=%d "
+			"votes=%d/%d\n",
+			sr->sr_spec, sr->sr_address, sr->sr_port,
+			statenames[sr->sr_state], sr->sr_online, sr->sr_healthy,
+			sr->sr_drained, sr->sr_suppressed, sr->sr_suspect,
+			sr->sr_nsucc, sr->sr_nfail, sr->sr_penalty,
+			sr->sr_nreports, sr->sr_ngroups, ndown, nvotes);
+}
+
+static void
+ctl_dump_group(uc, group)
+	uclient_t	*uc;
+	group_t		*group;
+{
+	uclient_printf(uc, "group %s zone=%s servers=%d up4=%d backup4=%d "
+			"up6=%d backup6=%d source4=%s source6=%s ttl=%d\n",
+			group->gr_name,
+			group->gr_zone ? group->gr_zone->zn_name : "-",
+			group->gr_nservers,
+			group->gr_nup[0], group->gr_nbackup_up[0],
+			group->gr_nup[1], group->gr_nbackup_up[1],
+			group->gr_source[0] ? group->gr_source[0]->gr_name : "-",
+			group->gr_source[1] ? group->gr_source[1]->gr_name : "-",
+			group_ttl(group));
+}
+
+/*
+ * Show the last n (or all) checks of every server name matches.
+ */
+static void
+ctl_history(uc, name, nstr)
+	uclient_t	*uc;
+	char const	*name, *nstr;
+{
+server_t		*sr;
+checkrec_t const	*cr;
+struct timeval		 tv;
+hrtime_t		 now, age, wall;
+int			 i, n = HISTORY_MAX, nsr = 0;
+
+	if (nstr != NULL && parse_int("checks", nstr, 1, INT_MAX, &n) == -1) {
+		uclient_printf(uc, "error bad number of checks %s\n", nstr);
+		return;
+	}
+
+	(void) gettimeofday(&tv, NULL);
+	wall = (hrtime_t) tv.tv_sec * NANOSEC + (hrtime_t) tv.tv_usec * 1000;
+	now = gethrtime();
+
+	for (sr = NULL; (sr = find_server_report(curconf, name, sr)) != NULL; nsr++) {
+		uclient_printf(uc, "server %s address=%s port=%s checks=%d\n",
+				sr->sr_spec, sr->sr_address, sr->sr_port,
+				sr->sr_histlen);
+
+		for (i = sr->sr_histlen > n ? sr->sr_histlen - n : 0;
+		     (cr = history_get(sr, i)) != NULL; i++) {
+			age = now - cr->cr_when;
+			uclient_printf(uc, "check time=%lld.%03d age=%.3f took=%.3f "
+					"phase=%s result=%s",
+					(long long) ((wall - age) / NANOSEC),
+					(int) ((wall - age) % NANOSEC / 1000000),
+					(double) age / NANOSEC,
+					cr->cr_took / 1000.0,
+					statenames[cr->cr_phase],
+					resultnames[cr->cr_result]);
+			if (cr->cr_result == PROBE_FAIL)
+				uclient_printf(uc, " error=%s", strerror(cr->cr_error));
+			uclient_printf(uc, "\n");
+		}
+	}
+
+	if (nsr == 0)
+		uclient_printf(uc, "error no such server %s\n", name);
+	else
+		uclient_printf(uc, "ok\n");
+}
+
+/*
+ * Show how long the checks of every server name matches took, in the last
+ * secs seconds (or all we have).
+ */
+static void
+ctl_latency(uc, name, secs)
+	uclient_t	*uc;
+	char const	*name, *secs;
+{
+server_t	*sr;
+checkstats_t	 cs;
+int		 s = 0, nsr = 0;
+
+	if (secs != NULL && parse_int("seconds", secs, 1, INT_MAX, &s) == -1) {
+		uclient_printf(uc, "error bad number of seconds %s\n", secs);
+		return;
+	}
+
+	for (sr = NULL; (sr = find_server_report(curconf, name, sr)) != NULL; nsr++) {
+		history_stats(sr, (hrtime_t) s * NANOSEC, &cs);
+		uclient_printf(uc, "server %s address=%s port=%s ok=%d fail=%d "
+				"timeout=%d p50=%.3f p90=%.3f p99=%.3f max=%.3f\n",
+				sr->sr_spec, sr->sr_address, sr->sr_port,
+				cs.cs_n[PROBE_OK], cs.cs_n[PROBE_FAIL],
+				cs.cs_n[PROBE_TIMEOUT],
+				(double) cs.cs_p50 / 1000000,
+				(double) cs.cs_p90 / 1000000,
+				(double) cs.cs_p99 / 1000000,
+				(double) cs.cs_max / 1000000);
+	}
+
+	if (nsr == 0)
+		uclient_printf(uc, "error no such server %s\n", name);
+	else
+		uclient_printf(uc, "ok\n");
+}
@@ -0,0 +1,860 @@
+/* Copyright (c) 2009 River Tarnell <river@loreley.flyingparchment.org.uk>. */
+/*
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely. This software is provided 'as-is', without any express or implied
+ * warranty.
+ */
+
+/*
+ * Native DNS server.  Instead of answering PowerDNS over a pipe, wita can
+ * answer DNS queries itself over UDP and TCP.  Queries are matched to
+ * groups and answered exactly as for PowerDNS, using find_group_qname()
+ * and group_answer(), or group_srv_answer() for SRV queries.
+ *
+ * Everything runs in the main event loop.  A wakeup on a UDP socket
+ * handles up to DNS_BATCH queries before going back to the port, so a
+ * busy socket doesn't starve health checks.
+ */
+
+#include	<sys/types.h>
+#include	<sys/socket.h>
+#include	<sys/filio.h>
+#include	<netinet/in.h>
+
+#include	<stdlib.h>
+#include	<string.h>
+#include	<strings.h>
+#include	<errno.h>
+#include	<netdb.h>
+#include	<unistd.h>
+#include	<syslog.h>
+#include	<assert.h>
+#include	<port.h>
+
+#include	"wita.h"
+
+#define	DNS_PORT	"53"
+#define	DNS_UDPMAX	512	/* Largest UDP response (we don't do EDNS) */
+#define	DNS_TCPMAX	16384	/* Largest TCP response */
+#define	DNS_QUERYMAX	512	/* Largest query we accept */
+#define	DNS_BATCH	64	/* UDP queries or TCP reads per wakeup */
+#define	DNS_MAXCONN	256	/* Concurrent TCP connections */
+
+#define	DNS_HDRLEN	12
+
+#define	DNS_T_A		1
+#define	DNS_T_AAAA	28
+#define	DNS_T_SRV	33
+#define	DNS_T_ANY	255
+#define	DNS_C_IN	1
+
+#define	DNS_F_QR	0x8000
+#define	DNS_F_OPCODE	0x7800
+#define	DNS_F_AA	0x0400
+#define	DNS_F_TC	0x0200
+#define	DNS_F_RD	0x0100
+
+#define	DNS_R_FORMERR	1
+#define	DNS_R_NXDOMAIN	3
+#define	DNS_R_NOTIMP	4
+#define	DNS_R_REFUSED	5
+
+#define	GET16(p)	((unsigned) ((p)[0] << 8) | (p)[1])
+#define	PUT16(p, v)	((p)[0] = ((v) >> 8) & 0xff, (p)[1] = (v) & 0xff)
+#define	PUT32(p, v)	(PUT16((p), (v) >> 16), PUT16((p) + 2, (v)))
+
+/*
+ * A listening socket, UDP or TCP.
+ */
+typedef struct dnssock {
+	evsource_t	 ds_ev;		/* Must be first */
+	int		 ds_fd;
+} dnssock_t;
+
+/*
+ * A TCP client.  Connections are kept in most-recently-used order, so
+ * when we run out of room the one that's been idle longest is dropped.
+ * A connection that's closed is only freed by dns_flush(), after the
+ * batch of events, since one of them might still be for it.
+ */
+typedef struct dnsconn {
+	evsource_t	 dc_ev;		/* Must be first */
+	int		 dc_fd;
+	size_t		 dc_nin;	/* Bytes in dc_in */
+	size_t		 dc_nout;	/* Bytes in dc_out */
+	size_t		 dc_outoff;	/* Bytes of dc_out already written */
+	int		 dc_closing;	/* Free at the end of this batch */
+	struct dnsconn	*dc_next, *dc_prev;
+	u_char		 dc_in[2 + DNS_QUERYMAX];
+	u_char		 dc_out[2 + DNS_TCPMAX];
+} dnsconn_t;
+
+static dnsconn_t	*conn_head, *conn_tail;
+static dnsconn_t	*conn_dead;	/* Closed, for dns_flush(); on dc_next */
+static int		 nconns;
+
+static void	dns_udp_event(evsource_t *, port_event_t *);
+static void	dns_accept_event(evsource_t *, port_event_t *);
+static void	dns_conn_event(evsource_t *, port_event_t *);
+static void	dns_conn_close(dnsconn_t *);
+static size_t	dns_answer(u_char const *, size_t, u_char *, size_t);
+static size_t	dns_respond(u_char const *, size_t, u_char *, size_t, char *,
+			group_t **);
+static int	dns_wait(int, int, evsource_t *);
+static int	dns_socket(struct addrinfo *, char const *);
+static size_t	dns_put_rr(u_char *, size_t, size_t, unsigned, unsigned, unsigned,
+			u_char const *, size_t);
+static size_t	dns_put_name(u_char *, size_t, char const *);
+static size_t	dns_put_addr(u_char *, size_t, size_t, unsigned, server_t *,
+			unsigned);
+static size_t	dns_srv(group_t *, u_char *, size_t, size_t);
+static int	dns_nomatch(char const *);
+
+/*
+ * Start answering DNS on the given address, which is "host", "host:port",
+ * "[v6addr]" or "[v6addr]:port".  A host of "*" means all addresses.
+ */
+int
+dns_listen(addr)
+	char const	*addr;
+{
+char		*host, *sport, *p;
+struct addrinfo	 hints, *res = NULL;
+dnssock_t	*udp = NULL, *tcp = NULL;
+int		 i;
+
+	assert(addr);
+
+	if ((host = strdup(addr)) == NULL) {
+		syslog(LOG_ERR, "out of memory");
+		return -1;
+	}
+
+	sport = DNS_PORT;
+	if (*host == '[') {
+		if ((p = strchr(host, ']')) == NULL) {
+			syslog(LOG_ERR, "%s: missing ']' in listen address", addr);
+			goto err;
+		}
+		*p++ = 0;
+		if (*p == ':')
+			sport = p + 1;
+		(void) memmove(host, host + 1, strlen(host + 1) + 1);
+	} else if ((p = strchr(host, ':')) != NULL && strchr(p + 1, ':') == NULL) {
+		*p++ = 0;
+		sport = p;
+	}
+
+	bzero(&hints, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	hints.ai_flags = AI_PASSIVE;
+
+	if ((i = getaddrinfo(strcmp(host, "*") == 0 ? NULL : host, sport,
+			&hints, &res)) != 0) {
+		syslog(LOG_ERR, "cannot resolve listen address %s: %s",
+				addr, gai_strerror(i));
+		goto err;
+	}
+
+	if ((udp = calloc(1, sizeof(*udp))) == NULL ||
+	    (tcp = calloc(1, sizeof(*tcp))) == NULL) {
+		syslog(LOG_ERR, "out of memory");
+		goto err;
+	}
+	udp->ds_fd = tcp->ds_fd = -1;
+	udp->ds_ev.es_handler = dns_udp_event;
+	tcp->ds_ev.es_handler = dns_accept_event;
+
+	/* After an upgrade, we already have them. */
+	if ((udp->ds_fd = upgrade_fd("dns-udp", addr)) == -1) {
+		if ((udp->ds_fd = dns_socket(res, addr)) == -1)
+			goto err;
+		upgrade_keep("dns-udp", addr, udp->ds_fd);
+	}
+
+	if ((tcp->ds_fd = upgrade_fd("dns-tcp", addr)) == -1) {
+		res->ai_socktype = SOCK_STREAM;
+		res->ai_protocol = 0;
+		if ((tcp->ds_fd = dns_socket(res, addr)) == -1)
+			goto err;
+
+		if (listen(tcp->ds_fd, 128) == -1) {
+			syslog(LOG_ERR, "%s: listen: %m", addr);
+			goto err;
+		}
+		upgrade_keep("dns-tcp", addr, tcp->ds_fd);
+	}
+
+	if (dns_wait(udp->ds_fd, POLLIN, &udp->ds_ev) == -1 ||
+	    dns_wait(tcp->ds_fd, POLLIN, &tcp->ds_ev) == -1)
+		goto err;
+
+	syslog(LOG_INFO, "answering DNS queries on %s", addr);
+	freeaddrinfo(res);
+	free(host);
+	return 0;
+
+err:
+	if (udp && udp->ds_fd != -1)
+		(void) close(udp->ds_fd);
+	if (tcp && tcp->ds_fd != -1)
+		(void) close(tcp->ds_fd);
+	free(udp);
+	free(tcp);
+	if (res)
+		freeaddrinfo(res);
+	free(host);
+	return -1;
+}
+
+/*
+ * Create a non-blocking socket bound to the given address.
+ */
+static int
+dns_socket(ai, addr)
+	struct addrinfo	*ai;
+	char const	*addr;
+{
+int	fd, on = 1;
+
+	if ((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) == -1) {
+		syslog(LOG_ERR, "%s: socket: %m", addr);
+		return -1;
+	}
+
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on) == -1) {
+		syslog(LOG_ERR, "%s: setsockopt(SO_REUSEADDR): %m", addr);
+		(void) close(fd);
+		return -1;
+	}
+
+	if (bind(fd, ai->ai_addr, ai->ai_addrlen) == -1) {
+		syslog(LOG_ERR, "%s: bind: %m", addr);
+		(void) close(fd);
+		return -1;
+	}
+
+	if (ioctl(fd, FIONBIO, &on) == -1) {
+		syslog(LOG_ERR, "%s: ioctl(FIONBIO): %m", addr);
+		(void) close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/*
+ * (Re-)associate a socket with the event port.
+ */
+static int
+dns_wait(fd, events, es)
+	int		 fd, events;
+	evsource_t	*es;
+{
+	if (port_associate(port, PORT_SOURCE_FD, fd, events, es) == -1) {
+		syslog(LOG_ERR, "dns_wait: cannot associate fd: port_associate: %m");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Queries are waiting on a UDP socket.
+ */
+static void
+dns_udp_event(es, ev)
+	evsource_t	*es;
+	port_event_t	*ev;
+{
+dnssock_t		*ds = (dnssock_t *) es;
+struct sockaddr_storage	 from;
+socklen_t		 fromlen;
+u_char			 query[DNS_QUERYMAX], resp[DNS_UDPMAX];
+ssize_t			 n;
+size_t			 rlen;
+int			 i;
+
+	for (i = 0; i < DNS_BATCH; i++) {
+		fromlen = sizeof from;
+		if ((n = recvfrom(ds->ds_fd, query, sizeof query, 0,
+				(struct sockaddr *) &from, &fromlen)) == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			if (errno == EINTR)
+				continue;
+			syslog(LOG_ERR, "dns_udp_event: recvfrom: %m");
+			break;
+		}
+
+		if ((rlen = dns_answer(query, (size_t) n, resp, sizeof resp)) == 0)
+			continue;
+
+		/*
+		 * If the socket buffer is full, the client will retry.
+		 */
+		(void) sendto(ds->ds_fd, resp, rlen, 0,
+				(struct sockaddr *) &from, fromlen);
+	}
+
+	if (dns_wait(ds->ds_fd, POLLIN, &ds->ds_ev) == -1)
+		exit(1);
+}
+
+/*
+ * A TCP client is connecting.
+ */
+static void
+dns_accept_event(es, ev)
+	evsource_t	*es;
+	port_event_t	*ev;
+{
+dnssock_t	*ds = (dnssock_t *) es;
+dnsconn_t	*dc;
+int		 fd, on = 1;
+
+	while ((fd = accept(ds->ds_fd, NULL, NULL)) != -1) {
+		if (nconns >= DNS_MAXCONN)
+			dns_conn_close(conn_tail);
+
+		if ((dc = calloc(1, sizeof(*dc))) == NULL) {
+			syslog(LOG_ERR, "out of memory (trying to continue anyway)");
+			(void) close(fd);
+			continue;
+		}
+
+		if (ioctl(fd, FIONBIO, &on) == -1) {
+			syslog(LOG_ERR, "dns_accept_event: ioctl(FIONBIO): %m");
+			(void) close(fd);
+			free(dc);
+			continue;
+		}
+
+		dc->dc_ev.es_handler = dns_conn_event;
+		dc->dc_fd = fd;
+		if ((dc->dc_next = conn_head) != NULL)
+			conn_head->dc_prev = dc;
+		else
+			conn_tail = dc;
+		conn_head = dc;
+		nconns++;
+
+		if (dns_wait(fd, POLLIN, &dc->dc_ev) == -1)
+			dns_conn_close(dc);
+	}
+
+	if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR &&
+	    errno != ECONNABORTED)
+		syslog(LOG_ERR, "dns_accept_event: accept: %m");
+
+	if (dns_wait(ds->ds_fd, POLLIN, &ds->ds_ev) == -1)
+		exit(1);
+}
+
+/*
+ * A TCP client can be read from or written to.  Queries are answered one
+ * at a time: we don't read the next until the last answer has been sent.
+ */
+static void
+dns_conn_event(es, ev)
+	evsource_t	*es;
+	port_event_t	*ev;
+{
+dnsconn_t	*dc = (dnsconn_t *) es;
+ssize_t		 n;
+size_t		 qlen, rlen;
+int		 i;
+
+	/*
+	 * Dropped earlier in this batch to make room for a new client.
+	 */
+	if (dc->dc_closing)
+		return;
+
+	/*
+	 * Move to the front of the idle list.
+	 */
+	if (dc != conn_head) {
+		dc->dc_prev->dc_next = dc->dc_next;
+		if (dc->dc_next)
+			dc->dc_next->dc_prev = dc->dc_prev;
+		else
+			conn_tail = dc->dc_prev;
+		dc->dc_prev = NULL;
+		dc->dc_next = conn_head;
+		conn_head->dc_prev = dc;
+		conn_head = dc;
+	}
+
+	for (i = 0; i < DNS_BATCH; i++) {
+		/*
+		 * Finish writing the last answer.
+		 */
+		if (dc->dc_outoff < dc->dc_nout) {
+			if ((n = write(dc->dc_fd, dc->dc_out + dc->dc_outoff,
+					dc->dc_nout - dc->dc_outoff)) == -1) {
+				if (errno == EAGAIN || errno == EWOULDBLOCK) {
+					if (dns_wait(dc->dc_fd, POLLOUT, &dc->dc_ev) == -1)
+						dns_conn_close(dc);
+					return;
+				}
+				dns_conn_close(dc);
+				return;
+			}
+			dc->dc_outoff += n;
+			continue;
+		}
+		dc->dc_nout = dc->dc_outoff = 0;
+
+		/*
+		 * If there's a whole query buffered, answer it.
+		 */
+		if (dc->dc_nin >= 2) {
+			qlen = GET16(dc->dc_in);
+			if (qlen < DNS_HDRLEN || qlen > DNS_QUERYMAX) {
+				dns_conn_close(dc);
+				return;
+			}
+
+			if (dc->dc_nin >= qlen + 2) {
+				rlen = dns_answer(dc->dc_in + 2, qlen,
+						dc->dc_out + 2, DNS_TCPMAX);
+				dc->dc_nin -= qlen + 2;
+				(void) memmove(dc->dc_in, dc->dc_in + qlen + 2, dc->dc_nin);
+				if (rlen > 0) {
+					PUT16(dc->dc_out, rlen);
+					dc->dc_nout = rlen + 2;
+				}
+				continue;
+			}
+		}
+
+		switch (n = read(dc->dc_fd, dc->dc_in + dc->dc_nin,
+				sizeof dc->dc_in - dc->dc_nin)) {
+		case 0:
+			dns_conn_close(dc);
+			return;
+
+		case -1:
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				if (dns_wait(dc->dc_fd, POLLIN, &dc->dc_ev) == -1)
+					dns_conn_close(dc);
+				return;
+			}
+			dns_conn_close(dc);
+			return;
+
+		default:
+			dc->dc_nin += n;
+			break;
+		}
+	}
+
+	/*
+	 * We've done our share for this wakeup.  There may be a query
+	 * already buffered, which POLLIN wouldn't tell us about; POLLOUT
+	 * will bring us straight back here.
+	 */
+	if (dns_wait(dc->dc_fd, POLLOUT, &dc->dc_ev) == -1)
+		dns_conn_close(dc);
+}
+
+/*
+ * Disconnect a client.  Closing the socket dissociates it from the port,
+ * but this batch of events might still have one for it, so it's freed
+ * later by dns_flush().
+ */
+static void
+dns_conn_close(dc)
+	dnsconn_t	*dc;
+{
+	if (dc->dc_prev)
+		dc->dc_prev->dc_next = dc->dc_next;
+	else
+		conn_head = dc->dc_next;
+	if (dc->dc_next)
+		dc->dc_next->dc_prev = dc->dc_prev;
+	else
+		conn_tail = dc->dc_prev;
+	nconns--;
+
+	(void) close(dc->dc_fd);
+	dc->dc_closing = 1;
+	dc->dc_prev = NULL;
+	dc->dc_next = conn_dead;
+	conn_dead = dc;
+}
+
+/*
+ * Free the clients closed during this batch.  Called by the main loop
+ * after each batch of events.
+ */
+void
+dns_flush()
+{
+dnsconn_t	*dc;
+
+	while ((dc = conn_dead) != NULL) {
+		conn_dead = dc->dc_next;
+		free(dc);
+	}
+}
+
+/*
+ * Answer a query, and time it.
+ */
+static size_t
+dns_answer(q, qlen, r, rmax)
+	u_char const	*q;
+	size_t		 qlen;
+	u_char		*r;
+	size_t		 rmax;
+{
+hrtime_t	 start;
+size_t		 rlen;
+char		 name[256];
+group_t		*group = NULL;
+
+	WITA_QUERY_START(QUERY_DNS);
+
+	start = gethrtime();
+	rlen = dns_respond(q, qlen, r, rmax, name, &group);
+	hist_add(&metrics.m_query_time[QUERY_DNS], gethrtime() - start);
+
+	/* Anything longer than a header has the question, so a name. */
+	if (WITA_QUERY_DONE_ENABLED())
+		WITA_QUERY_DONE(QUERY_DNS, rlen > DNS_HDRLEN ? name : "",
+				group ? group->gr_name : "",
+				rlen > DNS_HDRLEN ? GET16(r + 6) : 0);
+	return rlen;
+}
+
+/*
+ * Build the response to a query.  Returns the length of the response, or
+ * 0 if the query should be ignored.  If the response is longer than a
+ * header, the name asked for is left in name (which has room for 256
+ * bytes).  The group that answered, if any, is left in *groupp.
+ */
+static size_t
+dns_respond(q, qlen, r, rmax, name, groupp)
+	u_char const	*q;
+	size_t		 qlen;
+	u_char		*r;
+	size_t		 rmax;
+	char		*name;
+	group_t		**groupp;
+{
+unsigned	 flags, qtype, qclass, ttl;
+size_t		 off, rlen, newlen, namelen = 0;
+group_t		*group;
+server_t	*answer[MAXANSWERS], *sr;
+int		 i, n, f, nans = 0;
+int		 want[NFAMILIES] = { 0, 0 };
+
+	if (qlen < DNS_HDRLEN)
+		return 0;
+
+	flags = GET16(q + 2);
+	if (flags & DNS_F_QR)
+		return 0;
+
+	/*
+	 * Start with a header-only response; if we fail before the
+	 * question is parsed, that's what we send.
+	 */
+	bzero(r, DNS_HDRLEN);
+	r[0] = q[0];
+	r[1] = q[1];
+	PUT16(r + 2, DNS_F_QR | DNS_F_AA | (flags & (DNS_F_OPCODE | DNS_F_RD)));
+
+	if (flags & DNS_F_OPCODE) {
+		r[3] |= DNS_R_NOTIMP;
+		return DNS_HDRLEN;
+	}
+
+	if (GET16(q + 4) != 1) {
+		r[3] |= DNS_R_FORMERR;
+		return DNS_HDRLEN;
+	}
+
+	/*
+	 * Decode the name into dotted form.
+	 */
+	off = DNS_HDRLEN;
+	for (;;) {
+	size_t	llen;
+		if (off >= qlen) {
+			r[3] |= DNS_R_FORMERR;
+			return DNS_HDRLEN;
+		}
+
+		if ((llen = q[off++]) == 0)
+			break;
+
+		/* Compression isn't allowed in the question. */
+		if (llen > 63 || off + llen > qlen ||
+		    namelen + llen + 1 >= 256) {
+			r[3] |= DNS_R_FORMERR;
+			return DNS_HDRLEN;
+		}
+
+		if (namelen)
+			name[namelen++] = '.';
+		(void) memcpy(name + namelen, q + off, llen);
+
+		/* A name we can't write down can't be one of ours. */
+		if (memchr(name + namelen, '.', llen) != NULL ||
+		    memchr(name + namelen, 0, llen) != NULL) {
+			r[3] |= DNS_R_REFUSED;
+			return DNS_HDRLEN;
+		}
+
+		namelen += llen;
+		off += llen;
+	}
+	name[namelen] = 0;
+
+	if (off + 4 > qlen || off + 4 > rmax) {
+		r[3] |= DNS_R_FORMERR;
+		return DNS_HDRLEN;
+	}
+	qtype = GET16(q + off);
+	qclass = GET16(q + off + 2);
+	off += 4;
+
+	/*
+	 * Echo the question back.
+	 */
+	(void) memcpy(r + DNS_HDRLEN, q + DNS_HDRLEN, off - DNS_HDRLEN);
+	PUT16(r + 4, 1);
+	rlen = off;
+
+	if (qclass != DNS_C_IN) {
+		r[3] |= DNS_R_REFUSED;
+		return rlen;
+	}
+
+	if (qtype == DNS_T_SRV) {
+		if ((group = find_group_srv(curconf, name)) == NULL) {
+			metrics.m_unknown[QUERY_DNS]++;
+			r[3] |= dns_nomatch(name);
+			return rlen;
+		}
+		group->gr_nqueries++;
+		*groupp = group;
+		return dns_srv(group, r, rlen, rmax);
+	}
+
+	if (qtype == DNS_T_ANY)
+		want[0] = want[1] = 1;
+	else if (qtype == DNS_T_A)
+		want[0] = 1;
+	else if (qtype == DNS_T_AAAA)
+		want[1] = 1;
+
+	if ((group = find_group_qname(curconf, name)) == NULL) {
+		/*
+		 * It might be a server's own name, from an SRV target.
+		 */
+		if ((sr = find_server_host(curconf, name)) == NULL) {
+			metrics.m_unknown[QUERY_DNS]++;
+			r[3] |= dns_nomatch(name);
+			return rlen;
+		}
+
+		for (; sr; sr = sr->sr_nextaddr) {
+			if (!want[FAMILY_INDEX(sr->sr_family)])
+				continue;
+			if ((newlen = dns_put_addr(r, rlen, rmax, DNS_HDRLEN, sr,
+					(unsigned) curconf->ttlmax)) == 0) {
+				r[2] |= DNS_F_TC >> 8;
+				break;
+			}
+			rlen = newlen;
+			nans++;
+		}
+
+		PUT16(r + 6, nans);
+		return rlen;
+	}
+
+	group->gr_nqueries++;
+	*groupp = group;
+	ttl = (unsigned) group_ttl(group);
+	for (f = 0; f < NFAMILIES; f++) {
+		if (!want[f])
+			continue;
+
+		n = group_answer(group, f ? AF_INET6 : AF_INET, namelen,
+				f ? 16 : 4, answer);
+
+		for (i = 0; i < n; i++) {
+			if ((newlen = dns_put_addr(r, rlen, rmax, DNS_HDRLEN,
+					answer[i], ttl)) == 0) {
+				r[2] |= DNS_F_TC >> 8;
+				break;
+			}
+			rlen = newlen;
+			nans++;
+		}
+	}
+
+	PUT16(r + 6, nans);
+	return rlen;
+}
+
+/*
+ * Return the response code for a name that isn't a group or a server.
+ * If we have zones, a name outside all of them isn't ours to deny; the
+ * apex of a zone exists, but has no addresses.
+ */
+static int
+dns_nomatch(name)
+	char const	*name;
+{
+int	apex;
+
+	if (find_zone_qname(curconf, name, &apex) != NULL)
+		return apex ? 0 : DNS_R_NXDOMAIN;
+	return curconf->nzones > 0 ? DNS_R_REFUSED : DNS_R_NXDOMAIN;
+}
+
+/*
+ * Add the SRV records for a group to the response in r, which is rlen
+ * bytes so far, followed by the address of each target in the additional
+ * section.  Returns the new length of the response.
+ */
+static size_t
+dns_srv(group, r, rlen, rmax)
+	group_t	*group;
+	u_char	*r;
+	size_t	 rlen, rmax;
+{
+server_group_t		*answer[MAXANSWERS];
+server_t		*hosts[MAXANSWERS], *sr;
+size_t			 targets[MAXANSWERS];
+u_char			 rdata[6 + 256];
+char			 target[256];
+size_t			 tlen, newlen;
+unsigned		 ttl;
+int			 i, n, nans = 0, nadd = 0;
+
+	ttl = (unsigned) group_ttl(group);
+	n = group_srv_answer(group, answer);
+
+	for (i = 0; i < n; i++) {
+		if (server_target(answer[i]->sg_server, target, sizeof target) == -1 ||
+		    (tlen = dns_put_name(rdata + 6, sizeof rdata - 6, target)) == 0)
+			continue;
+
+		PUT16(rdata, answer[i]->sg_backup);
+		PUT16(rdata + 2, answer[i]->sg_weight);
+		PUT16(rdata + 4, server_portnum(answer[i]->sg_server));
+
+		if ((newlen = dns_put_rr(r, rlen, rmax, DNS_HDRLEN, DNS_T_SRV, ttl,
+				rdata, 6 + tlen)) == 0) {
+			r[2] |= DNS_F_TC >> 8;
+			break;
+		}
+
+		/* Where the target name went, for the additional records. */
+		hosts[nans] = answer[i]->sg_server->sr_host;
+		targets[nans++] = rlen + 12 + 6;
+		rlen = newlen;
+	}
+	PUT16(r + 6, nans);
+
+	/*
+	 * Addresses for the targets, if there's room.  The owner name is
+	 * a pointer to the target in the SRV record.
+	 */
+	for (i = 0; i < nans; i++) {
+		for (sr = hosts[i]; sr; sr = sr->sr_nextaddr) {
+			if ((newlen = dns_put_addr(r, rlen, rmax, targets[i], sr,
+					(unsigned) curconf->ttlmax)) == 0)
+				goto full;
+			rlen = newlen;
+			nadd++;
+		}
+	}
+full:
+	PUT16(r + 10, nadd);
+
+	return rlen;
+}
+
+/*
+ * Append an A or AAAA record for the server's address.
+ */
+static size_t
+dns_put_addr(r, rlen, rmax, nameoff, sr, ttl)
+	u_char		*r;
+	size_t		 rlen, rmax;
+	unsigned	 nameoff;
+	server_t	*sr;
+	unsigned	 ttl;
+{
+void const	*addr;
+int		 len;
+
+	len = server_addr(sr, &addr);
+	return dns_put_rr(r, rlen, rmax, nameoff,
+			sr->sr_family == AF_INET6 ? DNS_T_AAAA : DNS_T_A, ttl,
+			addr, (size_t) len);
+}
+
+/*
+ * Append a resource record whose owner is a compression pointer to
+ * nameoff.  Returns the new length, or 0 if it doesn't fit.
+ */
+static size_t
+dns_put_rr(r, rlen, rmax, nameoff, type, ttl, rdata, rdlen)
+	u_char		*r;
+	size_t		 rlen, rmax;
+	unsigned	 nameoff, type, ttl;
+	u_char const	*rdata;
+	size_t		 rdlen;
+{
+	if (rlen + 12 + rdlen > rmax)
+		return 0;
+
+	PUT16(r + rlen, 0xc000 | nameoff);
+	PUT16(r + rlen + 2, type);
+	PUT16(r + rlen + 4, DNS_C_IN);
+	PUT32(r + rlen + 6, ttl);
+	PUT16(r + rlen + 10, rdlen);
+	(void) memcpy(r + rlen + 12, rdata, rdlen);
+	return rlen + 12 + rdlen;
+}
+
+/*
+ * Encode a dotted name in wire format.  Returns its length, or 0 if it
+ * doesn't fit or isn't a valid name.
+ */
+static size_t
+dns_put_name(p, room, name)
+	u_char		*p;
+	size_t		 room;
+	char const	*name;
+{
+size_t		 len = 0, llen;
+char const	*dot;
+
+	while (*name) {
+		if ((dot = strchr(name, '.')) == NULL)
+			dot = name + strlen(name);
+		llen = dot - name;
+		if (llen == 0 || llen > 63 || len + llen + 2 > room)
+			return 0;
+
+		p[len++] = (u_char) llen;
+		(void) memcpy(p + len, name, llen);
+		len += llen;
+
+		name = *dot ? dot + 1 : dot;
+	}
+
+	p[len++] = 0;
+	return len;
+}
@@ -0,0 +1,868 @@
+/* Copyright (c) 2009 River Tarnell <river@loreley.flyingparchment.org.uk>. */
+/*
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely. This software is provided 'as-is', without any express or implied
+ * warranty.
+ */
+
+/*
+ * farmbench: see how the checks in server.c cope with a large farm.
+ *
+ * It runs a farm of loopback listeners, one per server, on many ports
+ * and (with -a) many 127.x addresses, and runs wita to check them.  Each
+ * listener behaves in one of four ways:
+ *
+ *	greet		accept and send a byte, like MySQL; the only way
+ *			to be up
+ *	silent		accept and say nothing, so the check times out
+ *			reading
+ *	refuse		not listening, so connections are refused
+ *	blackhole	listening with a full accept queue, never
+ *			accepting, so the check times out
+ *
+ * Everything starts out greeting.  Listeners change behaviour on a
+ * schedule, read from a file given with -f:
+ *
+ *	# seconds  behaviour  listeners
+ *	10	refuse	0-99
+ *	20	greet	0-99
+ *	30	silent	500
+ *
+ * with times counted from when wita first has every server up; or at
+ * random, with -k: every -i seconds, k listeners chosen at random flip
+ * between greeting and a failure (-b, or a mix of all three).
+ *
+ * farmbench subscribes to every group (see sub.c), so it sees each
+ * change to a server's state as soon as wita makes it, and reports:
+ *
+ *	- how long wita took to find every server up to begin with
+ *	- detection latency: from a listener changing to wita changing the
+ *	  server's state, as percentiles, and how many changes wita never
+ *	  saw or that were undone before it did
+ *	- checks per second, from wita's metrics file
+ *	- CPU time per check (user + system, for wita's whole run)
+ *	- how many file descriptors wita had open, on average and at most
+ *
+ * Options:
+ *
+ *	-n <n>		number of listeners (1000)
+ *	-a <n>		spread them over this many addresses, 127.0.0.1
+ *			upwards (1)
+ *	-g <n>		servers per group (40, which is also the most)
+ *	-t <secs>	how long to run after startup (60)
+ *	-f <file>	schedule of changes
+ *	-k <n>		listeners to flip at random each interval
+ *	-i <secs>	interval between random flips (10)
+ *	-b <behaviour>	what flipped listeners do: silent, refuse,
+ *			blackhole or mixed (mixed)
+ *	-e <line>	add a line to wita's configuration, e.g.
+ *			-e "set fall 1" (may be repeated)
+ *	-r <seed>	random seed (1)
+ *	-w <path>	the wita to run (./wita)
+ *
+ * Addresses other than 127.0.0.1 need to be configured on the loopback
+ * interface first, except on systems (like Linux) that answer for all of
+ * 127/8.  The farm holds a descriptor per listener and per silent
+ * connection, and wita one per check in progress, so both raise their
+ * limit on descriptors as far as they can.
+ */
+
+#include	<sys/types.h>
+#include	<sys/socket.h>
+#include	<sys/resource.h>
+#include	<sys/filio.h>
+#include	<sys/stat.h>
+#include	<sys/wait.h>
+#include	<sys/un.h>
+#include	<netinet/in.h>
+#include	<arpa/inet.h>
+
+#include	<stdlib.h>
+#include	<stdio.h>
+#include	<string.h>
+#include	<strings.h>
+#include	<errno.h>
+#include	<unistd.h>
+#include	<signal.h>
+#include	<dirent.h>
+#include	<ctype.h>
+#include	<port.h>
+
+#include	"wita.h"
+#include	"bench.h"
+
+#define	BASEPORT	20000	/* Listeners start at this port */
+#define	MAXGROUP	40	/* So a group's line fits in wita's 1024 bytes */
+#define	MAXEXTRA	32	/* -e lines */
+#define	MAXEVENTS	256
+#define	TICK		(NANOSEC / 10)	/* How often to look at the schedule */
+#define	STARTUP_MAX	((hrtime_t) 120 * NANOSEC)
+
+/*
+ * One simulated server.  Like everything we get port events for, it
+ * starts with an evsource_t, which is what the event's user pointer
+ * points to, as in wita.
+ */
+typedef struct listener {
+	evsource_t	 ls_ev;		/* Must be first */
+	int		 ls_fd;		/* Listening socket, or -1 */
+	int		 ls_fillers[2];	/* Our connections filling a blackhole */
+	behaviour_t	 ls_behaviour;
+	struct sockaddr_in ls_sin;
+
+	int		 ls_seen;	/* Up, as far as wita has told us */
+	int		 ls_known;	/* Have we heard from wita at all? */
+	hrtime_t	 ls_changed;	/* When it changed, if wita hasn't seen it */
+} listener_t;
+
+/*
+ * A connection a silent listener accepted; we wait for wita to close it.
+ */
+typedef struct silent {
+	evsource_t	 sl_ev;		/* Must be first */
+	int		 sl_fd;
+} silent_t;
+
+static int		 nlisteners = 1000, naddrs = 1, groupsize = 40;
+static int		 duration = 60, nflip = 0, flipinterval = 10;
+static behaviour_t	 flipto = B_MIXED;
+static char const	*extra[MAXEXTRA];
+static int		 nextra;
+static char const	*witapath = "./wita";
+
+static listener_t	*listeners;
+static schedule_t	*sched;
+static int		 nsched;
+
+static int		 evport;
+static char		 dir[] = "/tmp/farmbenchXXXXXX";
+static char		 cfgpath[64], subpath[64], metricspath[64];
+
+/* Subscription stream from wita */
+static evsource_t	 subev;
+static int		 subfd;
+static char		 subbuf[8192];
+static size_t		 subnb;
+
+/* Results */
+static int		 nup;		/* Servers wita has up */
+static int		 nexpected;	/* Listeners greeting */
+static hrtime_t		*lat;		/* Detection latencies */
+static int		 nlat, latsize, nmissed, nundone, nflips;
+
+static void	 usage(void);
+static void	 write_config(void);
+static pid_t	 start_wita(int *);
+static void	 subscribe(void);
+static void	 set_behaviour(listener_t *, behaviour_t, hrtime_t);
+static int	 open_listener(listener_t *, int);
+static void	 close_listener(listener_t *);
+static void	 listener_event(evsource_t *, port_event_t *);
+static void	 silent_event(evsource_t *, port_event_t *);
+static void	 sub_event(evsource_t *, port_event_t *);
+static void	 sub_line(char *);
+static void	 saw(listener_t *, int, hrtime_t);
+static void	 run_events(hrtime_t);
+static int	 count_fds(pid_t);
+static double	 read_probes(void);
+
+int
+main(argc, argv)
+	char	**argv;
+{
+int		 c, i, fds, fdmax = 0, nfdsamples = 0;
+unsigned	 seed = 1;
+char const	*schedfile = NULL;
+struct rlimit	 rl;
+struct rusage	 ru;
+struct stat	 sb;
+pid_t		 pid;
+int		 witain;
+hrtime_t	 start, ready, now, nextflip, nextsample;
+time_t		 mtime = 0;
+double		 fdtotal = 0, probes0 = -1, probes1 = -1, cpu;
+hrtime_t	 ptime0 = 0, ptime1 = 0;
+int		 s = 0;
+
+	while ((c = getopt(argc, argv, "n:a:g:t:f:k:i:b:e:r:w:")) != -1) {
+		switch (c) {
+		case 'n':	nlisteners = atoi(optarg); break;
+		case 'a':	naddrs = atoi(optarg); break;
+		case 'g':	groupsize = atoi(optarg); break;
+		case 't':	duration = atoi(optarg); break;
+		case 'f':	schedfile = optarg; break;
+		case 'k':	nflip = atoi(optarg); break;
+		case 'i':	flipinterval = atoi(optarg); break;
+		case 'b':	flipto = bparse("farmbench", optarg); break;
+		case 'r':	seed = (unsigned) strtoul(optarg, NULL, 10); break;
+		case 'w':	witapath = optarg; break;
+		case 'e':
+			if (nextra == MAXEXTRA)
+				usage();
+			extra[nextra++] = optarg;
+			break;
+		default:	usage();
+		}
+	}
+
+	if (nlisteners < 1 || naddrs < 1 || naddrs > 254 * 254 ||
+	    groupsize < 1 || groupsize > MAXGROUP || duration < 1 ||
+	    nflip < 0 || nflip > nlisteners || flipinterval < 1 ||
+	    flipto == B_GREET)
+		usage();
+
+	if ((nlisteners + naddrs - 1) / naddrs > 65535 - BASEPORT) {
+		(void) fprintf(stderr, "farmbench: not enough ports; "
+				"use more addresses\n");
+		return 1;
+	}
+
+	if (schedfile)
+		sched = read_schedule("farmbench", schedfile, "listener",
+				nlisteners, &nsched);
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+		rl.rlim_cur = rl.rlim_max;
+		(void) setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	(void) signal(SIGPIPE, SIG_IGN);
+	srand(seed);
+
+	if (mkdtemp(dir) == NULL) {
+		perror("farmbench: mkdtemp");
+		return 1;
+	}
+	(void) snprintf(cfgpath, sizeof cfgpath, "%s/wita.cfg", dir);
+	(void) snprintf(subpath, sizeof subpath, "%s/sub", dir);
+	(void) snprintf(metricspath, sizeof metricspath, "%s/metrics", dir);
+
+	if ((evport = port_create()) == -1) {
+		perror("farmbench: port_create");
+		return 1;
+	}
+
+	if ((listeners = calloc(nlisteners, sizeof(*listeners))) == NULL) {
+		(void) fprintf(stderr, "farmbench: out of memory\n");
+		return 1;
+	}
+
+	for (i = 0; i < nlisteners; i++) {
+	listener_t	*ls = &listeners[i];
+	int		 a = i % naddrs;
+		ls->ls_ev.es_handler = listener_event;
+		ls->ls_fd = ls->ls_fillers[0] = ls->ls_fillers[1] = -1;
+		ls->ls_behaviour = B_REFUSE;
+		ls->ls_sin.sin_family = AF_INET;
+		ls->ls_sin.sin_port = htons(BASEPORT + i / naddrs);
+		ls->ls_sin.sin_addr.s_addr = htonl(0x7f000000 |
+				(a / 254) << 8 | (a % 254 + 1));
+		set_behaviour(ls, B_GREET, 0);
+	}
+
+	write_config();
+	(void) printf("%d listeners on %d addresses, %d per group\n",
+			nlisteners, naddrs, groupsize);
+	(void) fflush(stdout);
+
+	start = gethrtime();
+	pid = start_wita(&witain);
+	subscribe();
+
+	/*
+	 * Wait for wita to find the whole farm up.
+	 */
+	while (nup < nlisteners) {
+		if (gethrtime() - start > STARTUP_MAX) {
+			(void) fprintf(stderr, "farmbench: only %d of %d servers "
+					"up after %d seconds\n", nup, nlisteners,
+					(int) (STARTUP_MAX / NANOSEC));
+			(void) kill(pid, SIGTERM);
+			return 1;
+		}
+		run_events(TICK);
+	}
+	ready = gethrtime();
+	(void) printf("all servers up after %.2fs\n",
+			(double) (ready - start) / NANOSEC);
+	(void) fflush(stdout);
+
+	nextflip = ready + (hrtime_t) flipinterval * NANOSEC;
+	nextsample = ready;
+
+	while ((now = gethrtime()) - ready < (hrtime_t) duration * NANOSEC) {
+		while (s < nsched && ready + sched[s].ev_when <= now) {
+			for (i = sched[s].ev_first; i <= sched[s].ev_last; i++)
+				set_behaviour(&listeners[i], sched[s].ev_behaviour,
+						now);
+			s++;
+		}
+
+		if (nflip && now >= nextflip) {
+			for (i = 0; i < nflip; i++) {
+			listener_t	*ls = &listeners[rand() % nlisteners];
+				if (ls->ls_behaviour != B_GREET)
+					set_behaviour(ls, B_GREET, now);
+				else if (flipto == B_MIXED)
+					set_behaviour(ls, B_SILENT + rand() % 3, now);
+				else
+					set_behaviour(ls, flipto, now);
+			}
+			nextflip += (hrtime_t) flipinterval * NANOSEC;
+		}
+
+		if (now >= nextsample) {
+			if ((fds = count_fds(pid)) > fdmax)
+				fdmax = fds;
+			fdtotal += fds;
+			nfdsamples++;
+
+			/* A new metrics file; note how many checks so far. */
+			if (stat(metricspath, &sb) == 0 && sb.st_mtime != mtime) {
+				mtime = sb.st_mtime;
+				if (probes0 < 0) {
+					probes0 = read_probes();
+					ptime0 = now;
+				} else {
+					probes1 = read_probes();
+					ptime1 = now;
+				}
+			}
+			nextsample = now + NANOSEC;
+		}
+
+		run_events(TICK);
+	}
+
+	/*
+	 * Wait for wita to write its metrics once more, and stop it
+	 * straight away, so its CPU time goes with the checks it counted.
+	 */
+	if (stat(metricspath, &sb) == 0)
+		mtime = sb.st_mtime;
+	while (stat(metricspath, &sb) == 0 && sb.st_mtime == mtime &&
+	    gethrtime() - now < (hrtime_t) 15 * NANOSEC)
+		run_events(TICK);
+	probes1 = read_probes();
+	ptime1 = gethrtime();
+	(void) kill(pid, SIGTERM);
+	(void) waitpid(pid, NULL, 0);
+	(void) close(witain);
+
+	(void) getrusage(RUSAGE_CHILDREN, &ru);
+	cpu = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+		ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+
+	for (i = 0; i < nlisteners; i++)
+		if (listeners[i].ls_changed)
+			nmissed++;
+
+	(void) printf("%d changes: %d seen, %d not seen, %d undone first\n",
+			nflips, nlat, nmissed, nundone);
+	if (nlat > 0) {
+		qsort(lat, nlat, sizeof(*lat), hrcmp);
+#define	PCT(p)	((double) lat[(int) ((nlat - 1) * (p))] / NANOSEC)
+		(void) printf("detection: p50 %.2fs p90 %.2fs p99 %.2fs "
+				"max %.2fs\n",
+				PCT(0.5), PCT(0.9), PCT(0.99), PCT(1.0));
+#undef	PCT
+	}
+
+	if (probes0 >= 0 && ptime1 > ptime0)
+		(void) printf("checks: %.0f/s\n", (probes1 - probes0) * NANOSEC /
+				(ptime1 - ptime0));
+	if (probes1 > 0)
+		(void) printf("cpu: %.1fs, %.1fus per check\n", cpu,
+				cpu * 1e6 / probes1);
+	if (nfdsamples > 0)
+		(void) printf("descriptors: %.0f average, %d most\n",
+				fdtotal / nfdsamples, fdmax);
+
+	(void) unlink(cfgpath);
+	(void) unlink(subpath);
+	(void) unlink(metricspath);
+	(void) rmdir(dir);
+	return 0;
+}
+
+static void
+usage()
+{
+	(void) fprintf(stderr, "usage: farmbench [-n listeners] [-a addresses] "
+			"[-g groupsize] [-t secs]\n"
+			"\t[-f schedule] [-k flips] [-i secs] [-b behaviour] "
+			"[-e config-line]\n"
+			"\t[-r seed] [-w wita]\n");
+	exit(1);
+}
+
+/*
+ * One group of groupsize servers per line, "f0", "f1" and so on.
+ */
+static void
+write_config()
+{
+FILE	*f;
+int	 i;
+char	 addr[INET_ADDRSTRLEN];
+
+	if ((f = fopen(cfgpath, "w")) == NULL) {
+		perror(cfgpath);
+		exit(1);
+	}
+
+	for (i = 0; i < nextra; i++)
+		(void) fprintf(f, "%s\n", extra[i]);
+
+	for (i = 0; i < nlisteners; i++) {
+		if (i % groupsize == 0)
+			(void) fprintf(f, "%sf%d", i ? "\n" : "", i / groupsize);
+		(void) fprintf(f, " %s:%d",
+				inet_ntop(AF_INET, &listeners[i].ls_sin.sin_addr,
+					addr, sizeof addr),
+				ntohs(listeners[i].ls_sin.sin_port));
+	}
+	(void) fputc('\n', f);
+
+	if (fclose(f) == EOF) {
+		perror(cfgpath);
+		exit(1);
+	}
+}
+
+/*
+ * Run wita as a pipe backend that never gets a query; we only want its
+ * checks.  *in is the other end of its stdin, which must stay open.
+ */
+static pid_t
+start_wita(in)
+	int	*in;
+{
+pid_t	pid;
+int	fds[2];
+
+	if (pipe(fds) == -1 || (pid = fork()) == -1) {
+		perror("farmbench: start_wita");
+		exit(1);
+	}
+
+	if (pid > 0) {
+		(void) close(fds[0]);
+		*in = fds[1];
+		return pid;
+	}
+
+	/* The farm's descriptors mustn't count as wita's. */
+	(void) dup2(fds[0], STDIN_FILENO);
+	closefrom(STDERR_FILENO + 1);
+	(void) execl(witapath, "wita", "-c", cfgpath, "-s", subpath,
+			"-m", metricspath, (char *) NULL);
+	(void) fprintf(stderr, "farmbench: %s: %s\n", witapath, strerror(errno));
+	_exit(1);
+	/*NOTREACHED*/
+}
+
+/*
+ * Connect to wita's subscription socket (once it's there), and subscribe
+ * to every group.
+ */
+static void
+subscribe()
+{
+struct sockaddr_un	 sun;
+hrtime_t		 start = gethrtime();
+char			 line[32];
+int			 g, on = 1;
+
+	bzero(&sun, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	(void) strcpy(sun.sun_path, subpath);
+
+	for (;;) {
+		if ((subfd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+			perror("farmbench: socket");
+			exit(1);
+		}
+		if (connect(subfd, (struct sockaddr *) &sun, sizeof(sun)) == 0)
+			break;
+		(void) close(subfd);
+
+		if (gethrtime() - start > STARTUP_MAX) {
+			(void) fprintf(stderr, "farmbench: cannot connect to %s\n",
+					subpath);
+			exit(1);
+		}
+		run_events(TICK);
+	}
+
+	/* Blocking writes are fine; wita reads these as fast as we write. */
+	for (g = 0; g < (nlisteners + groupsize - 1) / groupsize; g++) {
+	int	n = snprintf(line, sizeof line, "sub f%d\n", g);
+		if (write(subfd, line, n) != n) {
+			perror("farmbench: subscribe");
+			exit(1);
+		}
+	}
+
+	(void) ioctl(subfd, FIONBIO, &on);
+	subev.es_handler = sub_event;
+	if (port_associate(evport, PORT_SOURCE_FD, subfd, POLLIN, &subev) == -1) {
+		perror("farmbench: port_associate");
+		exit(1);
+	}
+}
+
+/*
+ * Change what a listener does.  now is when, for detection latency, or
+ * 0 during setup.
+ */
+static void
+set_behaviour(ls, b, now)
+	listener_t	*ls;
+	behaviour_t	 b;
+	hrtime_t	 now;
+{
+int	wasup = ls->ls_behaviour == B_GREET;
+
+	if (b == ls->ls_behaviour)
+		return;
+
+	close_listener(ls);
+	switch (b) {
+	case B_GREET:
+	case B_SILENT:
+		if (open_listener(ls, 128) == -1)
+			exit(1);
+		if (port_associate(evport, PORT_SOURCE_FD, ls->ls_fd, POLLIN,
+				&ls->ls_ev) == -1) {
+			perror("farmbench: port_associate");
+			exit(1);
+		}
+		break;
+
+	case B_REFUSE:
+		break;
+
+	case B_BLACKHOLE:
+		/*
+		 * Fill the accept queue ourselves, and never accept, so
+		 * further connections get no answer at all.
+		 */
+		if (open_listener(ls, 0) == -1)
+			exit(1);
+		{
+		int	i;
+			for (i = 0; i < 2; i++) {
+			int	on = 1;
+				if ((ls->ls_fillers[i] = socket(AF_INET,
+						SOCK_STREAM, 0)) == -1)
+					break;
+				(void) ioctl(ls->ls_fillers[i], FIONBIO, &on);
+				(void) connect(ls->ls_fillers[i],
+						(struct sockaddr *) &ls->ls_sin,
+						sizeof(ls->ls_sin));
+			}
+		}
+		break;
+
+	default:
+		abort();
+	}
+
+	ls->ls_behaviour = b;
+	nexpected += (b == B_GREET) - wasup;
+
+	if (now == 0 || wasup == (b == B_GREET))
+		return;
+
+	nflips++;
+	if (ls->ls_changed) {
+		/* Changed back before wita noticed. */
+		ls->ls_changed = 0;
+		nundone++;
+	} else if (ls->ls_known && ls->ls_seen != (b == B_GREET))
+		ls->ls_changed = now;
+}
+
+static int
+open_listener(ls, backlog)
+	listener_t	*ls;
+{
+int	on = 1;
+
+	if ((ls->ls_fd = socket(AF_INET, SOCK_STREAM, 0)) == -1 ||
+	    setsockopt(ls->ls_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == -1 ||
+	    ioctl(ls->ls_fd, FIONBIO, &on) == -1 ||
+	    bind(ls->ls_fd, (struct sockaddr *) &ls->ls_sin,
+			sizeof(ls->ls_sin)) == -1 ||
+	    listen(ls->ls_fd, backlog) == -1) {
+		(void) fprintf(stderr, "farmbench: listen on %s:%d: %s\n",
+				inet_ntoa(ls->ls_sin.sin_addr),
+				ntohs(ls->ls_sin.sin_port), strerror(errno));
+		if (ls->ls_fd != -1)
+			(void) close(ls->ls_fd);
+		ls->ls_fd = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
+static void
+close_listener(ls)
+	listener_t	*ls;
+{
+int	i;
+
+	/* Closing the fd also dissociates it from the port. */
+	if (ls->ls_fd != -1)
+		(void) close(ls->ls_fd);
+	ls->ls_fd = -1;
+
+	for (i = 0; i < 2; i++) {
+		if (ls->ls_fillers[i] != -1)
+			(void) close(ls->ls_fillers[i]);
+		ls->ls_fillers[i] = -1;
+	}
+}
+
+static void
+listener_event(es, ev)
+	evsource_t	*es;
+	port_event_t	*ev;
+{
+listener_t	*ls = (listener_t *) es;
+silent_t	*sl;
+int		 fd;
+
+	if (ls->ls_fd != (int) ev->portev_object)
+		return;		/* Closed while the event was waiting */
+
+	while ((fd = accept(ls->ls_fd, NULL, NULL)) != -1) {
+		if (ls->ls_behaviour == B_GREET) {
+			(void) write(fd, "\n", 1);
+			(void) close(fd);
+			continue;
+		}
+
+		/* Silent: wait for wita to give up and close it. */
+		if ((sl = calloc(1, sizeof(*sl))) == NULL) {
+			(void) close(fd);
+			continue;
+		}
+		sl->sl_ev.es_handler = silent_event;
+		sl->sl_fd = fd;
+		if (port_associate(evport, PORT_SOURCE_FD, fd, POLLIN,
+				&sl->sl_ev) == -1) {
+			(void) close(fd);
+			free(sl);
+		}
+	}
+
+	if (port_associate(evport, PORT_SOURCE_FD, ls->ls_fd, POLLIN,
+			&ls->ls_ev) == -1) {
+		perror("farmbench: port_associate");
+		exit(1);
+	}
+}
+
+static void
+silent_event(es, ev)
+	evsource_t	*es;
+	port_event_t	*ev;
+{
+silent_t	*sl = (silent_t *) es;
+char		 buf[64];
+
+	if (read(sl->sl_fd, buf, sizeof buf) > 0 &&
+	    port_associate(evport, PORT_SOURCE_FD, sl->sl_fd, POLLIN,
+			&sl->sl_ev) == 0)
+		return;
+
+	(void) close(sl->sl_fd);
+	free(sl);
+}
+
+static void
+sub_event(es, ev)
+	evsource_t	*es;
+	port_event_t	*ev;
+{
+ssize_t	 n;
+char	*line, *p;
+
+	while ((n = read(subfd, subbuf + subnb, sizeof subbuf - subnb)) > 0) {
+		subnb += n;
+
+		line = subbuf;
+		while ((p = memchr(line, '\n', subnb - (line - subbuf))) != NULL) {
+			*p = 0;
+			sub_line(line);
+			line = p + 1;
+		}
+		subnb -= line - subbuf;
+		(void) memmove(subbuf, line, subnb);
+
+		if (subnb == sizeof subbuf) {
+			(void) fprintf(stderr, "farmbench: subscription line "
+					"too long\n");
+			exit(1);
+		}
+	}
+
+	if (n == 0 || errno != EAGAIN) {
+		(void) fprintf(stderr, "farmbench: wita went away\n");
+		exit(1);
+	}
+
+	if (port_associate(evport, PORT_SOURCE_FD, subfd, POLLIN, &subev) == -1) {
+		perror("farmbench: port_associate");
+		exit(1);
+	}
+}
+
+/*
+ * A group's new answer: "f<n> <addr>:<port> ...", listing the servers
+ * that are up.
+ */
+static void
+sub_line(line)
+	char	*line;
+{
+char		*tok, *last, *colon;
+int		 g, i, first, end, a;
+char		*inup;
+hrtime_t	 now = gethrtime();
+in_addr_t	 addr;
+
+	if ((tok = strtok_r(line, " ", &last)) == NULL || *tok != 'f')
+		return;		/* An error, which we don't expect */
+
+	g = atoi(tok + 1);
+	first = g * groupsize;
+	end = first + groupsize < nlisteners ? first + groupsize : nlisteners;
+	if ((inup = calloc(groupsize, 1)) == NULL) {
+		(void) fprintf(stderr, "farmbench: out of memory\n");
+		exit(1);
+	}
+
+	while ((tok = strtok_r(NULL, " ", &last)) != NULL) {
+		if ((colon = strchr(tok, ':')) == NULL)
+			continue;
+		*colon = 0;
+		if ((addr = inet_addr(tok)) == (in_addr_t) -1)
+			continue;
+		addr = ntohl(addr);
+		a = ((addr >> 8) & 0xff) * 254 + (addr & 0xff) - 1;
+		i = (atoi(colon + 1) - BASEPORT) * naddrs + a;
+		if (i >= first && i < end)
+			inup[i - first] = 1;
+	}
+
+	for (i = first; i < end; i++)
+		saw(&listeners[i], inup[i - first], now);
+	free(inup);
+}
+
+/*
+ * wita says a server is (or isn't) up.
+ */
+static void
+saw(ls, isup, now)
+	listener_t	*ls;
+	hrtime_t	 now;
+{
+	if (ls->ls_known && ls->ls_seen == isup)
+		return;
+
+	nup += isup - (ls->ls_known && ls->ls_seen);
+	ls->ls_known = 1;
+	ls->ls_seen = isup;
+
+	if (ls->ls_changed && isup == (ls->ls_behaviour == B_GREET)) {
+		if (nlat == latsize) {
+			latsize = latsize ? latsize * 2 : 1024;
+			if ((lat = realloc(lat, latsize * sizeof(*lat))) == NULL) {
+				(void) fprintf(stderr, "farmbench: out of memory\n");
+				exit(1);
+			}
+		}
+		lat[nlat++] = now - ls->ls_changed;
+		ls->ls_changed = 0;
+	}
+}
+
+/*
+ * Handle events for up to timeout.
+ */
+static void
+run_events(timeout)
+	hrtime_t	timeout;
+{
+port_event_t	 evs[MAXEVENTS];
+uint_t		 i, nget = 1;
+struct timespec	 ts;
+evsource_t	*es;
+
+	ts.tv_sec = timeout / NANOSEC;
+	ts.tv_nsec = timeout % NANOSEC;
+
+	/* A timeout can still return some events. */
+	if (port_getn(evport, evs, MAXEVENTS, &nget, &ts) == -1) {
+		if (errno == EINTR)
+			return;
+		if (errno != ETIME) {
+			perror("farmbench: port_getn");
+			exit(1);
+		}
+	}
+
+	for (i = 0; i < nget; i++) {
+		es = evs[i].portev_user;
+		es->es_handler(es, &evs[i]);
+	}
+}
+
+/*
+ * How many descriptors a process has open.
+ */
+static int
+count_fds(pid)
+	pid_t	pid;
+{
+char		 path[64];
+DIR		*d;
+struct dirent	*de;
+int		 n = 0;
+
+	(void) snprintf(path, sizeof path, "/proc/%ld/fd", (long) pid);
+	if ((d = opendir(path)) == NULL)
+		return 0;
+	while ((de = readdir(d)) != NULL)
+		if (isdigit((unsigned char) de->d_name[0]))
+			n++;
+	(void) closedir(d);
+	return n;
+}
+
+/*
+ * Total checks so far, from wita's metrics file.
+ */
+static double
+read_probes()
+{
+FILE	*f;
+char	 line[256];
+double	 total = 0;
+
+	if ((f = fopen(metricspath, "r")) == NULL)
+		return 0;
+
+	while (fgets(line, sizeof line, f) != NULL)
+		if (strncmp(line, "wita_probes_total{", 18) == 0)
+			total += strtod(strchr(line, ' ') + 1, NULL);
+
+	(void) fclose(f);
+	return total;
+}
@@ -0,0 +1,650 @@
+/* Copyright (c) 2009 River Tarnell <river@loreley.flyingparchment.org.uk>. */
+/*
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely. This software is provided 'as-is', without any express or implied
+ * warranty.
+ */
+
+/*
+ * Sharing checks between several witas with the same configuration.  One
+ * wita's view of a server can be wrong because of trouble on its own
+ * host, and on its own it would take good servers out of every answer.
+ * With "-g <host:port>" and a "-P <host:port>" for each other instance,
+ * each wita tells the others what its checks found, and a server is only
+ * marked down when "quorum" instances (set in the configuration; 1 by
+ * default) agree that it is.
+ *
+ * Each server is checked by only "quorum" of the instances, chosen by
+ * rendezvous hashing: every instance ranks all of them (itself and the
+ * peers it has heard from lately) by a hash of the instance's address and
+ * the server's, and checks the servers it's in the top "quorum" for.
+ * Everyone works out the same ranking without talking about it, and when
+ * an instance goes away, only its servers move, each to the next in line.
+ * The other instances' checks are stopped, and their results come from
+ * the checkers.  So with quorum 1, each server is checked once however
+ * many witas there are, and with quorum 2, twice.
+ *
+ * A server is down if at least quorum of the instances that have a
+ * verdict on it say so, or if all of them do when there are fewer than
+ * that; at startup, before the peers have been heard from, that's just
+ * our own checks.  When a checker goes away, whoever takes its servers
+ * over has no verdict on them until its next check, so for GOSSIP_HOLD
+ * the old checker's verdicts still count towards quorum, but only while
+ * there aren't enough fresh ones.  The other way round, when a peer
+ * appears and takes servers over from us, we go on checking each of them
+ * until one of its new checkers has sent a verdict on it.
+ *
+ * The digests are UDP datagrams, each covering up to GOSSIP_CHUNK
+ * consecutive servers, in configuration order, with two bits each:
+ *
+ *	uint32	GOSSIP_MAGIC
+ *	uint32	fingerprint of the servers (see gossip_fingerprint())
+ *	uint32	number of servers
+ *	uint32	first server in this datagram
+ *	uint32	number of servers in this datagram
+ *	...	four servers a byte, lowest bits first: 0 no verdict,
+ *		1 up, 2 down
+ *
+ * all in network order.  A digest from an instance with different servers
+ * (say, one that hasn't reloaded yet) is ignored.  Every instance sends
+ * all of its digests to every peer each GOSSIP_INTERVAL, which also says
+ * it's alive, and a digest as soon as one of its verdicts changes; a
+ * peer that's silent for GOSSIP_TIMEOUT is taken to be gone, and its
+ * verdicts and its share of the checks with it.
+ *
+ * Datagrams are only accepted from the configured peers' addresses, and
+ * are sent from our own, so several witas can run on one host with
+ * different ports.  Nothing is authenticated: the gossip address should
+ * be on a trusted network.
+ */
+
+#include	<sys/types.h>
+#include	<sys/socket.h>
+#include	<sys/filio.h>
+#include	<netinet/in.h>
+
+#include	<stdlib.h>
+#include	<string.h>
+#include	<strings.h>
+#include	<errno.h>
+#include	<netdb.h>
+#include	<unistd.h>
+#include	<signal.h>
+#include	<syslog.h>
+#include	<assert.h>
+#include	<port.h>
+
+#include	"wita.h"
+
+#define	GOSSIP_MAGIC	0x77670001U	/* "wg", version 1 */
+#define	GOSSIP_HDRLEN	20
+#define	GOSSIP_CHUNK	4096		/* Servers per datagram */
+#define	GOSSIP_MAX	(GOSSIP_HDRLEN + GOSSIP_CHUNK / 4)
+#define	GOSSIP_BATCH	64		/* Datagrams read per wakeup */
+#define	GOSSIP_INTERVAL	1		/* Seconds between full digests */
+#define	GOSSIP_TIMEOUT	((hrtime_t) 3 * NANOSEC) /* Silence before a peer is gone */
+#define	GOSSIP_HOLD	((hrtime_t) 15 * NANOSEC) /* How long its verdicts last */
+
+typedef struct peer {
+	char const		*pe_name;	/* As given with -P */
+	struct sockaddr_storage	 pe_addr;
+	socklen_t		 pe_addrlen;
+	uint64_t		 pe_key;	/* For rendezvous hashing */
+	hrtime_t		 pe_heard;	/* Last digest from it */
+	int			 pe_live;	/* Heard within GOSSIP_TIMEOUT */
+	int			 pe_held;	/* Gone, but its verdicts are kept */
+} peer_t;
+
+uint32_t		 peers_live;
+
+static peer_t		 peers[MAXPEERS];
+static int		 npeers;
+static int		 gossip_fd = -1;
+static uint64_t		 self_key;
+static evsource_t	 gossip_ev, gossip_timer_ev;
+static timer_t		 gossip_timer;
+
+/*
+ * Chunks with a verdict that changed since they were last sent.
+ */
+static unsigned char	*dirty;
+static int		 ndirty;
+static int		 anydirty;
+
+/*
+ * gossip_fingerprint() of curconf, and the size it was worked out for;
+ * servers can be added while we run (see ctl.c).
+ */
+static config_t		*fp_conf;
+static int		 fp_nservers;
+static uint32_t		 fp_value;
+
+static void	 gossip_event(evsource_t *, port_event_t *);
+static void	 gossip_tick(evsource_t *, port_event_t *);
+static void	 gossip_digest(peer_t *, unsigned char const *, size_t);
+static void	 gossip_send(int);
+static void	 gossip_expire(void);
+static uint32_t	 gossip_fingerprint(void);
+static int	 gossip_resolve(char const *, struct sockaddr_storage *,
+			socklen_t *);
+static uint64_t	 addr_key(struct sockaddr const *, socklen_t);
+static uint64_t	 fnv(uint64_t, char const *);
+static uint64_t	 mix(uint64_t);
+static void	 put32(unsigned char *, uint32_t);
+static uint32_t	 get32(unsigned char const *);
+
+/*
+ * Add a peer to gossip with.  Must be done before gossip_listen().
+ */
+int
+gossip_peer(addr)
+	char const	*addr;
+{
+peer_t	*pe;
+
+	if (npeers == MAXPEERS) {
+		syslog(LOG_ERR, "too many peers (at most %d)", MAXPEERS);
+		return -1;
+	}
+
+	pe = &peers[npeers];
+	if (gossip_resolve(addr, &pe->pe_addr, &pe->pe_addrlen) == -1)
+		return -1;
+	pe->pe_name = addr;
+	pe->pe_key = addr_key((struct sockaddr *) &pe->pe_addr, pe->pe_addrlen);
+	npeers++;
+	return 0;
+}
+
+/*
+ * Start gossiping with our peers from addr.
+ */
+int
+gossip_listen(addr)
+	char const	*addr;
+{
+struct sockaddr_storage	 ss;
+socklen_t		 sslen;
+struct sigevent		 ev;
+port_notify_t		 notf;
+struct itimerspec	 ts;
+int			 on = 1;
+
+	assert(addr);
+
+	if (gossip_resolve(addr, &ss, &sslen) == -1)
+		return -1;
+	self_key = addr_key((struct sockaddr *) &ss, sslen);
+
+	if ((gossip_fd = upgrade_fd("gossip", addr)) == -1) {
+		if ((gossip_fd = socket(ss.ss_family, SOCK_DGRAM, 0)) == -1) {
+			syslog(LOG_ERR, "%s: socket: %m", addr);
+			return -1;
+		}
+
+		if (bind(gossip_fd, (struct sockaddr *) &ss, sslen) == -1) {
+			syslog(LOG_ERR, "%s: bind: %m", addr);
+			return -1;
+		}
+		upgrade_keep("gossip", addr, gossip_fd);
+	}
+
+	if (ioctl(gossip_fd, FIONBIO, &on) == -1) {
+		syslog(LOG_ERR, "%s: ioctl(FIONBIO): %m", addr);
+		return -1;
+	}
+
+	gossip_ev.es_handler = gossip_event;
+	if (port_associate(port, PORT_SOURCE_FD, gossip_fd, POLLIN, &gossip_ev) == -1) {
+		syslog(LOG_ERR, "gossip_listen: cannot associate fd: port_associate: %m");
+		return -1;
+	}
+
+	gossip_timer_ev.es_handler = gossip_tick;
+	bzero(&ev, sizeof(ev));
+	ev.sigev_notify = SIGEV_PORT;
+	ev.sigev_value.sival_ptr = &notf;
+	notf.portnfy_port = port;
+	notf.portnfy_user = &gossip_timer_ev;
+
+	if (timer_create(CLOCK_REALTIME, &ev, &gossip_timer) == -1) {
+		syslog(LOG_ERR, "gossip_listen: cannot create timer: %m");
+		return -1;
+	}
+
+	bzero(&ts, sizeof(ts));
+	ts.it_value.tv_sec = GOSSIP_INTERVAL;
+	ts.it_interval.tv_sec = GOSSIP_INTERVAL;
+	if (timer_settime(gossip_timer, 0, &ts, NULL) == -1) {
+		syslog(LOG_ERR, "gossip_listen: cannot set timer: timer_settime: %m");
+		return -1;
+	}
+
+	syslog(LOG_INFO, "gossiping on %s with %d peers", addr, npeers);
+	return 0;
+}
+
+/*
+ * Should we check sr ourselves, or leave it to other instances?
+ */
+int
+gossip_mine(sr)
+	server_t	*sr;
+{
+uint64_t	h, mine;
+int		i, ahead = 0;
+
+	if (gossip_fd == -1)
+		return 1;
+
+	h = fnv(fnv(14695981039346656037ULL, sr->sr_address), sr->sr_port);
+	mine = mix(h ^ self_key);
+	for (i = 0; i < npeers; i++)
+		if (peers[i].pe_live && mix(h ^ peers[i].pe_key) > mine)
+			ahead++;
+	return ahead < curconf->quorum;
+}
+
+/*
+ * Has one of the instances that should check sr instead of us (a live
+ * peer that gossip_mine() ranks in the top "quorum") told us what it
+ * found?  Until one has, our own checks still count.
+ */
+int
+gossip_covered(sr)
+	server_t	*sr;
+{
+uint64_t	h, score;
+uint32_t	voted = (sr->sr_peerup | sr->sr_peerdown) & peers_live;
+int		i, j, ahead;
+
+	if (gossip_fd == -1 || voted == 0)
+		return 0;
+
+	h = fnv(fnv(14695981039346656037ULL, sr->sr_address), sr->sr_port);
+	for (i = 0; i < npeers; i++) {
+		if (!(voted & ((uint32_t) 1 << i)))
+			continue;
+
+		score = mix(h ^ peers[i].pe_key);
+		ahead = mix(h ^ self_key) > score;
+		for (j = 0; j < npeers; j++)
+			if (j != i && peers[j].pe_live &&
+			    mix(h ^ peers[j].pe_key) > score)
+				ahead++;
+		if (ahead < curconf->quorum)
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * Our verdict on sr has changed; tell the peers at the end of this batch.
+ */
+void
+gossip_changed(sr)
+	server_t	*sr;
+{
+int		 chunk;
+unsigned char	*nd;
+
+	if (gossip_fd == -1 || sr->sr_index >= curconf->nservers ||
+	    curconf->servers[sr->sr_index] != sr)
+		return;
+
+	chunk = sr->sr_index / GOSSIP_CHUNK;
+	if (chunk >= ndirty) {
+		if ((nd = realloc(dirty, chunk + 1)) == NULL)
+			return;		/* It'll go with the next full digest */
+		bzero(nd + ndirty, chunk + 1 - ndirty);
+		dirty = nd;
+		ndirty = chunk + 1;
+	}
+	dirty[chunk] = 1;
+	anydirty = 1;
+}
+
+/*
+ * Send the digests with verdicts that changed during this batch.
+ */
+void
+gossip_flush()
+{
+int	i;
+
+	if (!anydirty)
+		return;
+
+	for (i = 0; i < ndirty; i++)
+		if (dirty[i]) {
+			dirty[i] = 0;
+			if (i * GOSSIP_CHUNK < curconf->nservers)
+				gossip_send(i * GOSSIP_CHUNK);
+		}
+	anydirty = 0;
+}
+
+/*
+ * Timer: time out silent peers, and send everything.
+ */
+/*ARGSUSED*/
+static void
+gossip_tick(es, ev)
+	evsource_t	*es;
+	port_event_t	*ev;
+{
+int	first;
+
+	gossip_expire();
+
+	for (first = 0; first < curconf->nservers; first += GOSSIP_CHUNK)
+		gossip_send(first);
+
+	if (ndirty)
+		bzero(dirty, ndirty);
+	anydirty = 0;
+}
+
+/*
+ * Peers we haven't heard from for GOSSIP_TIMEOUT are gone: their servers
+ * are ours to check, or the next instance's, from their next timer on.
+ * Their verdicts are forgotten once GOSSIP_HOLD is up.
+ */
+static void
+gossip_expire()
+{
+hrtime_t	now = gethrtime();
+int		i, s;
+
+	for (i = 0; i < npeers; i++) {
+		if (peers[i].pe_live && now - peers[i].pe_heard >= GOSSIP_TIMEOUT) {
+			syslog(LOG_WARNING, "peer %s has gone quiet; sharing out "
+					"its checks", peers[i].pe_name);
+			peers[i].pe_live = 0;
+			peers[i].pe_held = 1;
+			peers_live &= ~((uint32_t) 1 << i);
+			for (s = 0; s < curconf->nservers; s++)
+				server_peer_vote(curconf->servers[s], i, VOTE_SAME);
+		}
+
+		if (peers[i].pe_held && now - peers[i].pe_heard >= GOSSIP_HOLD) {
+			peers[i].pe_held = 0;
+			for (s = 0; s < curconf->nservers; s++)
+				server_peer_vote(curconf->servers[s], i, VOTE_NONE);
+		}
+	}
+}
+
+/*
+ * Send our verdicts on the chunk of servers starting at first to every
+ * peer, whether or not we've heard from it, so it knows we're here.
+ */
+static void
+gossip_send(first)
+	int	first;
+{
+unsigned char	 buf[GOSSIP_MAX];
+int		 i, n, v;
+server_t	*sr;
+size_t		 len;
+
+	n = curconf->nservers - first;
+	if (n > GOSSIP_CHUNK)
+		n = GOSSIP_CHUNK;
+
+	put32(buf, GOSSIP_MAGIC);
+	put32(buf + 4, gossip_fingerprint());
+	put32(buf + 8, (uint32_t) curconf->nservers);
+	put32(buf + 12, (uint32_t) first);
+	put32(buf + 16, (uint32_t) n);
+
+	len = GOSSIP_HDRLEN + (n + 3) / 4;
+	bzero(buf + GOSSIP_HDRLEN, len - GOSSIP_HDRLEN);
+
+	for (i = 0; i < n; i++) {
+		sr = curconf->servers[first + i];
+		v = !sr->sr_checked ? VOTE_NONE : sr->sr_healthy ? VOTE_UP : VOTE_DOWN;
+		buf[GOSSIP_HDRLEN + i / 4] |= v << (i % 4 * 2);
+	}
+
+	for (i = 0; i < npeers; i++)
+		if (sendto(gossip_fd, buf, len, 0,
+		    (struct sockaddr *) &peers[i].pe_addr, peers[i].pe_addrlen) == -1 &&
+		    errno != EAGAIN && errno != EWOULDBLOCK)
+			wlog(LOG_DEBUG, "%s: sendto: %m", peers[i].pe_name);
+}
+
+/*
+ * Digests are waiting on the socket.
+ */
+/*ARGSUSED*/
+static void
+gossip_event(es, ev)
+	evsource_t	*es;
+	port_event_t	*ev;
+{
+unsigned char		 buf[GOSSIP_MAX];
+struct sockaddr_storage	 from;
+socklen_t		 fromlen;
+ssize_t			 n;
+int			 i, p;
+
+	for (i = 0; i < GOSSIP_BATCH; i++) {
+		fromlen = sizeof from;
+		if ((n = recvfrom(gossip_fd, buf, sizeof buf, 0,
+		    (struct sockaddr *) &from, &fromlen)) == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			if (errno == EINTR)
+				continue;
+			syslog(LOG_ERR, "gossip_event: recvfrom: %m");
+			break;
+		}
+
+		for (p = 0; p < npeers; p++)
+			if (addr_key((struct sockaddr *) &from, fromlen) == peers[p].pe_key)
+				break;
+
+		if (p == npeers) {
+			wlog(LOG_DEBUG, "ignoring gossip from an unknown peer");
+			continue;
+		}
+
+		gossip_digest(&peers[p], buf, (size_t) n);
+	}
+
+	if (port_associate(port, PORT_SOURCE_FD, gossip_fd, POLLIN, &gossip_ev) == -1) {
+		syslog(LOG_ERR, "gossip_event: cannot associate fd: port_associate: %m");
+		exit(1);
+	}
+}
+
+/*
+ * Take in one digest from pe.
+ */
+static void
+gossip_digest(pe, buf, len)
+	peer_t			*pe;
+	unsigned char const	*buf;
+	size_t			 len;
+{
+uint32_t	first, n, i;
+
+	if (len < GOSSIP_HDRLEN || get32(buf) != GOSSIP_MAGIC) {
+		wlog(LOG_DEBUG, "ignoring malformed gossip from %s", pe->pe_name);
+		return;
+	}
+
+	if (get32(buf + 4) != gossip_fingerprint() ||
+	    get32(buf + 8) != (uint32_t) curconf->nservers) {
+		wlog(LOG_WARNING, "ignoring gossip from %s, which has different "
+				"servers", pe->pe_name);
+		return;
+	}
+
+	first = get32(buf + 12);
+	n = get32(buf + 16);
+	if (first > (uint32_t) curconf->nservers ||
+	    n > (uint32_t) curconf->nservers - first ||
+	    len < GOSSIP_HDRLEN + (n + 3) / 4) {
+		wlog(LOG_DEBUG, "ignoring malformed gossip from %s", pe->pe_name);
+		return;
+	}
+
+	pe->pe_heard = gethrtime();
+	if (!pe->pe_live) {
+		syslog(LOG_NOTICE, "peer %s is here; sharing checks with it",
+				pe->pe_name);
+		pe->pe_live = 1;
+		pe->pe_held = 0;
+		peers_live |= (uint32_t) 1 << (pe - peers);
+		for (i = 0; i < (uint32_t) curconf->nservers; i++)
+			server_peer_vote(curconf->servers[i], pe - peers, VOTE_SAME);
+	}
+
+	for (i = 0; i < n; i++)
+		server_peer_vote(curconf->servers[first + i], pe - peers,
+				(buf[GOSSIP_HDRLEN + i / 4] >> (i % 4 * 2)) & 3);
+}
+
+/*
+ * A hash of every server's address and port, in order, so instances with
+ * different servers don't take each other's verdicts for the wrong ones.
+ */
+static uint32_t
+gossip_fingerprint()
+{
+uint64_t	h = 14695981039346656037ULL;
+int		i;
+
+	if (fp_conf == curconf && fp_nservers == curconf->nservers)
+		return fp_value;
+
+	for (i = 0; i < curconf->nservers; i++) {
+		h = fnv(h, curconf->servers[i]->sr_address);
+		h = fnv(h, curconf->servers[i]->sr_port);
+	}
+
+	fp_conf = curconf;
+	fp_nservers = curconf->nservers;
+	fp_value = (uint32_t) (mix(h) >> 32);
+	return fp_value;
+}
+
+/*
+ * Resolve "host:port" (or "[v6addr]:port") to one address.
+ */
+static int
+gossip_resolve(addr, ss, sslen)
+	char const		*addr;
+	struct sockaddr_storage	*ss;
+	socklen_t		*sslen;
+{
+struct addrinfo	 hints, *res;
+char		*host, *sport;
+int		 i;
+
+	if ((host = strdup(addr)) == NULL) {
+		syslog(LOG_ERR, "out of memory");
+		return -1;
+	}
+
+	if ((sport = strrchr(host, ':')) == NULL) {
+		syslog(LOG_ERR, "%s: gossip address needs a port", addr);
+		free(host);
+		return -1;
+	}
+	*sport++ = 0;
+	if (*host == '[' && sport[-2] == ']') {
+		sport[-2] = 0;
+		(void) memmove(host, host + 1, strlen(host + 1) + 1);
+	}
+
+	bzero(&hints, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+
+	if ((i = getaddrinfo(host, sport, &hints, &res)) != 0) {
+		syslog(LOG_ERR, "cannot resolve gossip address %s: %s",
+				addr, gai_strerror(i));
+		free(host);
+		return -1;
+	}
+	free(host);
+
+	assert(res->ai_addrlen <= sizeof(*ss));
+	bzero(ss, sizeof(*ss));
+	(void) memcpy(ss, res->ai_addr, res->ai_addrlen);
+	*sslen = res->ai_addrlen;
+	freeaddrinfo(res);
+	return 0;
+}
+
+/*
+ * An instance's key, from its numeric address and port, so it's the same
+ * however each instance spells it.
+ */
+static uint64_t
+addr_key(sa, salen)
+	struct sockaddr const	*sa;
+	socklen_t		 salen;
+{
+char	host[NI_MAXHOST], serv[NI_MAXSERV];
+
+	if (getnameinfo(sa, salen, host, sizeof host, serv, sizeof serv,
+			NI_NUMERICHOST | NI_NUMERICSERV) != 0)
+		return 0;
+	return mix(fnv(fnv(14695981039346656037ULL, host), serv));
+}
+
+/*
+ * FNV-1a, continuing from h.
+ */
+static uint64_t
+fnv(h, s)
+	uint64_t	 h;
+	char const	*s;
+{
+	for (; *s; s++) {
+		h ^= (unsigned char) *s;
+		h *= 1099511628211ULL;
+	}
+	h ^= 0xff;	/* So "ab" "c" differs from "a" "bc" */
+	return h * 1099511628211ULL;
+}
+
+/*
+ * A 64-bit finalizer (from splitmix64), so that every bit of the rendezvous
+ * weight depends on every bit of both keys.
+ */
+static uint64_t
+mix(x)
+	uint64_t	x;
+{
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebULL;
+	x ^= x >> 31;
+	return x;
+}
+
+static void
+put32(p, v)
+	unsigned char	*p;
+	uint32_t	 v;
+{
+	p[0] = (v >> 24) & 0xff;
+	p[1] = (v >> 16) & 0xff;
+	p[2] = (v >> 8) & 0xff;
+	p[3] = v & 0xff;
+}
+
+static uint32_t
+get32(p)
+	unsigned char const	*p;
+{
+	return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) |
+		((uint32_t) p[2] << 8) | p[3];
+}
@@ -7,12 +7,42 @@
  */
   
 #include	<stdlib.h>
+#include	<stdio.h>
 #include	<string.h>
+#include	<strings.h>
 #include	<assert.h>
 #include	<syslog.h>
+#include	<time.h>
 
 #include	"wita.h"
 
+static void	group_changed(group_t *);
+static void	group_own_changed(group_t *, int);
+static void	group_propagate(group_t *, int, group_t *);
+static group_t	*group_source(group_t *, int);
+
+uint32_t	zone_serial;
+static int	serial_bumped;	/* zone_serial went up in this batch */
+static uint32_t	serial_saved;	/* Last written to the serial file */
+
+/*
+ * A group's TTL is the time since its answer last changed divided by
+ * this, bounded by the configured minimum and maximum.  A group that has
+ * been stable for ten minutes is unlikely to change in the next minute.
+ */
+#define	TTL_DIVISOR	10
+
+/*
+ * Sizes used to work out how many records fit in a plain (non-EDNS) UDP
+ * response: the DNS header, the fixed part of the question, and the
+ * fixed part of each resource record (compressed name, type, class, TTL
+ * and rdlength).
+ */
+#define	DNS_UDP_MAX	512
+#define	DNS_HDR_SIZE	12
+#define	DNS_QFIXED	4
+#define	DNS_RRFIXED	12
+
 /*
  * Create a new group with no servers in it.
  */
@@ -30,6 +60,10 @@ group_t	**newgrs = conf->groups;
 	if ((r = calloc(1, sizeof(group_t))) == NULL)
 		goto err;
 
+	r->gr_ttlmin = r->gr_ttlmax = -1;
+	r->gr_maxanswers = -1;
+	r->gr_changed = gethrtime();
+
 	if ((r->gr_name = strdup(name)) == NULL) {
 		syslog(LOG_ERR, "out of memory (trying to continue anyway)");
 		goto err;
@@ -52,11 +86,12 @@ err:
 }
 
 /*
- * Find an existing group.
+ * Find an existing group in a zone (NULL for groups not in any zone).
  */
 group_t *
-find_group(conf, name)
+find_group(conf, zone, name)
 	config_t	*conf;
+	zone_t		*zone;
 	char const	*name;
 {
 int	i;
@@ -65,22 +100,46 @@ int	i;
 	assert(name);
 
 	for (i = 0; i < conf->ngroups; i++)
-		if (strcmp(name, conf->groups[i]->gr_name) == 0)
+		if (conf->groups[i]->gr_zone == zone &&
+		    strcasecmp(name, conf->groups[i]->gr_name) == 0)
 			return conf->groups[i];
 	return NULL;
 }
 
+/*
+ * Find the group an SRV query is for.  Any leading service and protocol
+ * labels ("_mysql._tcp.") are skipped.
+ */
+group_t *
+find_group_srv(conf, qname)
+	config_t	*conf;
+	char const	*qname;
+{
+char const	*p;
+
+	while (*qname == '_') {
+		if ((p = strchr(qname, '.')) == NULL)
+			return NULL;
+		qname = p + 1;
+	}
+
+	return find_group_qname(conf, qname);
+}
+
 /*
  * Add a server to an existing group.
  */
 int
-add_server_to_group(group, server, backup)
+add_server_to_group(group, server, backup, weight)
 	group_t		*group;
 	server_t	*server;
 	int		 backup;
+	int		 weight;
 {
 server_group_t	**news = group->gr_servers;
+server_group_t	**srgrs;
 server_group_t	 *sg = NULL;
+int		  f;
 	
 	assert(group);
 	assert(server);
@@ -95,20 +154,360 @@ server_group_t	 *sg = NULL;
 		syslog(LOG_ERR, "out of memory (trying to continue anyway");
 		goto err;
 	}
+	group->gr_servers = news;
+
+	if ((srgrs = realloc(server->sr_groups,
+			sizeof(server_group_t *) * (server->sr_ngroups + 1))) == NULL) {
+		syslog(LOG_ERR, "out of memory (trying to continue anyway");
+		goto err;
+	}
+	server->sr_groups = srgrs;
 
 	sg->sg_server = server;
+	sg->sg_group = group;
 	sg->sg_backup = backup;
-	group->gr_servers = news;
+	sg->sg_weight = weight;
 	group->gr_servers[group->gr_nservers] = sg;
 	group->gr_nservers++;
+	server->sr_groups[server->sr_ngroups] = sg;
+	server->sr_ngroups++;
+
+	if (server->sr_online) {
+		f = FAMILY_INDEX(server->sr_family);
+		if (backup)
+			group->gr_nbackup_up[f]++;
+		else
+			group->gr_nup[f]++;
+		if (!backup || group->gr_nup[f] == 0)
+			group_own_changed(group, f);
+	}
 
 	return 0;
 
 err:
 	free(sg);
+	return -1;
+}
+
+/*
+ * Take a server out of a group.  The server itself stays in the
+ * configuration.  Returns -1 if it wasn't in the group.
+ */
+int
+remove_server_from_group(group, server)
+	group_t		*group;
+	server_t	*server;
+{
+server_group_t	*sg;
+int		 i, j, f;
+
+	assert(group);
+	assert(server);
+
+	for (i = 0; i < server->sr_ngroups; i++)
+		if (server->sr_groups[i]->sg_group == group)
+			break;
+	if (i == server->sr_ngroups)
+		return -1;
+
+	sg = server->sr_groups[i];
+	server->sr_groups[i] = server->sr_groups[--server->sr_ngroups];
+
+	/* Keep the group's servers in order, for answer rotation. */
+	for (j = 0; group->gr_servers[j] != sg; j++)
+		;
+	(void) memmove(&group->gr_servers[j], &group->gr_servers[j + 1],
+			sizeof(server_group_t *) * (group->gr_nservers - j - 1));
+	group->gr_nservers--;
+
+	if (server->sr_online) {
+		f = FAMILY_INDEX(server->sr_family);
+		if (sg->sg_backup)
+			group->gr_nbackup_up[f]--;
+		else
+			group->gr_nup[f]--;
+		if (!sg->sg_backup || group->gr_nup[f] == 0)
+			group_own_changed(group, f);
+	}
+
+	free(sg);
+	return 0;
+}
+
+/*
+ * A server's sr_online just changed; update the groups it's in.  A
+ * primary always changes its group's own answer (it's either in it, or
+ * it's replacing the backups).  A backup only matters if no primary of
+ * the same address family is up.
+ */
+void
+group_server_changed(server)
+	server_t	*server;
+{
+int		 i, delta, f;
+server_group_t	*sg;
+group_t		*group;
+
+	delta = server->sr_online ? 1 : -1;
+	f = FAMILY_INDEX(server->sr_family);
+
+	for (i = 0; i < server->sr_ngroups; i++) {
+		sg = server->sr_groups[i];
+		group = sg->sg_group;
+
+		if (sg->sg_backup) {
+			group->gr_nbackup_up[f] += delta;
+			if (group->gr_nup[f] == 0)
+				group_own_changed(group, f);
+		} else {
+			group->gr_nup[f] += delta;
+			group_own_changed(group, f);
+		}
+	}
+}
+
+/*
+ * Fallback groups.  A group with none of its own servers up in a family
+ * answers from the first of its fallback groups that has an answer,
+ * which may itself come from one of that group's fallbacks.  Each group
+ * remembers where its answer currently comes from (gr_source) and which
+ * groups fall back to it (gr_dependents), so when a group's own servers
+ * change we only revisit the groups that depend on it, and stop as soon
+ * as a group's answer turns out not to have changed.
+ */
+
+/*
+ * Work out where a group's answer should come from, given the current
+ * sources of its fallbacks.
+ */
+static group_t *
+group_source(group, f)
+	group_t	*group;
+	int	 f;
+{
+int	i;
+
+	if (group->gr_nup[f] + group->gr_nbackup_up[f] > 0)
+		return group;
+
+	for (i = 0; i < group->gr_nfallbacks; i++)
+		if (group->gr_fallbacks[i]->gr_source[f] != NULL)
+			return group->gr_fallbacks[i]->gr_source[f];
+
 	return NULL;
 }
 
+/*
+ * The set of servers a group answers with from its own members has
+ * changed, for one family.
+ */
+static void
+group_own_changed(group, f)
+	group_t	*group;
+	int	 f;
+{
+group_t	*src;
+
+	src = group_source(group, f);
+
+	/*
+	 * If it was answering from a fallback and still is, nothing that
+	 * anyone sees has changed.
+	 */
+	if (src != group && src == group->gr_source[f])
+		return;
+
+	group->gr_source[f] = src;
+	group_changed(group);
+	group_propagate(group, f, group);
+}
+
+/*
+ * group's answer has changed, because the own answer of changed (which
+ * may be group itself) did; update the groups that fall back to it.
+ */
+static void
+group_propagate(group, f, changed)
+	group_t	*group, *changed;
+	int	 f;
+{
+int	 i;
+group_t	*dep, *src;
+
+	for (i = 0; i < group->gr_ndependents; i++) {
+		dep = group->gr_dependents[i];
+
+		/* Its own servers come first. */
+		if (dep->gr_source[f] == dep)
+			continue;
+
+		src = group_source(dep, f);
+		if (src == dep->gr_source[f] && src != changed)
+			continue;
+
+		dep->gr_source[f] = src;
+		group_changed(dep);
+		group_propagate(dep, f, changed);
+	}
+}
+
+/*
+ * Make group fall back to fallback, after any fallbacks it already has.
+ * The caller has made sure this doesn't create a loop.
+ */
+int
+add_group_fallback(group, fallback)
+	group_t	*group, *fallback;
+{
+group_t	**news, *src;
+int	  f;
+
+	if ((news = realloc(group->gr_fallbacks,
+			sizeof(group_t *) * (group->gr_nfallbacks + 1))) == NULL) {
+		syslog(LOG_ERR, "out of memory");
+		return -1;
+	}
+	group->gr_fallbacks = news;
+	group->gr_fallbacks[group->gr_nfallbacks++] = fallback;
+
+	if ((news = realloc(fallback->gr_dependents,
+			sizeof(group_t *) * (fallback->gr_ndependents + 1))) == NULL) {
+		syslog(LOG_ERR, "out of memory");
+		return -1;
+	}
+	fallback->gr_dependents = news;
+	fallback->gr_dependents[fallback->gr_ndependents++] = group;
+
+	for (f = 0; f < NFAMILIES; f++) {
+		if ((src = group_source(group, f)) == group->gr_source[f])
+			continue;
+		group->gr_source[f] = src;
+		group_changed(group);
+		group_propagate(group, f, src);
+	}
+
+	return 0;
+}
+
+/*
+ * The set of addresses we return for this group has changed.
+ */
+static void
+group_changed(group)
+	group_t	*group;
+{
+	group->gr_changed = gethrtime();
+	group->gr_nchanges++;
+	zone_serial_bump();
+
+	if (group->gr_subs)
+		sub_notify(group);
+}
+
+/*
+ * The first serial, when the first configuration is loaded: the current
+ * time, or one more than the serial file says, if that's later.
+ */
+void
+zone_serial_start(file)
+	char const	*file;
+{
+FILE		*f;
+unsigned long	 saved;
+uint32_t	 now = (uint32_t) time(NULL);
+
+	zone_serial = now;
+	if (file == NULL || (f = fopen(file, "r")) == NULL)
+		return;
+
+	if (fscanf(f, "%lu", &saved) == 1 && (uint32_t) saved >= now) {
+		serial_saved = (uint32_t) saved;
+		zone_serial = serial_saved + 1;
+	}
+	(void) fclose(f);
+}
+
+/*
+ * Some answer has changed.  However many change in one batch of events,
+ * the serial only goes up once, and it's never behind the clock, so a
+ * restart (which starts from the clock) doesn't take it backwards unless
+ * we've been changing more than once a second.
+ */
+void
+zone_serial_bump()
+{
+uint32_t	now;
+
+	if (serial_bumped)
+		return;
+	serial_bumped = 1;
+
+	now = (uint32_t) time(NULL);
+	zone_serial = now > zone_serial ? now : zone_serial + 1;
+}
+
+/*
+ * The end of a batch of events.  If changing quickly has put the serial
+ * ahead of the clock, save it in the serial file (if there is one), for
+ * zone_serial_start() to carry on from after a restart.
+ */
+void
+zone_serial_done()
+{
+FILE	*f;
+char	*tmp;
+size_t	 len;
+
+	if (!serial_bumped)
+		return;
+	serial_bumped = 0;
+
+	if (curconf == NULL || curconf->serial_file == NULL ||
+	    zone_serial <= (uint32_t) time(NULL) || zone_serial == serial_saved)
+		return;
+
+	len = strlen(curconf->serial_file) + sizeof ".new";
+	if ((tmp = malloc(len)) == NULL)
+		return;
+	(void) snprintf(tmp, len, "%s.new", curconf->serial_file);
+
+	if ((f = fopen(tmp, "w")) == NULL) {
+		syslog(LOG_ERR, "%s: cannot write serial: %m", tmp);
+		free(tmp);
+		return;
+	}
+
+	(void) fprintf(f, "%lu\n", (unsigned long) zone_serial);
+	if (fclose(f) == EOF || rename(tmp, curconf->serial_file) == -1)
+		syslog(LOG_ERR, "%s: cannot write serial: %m",
+				curconf->serial_file);
+	else
+		serial_saved = zone_serial;
+	free(tmp);
+}
+
+/*
+ * Return the TTL to use for answers from this group.
+ */
+int
+group_ttl(group)
+	group_t	*group;
+{
+hrtime_t	age;
+int		ttlmin, ttlmax;
+int		ttl;
+
+	ttlmin = group->gr_ttlmin != -1 ? group->gr_ttlmin : curconf->ttlmin;
+	ttlmax = group->gr_ttlmax != -1 ? group->gr_ttlmax : curconf->ttlmax;
+
+	age = (gethrtime() - group->gr_changed) / NANOSEC;
+	if (age / TTL_DIVISOR >= ttlmax)
+		return ttlmax;
+
+	ttl = (int) (age / TTL_DIVISOR);
+	return ttl < ttlmin ? ttlmin : ttl;
+}
+
 void
 free_group(gr)
 	group_t	*gr;
@@ -120,10 +519,176 @@ int	i;
 
 	free(gr->gr_name);
 	
-	for (i = 0; i < gr->gr_nservers; ++i) {
-		free_server(gr->gr_servers[i]->sg_server);
+	/*
+	 * The servers themselves may be shared with other groups; they belong
+	 * to the configuration and are freed by free_configuration().
+	 */
+	for (i = 0; i < gr->gr_nservers; ++i)
 		free(gr->gr_servers[i]);
-	}
 	free(gr->gr_servers);
+	free(gr->gr_fallbacks);
+	free(gr->gr_dependents);
+	free(gr->gr_fallback_names);
+	free(gr->gr_probe_name);
 	free(gr);
 }
+
+/*
+ * Work out which servers to return for an A (family AF_INET) or AAAA
+ * (AF_INET6) query on this group.  If any primary with an address in
+ * that family is up we return the primaries that are up, otherwise the
+ * backups that are up.  If none of those are up either, the answer comes
+ * from the group's fallbacks (see group_source()).  The families are
+ * independent: a group whose IPv6 primaries are all down answers AAAA
+ * queries from its backups even while its IPv4 primaries are up.  If
+ * there are more than the group's answer limit, we return a window of
+ * them, and move the window along by its own size each time so that
+ * every server gets its share of queries.
+ *
+ * qnamelen and rrsize (the size of each record's data) are used to work
+ * out the limit if none is configured, so that the answer fits in a
+ * single UDP datagram.  out must have room for MAXANSWERS servers.
+ * Returns the number of servers stored in out.
+ */
+int
+group_answer(group, family, qnamelen, rrsize, out)
+	group_t		 *group;
+	int		  family;
+	size_t		  qnamelen, rrsize;
+	server_t	**out;
+{
+int		 backup, avail, max, start, i, j, pos, f;
+server_group_t	*sg;
+group_t		*src;
+size_t		 room;
+
+	f = FAMILY_INDEX(family);
+	if ((src = group->gr_source[f]) == NULL)
+		return 0;
+
+	if (src->gr_nup[f] > 0) {
+		backup = 0;
+		avail = src->gr_nup[f];
+	} else {
+		backup = 1;
+		avail = src->gr_nbackup_up[f];
+	}
+
+	if (avail == 0)
+		return 0;
+
+	max = group->gr_maxanswers != -1 ? group->gr_maxanswers : curconf->maxanswers;
+	if (max == 0) {
+		/* qnamelen + 2 for the length of the first label and the root */
+		room = DNS_UDP_MAX - DNS_HDR_SIZE - (qnamelen + 2) - DNS_QFIXED;
+		if (qnamelen + 2 + DNS_HDR_SIZE + DNS_QFIXED >= DNS_UDP_MAX)
+			max = 1;
+		else if ((max = (int) (room / (DNS_RRFIXED + rrsize))) < 1)
+			max = 1;
+	}
+	if (max > MAXANSWERS)
+		max = MAXANSWERS;
+
+	if (avail <= max) {
+		start = 0;
+		max = avail;
+	} else {
+		start = (int) (group->gr_rotor[f] % (unsigned) avail);
+		group->gr_rotor[f] += (unsigned) max;
+	}
+
+	/*
+	 * j counts the eligible servers; each one goes in the output at its
+	 * distance from the start of the window, if that's inside it.
+	 */
+	for (i = 0, j = 0; i < src->gr_nservers && j < avail; i++) {
+		sg = src->gr_servers[i];
+		if (sg->sg_backup != backup || !sg->sg_server->sr_online ||
+		    sg->sg_server->sr_family != family)
+			continue;
+
+		pos = (j - start + avail) % avail;
+		if (pos < max)
+			out[pos] = sg->sg_server;
+		j++;
+	}
+
+	return max;
+}
+
+/*
+ * Store every server in the group's current answer for a family in out,
+ * which must have room for MAXANSWERS, ignoring the answer limit.
+ * Returns how many there are.
+ */
+int
+group_members(group, family, out)
+	group_t		 *group;
+	int		  family;
+	server_t	**out;
+{
+int		 backup, f, i, n = 0;
+server_group_t	*sg;
+group_t		*src;
+
+	f = FAMILY_INDEX(family);
+	if ((src = group->gr_source[f]) == NULL)
+		return 0;
+
+	backup = src->gr_nup[f] == 0;
+	for (i = 0; i < src->gr_nservers && n < MAXANSWERS; i++) {
+		sg = src->gr_servers[i];
+		if (sg->sg_backup == backup && sg->sg_server->sr_online &&
+		    sg->sg_server->sr_family == family)
+			out[n++] = sg->sg_server;
+	}
+
+	return n;
+}
+
+/*
+ * Work out the SRV records for a query on this group: every server that's
+ * up, primaries first.  Unlike A records, these go out together, since the
+ * priority (0 for primaries, 1 for backups) tells the client which to
+ * use.  A server with several addresses is listed once, if any of them
+ * is up.  A group with no servers of its own up lists its fallback's.
+ * out must have room for MAXANSWERS entries.  Returns the number
+ * of entries stored in out.
+ */
+int
+group_srv_answer(group, out)
+	group_t		 *group;
+	server_group_t	**out;
+{
+int		 backup, i, j, n = 0;
+server_group_t	*sg;
+group_t		*src;
+
+	/*
+	 * With none of its own servers up, use a fallback's.
+	 */
+	if (group->gr_source[0] == group || group->gr_source[1] == group)
+		src = group;
+	else if ((src = group->gr_source[0]) == NULL &&
+		 (src = group->gr_source[1]) == NULL)
+		return 0;
+
+	for (backup = 0; backup <= 1; backup++) {
+		for (i = 0; i < src->gr_nservers && n < MAXANSWERS; i++) {
+			sg = src->gr_servers[i];
+			if (sg->sg_backup != backup || !sg->sg_server->sr_online)
+				continue;
+
+			for (j = 0; j < n; j++)
+				if (out[j]->sg_server->sr_host == sg->sg_server->sr_host &&
+				    out[j]->sg_backup == backup)
+					break;
+			if (j < n)
+				continue;
+
+			out[n++] = sg;
+		}
+	}
+
+	return n;
+}
@@ -0,0 +1,241 @@
+/* Copyright (c) 2009 River Tarnell <river@loreley.flyingparchment.org.uk>. */
+/*
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely. This software is provided 'as-is', without any express or implied
+ * warranty.
+ */
+
+/*
+ * What each server's last checks did, for working out afterwards how a
+ * server failed: whether it refused the connection, took the connection
+ * but never answered, or answered and hung up, and whether it was getting
+ * slower first.  The log only says so when a server changes state.
+ *
+ * Each server keeps its last "history" checks (set in the configuration;
+ * 64 by default, and 0 turns this off) in a ring of checkrec_t: when the
+ * check finished, how long it took, how far it got and the error it
+ * ended with.  The rings for a configuration are all in one slab,
+ * allocated when it's loaded, so recording a check is a few stores and
+ * never allocates.  Servers added through the control socket make the
+ * slab bigger.
+ *
+ * A reload keeps the history of servers that are still configured.  An
+ * upgrade (see upgrade.c) starts again with none.
+ *
+ * The control socket's "history" and "latency" commands show the rings
+ * (see ctl.c).
+ */
+
+#include	<stdlib.h>
+#include	<string.h>
+#include	<strings.h>
+#include	<errno.h>
+#include	<syslog.h>
+
+#include	"wita.h"
+
+static uint32_t	scratch[HISTORY_MAX];	/* For sorting in history_stats() */
+
+static void	history_copy(server_t *, server_t *);
+static void	history_place(config_t *);
+static int	took_cmp(void const *, void const *);
+
+/*
+ * Make the slab for a configuration that's been loaded, and carry over
+ * what old (if not NULL) knew about the same servers.
+ */
+int
+history_start(conf, old)
+	config_t	*conf, *old;
+{
+server_t	*sr, *osr;
+int		 i;
+
+	if (conf->history == 0)
+		return 0;
+
+	conf->ncheckrecs = conf->nservers > 0 ? conf->nservers : 1;
+	if ((conf->checkrecs = calloc((size_t) conf->ncheckrecs * conf->history,
+			sizeof(checkrec_t))) == NULL) {
+		syslog(LOG_ERR, "out of memory");
+		conf->ncheckrecs = 0;
+		return -1;
+	}
+	history_place(conf);
+
+	if (old == NULL)
+		return 0;
+
+	for (i = 0; i < conf->nservers; i++) {
+		sr = conf->servers[i];
+		for (osr = find_server(old, sr->sr_spec); osr; osr = osr->sr_nextaddr)
+			if (strcmp(osr->sr_address, sr->sr_address) == 0 &&
+			    strcmp(osr->sr_port, sr->sr_port) == 0) {
+				history_copy(sr, osr);
+				break;
+			}
+	}
+	return 0;
+}
+
+/*
+ * sr has just been added to conf.  If that's after loading, it needs a
+ * ring of its own.
+ */
+void
+history_add(conf, sr)
+	config_t	*conf;
+	server_t	*sr;
+{
+checkrec_t	*slab;
+int		 n;
+
+	if (conf->checkrecs == NULL)
+		return;
+
+	if (sr->sr_index >= conf->ncheckrecs) {
+		n = conf->ncheckrecs * 2;
+		if ((slab = realloc(conf->checkrecs, (size_t) n * conf->history *
+				sizeof(checkrec_t))) == NULL) {
+			syslog(LOG_ERR, "out of memory; not keeping history for "
+					"%s[%s]:%s", sr->sr_name, sr->sr_address,
+					sr->sr_port);
+			return;
+		}
+		conf->checkrecs = slab;
+		conf->ncheckrecs = n;
+	}
+
+	history_place(conf);
+}
+
+/*
+ * Point every server at its ring in the slab.
+ */
+static void
+history_place(conf)
+	config_t	*conf;
+{
+server_t	*sr;
+int		 i;
+
+	for (i = 0; i < conf->nservers && i < conf->ncheckrecs; i++) {
+		sr = conf->servers[i];
+		sr->sr_history = conf->checkrecs + (size_t) i * conf->history;
+		sr->sr_histsize = conf->history;
+	}
+}
+
+/*
+ * Give sr the most recent of osr's checks that it has room for.
+ */
+static void
+history_copy(sr, osr)
+	server_t	*sr, *osr;
+{
+int	i, n;
+
+	n = osr->sr_histlen < sr->sr_histsize ? osr->sr_histlen : sr->sr_histsize;
+	for (i = 0; i < n; i++)
+		sr->sr_history[i] = *history_get(osr, osr->sr_histlen - n + i);
+	sr->sr_histlen = n;
+	sr->sr_histpos = n % sr->sr_histsize;
+}
+
+/*
+ * A check of sr has just ended, in the state it got to.  This is called
+ * for every check, so it mustn't allocate or log.
+ */
+void
+history_record(sr, result, error, took)
+	server_t	*sr;
+	int		 result, error;
+	hrtime_t	 took;
+{
+checkrec_t	*cr;
+
+	if (sr->sr_history == NULL)
+		return;
+
+	cr = &sr->sr_history[sr->sr_histpos];
+	cr->cr_when = gethrtime();
+	cr->cr_took = took / 1000 > UINT32_MAX ? UINT32_MAX : (uint32_t) (took / 1000);
+	cr->cr_error = error > UINT16_MAX ? UINT16_MAX : error;
+	cr->cr_result = result;
+
+	/*
+	 * The first read is tried before the state moves on from
+	 * SR_CONNECT, so a reply (even a bad one) or EOF then means the
+	 * check got as far as reading.
+	 */
+	cr->cr_phase = sr->sr_state;
+	if (cr->cr_phase == SR_CONNECT && (result == PROBE_OK ||
+	    error == ENODATA || error == EPROTO))
+		cr->cr_phase = SR_READ;
+
+	if (++sr->sr_histpos == sr->sr_histsize)
+		sr->sr_histpos = 0;
+	if (sr->sr_histlen < sr->sr_histsize)
+		sr->sr_histlen++;
+}
+
+/*
+ * sr's i'th check, counting from the oldest we have, or NULL if there
+ * aren't that many.
+ */
+checkrec_t const *
+history_get(sr, i)
+	server_t	*sr;
+	int		 i;
+{
+	if (i < 0 || i >= sr->sr_histlen)
+		return NULL;
+	return &sr->sr_history[(sr->sr_histpos - sr->sr_histlen + i +
+			sr->sr_histsize) % sr->sr_histsize];
+}
+
+/*
+ * Count sr's checks in the last since ns (or all we have, if since is
+ * 0), and work out percentiles of how long the successful ones took.
+ */
+void
+history_stats(sr, since, cs)
+	server_t	*sr;
+	hrtime_t	 since;
+	checkstats_t	*cs;
+{
+checkrec_t const	*cr;
+hrtime_t		 now = gethrtime();
+int			 i, n = 0;
+
+	bzero(cs, sizeof(*cs));
+
+	for (i = 0; (cr = history_get(sr, i)) != NULL; i++) {
+		if (since != 0 && now - cr->cr_when > since)
+			continue;
+		cs->cs_n[cr->cr_result]++;
+		if (cr->cr_result == PROBE_OK)
+			scratch[n++] = cr->cr_took;
+	}
+
+	if (n == 0)
+		return;
+
+	qsort(scratch, n, sizeof(*scratch), took_cmp);
+
+	/* Nearest rank. */
+	cs->cs_p50 = (hrtime_t) scratch[(n * 50 + 99) / 100 - 1] * 1000;
+	cs->cs_p90 = (hrtime_t) scratch[(n * 90 + 99) / 100 - 1] * 1000;
+	cs->cs_p99 = (hrtime_t) scratch[(n * 99 + 99) / 100 - 1] * 1000;
+	cs->cs_max = (hrtime_t) scratch[n - 1] * 1000;
+}
+
+static int
+took_cmp(a, b)
+	void const	*a, *b;
+{
+uint32_t	x = *(uint32_t const *) a, y = *(uint32_t const *) b;
+
+	return x < y ? -1 : x > y;
+}
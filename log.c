@@ -0,0 +1,238 @@
+/* Copyright (c) 2009 River Tarnell <river@loreley.flyingparchment.org.uk>. */
+/*
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely. This software is provided 'as-is', without any express or implied
+ * warranty.
+ */
+
+/*
+ * Logging for things clients can make happen as often as they like: junk
+ * queries, bad reports and so on.  syslog() can block, and a client
+ * sending thousands of these a second shouldn't be able to slow down
+ * answers or checks.
+ *
+ * wlog() takes the same arguments as syslog().  It formats the message
+ * into a fixed ring, and wlog_flush(), which the main loop calls after
+ * each batch of events, hands the ring to syslog.  If the ring is full,
+ * messages are dropped, and counted.
+ *
+ * Messages are rate limited by their format string: each one may be
+ * logged LOG_BURST times in LOG_WINDOW.  Beyond that they're only
+ * counted, which costs no formatting, and once the window is over we log
+ * how many were suppressed, with the last one that was logged as an
+ * example.
+ *
+ * The formats' windows are kept in a small table, LOG_WAYS to a set.  A
+ * format only takes over another's slot once that one's window is over,
+ * so two formats that hash alike can't keep starting each other's
+ * windows again.  If every slot in the set is in use, the message is
+ * dropped and counted.
+ */
+
+#include	<stdlib.h>
+#include	<stdio.h>
+#include	<stdarg.h>
+#include	<string.h>
+#include	<errno.h>
+#include	<syslog.h>
+
+#include	"wita.h"
+
+#define	LOG_RING	128		/* Messages waiting for wlog_flush() */
+#define	LOG_MSGMAX	256		/* Longest message we keep */
+#define	LOG_NKEYS	64		/* Formats we rate limit separately */
+#define	LOG_WAYS	4		/* Slots a format can use */
+#define	LOG_BURST	5		/* Messages per format per window */
+#define	LOG_WINDOW	((hrtime_t) 10 * NANOSEC)
+
+typedef struct {
+	int	lm_pri;
+	char	lm_msg[LOG_MSGMAX];
+} logmsg_t;
+
+/*
+ * Rate limiting for one format.
+ */
+typedef struct {
+	char const	*lk_fmt;
+	int		 lk_pri;
+	hrtime_t	 lk_start;	/* When this window began */
+	int		 lk_count;	/* Logged in this window */
+	int		 lk_suppressed;	/* Not logged in this window */
+	char		 lk_last[LOG_MSGMAX]; /* Last one logged */
+} logkey_t;
+
+static logmsg_t	 ring[LOG_RING];
+static int	 ring_head, ring_count, ring_lost;
+static logkey_t	 keys[LOG_NKEYS];
+static int	 keys_full;	/* Dropped for want of a slot */
+
+static logkey_t	*log_key(char const *, int, hrtime_t);
+static logmsg_t	*log_slot(int);
+static void	 log_summary(logkey_t *);
+
+void
+wlog(int pri, char const *fmt, ...)
+{
+va_list		 ap;
+int		 err = errno;
+hrtime_t	 now = gethrtime();
+logkey_t	*k;
+logmsg_t	*m;
+char		 efmt[LOG_MSGMAX], *q, *end = efmt + sizeof efmt - 1;
+char const	*p, *e;
+
+	if ((k = log_key(fmt, pri, now)) == NULL) {
+		keys_full++;
+		return;
+	}
+
+	if (k->lk_count >= LOG_BURST) {
+		k->lk_suppressed++;
+		return;
+	}
+	k->lk_count++;
+
+	if ((m = log_slot(pri)) == NULL)
+		return;
+
+	/*
+	 * vsnprintf() doesn't know %m, so put the error in the format
+	 * first, as syslog() would.
+	 */
+	for (p = fmt, q = efmt; *p && q < end; p++) {
+		if (p[0] == '%' && p[1] == 'm') {
+			for (e = strerror(err); *e && q < end; e++)
+				*q++ = *e;
+			p++;
+		} else if (p[0] == '%' && p[1] == '%' && q < end - 1) {
+			*q++ = *p++;
+			*q++ = *p;
+		} else
+			*q++ = *p;
+	}
+	*q = 0;
+
+	va_start(ap, fmt);
+	(void) vsnprintf(m->lm_msg, sizeof m->lm_msg, efmt, ap);
+	va_end(ap);
+
+	(void) strcpy(k->lk_last, m->lm_msg);
+	errno = err;
+}
+
+/*
+ * Write out everything waiting, and say what's been suppressed in
+ * windows that are over.
+ */
+void
+wlog_flush()
+{
+hrtime_t	 now;
+logmsg_t	*m;
+int		 i;
+
+	now = gethrtime();
+	for (i = 0; i < LOG_NKEYS; i++)
+		if (keys[i].lk_suppressed && now - keys[i].lk_start >= LOG_WINDOW) {
+			log_summary(&keys[i]);
+			keys[i].lk_count = 0;
+			keys[i].lk_start = now;
+		}
+
+	if (ring_lost) {
+		syslog(LOG_WARNING, "logging too fast; lost %d messages",
+				ring_lost);
+		ring_lost = 0;
+	}
+
+	if (keys_full) {
+		syslog(LOG_WARNING, "too many kinds of message; lost %d",
+				keys_full);
+		keys_full = 0;
+	}
+
+	while (ring_count > 0) {
+		m = &ring[ring_head];
+		syslog(m->lm_pri, "%s", m->lm_msg);
+		ring_head = (ring_head + 1) % LOG_RING;
+		ring_count--;
+	}
+}
+
+/*
+ * The rate limit for fmt, starting a new window if its last one is over.
+ * NULL if fmt has no slot and every slot it could have is still in its
+ * window.
+ */
+static logkey_t *
+log_key(fmt, pri, now)
+	char const	*fmt;
+	int		 pri;
+	hrtime_t	 now;
+{
+logkey_t	*set, *k, *spare = NULL;
+int		 i;
+
+	set = &keys[((uintptr_t) fmt >> 3) % (LOG_NKEYS / LOG_WAYS) * LOG_WAYS];
+	for (i = 0; i < LOG_WAYS; i++) {
+		k = &set[i];
+		if (k->lk_fmt == fmt)
+			break;
+		if (spare == NULL && (k->lk_fmt == NULL ||
+		    now - k->lk_start >= LOG_WINDOW))
+			spare = k;
+	}
+
+	if (i == LOG_WAYS) {
+		if ((k = spare) == NULL)
+			return NULL;
+	} else if (now - k->lk_start < LOG_WINDOW)
+		return k;
+
+	log_summary(k);
+	k->lk_fmt = fmt;
+	k->lk_pri = pri;
+	k->lk_start = now;
+	k->lk_count = 0;
+	return k;
+}
+
+/*
+ * The next free message in the ring, or NULL if it's full.
+ */
+static logmsg_t *
+log_slot(pri)
+	int	pri;
+{
+logmsg_t	*m;
+
+	if (ring_count == LOG_RING) {
+		ring_lost++;
+		return NULL;
+	}
+
+	m = &ring[(ring_head + ring_count++) % LOG_RING];
+	m->lm_pri = pri;
+	return m;
+}
+
+/*
+ * Log how many messages like k's were suppressed, if any.
+ */
+static void
+log_summary(k)
+	logkey_t	*k;
+{
+logmsg_t	*m;
+
+	if (k->lk_suppressed == 0)
+		return;
+
+	if ((m = log_slot(k->lk_pri)) != NULL)
+		(void) snprintf(m->lm_msg, sizeof m->lm_msg,
+				"suppressed %d similar to: %s",
+				k->lk_suppressed, k->lk_last);
+	k->lk_suppressed = 0;
+}
@@ -19,8 +19,9 @@
  * PowerDNS to send requests to wita for wita.example.com, wita will serve
  * sql-s1-fast.wita.example.com and sql-s1.wita.example.com.
  *
- * Wita doesn't actually care what the FQDN of the query is; it will strip
- * off all except the first element of the FQDN and use that as the group name.
+ * Unless you tell wita which zones it serves (see below), it doesn't care
+ * what the FQDN of the query is; it will strip off all except the first
+ * element of the FQDN and use that as the group name.
  *
  * Wita uses a simple configuration format that looks like this:
  *
@@ -37,10 +38,131 @@
  *
  *     sql-s1-fast thyme:3307 !rosemary
  *
- * But you should not configure the same server more than once with different
- * ports (it will not work properly).
+ * An IPv6 address with a port goes in brackets: [2001:db8::1]:3307.
  *
- * Server names will be resolved to IPs at startup time and cached.
+ * Server names will be resolved to IPs at startup time and cached.  A name
+ * with several addresses (IPv4, IPv6, or both) is checked at each of them
+ * separately, and each address is returned only while it is up.  A
+ * queries get the IPv4 addresses and AAAA queries the IPv6 ones; each
+ * family falls back to the backups on its own, when none of the
+ * primaries has an address of that family up.
+ *
+ * Lines of the form "set <option> <value>" change tunables:
+ *
+ *     set maxprobes 500
+ *
+ * maxprobes limits how many servers are checked at the same time (each
+ * check holds a socket).  Checks over the limit wait their turn in a
+ * queue.  The default is the file descriptor limit less a small reserve.
+ *
+ * A server is only marked up after "rise" consecutive successful checks,
+ * and only marked down after "fall" consecutive failures (both default to
+ * 2), so one lost packet doesn't change the answers.  The first check
+ * after startup sets the state directly.
+ *
+ * Servers that keep changing state can be held down by flap dampening:
+ *
+ *     set dampen-halflife 60
+ *     set dampen-suppress 3000
+ *     set dampen-reuse 1500
+ *
+ * Each state change adds 1000 to a penalty which halves every
+ * dampen-halflife seconds.  A server whose penalty reaches dampen-suppress
+ * is considered down until the penalty falls below dampen-reuse.  The
+ * penalty never goes above 16 times dampen-reuse, so dampen-suppress
+ * can't be more than that.
+ * Dampening is off unless dampen-halflife is set.
+ *
+ * The TTL on answers for a group grows with the time since the group's
+ * answer last changed (one tenth of it), between ttl-min and ttl-max
+ * (5 and 60 seconds by default).  Stable groups are re-queried less
+ * often, while a group that has just changed gets a short TTL.  Options
+ * for a single group are given as name=value on the group's line:
+ *
+ *     sql-s1 thyme !rosemary ttl-min=2 ttl-max=30
+ *
+ * By default, an answer holds only as many records as fit in a 512-byte
+ * UDP response, so clients never need to retry over TCP.  "max-answers"
+ * (globally with "set", or per group) sets a fixed limit instead.  When
+ * there are more servers up than the limit, each answer takes the next
+ * few in turn, so they all get their share of clients.
+ * Because of this syntax, a group cannot be called "set".
+ *
+ * A group can fall back to other groups when none of its own servers
+ * (primary or backup) are up:
+ *
+ *     sql-local thyme sage fallback=sql-remote,sql-master
+ *     sql-remote rosemary fallback=sql-master
+ *     sql-master parsley
+ *
+ * The fallbacks are tried in order, and a fallback's answer includes its
+ * own fallbacks, so chains can be as long as needed.  Fallbacks must be
+ * in the same zone as the group, and may not loop.
+ *
+ * To let secondaries transfer the zone (AXFR), tell wita its name:
+ *
+ *     set zone wita.example.com
+ *     set soa-mname ns1.example.com.
+ *     set soa-rname hostmaster.example.com.
+ *
+ * wita then answers SOA and NS queries for the zone apex itself.  The
+ * SOA serial goes up every time any group's answer changes (once for
+ * each batch of changes), and is never less than the current time, so it
+ * doesn't go backwards when wita restarts.  If answers change more than
+ * once a second, that can put it ahead of the clock; to carry it across
+ * a restart then, give wita a file to keep it in:
+ *
+ *     set serial-file /var/wita/serial
+ *
+ * A transfer lists every server in the current answer for every group.
+ * Secondaries cannot be notified of changes, so the SOA asks them to
+ * check every 30 seconds.
+ * soa-mname (also used for the NS record) defaults to "localhost." and
+ * soa-rname to hostmaster in the zone.
+ *
+ * Groups can also be put in zones of their own.  A "zone <name>" line
+ * puts the groups that follow it in that zone; groups before the first
+ * one are in the "set zone" zone.  Groups in a zone only answer for
+ * their name in that zone, so two zones can each have a group with the
+ * same name, and queries for other zones are not answered.  A group's
+ * name can have several labels, and a "*" label matches any one label:
+ *
+ *     zone tenants.example.com
+ *     *.db tenant-db1 !tenant-db2
+ *
+ * answers for acme.db.tenants.example.com, initech.db.tenants.example.com,
+ * and so on.  An exact name is preferred to a wildcard.  Each zone has its
+ * own SOA and can be transferred separately.  Like "set", "zone" cannot
+ * be used as a group name.
+ *
+ * SRV queries for any name ending in a group, such as
+ * _mysql._tcp.sql-s1.wita.example.com, list every server in the group
+ * that is up, with its port.  Backup servers get priority 1, the others
+ * priority 0.  A server's SRV weight (default 1) follows a '/':
+ *
+ *     sql-s1 thyme:3307/10 sage:3307/5 !rosemary:3307
+ *
+ * The target of each SRV record is the server's name in the zone (a
+ * numeric address has its dots and colons changed to dashes, so
+ * 10.0.0.1 becomes 10-0-0-1.wita.example.com), and wita answers A
+ * queries for these names too.
+ *
+ * By default a server is up if it accepts a connection and sends
+ * something, which suits MySQL.  Other protocols need a probe, which
+ * says what to send and what the reply should look like, and which
+ * groups use with "probe=":
+ *
+ *     probe redis send=PING\r\n expect=+PONG
+ *     cache-s1 tarragon:6379 chervil:6379 probe=redis
+ *
+ * See probe.c for the details.  A server in several groups must use the
+ * same probe in all of them.  "probe" cannot be used as a group name.
+ *
+ * Normally wita runs as a PowerDNS pipe backend, reading queries on
+ * stdin.  With "-l <address>[:<port>]" (which can be given more than
+ * once), it instead answers DNS itself, over UDP and TCP, on that
+ * address (port 53 by default; use "[addr]" for IPv6 and "*" for all
+ * addresses).  The answers are the same either way.
  *
  * For each configured server, wita connects to it every 5 seconds.
  * If the connection succeeds, it then waits 5 seconds for the server
@@ -48,6 +170,55 @@
  * considered to be down.  Otherwise, it's up.  When PowerDNS requests
  * RRs for a particular group, wita returns the addresses of the servers
  * in that group that are up.
+ *
+ * Clients don't have to wait for the next check to find out about a dead
+ * server.  With "-r <path>" (a unix datagram socket) or "-r <host>:<port>"
+ * (UDP, which should be on loopback), a client that can't use a server
+ * can send "fail <server>", naming it as in the configuration or by
+ * address ("10.0.0.1:3306").  wita checks it straight away, and once
+ * "report-threshold" reports (default 3; "set report-threshold 0" turns
+ * this off) arrive within 10 seconds, stops returning the server until a
+ * check succeeds.  Reports are rate limited, and repeated reports while
+ * a check is running are only counted.
+ *
+ * Programs that want to know when a group's answer changes can connect
+ * to the unix socket given with "-s <path>" and subscribe to it; see
+ * sub.c for the protocol.
+ *
+ * Servers can be drained, checked, and added to or removed from groups
+ * while wita runs, without a reload, through the control socket given
+ * with "-C <path>"; see ctl.c.
+ *
+ * wita remembers how each server's last 64 checks went ("set history"
+ * changes how many), and the control socket's "history" and "latency"
+ * commands show them, for finding out afterwards how a server failed;
+ * see history.c.
+ *
+ * With "-m <file>", wita writes counters and latency histograms for
+ * checks, queries, servers and groups to the file every few seconds, in
+ * Prometheus's text format; see metrics.c.
+ *
+ * For looking inside a running wita, there are DTrace probes on queries,
+ * checks, state changes and reloads; see wita.d.
+ *
+ * "-R <file>" records everything PowerDNS sends, with its timing, so
+ * pdnsreplay can send it to another wita later; see record.c.
+ *
+ * Several witas with the same configuration can share their checks, so
+ * that one with network trouble of its own doesn't take good servers out
+ * of its answers.  Each is given "-g <host>:<port>" to gossip on, and
+ * "-P <host>:<port>" for each of the others.  With "set quorum 2", each
+ * server is checked by two of the instances and is only down when both
+ * say so; the default, 1, splits the checks between the instances with
+ * no overlap.  See gossip.c.
+ *
+ * To upgrade wita without restarting PowerDNS or losing what it knows
+ * about the servers, replace the binary and send wita SIGUSR2.  It execs
+ * the new binary in the same process, handing over its pipes, listening
+ * sockets and server state, so no query goes unanswered and nothing is
+ * checked again early.  The configuration is read again, as on SIGHUP.
+ * The new process is told where the state is with "-U <fd>", which is
+ * for wita's own use.  See upgrade.c.
  */
 
 #include	<sys/socket.h>
@@ -56,6 +227,7 @@
 #include	<stdlib.h>
 #include	<assert.h>
 #include	<string.h>
+#include	<strings.h>
 #include	<stdio.h>
 #include	<errno.h>
 #include	<signal.h>
@@ -70,6 +242,27 @@
 char const	*cfg = "/etc/opt/ts/wita.cfg";
 int		 port;	/* Solaris event port */
 
+/*
+ * Maximum number of events retrieved from the port with a single
+ * port_getn() call.  With many servers, most wakeups find several
+ * completions waiting, and reaping them together saves a system call
+ * per event.
+ */
+#define	MAXEVENTS	64
+
+/*
+ * A timer for housekeeping that no other event drives: for now, flushing
+ * the recording of PowerDNS's queries (see record.c), so it's only made
+ * when we're recording.
+ */
+#define	TICK_INTERVAL	1	/* Seconds */
+
+static evsource_t	 tick_ev;
+static timer_t		 tick_timer;
+
+static int	tick_start(void);
+static void	tick(evsource_t *, port_event_t *);
+
 /*
  * Handle async signal delivery and send the signal as
  * an event to our event port in main().
@@ -83,43 +276,150 @@ sighandle(int sig)
 	}
 }
 
+/*
+ * Addresses given with -l to answer DNS on.
+ */
+#define	MAXLISTEN	16
+static char const	*listenaddrs[MAXLISTEN];
+static int		 nlisten;
+
+/*
+ * Where clients send failure reports (-r), if anywhere.
+ */
+static char const	*reportaddr;
+
+/*
+ * Where clients subscribe to group changes (-s), if anywhere.
+ */
+static char const	*subpath;
+
+/*
+ * Where the operator sends commands (-C), if anywhere.
+ */
+static char const	*ctlpath;
+
+/*
+ * Where to write metrics (-m), if anywhere.
+ */
+static char const	*metricspath;
+
+/*
+ * Where to record PowerDNS's queries (-R), if anywhere.
+ */
+static char const	*recordpath;
+
+/*
+ * Where we gossip with other instances (-g), if anywhere, and how many
+ * of them (-P) there are.
+ */
+static char const	*gossipaddr;
+static int		 npeers;
+
 int
 main(argc, argv)
 	int 	  argc;
 	char	**argv;
 {
 int		 i, fl;
-port_event_t	 ev;
-server_t	*sr;
+port_event_t	 evs[MAXEVENTS], *ev;
+uint_t		 nev, n;
+evsource_t	*es;
 int		 c;
 
 	openlog("wita", LOG_PID, LOG_DAEMON);
+	upgrade_init(argc, argv);
 
-	while ((c = getopt(argc, argv, "vc:")) != -1) {
+	while ((c = getopt(argc, argv, "vc:l:r:s:C:m:R:g:P:U:")) != -1) {
 		switch(c) {
 		case 'c':
 			cfg = optarg;
 			break;
 
+		case 'l':
+			if (nlisten == MAXLISTEN) {
+				(void) fprintf(stderr, "wita: too many -l options\n");
+				return 1;
+			}
+			listenaddrs[nlisten++] = optarg;
+			break;
+
+		case 'r':
+			reportaddr = optarg;
+			break;
+
+		case 's':
+			subpath = optarg;
+			break;
+
+		case 'C':
+			ctlpath = optarg;
+			break;
+
+		case 'm':
+			metricspath = optarg;
+			break;
+
+		case 'R':
+			recordpath = optarg;
+			break;
+
+		case 'g':
+			gossipaddr = optarg;
+			break;
+
+		case 'P':
+			if (gossip_peer(optarg) == -1)
+				return 1;
+			npeers++;
+			break;
+
+		case 'U':
+			(void) upgrade_load(optarg);
+			break;
+
 		case 'v':
 			(void) fprintf(stderr, "wita version %s\n", WITA_VERSION);
 			return 0;
 
 		default:
-			syslog(LOG_ERR, "usage: wita [-c cfg]");
-			(void) fprintf(stderr, "usage: wita [-c cfg]\n");
+			syslog(LOG_ERR, "usage: wita [-c cfg] [-r report-addr] "
+					"[-s sub-path] [-C ctl-path] [-m metrics-file] "
+					"[-R record-file] [-g gossip-addr [-P peer]...] "
+					"[-l addr[:port]]...");
+			(void) fprintf(stderr, "usage: wita [-c cfg] [-r report-addr] "
+					"[-s sub-path] [-C ctl-path] [-m metrics-file] "
+					"[-R record-file] [-g gossip-addr [-P peer]...] "
+					"[-l addr[:port]]...\n");
 			return 1;
 		}
 	}
 
+	if (recordpath && nlisten > 0) {
+		(void) fprintf(stderr, "wita: -R records queries from PowerDNS, "
+				"and can't be used with -l\n");
+		return 1;
+	}
+
+	if (npeers > 0 && gossipaddr == NULL) {
+		(void) fprintf(stderr, "wita: -P needs -g, to say where to "
+				"gossip from\n");
+		return 1;
+	}
+
 	if ((port = port_create()) == -1) {
 		syslog(LOG_ERR, "cannot create event port: %m");
 		return 1;
 	}
 
+	/*
+	 * A server or local client that goes away while we're writing to
+	 * it is handled where the write fails.
+	 */
+	(void) signal(SIGPIPE, SIG_IGN);
 	(void) signal(SIGINT, sighandle);
 	(void) signal(SIGHUP, sighandle);
 	(void) signal(SIGTERM, sighandle);
+	(void) signal(SIGUSR2, sighandle);
 
 	if (load_configuration(cfg) == -1) {
 		syslog(LOG_ERR, "cannot load configuration");
@@ -127,102 +427,217 @@ int		 c;
 	}
 
 	/*
-	 * Start the initial check for each server.
+	 * Start the initial check for each server, unless we're carrying
+	 * on from before an upgrade.
 	 */
 	for (i = 0; i < curconf->nservers; i++)
-		server_start_connect_check(curconf->servers[i]);
+		if (!upgrade_resume(curconf->servers[i]))
+			server_start_connect_check(curconf->servers[i]);
 
-	/*
-	 * Register for events from PowerDNS on stdin.
-	 */
-	if ((fl = fcntl(STDIN_FILENO, F_GETFL, 0)) == -1) {
-		syslog(LOG_ERR, "fcntl(0, F_GETFL): %m");
+	if (reportaddr && report_listen(reportaddr) == -1)
 		return 1;
-	}
 
-	if (fcntl(STDIN_FILENO, F_SETFL, fl | O_NONBLOCK) == -1) {
-		syslog(LOG_ERR, "fcntl(0, F_SETFL): %m");
+	if (subpath && sub_listen(subpath) == -1)
 		return 1;
-	}
 
-	if (port_associate(port, PORT_SOURCE_FD, STDIN_FILENO, POLLIN, NULL) == -1) {
-		syslog(LOG_ERR, "port_associate(0, POLLIN): %m");
+	if (ctlpath && ctl_listen(ctlpath) == -1)
+		return 1;
+
+	if (metricspath && metrics_start(metricspath) == -1)
+		return 1;
+
+	if (gossipaddr && gossip_listen(gossipaddr) == -1)
 		return 1;
-	}
 
 	/*
-	 * Handle any pending events on stdin.
+	 * In native mode, we answer DNS ourselves and don't talk to PowerDNS.
 	 */
-	handle_pdns();
+	for (i = 0; i < nlisten; i++)
+		if (dns_listen(listenaddrs[i]) == -1)
+			return 1;
+
+	if (nlisten == 0 && recordpath &&
+	    (record_open(recordpath) == -1 || tick_start() == -1))
+		return 1;
 
 	/*
-	 * Main event loop.
+	 * Everything that takes over a socket after an upgrade has, so the
+	 * rest can be closed.
 	 */
-	while ((i = port_get(port, &ev, NULL)) != -1 || errno == EINTR) {
-		if (i == -1 && errno == EINTR)
-			continue;
-
-		switch (ev.portev_source) {
+	upgrade_done();
 
+	if (nlisten == 0) {
 		/*
-		 * Timer event: this can either mean our connect() or read()
-		 * timed out, or the server is due for another check.  We
-		 * decide which based on server's current state.
+		 * Register for events from PowerDNS on stdin.
 		 */
-		case PORT_SOURCE_TIMER:
-			sr = (server_t *) ev.portev_user;
-			assert(sr);
-			server_handle_timer(sr);
-			break;
+		if ((fl = fcntl(STDIN_FILENO, F_GETFL, 0)) == -1) {
+			syslog(LOG_ERR, "fcntl(0, F_GETFL): %m");
+			return 1;
+		}
+
+		if (fcntl(STDIN_FILENO, F_SETFL, fl | O_NONBLOCK) == -1) {
+			syslog(LOG_ERR, "fcntl(0, F_SETFL): %m");
+			return 1;
+		}
+
+		if (port_associate(port, PORT_SOURCE_FD, STDIN_FILENO, POLLIN, NULL) == -1) {
+			syslog(LOG_ERR, "port_associate(0, POLLIN): %m");
+			return 1;
+		}
 
 		/*
-		 * FD event: this can come from a connect() or read() to a
-		 * server either succeeding or returning an error.  If it's on
-		 * fd 0, it's a question from PowerDNS.
+		 * Handle any pending events on stdin.
 		 */
-		case PORT_SOURCE_FD:
-			if (ev.portev_object == 0) {
-				handle_pdns();
+		handle_pdns();
+	}
+
+	/*
+	 * Main event loop.  Block until at least one event is ready, then
+	 * take as many as are available (up to MAXEVENTS) in one go.
+	 */
+	for (;;) {
+		nev = 1;
+		if (port_getn(port, evs, MAXEVENTS, &nev, NULL) == -1) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		for (n = 0; n < nev; n++) {
+			ev = &evs[n];
+
+			switch (ev->portev_source) {
+
+			/*
+			 * Timer event: for a server, this can either mean our
+			 * connect() or read() timed out, or the server is due
+			 * for another check.  The server decides which based
+			 * on its current state.
+			 *
+			 * FD event: this can come from a connect() or read() to a
+			 * server either succeeding or returning an error, or from
+			 * one of our DNS sockets.  If it's on fd 0, it's a question
+			 * from PowerDNS.
+			 */
+			case PORT_SOURCE_TIMER:
+			case PORT_SOURCE_FD:
+				if (ev->portev_source == PORT_SOURCE_FD &&
+				    ev->portev_object == 0) {
+					handle_pdns();
+					break;
+				}
+
+				es = (evsource_t *) ev->portev_user;
+				assert(es);
+				es->es_handler(es, ev);
 				break;
+
+			/*
+			 * PORT_SOURCE_USER is a signal delivery from sighandle().
+			 */
+			case PORT_SOURCE_USER:
+				(void) signal(ev->portev_events, sighandle);
+
+				switch (ev->portev_events) {
+				case SIGHUP:
+					syslog(LOG_INFO, "SIGHUP received, reloading configuration");
+					if (load_configuration(cfg) == -1) {
+						syslog(LOG_ERR, "cannot reload configuration");
+						break;
+					}
+
+					/*
+					 * Restart check timers for all servers with the new configuration.
+					 */
+					for (i = 0; i < curconf->nservers; i++)
+						server_start_connect_check(curconf->servers[i]);
+					sub_reload();
+					break;
+
+				case SIGUSR2:
+					syslog(LOG_INFO, "SIGUSR2 received, upgrading");
+					upgrade_request();
+					break;
+
+				case SIGINT:
+				case SIGTERM:
+					wlog_flush();
+					syslog(LOG_INFO, "exit requested by signal");
+					return 0;
+				}
+				break;
+
+			default:
+				abort();
 			}
+		}
 
-			sr = (server_t *) ev.portev_user;
-			assert(sr);
-			server_handle_fd(sr);
-			break;
+		/*
+		 * Tell subscribers and peers about anything that changed,
+		 * write out what's waiting for our unix socket clients, free
+		 * DNS clients that were closed, log what was queued with
+		 * wlog(), and save the SOA serial if it needs to be.
+		 */
+		sub_flush();
+		gossip_flush();
+		uclient_flush();
+		dns_flush();
+		wlog_flush();
+		zone_serial_done();
 
+		/*
+		 * Nothing left in hand can refer to a configuration
+		 * replaced during this batch.
+		 */
+		config_reap();
 
 		/*
-		 * PORT_SOURCE_USER is a signal delivery from sighandle().
+		 * Everything from this batch is done, so it's a good time to
+		 * upgrade.  This only returns if it fails.
 		 */
-		case PORT_SOURCE_USER:
-			(void) signal(ev.portev_events, sighandle);
-
-			switch (ev.portev_events) {
-			case SIGHUP:
-				syslog(LOG_INFO, "SIGHUP received, reloading configuration");
-				if (load_configuration(cfg) == -1)
-					syslog(LOG_ERR, "cannot reload configuration");
-
-				/*
-				 * Restart check timers for all servers with the new configuration.
-				 */
-				for (i = 0; i < curconf->nservers; i++)
-					server_start_connect_check(curconf->servers[i]);
-				break;
+		if (upgrade_requested())
+			upgrade_exec();
+	}
 
-			case SIGINT:
-			case SIGTERM:
-				syslog(LOG_INFO, "exit requested by signal");
-				return 0;
-			}
-			break;
+	syslog(LOG_ERR, "port_getn: %m\n");
+	return 0;
+}
 
-		default:
-			abort();
-		}
+static int
+tick_start()
+{
+struct sigevent		ev;
+port_notify_t		notf;
+struct itimerspec	ts;
+
+	tick_ev.es_handler = tick;
+	bzero(&ev, sizeof(ev));
+	ev.sigev_notify = SIGEV_PORT;
+	ev.sigev_value.sival_ptr = &notf;
+	notf.portnfy_port = port;
+	notf.portnfy_user = &tick_ev;
+
+	if (timer_create(CLOCK_REALTIME, &ev, &tick_timer) == -1) {
+		syslog(LOG_ERR, "tick_start: cannot create timer: %m");
+		return -1;
+	}
+
+	bzero(&ts, sizeof(ts));
+	ts.it_value.tv_sec = TICK_INTERVAL;
+	ts.it_interval.tv_sec = TICK_INTERVAL;
+	if (timer_settime(tick_timer, 0, &ts, NULL) == -1) {
+		syslog(LOG_ERR, "tick_start: cannot set timer: timer_settime: %m");
+		return -1;
 	}
 
-	syslog(LOG_ERR, "port_get: %m\n");
 	return 0;
 }
+
+/*ARGSUSED*/
+static void
+tick(es, ev)
+	evsource_t	*es;
+	port_event_t	*ev;
+{
+	record_flush();
+}
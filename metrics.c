@@ -0,0 +1,386 @@
+/* Copyright (c) 2009 River Tarnell <river@loreley.flyingparchment.org.uk>. */
+/*
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely. This software is provided 'as-is', without any express or implied
+ * warranty.
+ */
+
+/*
+ * Metrics.  The code that does the work keeps plain counters as it goes:
+ * in the servers and groups themselves, and in the global "metrics".
+ * Since everything runs on one thread, that's an increment or two per
+ * event, with no locking.  With -m <file>, every METRICS_INTERVAL seconds
+ * they are all written to the file in Prometheus's text format, for
+ * node_exporter's textfile collector or anything else that can read it.
+ * The file is written under another name and renamed into place, so a
+ * reader never sees half of it.
+ *
+ * Latencies go into histograms with log-linear buckets, as in HDR
+ * histograms: each power of two is split into HIST_SUB buckets, so the
+ * error is bounded by a fixed fraction of the value across the whole
+ * range, from microseconds to a minute, in about a hundred buckets.
+ * Histograms are kept for all probes together and for all queries; each
+ * server only keeps a count and total time, since a histogram for every
+ * server would swamp the file on a large farm.
+ *
+ * Counters start again from zero when the configuration is reloaded,
+ * which Prometheus treats as a counter reset.
+ */
+
+#include	<stdlib.h>
+#include	<stdio.h>
+#include	<string.h>
+#include	<unistd.h>
+#include	<signal.h>
+#include	<syslog.h>
+#include	<assert.h>
+#include	<port.h>
+
+#include	"wita.h"
+
+#define	METRICS_INTERVAL	10	/* Seconds between writes */
+
+metrics_t	metrics;
+
+static char const	*metrics_path;
+static char		*metrics_tmp;
+static evsource_t	 metrics_ev;
+static timer_t		 metrics_timer;
+
+static char const *const	probe_results[NPROBE_RESULTS] = {
+	"ok", "fail", "timeout"
+};
+static char const *const	query_sources[NQUERY_SOURCES] = {
+	"pdns", "dns"
+};
+static char const *const	family_names[NFAMILIES] = {
+	"ipv4", "ipv6"
+};
+
+static void	metrics_event(evsource_t *, port_event_t *);
+static void	metrics_write(void);
+static hrtime_t	hist_bound(int);
+static void	print_help(FILE *, char const *, char const *, char const *);
+static void	print_hist(FILE *, char const *, char const *, hist_t *);
+static void	print_server(FILE *, char const *, server_t *);
+static void	print_group(FILE *, char const *, group_t *);
+static void	print_label(FILE *, char const *, char const *);
+
+/*
+ * Count a value (in nanoseconds) in a histogram.
+ */
+void
+hist_add(h, ns)
+	hist_t		*h;
+	hrtime_t	 ns;
+{
+uint64_t	v;
+int		msb, idx;
+
+	if (ns < 0)
+		ns = 0;
+	h->h_n++;
+	h->h_sum += ns;
+
+	v = (uint64_t) ns >> HIST_MINSHIFT;
+	if (v < HIST_SUB)
+		idx = (int) v;
+	else {
+		for (msb = HIST_SUBBITS; (v >> (msb + 1)) != 0; msb++)
+			;
+		idx = (msb - HIST_SUBBITS + 1) * HIST_SUB +
+			(int) ((v >> (msb - HIST_SUBBITS)) & (HIST_SUB - 1));
+	}
+
+	if (idx >= HIST_NBUCKETS)
+		idx = HIST_NBUCKETS - 1;
+	h->h_count[idx]++;
+}
+
+/*
+ * The upper bound of a histogram bucket, in nanoseconds.
+ */
+static hrtime_t
+hist_bound(idx)
+	int	idx;
+{
+int	oct = idx / HIST_SUB, sub = idx % HIST_SUB;
+
+	if (oct == 0)
+		return (hrtime_t) (idx + 1) << HIST_MINSHIFT;
+	return (hrtime_t) (HIST_SUB + sub + 1) << (oct - 1 + HIST_MINSHIFT);
+}
+
+/*
+ * Start writing metrics to path.
+ */
+int
+metrics_start(path)
+	char const	*path;
+{
+struct sigevent		ev;
+port_notify_t		notf;
+struct itimerspec	ts;
+size_t			len;
+
+	assert(path);
+
+	len = strlen(path) + sizeof ".tmp";
+	if ((metrics_tmp = malloc(len)) == NULL) {
+		syslog(LOG_ERR, "out of memory");
+		return -1;
+	}
+	(void) snprintf(metrics_tmp, len, "%s.tmp", path);
+	metrics_path = path;
+
+	metrics_ev.es_handler = metrics_event;
+	bzero(&ev, sizeof(ev));
+	ev.sigev_notify = SIGEV_PORT;
+	ev.sigev_value.sival_ptr = &notf;
+	notf.portnfy_port = port;
+	notf.portnfy_user = &metrics_ev;
+
+	if (timer_create(CLOCK_REALTIME, &ev, &metrics_timer) == -1) {
+		syslog(LOG_ERR, "metrics_start: cannot create timer: %m");
+		return -1;
+	}
+
+	bzero(&ts, sizeof(ts));
+	ts.it_value.tv_sec = METRICS_INTERVAL;
+	ts.it_interval.tv_sec = METRICS_INTERVAL;
+	if (timer_settime(metrics_timer, 0, &ts, NULL) == -1) {
+		syslog(LOG_ERR, "metrics_start: cannot set timer: timer_settime: %m");
+		return -1;
+	}
+
+	syslog(LOG_INFO, "writing metrics to %s every %d seconds", path,
+			METRICS_INTERVAL);
+	return 0;
+}
+
+/*ARGSUSED*/
+static void
+metrics_event(es, ev)
+	evsource_t	*es;
+	port_event_t	*ev;
+{
+	metrics_write();
+}
+
+static void
+metrics_write()
+{
+FILE		*f;
+int		 i, r, s, fam;
+server_t	*sr;
+group_t		*gr;
+char		 label[32];
+
+	if ((f = fopen(metrics_tmp, "w")) == NULL) {
+		syslog(LOG_ERR, "%s: %m", metrics_tmp);
+		return;
+	}
+
+	print_help(f, "wita_probes_total", "counter",
+			"Server checks, by result.");
+	for (r = 0; r < NPROBE_RESULTS; r++)
+		(void) fprintf(f, "wita_probes_total{result=\"%s\"} %llu\n",
+				probe_results[r],
+				(unsigned long long) metrics.m_probes[r]);
+
+	print_help(f, "wita_probe_duration_seconds", "histogram",
+			"Time from starting a check to its result.");
+	print_hist(f, "wita_probe_duration_seconds", "", &metrics.m_probe_time);
+
+	print_help(f, "wita_probe_queue_wait_seconds", "histogram",
+			"Time checks waited for a free probe slot.");
+	print_hist(f, "wita_probe_queue_wait_seconds", "",
+			&metrics.m_probeq_wait);
+
+	print_help(f, "wita_query_duration_seconds", "histogram",
+			"Time to answer a query.");
+	for (s = 0; s < NQUERY_SOURCES; s++) {
+		(void) snprintf(label, sizeof label, "source=\"%s\"",
+				query_sources[s]);
+		print_hist(f, "wita_query_duration_seconds", label,
+				&metrics.m_query_time[s]);
+	}
+
+	print_help(f, "wita_unknown_queries_total", "counter",
+			"Queries for names that are not ours.");
+	for (s = 0; s < NQUERY_SOURCES; s++)
+		(void) fprintf(f, "wita_unknown_queries_total{source=\"%s\"} %llu\n",
+				query_sources[s],
+				(unsigned long long) metrics.m_unknown[s]);
+
+	print_help(f, "wita_zone_serial", "gauge", "SOA serial of our zones.");
+	(void) fprintf(f, "wita_zone_serial %lu\n", (unsigned long) zone_serial);
+
+	/*
+	 * The text format wants all of one metric together, so each
+	 * goes through every server or group in turn.
+	 */
+	print_help(f, "wita_server_up", "gauge",
+			"Whether the server is handed out.");
+	for (i = 0; i < curconf->nservers; i++) {
+		sr = curconf->servers[i];
+		print_server(f, "wita_server_up", sr);
+		(void) fprintf(f, "} %d\n", sr->sr_online);
+	}
+
+	print_help(f, "wita_server_probes_total", "counter",
+			"Checks of the server, by result.");
+	for (i = 0; i < curconf->nservers; i++) {
+		sr = curconf->servers[i];
+		for (r = 0; r < NPROBE_RESULTS; r++) {
+			print_server(f, "wita_server_probes_total", sr);
+			(void) fprintf(f, ",result=\"%s\"} %llu\n", probe_results[r],
+					(unsigned long long) sr->sr_nprobes[r]);
+		}
+	}
+
+	print_help(f, "wita_server_probe_seconds_total", "counter",
+			"Time spent checking the server.");
+	for (i = 0; i < curconf->nservers; i++) {
+		sr = curconf->servers[i];
+		print_server(f, "wita_server_probe_seconds_total", sr);
+		(void) fprintf(f, "} %.6f\n", (double) sr->sr_probe_time / NANOSEC);
+	}
+
+	print_help(f, "wita_server_state_changes_total", "counter",
+			"Times the server went up or down.");
+	for (i = 0; i < curconf->nservers; i++) {
+		sr = curconf->servers[i];
+		print_server(f, "wita_server_state_changes_total", sr);
+		(void) fprintf(f, "} %llu\n", (unsigned long long) sr->sr_nchanges);
+	}
+
+	print_help(f, "wita_group_queries_total", "counter",
+			"Queries answered from the group.");
+	for (i = 0; i < curconf->ngroups; i++) {
+		gr = curconf->groups[i];
+		print_group(f, "wita_group_queries_total", gr);
+		(void) fprintf(f, "} %llu\n", (unsigned long long) gr->gr_nqueries);
+	}
+
+	print_help(f, "wita_group_changes_total", "counter",
+			"Times the group's answer changed.");
+	for (i = 0; i < curconf->ngroups; i++) {
+		gr = curconf->groups[i];
+		print_group(f, "wita_group_changes_total", gr);
+		(void) fprintf(f, "} %llu\n", (unsigned long long) gr->gr_nchanges);
+	}
+
+	print_help(f, "wita_group_servers_up", "gauge",
+			"Servers in the group's own answer.");
+	for (i = 0; i < curconf->ngroups; i++) {
+		gr = curconf->groups[i];
+		for (fam = 0; fam < NFAMILIES; fam++) {
+			print_group(f, "wita_group_servers_up", gr);
+			(void) fprintf(f, ",family=\"%s\"} %d\n", family_names[fam],
+					gr->gr_nup[fam] ? gr->gr_nup[fam] :
+						gr->gr_nbackup_up[fam]);
+		}
+	}
+
+	if (ferror(f)) {
+		syslog(LOG_ERR, "%s: write error", metrics_tmp);
+		(void) fclose(f);
+		(void) unlink(metrics_tmp);
+		return;
+	}
+
+	if (fclose(f) == EOF) {
+		syslog(LOG_ERR, "%s: %m", metrics_tmp);
+		(void) unlink(metrics_tmp);
+		return;
+	}
+
+	if (rename(metrics_tmp, metrics_path) == -1) {
+		syslog(LOG_ERR, "cannot rename %s to %s: %m", metrics_tmp,
+				metrics_path);
+		(void) unlink(metrics_tmp);
+	}
+}
+
+static void
+print_help(f, name, type, help)
+	FILE		*f;
+	char const	*name, *type, *help;
+{
+	(void) fprintf(f, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/*
+ * Print a histogram's buckets, sum and count.  label is any other labels
+ * it has, or "".  Every bucket is printed each time, even if it's
+ * empty, since Prometheus expects the same buckets in every scrape.
+ */
+static void
+print_hist(f, name, label, h)
+	FILE		*f;
+	char const	*name, *label;
+	hist_t		*h;
+{
+uint64_t	cum = 0;
+int		i;
+char const	*comma = *label ? "," : "";
+
+	for (i = 0; i < HIST_NBUCKETS - 1; i++) {
+		cum += h->h_count[i];
+		(void) fprintf(f, "%s_bucket{%s%sle=\"%.9g\"} %llu\n", name,
+				label, comma, (double) hist_bound(i) / NANOSEC,
+				(unsigned long long) cum);
+	}
+
+	(void) fprintf(f, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, label,
+			comma, (unsigned long long) h->h_n);
+	(void) fprintf(f, "%s_sum%s%s%s %.9f\n", name, *label ? "{" : "", label,
+			*label ? "}" : "", (double) h->h_sum / NANOSEC);
+	(void) fprintf(f, "%s_count%s%s%s %llu\n", name, *label ? "{" : "", label,
+			*label ? "}" : "", (unsigned long long) h->h_n);
+}
+
+/*
+ * Print the start of a metric for a server, up to its last label.
+ */
+static void
+print_server(f, name, sr)
+	FILE		*f;
+	char const	*name;
+	server_t	*sr;
+{
+	(void) fprintf(f, "%s{", name);
+	print_label(f, "server", sr->sr_spec);
+	(void) fprintf(f, ",address=\"%s\"", sr->sr_address);
+}
+
+static void
+print_group(f, name, gr)
+	FILE		*f;
+	char const	*name;
+	group_t		*gr;
+{
+	(void) fprintf(f, "%s{", name);
+	print_label(f, "group", gr->gr_name);
+	(void) fputc(',', f);
+	print_label(f, "zone", gr->gr_zone ? gr->gr_zone->zn_name : "");
+}
+
+/*
+ * Print name="value", with value escaped.
+ */
+static void
+print_label(f, name, value)
+	FILE		*f;
+	char const	*name, *value;
+{
+	(void) fprintf(f, "%s=\"", name);
+	for (; *value; value++) {
+		if (*value == '"' || *value == '\\')
+			(void) putc('\\', f);
+		(void) putc(*value, f);
+	}
+	(void) putc('"', f);
+}
@@ -13,6 +13,7 @@
 #include	<sys/socket.h>
 
 #include	<string.h>
+#include	<strings.h>
 #include	<stdlib.h>
 #include	<stdio.h>
 #include	<unistd.h>
@@ -32,6 +33,13 @@ static enum {
 	PD_RUN
 } pdns_state = PD_HELO;
 
+/*
+ * What the current query found, for the query-done probe (see wita.d).
+ */
+static char const	*q_name;
+static group_t		*q_group;
+static int		 q_nanswers;
+
 static void
 cmd_helo()
 {
@@ -53,10 +61,134 @@ char *version;
 	pdns_state = PD_RUN;
 }
 
+/*
+ * SOA timers for our zones.  Secondaries have no other way to hear about
+ * changes (the pipe backend can't trigger NOTIFY), so they should check
+ * the serial often, and stop answering fairly soon if we go away, since
+ * by then their idea of which servers are up is no use to anyone.
+ */
+#define	SOA_REFRESH	30
+#define	SOA_RETRY	10
+#define	SOA_EXPIRE	600
+
+/*
+ * Record type and address size for each address family, by FAMILY_INDEX().
+ */
+static int const	 families[NFAMILIES] = { AF_INET, AF_INET6 };
+static char const	*rrtypes[NFAMILIES] = { "A", "AAAA" };
+static size_t const	 addrsize[NFAMILIES] = { 4, 16 };
+
+/*
+ * Print the SOA and NS records for one of our zones.  Returns the number
+ * of records printed.
+ */
+static int
+print_apex(qname, zone, soa, ns)
+	char const	*qname;
+	zone_t		*zone;
+{
+	if (soa)
+		(void) printf("DATA\t%s\tIN\tSOA\t%d\t%d\t%s %s %lu %d %d %d %d\n",
+			qname, curconf->ttlmax, zone->zn_id,
+			curconf->soa_mname, zone->zn_rname,
+			(unsigned long) zone_serial,
+			SOA_REFRESH, SOA_RETRY, SOA_EXPIRE, curconf->ttlmin);
+	if (ns)
+		(void) printf("DATA\t%s\tIN\tNS\t%d\t%d\t%s\n",
+			qname, curconf->ttlmax, zone->zn_id, curconf->soa_mname);
+	return (soa != 0) + (ns != 0);
+}
+
+/*
+ * List a whole zone: the SOA and NS records, and every server in the
+ * current answer for every group in it.  A secondary serves the zone as
+ * it stands, so this isn't limited to the max-answers window and
+ * doesn't move the group's rotation on.  The domain ID PowerDNS gives
+ * us is the one from our SOA record (the zone's zn_id).  We don't look
+ * at the event port until we're done, so this is a consistent snapshot
+ * matching the serial in the SOA.
+ */
 static void
 cmd_axfr()
 {
-	(void) printf("FAIL\tAXFR not supported\n");
+char		*id;
+zone_t		*zone;
+group_t		*group;
+server_t	*answer[MAXANSWERS];
+int		 g, i, n, f, ttl, zid;
+
+	if ((id = strtok(NULL, "\t")) == NULL) {
+		(void) printf("FAIL\tMissing argument to AXFR\n");
+		(void) fflush(stdout);
+		return;
+	}
+
+	zid = atoi(id);
+	if (zid < 1 || zid > curconf->nzones) {
+		(void) printf("FAIL\tNo such zone\n");
+		(void) fflush(stdout);
+		return;
+	}
+	zone = curconf->zones[zid - 1];
+
+	(void) print_apex(zone->zn_name, zone, 1, 1);
+
+	for (g = 0; g < curconf->ngroups; g++) {
+		group = curconf->groups[g];
+		if (group->gr_zone != zone)
+			continue;
+
+		ttl = group_ttl(group);
+		for (f = 0; f < NFAMILIES; f++) {
+			n = group_members(group, families[f], answer);
+
+			for (i = 0; i < n; i++)
+				(void) printf("DATA\t%s.%s\tIN\t%s\t%d\t%d\t%s\n",
+					group->gr_name, zone->zn_name,
+					rrtypes[f], ttl, zone->zn_id,
+					answer[i]->sr_address);
+		}
+	}
+
+	(void) printf("END\n");
+	(void) fflush(stdout);
+}
+
+/*
+ * Answer an SRV query: one record for each server in the group that's up,
+ * with the port we check it on.
+ */
+static void
+cmd_q_srv(qname)
+	char const	*qname;
+{
+group_t		*group;
+server_group_t	*answer[MAXANSWERS];
+char		 target[256];
+int		 i, n, ttl;
+
+	if ((group = find_group_srv(curconf, qname)) == NULL) {
+		metrics.m_unknown[QUERY_PDNS]++;
+		(void) printf("END\n");
+		(void) fflush(stdout);
+		return;
+	}
+
+	group->gr_nqueries++;
+	q_group = group;
+	ttl = group_ttl(group);
+	n = group_srv_answer(group, answer);
+
+	for (i = 0; i < n; i++) {
+		if (server_target(answer[i]->sg_server, target, sizeof target) == -1)
+			continue;
+		(void) printf("DATA\t%s\tIN\tSRV\t%d\t-1\t%d %d %d %s\n",
+			qname, ttl, answer[i]->sg_backup, answer[i]->sg_weight,
+			server_portnum(answer[i]->sg_server), target);
+		q_nanswers++;
+	}
+
+	(void) printf("END\n");
 	(void) fflush(stdout);
 }
 
@@ -64,10 +196,12 @@ static void
 cmd_q()
 {
 char	*qname, *qclass, *qtype, *id, *ip;
-char	*grnam;
-char	*p;
 group_t	*group;
-int	 i, printed = 0;
+server_t *sr;
+server_t *answer[MAXANSWERS];
+zone_t	*zone;
+int	 i, n, f, ttl, apex;
+int	 want[NFAMILIES] = { 0, 0 };
 
 	if (	(qname = strtok(NULL, "\t")) == NULL ||
 		(qclass = strtok(NULL, "\t")) == NULL ||
@@ -79,6 +213,7 @@ int	 i, printed = 0;
 		(void) fflush(stdout);
 		return;
 	}
+	q_name = qname;
 
 	if (strcmp(qclass, "IN") != 0) {
 		(void) printf("FAIL\tOnly IN class is supported\n");
@@ -86,62 +221,70 @@ int	 i, printed = 0;
 		return;
 	}
 
-	if (strcmp(qtype, "A") != 0 && strcmp(qtype, "ANY") != 0) {
+	if ((zone = find_zone_qname(curconf, qname, &apex)) != NULL && apex) {
+		q_nanswers = print_apex(qname, zone,
+			strcmp(qtype, "SOA") == 0 || strcmp(qtype, "ANY") == 0,
+			strcmp(qtype, "NS") == 0 || strcmp(qtype, "ANY") == 0);
 		(void) printf("END\n");
 		(void) fflush(stdout);
 		return;
 	}
-	
-	/*
-	 * Strip the fqdn from the name and use it as the group
-	 * name.
-	 */
-	if ((grnam = strdup(qname)) == NULL) {
-		syslog(LOG_ERR, "out of memory (trying to continue anyway)");
-		(void) write(STDOUT_FILENO, "END\n", 4);
+
+	if (strcmp(qtype, "SRV") == 0) {
+		cmd_q_srv(qname);
 		return;
 	}
 
-	if ((p = strchr(grnam, '.')) != NULL)
-		*p = 0;
+	if (strcmp(qtype, "ANY") == 0)
+		want[0] = want[1] = 1;
+	else if (strcmp(qtype, "A") == 0)
+		want[0] = 1;
+	else if (strcmp(qtype, "AAAA") == 0)
+		want[1] = 1;
+	else {
+		(void) printf("END\n");
+		(void) fflush(stdout);
+		return;
+	}
 
-	if ((group = find_group(curconf, grnam)) == NULL) {
-		syslog(LOG_INFO, "request for group %s, which does not exist",
-				grnam);
+	if ((group = find_group_qname(curconf, qname)) == NULL) {
+		/*
+		 * It might be a server's own name, from an SRV target.
+		 */
+		if ((sr = find_server_host(curconf, qname)) == NULL) {
+			metrics.m_unknown[QUERY_PDNS]++;
+			wlog(LOG_INFO, "request for %s, which is not a group", qname);
+		}
+		for (; sr; sr = sr->sr_nextaddr)
+			if (want[FAMILY_INDEX(sr->sr_family)]) {
+				(void) printf("DATA\t%s\tIN\t%s\t%d\t-1\t%s\n",
+					qname, rrtypes[FAMILY_INDEX(sr->sr_family)],
+					curconf->ttlmax, sr->sr_address);
+				q_nanswers++;
+			}
 		(void) printf("END\n");
 		(void) fflush(stdout);
 		return;
 	}
 
 	/*
-	 * Print the address of each server in the group that's
-	 * up.  We use a small TTL (10 seconds) because server
-	 * status can change quickly.
+	 * Print the address of each server we're returning.  The TTL
+	 * depends on how long the group's answer has been stable (see
+	 * group_ttl()).
 	 */
-	for (i = 0; i < group->gr_nservers; i++) {
-		if (group->gr_servers[i]->sg_backup)
-			continue;
-		if (!group->gr_servers[i]->sg_server->sr_online)
+	group->gr_nqueries++;
+	q_group = group;
+	ttl = group_ttl(group);
+	for (f = 0; f < NFAMILIES; f++) {
+		if (!want[f])
 			continue;
-		(void) printf("DATA\t%s\tIN\tA\t10\t-1\t%s\n",
-			qname, group->gr_servers[i]->sg_server->sr_address);
-		printed++;
-	}
 
-	/*
-	 * If we haven't printed anything, all primary servers
-	 * in the group are down.  Print the backup servers
-	 * instead.
-	 */
-	if (!printed) {
-		for (i = 0; i < group->gr_nservers; i++) {
-			if (!group->gr_servers[i]->sg_backup)
-				continue;
-			if (!group->gr_servers[i]->sg_server->sr_online)
-				continue;
-			(void) printf("DATA\t%s\tIN\tA\t10\t-1\t%s\n",
-				qname, group->gr_servers[i]->sg_server->sr_address);
-		}
+		n = group_answer(group, families[f], strlen(qname), addrsize[f],
+				answer);
+		q_nanswers += n;
+		for (i = 0; i < n; i++)
+			(void) printf("DATA\t%s\tIN\t%s\t%d\t-1\t%s\n",
+				qname, rrtypes[f], ttl, answer[i]->sr_address);
 	}
 
 	(void) printf("END\n");
@@ -151,9 +294,10 @@ int	 i, printed = 0;
 static void
 decode_pdns()
 {
-char	line[1024];
-char	*p;
-char	*cmd;
+char		 line[1024];
+char		*p;
+char		*cmd;
+hrtime_t	 start;
 
 	for (;;) {
 		/* Have we got a line yet? */
@@ -189,8 +333,21 @@ char	*cmd;
 		case PD_RUN:
 			if (strcmp(cmd, "AXFR") == 0)
 				cmd_axfr();
-			else if (strcmp(cmd, "Q") == 0) 
+			else if (strcmp(cmd, "Q") == 0) {
+				WITA_QUERY_START(QUERY_PDNS);
+				q_name = "";
+				q_group = NULL;
+				q_nanswers = 0;
+
+				start = gethrtime();
 				cmd_q();
+				hist_add(&metrics.m_query_time[QUERY_PDNS],
+						gethrtime() - start);
+
+				WITA_QUERY_DONE(QUERY_PDNS, (char *) q_name,
+						q_group ? q_group->gr_name : "",
+						q_nanswers);
+			}
 			else {
 				(void) printf("FAIL\tUnknown command (or invalid for this state)\n");
 				(void) fflush(stdout);
@@ -203,6 +360,32 @@ char	*cmd;
 	}
 }
 
+/*
+ * What an upgrade (see upgrade.c) needs to carry on talking to PowerDNS:
+ * whether it's said HELO, and input we haven't acted on yet.
+ */
+void
+pdns_save(running, buf, len)
+	int		*running, *len;
+	char const	**buf;
+{
+	*running = pdns_state == PD_RUN;
+	*buf = pdnsbuf;
+	*len = pdnsnb;
+}
+
+void
+pdns_restore(running, buf, len)
+	int		 running, len;
+	char const	*buf;
+{
+	if (len > (int) sizeof pdnsbuf)
+		len = sizeof pdnsbuf;
+	pdns_state = running ? PD_RUN : PD_HELO;
+	(void) memcpy(pdnsbuf, buf, len);
+	pdnsnb = len;
+}
+
 void
 handle_pdns()
 {
@@ -235,6 +418,7 @@ handle_pdns()
 			exit(0);
 
 		default:
+			record_input(pdnsbuf + pdnsnb, i);
 			pdnsnb += i;
 			decode_pdns();
 			break;
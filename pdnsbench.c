@@ -0,0 +1,697 @@
+/* Copyright (c) 2009 River Tarnell <river@loreley.flyingparchment.org.uk>. */
+/*
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely. This software is provided 'as-is', without any express or implied
+ * warranty.
+ */
+
+/*
+ * pdnsbench: benchmark the PowerDNS query path.
+ *
+ * It writes a configuration with a number of groups of servers, some of
+ * them up and some backups, and a stream of queries for those groups
+ * (and, optionally, for names that aren't groups).  Then it runs the
+ * stream two ways:
+ *
+ *	in-process	linked with wita's own code, feeding each query
+ *			through a pipe on stdin to handle_pdns() and timing
+ *			the call, as the main loop would make it.  The
+ *			server states are set directly, with no checks.
+ *
+ *	pipe		running wita itself as PowerDNS would, with up to
+ *			-d queries outstanding at once, and timing each
+ *			query from writing it to reading its END.  Servers
+ *			that should be up get a listener for wita to check.
+ *
+ * and reports queries per second and latency percentiles for each, and
+ * for the in-process run, how many allocations each query made (by
+ * counting calls to malloc() and friends).
+ *
+ * Options:
+ *
+ *	-g <n>		number of groups (100)
+ *	-s <n>		servers in each group (8)
+ *	-u <pct>	percentage of servers that are up (75)
+ *	-b <pct>	percentage of servers that are backups (25)
+ *	-x <pct>	percentage of queries for unknown names (0)
+ *	-n <n>		number of queries (200000)
+ *	-d <n>		queries outstanding at once, for the pipe run (64)
+ *	-r <seed>	random seed, for repeatable streams (1)
+ *	-w <path>	the wita to run for the pipe run (./wita)
+ *	-i		only run in-process
+ *	-p		only run through the pipe
+ *
+ * "make bench" builds and runs it with the defaults.  The numbers only
+ * mean much with optimisation, so compare builds made with the same
+ * CFLAGS (say, "make CFLAGS='-xO4 -xc99=%none' bench").
+ */
+
+#include	<sys/types.h>
+#include	<sys/socket.h>
+#include	<sys/resource.h>
+#include	<sys/wait.h>
+#include	<netinet/in.h>
+#include	<arpa/inet.h>
+
+#include	<stdlib.h>
+#include	<stdio.h>
+#include	<string.h>
+#include	<strings.h>
+#include	<errno.h>
+#include	<unistd.h>
+#include	<fcntl.h>
+#include	<signal.h>
+#include	<poll.h>
+#include	<dlfcn.h>
+#include	<port.h>
+
+#include	"wita.h"
+#include	"bench.h"
+
+#define	BASEPORT	20000	/* Server n is checked on 127.0.0.1:BASEPORT+n */
+#define	WARMUP		2	/* Seconds to let wita check everything */
+
+int	 port;		/* Event port, for wita's code */
+
+static int	 ngroups = 100, nservers = 8, pctup = 75, pctbackup = 25;
+static int	 pctunknown = 0, nqueries = 200000, depth = 64;
+static char const *witapath = "./wita";
+
+static char	*up;			/* Whether each server should be up */
+static char	*qbuf;			/* The query stream */
+static size_t	*qoff;			/* Where each query starts in qbuf */
+static hrtime_t	*lat;			/* Latency of each query */
+static FILE	*out;			/* Where results go */
+static char	 cfgpath[] = "/tmp/pdnsbenchXXXXXX";
+
+static int	 counting;		/* Count allocations? */
+static unsigned long nallocs;
+
+static void	usage(void);
+static void	gen_config(void);
+static void	gen_queries(void);
+static void	run_inproc(void);
+static void	run_pipe(void);
+static pid_t	start_listeners(void);
+static pid_t	start_wita(int *, int *);
+static void	report(char const *, hrtime_t, int);
+static void	writeall(int, char const *, size_t);
+
+int
+main(argc, argv)
+	char	**argv;
+{
+int		 c, doinproc = 1, dopipe = 1, fd;
+unsigned	 seed = 1;
+struct rlimit	 rl;
+
+	while ((c = getopt(argc, argv, "g:s:u:b:x:n:d:r:w:ip")) != -1) {
+		switch (c) {
+		case 'g':	ngroups = atoi(optarg); break;
+		case 's':	nservers = atoi(optarg); break;
+		case 'u':	pctup = atoi(optarg); break;
+		case 'b':	pctbackup = atoi(optarg); break;
+		case 'x':	pctunknown = atoi(optarg); break;
+		case 'n':	nqueries = atoi(optarg); break;
+		case 'd':	depth = atoi(optarg); break;
+		case 'r':	seed = (unsigned) strtoul(optarg, NULL, 10); break;
+		case 'w':	witapath = optarg; break;
+		case 'i':	dopipe = 0; break;
+		case 'p':	doinproc = 0; break;
+		default:	usage();
+		}
+	}
+
+	if (ngroups < 1 || nservers < 1 || nqueries < 1 || depth < 1 ||
+	    pctup < 0 || pctup > 100 || pctbackup < 0 || pctbackup > 100 ||
+	    pctunknown < 0 || pctunknown > 100 || !(doinproc || dopipe))
+		usage();
+
+	if ((long) ngroups * nservers > 65535 - BASEPORT) {
+		(void) fprintf(stderr, "pdnsbench: at most %d servers in all\n",
+				65535 - BASEPORT);
+		return 1;
+	}
+
+	/* The pipe run needs a listener for each server that's up. */
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+		rl.rlim_cur = rl.rlim_max;
+		(void) setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	(void) signal(SIGPIPE, SIG_IGN);
+	srand(seed);
+
+	if ((fd = mkstemp(cfgpath)) == -1) {
+		perror("pdnsbench: mkstemp");
+		return 1;
+	}
+	(void) close(fd);
+
+	/* The in-process run sends wita's own output to /dev/null. */
+	if ((out = fdopen(dup(STDOUT_FILENO), "w")) == NULL) {
+		perror("pdnsbench: fdopen");
+		return 1;
+	}
+	(void) setvbuf(out, NULL, _IOLBF, 0);
+
+	gen_config();
+	gen_queries();
+
+	if ((lat = calloc(nqueries, sizeof(*lat))) == NULL) {
+		(void) fprintf(stderr, "pdnsbench: out of memory\n");
+		return 1;
+	}
+
+	(void) fprintf(out, "%d groups of %d servers, %d%% up, %d%% backups; "
+			"%d queries, %d%% unknown\n\n", ngroups, nservers, pctup,
+			pctbackup, nqueries, pctunknown);
+	(void) fprintf(out, "%-10s %10s %10s %10s %10s %10s %10s %10s\n",
+			"run", "qps", "p50", "p90", "p99", "p99.9", "max",
+			"allocs/q");
+
+	if (dopipe)
+		run_pipe();
+	if (doinproc)
+		run_inproc();
+
+	(void) unlink(cfgpath);
+	return 0;
+}
+
+static void
+usage()
+{
+	(void) fprintf(stderr, "usage: pdnsbench [-ip] [-g groups] [-s servers] "
+			"[-u up%%] [-b backup%%] [-x unknown%%]\n"
+			"\t[-n queries] [-d depth] [-r seed] [-w wita]\n");
+	exit(1);
+}
+
+/*
+ * Write the configuration: group g is "g<g>", and has servers
+ * g * nservers up to (g + 1) * nservers - 1.
+ */
+static void
+gen_config()
+{
+FILE	*f;
+int	 g, s, n;
+
+	if ((up = calloc(ngroups * nservers, 1)) == NULL) {
+		(void) fprintf(stderr, "pdnsbench: out of memory\n");
+		exit(1);
+	}
+
+	if ((f = fopen(cfgpath, "w")) == NULL) {
+		perror(cfgpath);
+		exit(1);
+	}
+
+	for (g = 0; g < ngroups; g++) {
+		(void) fprintf(f, "g%d", g);
+		for (s = 0; s < nservers; s++) {
+			n = g * nservers + s;
+			up[n] = rand() % 100 < pctup;
+			(void) fprintf(f, " %s127.0.0.1:%d",
+					rand() % 100 < pctbackup ? "!" : "",
+					BASEPORT + n);
+		}
+		(void) fputc('\n', f);
+	}
+
+	if (fclose(f) == EOF) {
+		perror(cfgpath);
+		exit(1);
+	}
+}
+
+/*
+ * Build the query stream.
+ */
+static void
+gen_queries()
+{
+size_t	size, len = 0;
+int	i;
+char	line[128];
+
+	size = (size_t) nqueries * 64;
+	if ((qbuf = malloc(size)) == NULL ||
+	    (qoff = calloc(nqueries + 1, sizeof(*qoff))) == NULL) {
+		(void) fprintf(stderr, "pdnsbench: out of memory\n");
+		exit(1);
+	}
+
+	for (i = 0; i < nqueries; i++) {
+	int	n;
+		if (rand() % 100 < pctunknown)
+			n = snprintf(line, sizeof line,
+				"Q\tx%d.wita.example.com\tIN\tA\t-1\t127.0.0.1\n",
+				rand() % ngroups);
+		else
+			n = snprintf(line, sizeof line,
+				"Q\tg%d.wita.example.com\tIN\tA\t-1\t127.0.0.1\n",
+				rand() % ngroups);
+
+		if (len + n > size) {
+			size *= 2;
+			if ((qbuf = realloc(qbuf, size)) == NULL) {
+				(void) fprintf(stderr, "pdnsbench: out of memory\n");
+				exit(1);
+			}
+		}
+
+		qoff[i] = len;
+		(void) memcpy(qbuf + len, line, n);
+		len += n;
+	}
+	qoff[nqueries] = len;
+}
+
+/*
+ * Run the queries through handle_pdns(), one at a time.
+ */
+static void
+run_inproc()
+{
+int		 fds[2], i, fl;
+hrtime_t	 start, t;
+unsigned long	 allocs;
+
+	if ((port = port_create()) == -1) {
+		perror("pdnsbench: port_create");
+		exit(1);
+	}
+
+	if (load_configuration(cfgpath) == -1) {
+		(void) fprintf(stderr, "pdnsbench: cannot load %s\n", cfgpath);
+		exit(1);
+	}
+
+	for (i = 0; i < curconf->nservers; i++) {
+	server_t	*sr = curconf->servers[i];
+		if (!up[server_portnum(sr) - BASEPORT])
+			continue;
+		sr->sr_checked = sr->sr_healthy = sr->sr_online = 1;
+		group_server_changed(sr);
+	}
+
+	if (pipe(fds) == -1 || dup2(fds[0], STDIN_FILENO) == -1 ||
+	    (fl = fcntl(STDIN_FILENO, F_GETFL, 0)) == -1 ||
+	    fcntl(STDIN_FILENO, F_SETFL, fl | O_NONBLOCK) == -1) {
+		perror("pdnsbench: stdin");
+		exit(1);
+	}
+	(void) close(fds[0]);
+
+	if (freopen("/dev/null", "w", stdout) == NULL) {
+		perror("pdnsbench: /dev/null");
+		exit(1);
+	}
+
+	writeall(fds[1], "HELO\t1\n", 7);
+	handle_pdns();
+
+	counting = 1;
+	allocs = nallocs;
+	start = gethrtime();
+
+	for (i = 0; i < nqueries; i++) {
+		writeall(fds[1], qbuf + qoff[i], qoff[i + 1] - qoff[i]);
+		t = gethrtime();
+		handle_pdns();
+		lat[i] = gethrtime() - t;
+	}
+
+	t = gethrtime() - start;
+	counting = 0;
+
+	report("in-process", t, (int) (nallocs - allocs));
+	(void) close(fds[1]);
+}
+
+/*
+ * Run the queries through wita itself.
+ */
+static void
+run_pipe()
+{
+pid_t		 lpid, wpid;
+int		 in, outfd, sent = 0, done = 0, atstart = 1;
+size_t		 off = 0, end;
+hrtime_t	*sendtime, start, t;
+struct pollfd	 pfd[2];
+char		 buf[65536], *p;
+ssize_t		 n;
+
+	if ((sendtime = calloc(nqueries, sizeof(*sendtime))) == NULL) {
+		(void) fprintf(stderr, "pdnsbench: out of memory\n");
+		exit(1);
+	}
+
+	lpid = start_listeners();
+	wpid = start_wita(&in, &outfd);
+
+	writeall(in, "HELO\t1\n", 7);
+	if ((n = read(outfd, buf, sizeof buf)) <= 0 ||
+	    strncmp(buf, "OK\t", 3) != 0) {
+		(void) fprintf(stderr, "pdnsbench: wita didn't say hello\n");
+		exit(1);
+	}
+
+	/* Let the first checks finish. */
+	(void) sleep(WARMUP);
+
+	if (fcntl(in, F_SETFL, O_NONBLOCK) == -1) {
+		perror("pdnsbench: fcntl");
+		exit(1);
+	}
+
+	start = gethrtime();
+
+	while (done < nqueries) {
+		pfd[0].fd = in;
+		pfd[0].events = sent < nqueries && sent - done < depth ? POLLOUT : 0;
+		pfd[1].fd = outfd;
+		pfd[1].events = POLLIN;
+
+		if (poll(pfd, 2, 10000) <= 0) {
+			(void) fprintf(stderr, "pdnsbench: wita stopped answering "
+					"after %d queries\n", done);
+			exit(1);
+		}
+
+		/*
+		 * Write as many whole queries as we're allowed to have
+		 * outstanding; a query is sent once its last byte is.
+		 */
+		if (pfd[0].events && (pfd[0].revents & (POLLOUT | POLLERR))) {
+			end = qoff[sent + (depth - (sent - done) < nqueries - sent ?
+					depth - (sent - done) : nqueries - sent)];
+			if ((n = write(in, qbuf + off, end - off)) == -1) {
+				if (errno != EAGAIN) {
+					perror("pdnsbench: write");
+					exit(1);
+				}
+				n = 0;
+			}
+			off += n;
+			t = gethrtime();
+			while (sent < nqueries && qoff[sent + 1] <= off)
+				sendtime[sent++] = t;
+		}
+
+		if (!(pfd[1].revents & (POLLIN | POLLHUP | POLLERR)))
+			continue;
+
+		if ((n = read(outfd, buf, sizeof buf)) <= 0) {
+			(void) fprintf(stderr, "pdnsbench: wita went away\n");
+			exit(1);
+		}
+
+		/* Each query's answer ends with an END (or FAIL) line. */
+		t = gethrtime();
+		for (p = buf; p < buf + n; p++) {
+			if (atstart && (*p == 'E' || *p == 'F') && done < nqueries) {
+				lat[done] = t - sendtime[done];
+				done++;
+			}
+			atstart = *p == '\n';
+		}
+	}
+
+	t = gethrtime() - start;
+	report("pipe", t, -1);
+
+	(void) close(in);
+	(void) close(outfd);
+	(void) kill(wpid, SIGTERM);
+	(void) kill(lpid, SIGTERM);
+	(void) waitpid(wpid, NULL, 0);
+	(void) waitpid(lpid, NULL, 0);
+	free(sendtime);
+}
+
+/*
+ * Fork a process to accept connections for every server that should be
+ * up, and greet each one like MySQL would.
+ */
+static pid_t
+start_listeners()
+{
+struct pollfd		*pfd;
+struct sockaddr_in	 sin;
+int			 i, n = 0, fd, on = 1;
+pid_t			 pid;
+
+	if ((pfd = calloc(ngroups * nservers, sizeof(*pfd))) == NULL) {
+		(void) fprintf(stderr, "pdnsbench: out of memory\n");
+		exit(1);
+	}
+
+	for (i = 0; i < ngroups * nservers; i++) {
+		if (!up[i])
+			continue;
+
+		bzero(&sin, sizeof(sin));
+		sin.sin_family = AF_INET;
+		sin.sin_port = htons(BASEPORT + i);
+		sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+		if ((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1 ||
+		    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == -1 ||
+		    bind(fd, (struct sockaddr *) &sin, sizeof(sin)) == -1 ||
+		    listen(fd, 128) == -1) {
+			(void) fprintf(stderr, "pdnsbench: listen on port %d: %s\n",
+					BASEPORT + i, strerror(errno));
+			exit(1);
+		}
+
+		pfd[n].fd = fd;
+		pfd[n].events = POLLIN;
+		n++;
+	}
+
+	if ((pid = fork()) == -1) {
+		perror("pdnsbench: fork");
+		exit(1);
+	}
+
+	if (pid > 0) {
+		for (i = 0; i < n; i++)
+			(void) close(pfd[i].fd);
+		free(pfd);
+		return pid;
+	}
+
+	for (;;) {
+		if (poll(pfd, n, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			_exit(1);
+		}
+
+		for (i = 0; i < n; i++) {
+			if (!(pfd[i].revents & POLLIN))
+				continue;
+			if ((fd = accept(pfd[i].fd, NULL, NULL)) == -1)
+				continue;
+			(void) write(fd, "\n", 1);
+			(void) close(fd);
+		}
+	}
+	/*NOTREACHED*/
+}
+
+/*
+ * Run wita with pipes for its stdin and stdout, as PowerDNS does.
+ */
+static pid_t
+start_wita(in, outfd)
+	int	*in, *outfd;
+{
+int	tochild[2], fromchild[2];
+pid_t	pid;
+
+	if (pipe(tochild) == -1 || pipe(fromchild) == -1) {
+		perror("pdnsbench: pipe");
+		exit(1);
+	}
+
+	if ((pid = fork()) == -1) {
+		perror("pdnsbench: fork");
+		exit(1);
+	}
+
+	if (pid == 0) {
+		(void) dup2(tochild[0], STDIN_FILENO);
+		(void) dup2(fromchild[1], STDOUT_FILENO);
+		(void) close(tochild[0]);
+		(void) close(tochild[1]);
+		(void) close(fromchild[0]);
+		(void) close(fromchild[1]);
+		(void) execl(witapath, "wita", "-c", cfgpath, (char *) NULL);
+		(void) fprintf(stderr, "pdnsbench: %s: %s\n", witapath,
+				strerror(errno));
+		_exit(1);
+	}
+
+	(void) close(tochild[0]);
+	(void) close(fromchild[1]);
+	*in = tochild[1];
+	*outfd = fromchild[0];
+	return pid;
+}
+
+/*
+ * Print the results of a run that took elapsed, with allocs allocations
+ * (or -1 if we don't know).
+ */
+static void
+report(name, elapsed, allocs)
+	char const	*name;
+	hrtime_t	 elapsed;
+{
+char	abuf[32];
+
+	qsort(lat, nqueries, sizeof(*lat), hrcmp);
+
+	if (allocs >= 0)
+		(void) snprintf(abuf, sizeof abuf, "%.2f",
+				(double) allocs / nqueries);
+	else
+		(void) strcpy(abuf, "-");
+
+#define	PCT(p)	((double) lat[(int) ((nqueries - 1) * (p))] / 1000)
+	(void) fprintf(out, "%-10s %10.0f %8.1fus %8.1fus %8.1fus %8.1fus "
+			"%8.1fus %10s\n", name,
+			(double) nqueries * NANOSEC / elapsed,
+			PCT(0.5), PCT(0.9), PCT(0.99), PCT(0.999), PCT(1.0), abuf);
+#undef	PCT
+}
+
+static void
+writeall(fd, buf, len)
+	int		 fd;
+	char const	*buf;
+	size_t		 len;
+{
+ssize_t	n;
+
+	while (len > 0) {
+		if ((n = write(fd, buf, len)) == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("pdnsbench: write");
+			exit(1);
+		}
+		buf += n;
+		len -= n;
+	}
+}
+
+/*
+ * Count allocations by interposing on the allocator.  dlsym() itself
+ * may allocate before we know where the real functions are; those
+ * calls are served from a small static arena instead.
+ */
+static void	*(*real_malloc)(size_t);
+static void	*(*real_calloc)(size_t, size_t);
+static void	*(*real_realloc)(void *, size_t);
+static void	 (*real_free)(void *);
+
+static char	 arena[4096];
+static size_t	 arenaused;
+static int	 resolving;
+
+static void
+resolve()
+{
+	resolving = 1;
+	real_malloc = (void *(*)(size_t)) dlsym(RTLD_NEXT, "malloc");
+	real_calloc = (void *(*)(size_t, size_t)) dlsym(RTLD_NEXT, "calloc");
+	real_realloc = (void *(*)(void *, size_t)) dlsym(RTLD_NEXT, "realloc");
+	real_free = (void (*)(void *)) dlsym(RTLD_NEXT, "free");
+	resolving = 0;
+
+	if (!real_malloc || !real_calloc || !real_realloc || !real_free)
+		abort();
+}
+
+static void *
+arena_alloc(size)
+	size_t	size;
+{
+void	*p;
+
+	size = (size + 15) & ~(size_t) 15;
+	if (arenaused + size > sizeof arena)
+		return NULL;
+	p = arena + arenaused;
+	arenaused += size;
+	bzero(p, size);
+	return p;
+}
+
+#define	IN_ARENA(p)	((char *) (p) >= arena && (char *) (p) < arena + sizeof arena)
+
+void *
+malloc(size)
+	size_t	size;
+{
+	if (resolving)
+		return arena_alloc(size);
+	if (real_malloc == NULL)
+		resolve();
+	if (counting)
+		nallocs++;
+	return real_malloc(size);
+}
+
+void *
+calloc(n, size)
+	size_t	n, size;
+{
+	if (resolving)
+		return arena_alloc(n * size);
+	if (real_calloc == NULL)
+		resolve();
+	if (counting)
+		nallocs++;
+	return real_calloc(n, size);
+}
+
+void *
+realloc(p, size)
+	void	*p;
+	size_t	 size;
+{
+void	*np;
+
+	if (real_realloc == NULL)
+		resolve();
+	if (counting)
+		nallocs++;
+
+	if (IN_ARENA(p)) {
+		if ((np = real_malloc(size)) != NULL)
+			(void) memcpy(np, p, size < (size_t) (arena + sizeof arena -
+					(char *) p) ? size : (size_t) (arena +
+					sizeof arena - (char *) p));
+		return np;
+	}
+	return real_realloc(p, size);
+}
+
+void
+free(p)
+	void	*p;
+{
+	if (p == NULL || IN_ARENA(p))
+		return;
+	if (real_free == NULL)
+		resolve();
+	real_free(p);
+}
@@ -0,0 +1,345 @@
+/* Copyright (c) 2009 River Tarnell <river@loreley.flyingparchment.org.uk>. */
+/*
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely. This software is provided 'as-is', without any express or implied
+ * warranty.
+ */
+
+/*
+ * pdnsreplay: play a recording made with "wita -R" (see record.c) into
+ * a wita, as PowerDNS would, and report how it did.
+ *
+ *	pdnsreplay [-x speed | -f] [-c cfg] [-W secs] [-w wita] <recording>
+ *
+ * By default the recording is played at the speed it was made; "-x 2"
+ * plays it twice as fast, and -f as fast as wita will take it.  Each
+ * read() wita made while recording is written in one go, so queries
+ * arrive together as they did then.  The wita is started with the
+ * configuration given with -c, and given -W seconds (2) to check its
+ * servers before the replay starts.
+ *
+ * Every line PowerDNS sends gets exactly one OK, END or FAIL line back,
+ * so each line is timed from writing it to reading that.  It reports
+ * lines per second and latency percentiles, and, unless -f was given,
+ * how far behind the recording's timing the replay fell, which means
+ * wita (or this machine) couldn't keep up.
+ */
+
+#include	<sys/types.h>
+#include	<sys/stat.h>
+#include	<sys/wait.h>
+
+#include	<stdlib.h>
+#include	<stdio.h>
+#include	<string.h>
+#include	<errno.h>
+#include	<unistd.h>
+#include	<fcntl.h>
+#include	<signal.h>
+#include	<poll.h>
+
+#include	"wita.h"
+#include	"bench.h"
+
+#define	STALL	10000	/* ms without progress before we give up */
+
+typedef struct {
+	hrtime_t	 ch_when;	/* Since the recording started */
+	char const	*ch_data;
+	size_t		 ch_len;
+	int		 ch_nlines;	/* Lines that end in this chunk */
+} chunk_t;
+
+static chunk_t	*chunks;
+static int	 nchunks, nlines;
+
+static void	 usage(void);
+static void	 load(char const *);
+static int	 get_varint(unsigned char const **, unsigned char const *,
+			uint64_t *);
+static pid_t	 start_wita(char const *, char const *, int *, int *);
+
+int
+main(argc, argv)
+	char	**argv;
+{
+int		 c, warmup = 2, flat = 0, in, out, ci = 0, done = 0, sent = 0;
+int		 atstart = 1, timeout;
+double		 speed = 1;
+char const	*cfg = "/etc/opt/ts/wita.cfg", *witapath = "./wita";
+hrtime_t	*sendtime, *lat, start, now, due, lag = 0;
+size_t		 off = 0;
+ssize_t		 n;
+struct pollfd	 pfd[2];
+char		 buf[65536], *p;
+pid_t		 pid;
+
+	while ((c = getopt(argc, argv, "x:fc:W:w:")) != -1) {
+		switch (c) {
+		case 'x':	speed = atof(optarg); break;
+		case 'f':	flat = 1; break;
+		case 'c':	cfg = optarg; break;
+		case 'W':	warmup = atoi(optarg); break;
+		case 'w':	witapath = optarg; break;
+		default:	usage();
+		}
+	}
+
+	if (optind != argc - 1 || speed <= 0 || warmup < 0)
+		usage();
+
+	load(argv[optind]);
+	if (nlines == 0) {
+		(void) fprintf(stderr, "pdnsreplay: nothing to replay\n");
+		return 1;
+	}
+
+	if ((sendtime = calloc(nlines, sizeof(*sendtime))) == NULL ||
+	    (lat = calloc(nlines, sizeof(*lat))) == NULL) {
+		(void) fprintf(stderr, "pdnsreplay: out of memory\n");
+		return 1;
+	}
+
+	(void) signal(SIGPIPE, SIG_IGN);
+	pid = start_wita(witapath, cfg, &in, &out);
+	(void) sleep(warmup);
+
+	if (fcntl(in, F_SETFL, O_NONBLOCK) == -1) {
+		perror("pdnsreplay: fcntl");
+		return 1;
+	}
+
+	start = gethrtime();
+
+	while (done < nlines) {
+		now = gethrtime();
+		timeout = STALL;
+
+		pfd[0].fd = in;
+		pfd[0].events = 0;
+		if (ci < nchunks) {
+			due = start + (hrtime_t) (chunks[ci].ch_when / speed);
+			if (flat || off > 0 || now >= due)
+				pfd[0].events = POLLOUT;
+			else
+				timeout = (int) ((due - now + 999999) / 1000000);
+		}
+
+		pfd[1].fd = out;
+		pfd[1].events = POLLIN;
+
+		if ((c = poll(pfd, 2, timeout)) == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("pdnsreplay: poll");
+			return 1;
+		}
+
+		if (c == 0 && timeout == STALL) {
+			(void) fprintf(stderr, "pdnsreplay: no answer from wita "
+					"after %d of %d lines\n", done, nlines);
+			return 1;
+		}
+
+		if (pfd[0].revents & (POLLOUT | POLLERR)) {
+		chunk_t	*ch = &chunks[ci];
+			if ((n = write(in, ch->ch_data + off, ch->ch_len - off)) == -1) {
+				if (errno != EAGAIN) {
+					perror("pdnsreplay: write");
+					return 1;
+				}
+				n = 0;
+			}
+			off += n;
+
+			if (off == ch->ch_len) {
+				now = gethrtime();
+				if (!flat && now - (start +
+				    (hrtime_t) (ch->ch_when / speed)) > lag)
+					lag = now - (start +
+						(hrtime_t) (ch->ch_when / speed));
+				for (c = 0; c < ch->ch_nlines; c++)
+					sendtime[sent++] = now;
+				off = 0;
+				ci++;
+			}
+		}
+
+		if (!(pfd[1].revents & (POLLIN | POLLHUP | POLLERR)))
+			continue;
+
+		if ((n = read(out, buf, sizeof buf)) <= 0) {
+			(void) fprintf(stderr, "pdnsreplay: wita went away after "
+					"%d of %d lines\n", done, nlines);
+			return 1;
+		}
+
+		now = gethrtime();
+		for (p = buf; p < buf + n; p++) {
+			if (atstart && (*p == 'O' || *p == 'E' || *p == 'F') &&
+			    done < sent) {
+				lat[done] = now - sendtime[done];
+				done++;
+			}
+			atstart = *p == '\n';
+		}
+	}
+
+	now = gethrtime();
+	(void) close(in);
+	(void) close(out);
+	(void) kill(pid, SIGTERM);
+	(void) waitpid(pid, NULL, 0);
+
+	qsort(lat, nlines, sizeof(*lat), hrcmp);
+
+	(void) printf("%d lines in %d reads over %.2fs (recorded over %.2fs)\n",
+			nlines, nchunks, (double) (now - start) / NANOSEC,
+			(double) chunks[nchunks - 1].ch_when / NANOSEC);
+	(void) printf("%.0f lines/s\n", (double) nlines * NANOSEC / (now - start));
+#define	PCT(p)	((double) lat[(int) ((nlines - 1) * (p))] / 1000)
+	(void) printf("latency: p50 %.1fus p90 %.1fus p99 %.1fus p99.9 %.1fus "
+			"max %.1fus\n",
+			PCT(0.5), PCT(0.9), PCT(0.99), PCT(0.999), PCT(1.0));
+#undef	PCT
+	if (!flat)
+		(void) printf("fell behind by at most %.1fms\n",
+				(double) lag / 1000000);
+	return 0;
+}
+
+static void
+usage()
+{
+	(void) fprintf(stderr, "usage: pdnsreplay [-x speed | -f] [-c cfg] "
+			"[-W secs] [-w wita] <recording>\n");
+	exit(1);
+}
+
+/*
+ * Read the whole recording into memory, and split it into chunks.
+ */
+static void
+load(path)
+	char const	*path;
+{
+int			 fd;
+struct stat		 sb;
+unsigned char		*data;
+unsigned char const	*p, *end;
+uint64_t		 delta, len;
+hrtime_t		 when = 0;
+size_t			 size = 0;
+chunk_t			*ch;
+
+	if ((fd = open(path, O_RDONLY)) == -1 || fstat(fd, &sb) == -1) {
+		perror(path);
+		exit(1);
+	}
+
+	if ((data = malloc(sb.st_size + 1)) == NULL ||
+	    read(fd, data, sb.st_size) != sb.st_size) {
+		(void) fprintf(stderr, "pdnsreplay: cannot read %s\n", path);
+		exit(1);
+	}
+	(void) close(fd);
+
+	if (sb.st_size < (off_t) sizeof REC_MAGIC - 1 ||
+	    memcmp(data, REC_MAGIC, sizeof REC_MAGIC - 1) != 0) {
+		(void) fprintf(stderr, "pdnsreplay: %s isn't a wita recording\n",
+				path);
+		exit(1);
+	}
+
+	p = data + sizeof REC_MAGIC - 1;
+	end = data + sb.st_size;
+
+	while (p < end) {
+		if (get_varint(&p, end, &delta) == -1 ||
+		    get_varint(&p, end, &len) == -1 ||
+		    len > (uint64_t) (end - p)) {
+			/* Probably cut short by a crash; use what we have. */
+			(void) fprintf(stderr, "pdnsreplay: %s: ignoring a "
+					"truncated record at the end\n", path);
+			break;
+		}
+
+		if ((size_t) nchunks == size) {
+			size = size ? size * 2 : 1024;
+			if ((chunks = realloc(chunks, size * sizeof(*chunks))) == NULL) {
+				(void) fprintf(stderr, "pdnsreplay: out of memory\n");
+				exit(1);
+			}
+		}
+
+		when += (hrtime_t) delta * 1000;
+		ch = &chunks[nchunks++];
+		ch->ch_when = when;
+		ch->ch_data = (char const *) p;
+		ch->ch_len = (size_t) len;
+		ch->ch_nlines = 0;
+		for (; len > 0; len--)
+			if (*p++ == '\n')
+				ch->ch_nlines++;
+		nlines += ch->ch_nlines;
+	}
+
+	/* Play from the first read, not from when wita started. */
+	if (nchunks > 0) {
+	int	i;
+		for (i = nchunks - 1; i >= 0; i--)
+			chunks[i].ch_when -= chunks[0].ch_when;
+	}
+}
+
+static int
+get_varint(pp, end, v)
+	unsigned char const	**pp, *end;
+	uint64_t		 *v;
+{
+int	shift = 0;
+
+	*v = 0;
+	while (*pp < end && shift < 64) {
+		*v |= (uint64_t) (**pp & 0x7f) << shift;
+		if (!(*(*pp)++ & 0x80))
+			return 0;
+		shift += 7;
+	}
+	return -1;
+}
+
+static pid_t
+start_wita(path, cfg, in, out)
+	char const	*path, *cfg;
+	int		*in, *out;
+{
+int	tochild[2], fromchild[2];
+pid_t	pid;
+
+	if (pipe(tochild) == -1 || pipe(fromchild) == -1 ||
+	    (pid = fork()) == -1) {
+		perror("pdnsreplay: start_wita");
+		exit(1);
+	}
+
+	if (pid == 0) {
+		(void) dup2(tochild[0], STDIN_FILENO);
+		(void) dup2(fromchild[1], STDOUT_FILENO);
+		(void) close(tochild[0]);
+		(void) close(tochild[1]);
+		(void) close(fromchild[0]);
+		(void) close(fromchild[1]);
+		(void) execl(path, "wita", "-c", cfg, (char *) NULL);
+		(void) fprintf(stderr, "pdnsreplay: %s: %s\n", path,
+				strerror(errno));
+		_exit(1);
+	}
+
+	(void) close(tochild[0]);
+	(void) close(fromchild[1]);
+	*in = tochild[1];
+	*out = fromchild[0];
+	return pid;
+}
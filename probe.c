@@ -0,0 +1,274 @@
+/* Copyright (c) 2009 River Tarnell <river@loreley.flyingparchment.org.uk>. */
+/*
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely. This software is provided 'as-is', without any express or implied
+ * warranty.
+ */
+
+/*
+ * Probe definitions.  By default a server is up if it accepts a
+ * connection and sends at least one byte, which suits MySQL.  A probe
+ * says what to send once connected and what the reply must look like:
+ *
+ *	probe http send=GET\s/\sHTTP/1.0\r\n\r\n expect=HTTP/1. \
+ *		expect-re=^HTTP/1\.[01][[:space:]]2
+ *	probe redis send=PING\r\n expect=+PONG
+ *
+ * (on one line), and a group uses one with "probe=<name>".  The options
+ * are:
+ *
+ *	send=<bytes>		written once the connection is made
+ *	expect=<bytes>		the reply must start with these
+ *	mask=<bytes>		ANDed with the reply before comparing it to
+ *				expect; as long as expect
+ *	expect-re=<regex>	the reply must match this (POSIX extended)
+ *	read=<n>		read at most this many bytes (default 512)
+ *
+ * Byte strings can use \r, \n, \t, \s (a space), \\ and \xHH.  These
+ * escapes don't apply to expect-re, which goes to regcomp() as it is
+ * written, and POSIX has no \s: use [[:space:]] (a configuration line
+ * can't have a space in an option).  A regex is matched against what's
+ * been read so far each time more arrives, so it should be anchored at
+ * the start; it stops at a NUL byte, so binary replies should use expect
+ * and mask.  The reply fails if the server closes the connection or
+ * read= bytes arrive before it matches.
+ *
+ * The checks themselves run in the event loop like any other (see
+ * server.c); this file only parses probes and judges replies.
+ */
+
+#include	<stdlib.h>
+#include	<string.h>
+#include	<ctype.h>
+#include	<regex.h>
+#include	<syslog.h>
+#include	<assert.h>
+
+#include	"wita.h"
+
+#define	PROBE_DEFREAD	512	/* Default read limit for a probe */
+
+static int	probe_bytes(char const *, char const *, char **, size_t *);
+static int	hexval(int);
+
+/*
+ * Handle a "probe <name> <option>..." line.  The "probe" itself has
+ * already been consumed by strtok().
+ */
+int
+config_probe(conf)
+	config_t	*conf;
+{
+probe_t		 *pr, **newpr;
+char		 *name, *opt, *value;
+int		  i, err;
+char		  ebuf[128];
+
+	if ((name = strtok(NULL, " \t")) == NULL) {
+		syslog(LOG_ERR, "\"probe\" requires a probe name");
+		return -1;
+	}
+
+	if (find_probe(conf, name) != NULL) {
+		syslog(LOG_ERR, "probe %s is defined more than once", name);
+		return -1;
+	}
+
+	if ((pr = calloc(1, sizeof(*pr))) == NULL ||
+	    (pr->pr_name = strdup(name)) == NULL) {
+		syslog(LOG_ERR, "out of memory");
+		free(pr);
+		return -1;
+	}
+	pr->pr_readmax = PROBE_DEFREAD;
+
+	if ((newpr = realloc(conf->probes,
+			sizeof(probe_t *) * (conf->nprobes + 1))) == NULL) {
+		syslog(LOG_ERR, "out of memory");
+		free_probe(pr);
+		return -1;
+	}
+	conf->probes = newpr;
+	conf->probes[conf->nprobes++] = pr;
+
+	while ((opt = strtok(NULL, " \t")) != NULL) {
+		if ((value = strchr(opt, '=')) == NULL) {
+			syslog(LOG_ERR, "probe %s: expected option=value, not \"%s\"",
+					name, opt);
+			return -1;
+		}
+		*value++ = 0;
+
+		if (strcmp(opt, "send") == 0) {
+			if (probe_bytes(name, value, &pr->pr_send,
+					&pr->pr_sendlen) == -1)
+				return -1;
+		} else if (strcmp(opt, "expect") == 0) {
+			if (probe_bytes(name, value, &pr->pr_expect,
+					&pr->pr_expectlen) == -1)
+				return -1;
+		} else if (strcmp(opt, "mask") == 0) {
+			if (probe_bytes(name, value, &pr->pr_mask,
+					&pr->pr_masklen) == -1)
+				return -1;
+		} else if (strcmp(opt, "expect-re") == 0) {
+			if (pr->pr_hasre) {
+				syslog(LOG_ERR, "probe %s: expect-re given twice", name);
+				return -1;
+			}
+			if ((err = regcomp(&pr->pr_re, value,
+					REG_EXTENDED | REG_NOSUB)) != 0) {
+				(void) regerror(err, &pr->pr_re, ebuf, sizeof ebuf);
+				syslog(LOG_ERR, "probe %s: bad expect-re: %s", name, ebuf);
+				return -1;
+			}
+			pr->pr_hasre = 1;
+		} else if (strcmp(opt, "read") == 0) {
+			if (parse_int("read", value, 1, 65536, &i) == -1)
+				return -1;
+			pr->pr_readmax = i;
+		} else {
+			syslog(LOG_ERR, "probe %s: unknown option \"%s\"", name, opt);
+			return -1;
+		}
+	}
+
+	if (pr->pr_mask && pr->pr_masklen != pr->pr_expectlen) {
+		syslog(LOG_ERR, "probe %s: mask must be as long as expect", name);
+		return -1;
+	}
+
+	if (pr->pr_expectlen > pr->pr_readmax) {
+		syslog(LOG_ERR, "probe %s: expect is longer than read", name);
+		return -1;
+	}
+
+	return 0;
+}
+
+probe_t *
+find_probe(conf, name)
+	config_t	*conf;
+	char const	*name;
+{
+int	i;
+
+	for (i = 0; i < conf->nprobes; i++)
+		if (strcmp(conf->probes[i]->pr_name, name) == 0)
+			return conf->probes[i];
+	return NULL;
+}
+
+/*
+ * Decide whether the reply so far (len bytes in buf, which has room for
+ * a NUL after them) passes the probe.  done is set if no more is coming,
+ * because the server closed the connection or we've read as much as
+ * we will.  Returns 1 if it passed, 0 if it failed, or -1 if we need to
+ * read more to know.
+ */
+int
+probe_match(pr, buf, len, done)
+	probe_t		*pr;
+	char		*buf;
+	size_t		 len;
+	int		 done;
+{
+size_t	i;
+
+	for (i = 0; i < pr->pr_expectlen && i < len; i++)
+		if ((pr->pr_mask ? buf[i] & pr->pr_mask[i] : buf[i]) !=
+		    pr->pr_expect[i])
+			return 0;
+
+	if (len < pr->pr_expectlen)
+		return done ? 0 : -1;
+
+	if (pr->pr_hasre) {
+		buf[len] = 0;
+		if (regexec(&pr->pr_re, buf, 0, NULL, 0) == 0)
+			return 1;
+		return done ? 0 : -1;
+	}
+
+	return len > 0 ? 1 : (done ? 0 : -1);
+}
+
+void
+free_probe(pr)
+	probe_t	*pr;
+{
+	if (pr == NULL)
+		return;
+
+	free(pr->pr_name);
+	free(pr->pr_send);
+	free(pr->pr_expect);
+	free(pr->pr_mask);
+	if (pr->pr_hasre)
+		regfree(&pr->pr_re);
+	free(pr);
+}
+
+/*
+ * Decode a byte string with escapes.
+ */
+static int
+probe_bytes(name, s, out, outlen)
+	char const	*name, *s;
+	char		**out;
+	size_t		*outlen;
+{
+char	*p;
+int	 hi, lo;
+
+	free(*out);
+	if ((*out = p = malloc(strlen(s) + 1)) == NULL) {
+		syslog(LOG_ERR, "out of memory");
+		return -1;
+	}
+
+	while (*s) {
+		if (*s != '\\') {
+			*p++ = *s++;
+			continue;
+		}
+
+		switch (*++s) {
+		case 'r':	*p++ = '\r'; break;
+		case 'n':	*p++ = '\n'; break;
+		case 't':	*p++ = '\t'; break;
+		case 's':	*p++ = ' '; break;
+		case '\\':	*p++ = '\\'; break;
+		case 'x':
+			if ((hi = hexval(s[1])) == -1 || (lo = hexval(s[2])) == -1) {
+				syslog(LOG_ERR, "probe %s: bad \\x escape", name);
+				return -1;
+			}
+			*p++ = (char) (hi << 4 | lo);
+			s += 2;
+			break;
+		default:
+			syslog(LOG_ERR, "probe %s: unknown escape \\%c", name,
+					*s ? *s : ' ');
+			return -1;
+		}
+		s++;
+	}
+
+	*outlen = p - *out;
+	return 0;
+}
+
+static int
+hexval(c)
+	int	c;
+{
+	if (isdigit((unsigned char) c))
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
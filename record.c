@@ -0,0 +1,150 @@
+/* Copyright (c) 2009 River Tarnell <river@loreley.flyingparchment.org.uk>. */
+/*
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely. This software is provided 'as-is', without any express or implied
+ * warranty.
+ */
+
+/*
+ * Recording what PowerDNS sends us (-R), so pdnsreplay can play it back
+ * later with the same timing, mix of queries and pipelining.
+ *
+ * Every read() from stdin becomes one record, so the way queries arrive
+ * together is kept as well as the queries themselves.  The file is
+ * REC_MAGIC, then for each record:
+ *
+ *	varint	microseconds since the previous record (or since
+ *		recording started)
+ *	varint	number of bytes
+ *	bytes	exactly what read() returned
+ *
+ * where a varint is 7 bits per byte, least significant first, with the
+ * top bit set on every byte but the last.  A typical query costs two or
+ * three bytes on top of its text.
+ *
+ * Records go through a stdio buffer, which is flushed when it fills,
+ * when wita exits, and otherwise by record_flush(), which the main loop
+ * calls once a second, so a quiet period doesn't leave records
+ * unwritten.  If writing fails, we log it and stop recording; it's never
+ * a reason to stop answering.
+ */
+
+#include	<stdlib.h>
+#include	<stdio.h>
+#include	<syslog.h>
+
+#include	"wita.h"
+
+#define	REC_BUFSIZE	(64 * 1024)
+
+static FILE	*recf;
+static char const *recpath;
+static hrtime_t	 rec_last;	/* When the last record was made */
+static int	 rec_dirty;	/* Written to since the last flush */
+
+static void	put_varint(uint64_t);
+static void	record_failed(void);
+
+/*
+ * Start recording to path, replacing anything that's there.  After an
+ * upgrade, carry on with the recording the old process was making.
+ */
+int
+record_open(path)
+	char const	*path;
+{
+int	fd;
+
+	if ((fd = upgrade_fd("record", path)) != -1) {
+		if ((recf = fdopen(fd, "a")) == NULL) {
+			syslog(LOG_ERR, "%s: %m", path);
+			return -1;
+		}
+		(void) setvbuf(recf, NULL, _IOFBF, REC_BUFSIZE);
+		recpath = path;
+		rec_last = gethrtime();
+		return 0;
+	}
+
+	if ((recf = fopen(path, "w")) == NULL) {
+		syslog(LOG_ERR, "%s: %m", path);
+		return -1;
+	}
+	upgrade_keep("record", path, fileno(recf));
+
+	(void) setvbuf(recf, NULL, _IOFBF, REC_BUFSIZE);
+	recpath = path;
+	rec_last = gethrtime();
+
+	if (fwrite(REC_MAGIC, 1, sizeof REC_MAGIC - 1, recf) != sizeof REC_MAGIC - 1) {
+		syslog(LOG_ERR, "%s: %m", path);
+		upgrade_forget(fileno(recf));
+		(void) fclose(recf);
+		recf = NULL;
+		return -1;
+	}
+
+	syslog(LOG_INFO, "recording queries to %s", path);
+	return 0;
+}
+
+/*
+ * Record len bytes just read from PowerDNS.
+ */
+void
+record_input(buf, len)
+	char const	*buf;
+	size_t		 len;
+{
+hrtime_t	now;
+
+	if (recf == NULL)
+		return;
+
+	now = gethrtime();
+	put_varint((uint64_t) ((now - rec_last) / 1000));
+	put_varint((uint64_t) len);
+	(void) fwrite(buf, 1, len, recf);
+
+	/* Round down, so the deltas don't drift from the real times. */
+	rec_last += (now - rec_last) / 1000 * 1000;
+	rec_dirty = 1;
+
+	if (ferror(recf))
+		record_failed();
+}
+
+/*
+ * Write out whatever records are buffered.
+ */
+void
+record_flush()
+{
+	if (recf == NULL || !rec_dirty)
+		return;
+
+	rec_dirty = 0;
+	if (fflush(recf) == EOF || ferror(recf))
+		record_failed();
+}
+
+static void
+put_varint(v)
+	uint64_t	v;
+{
+	while (v >= 0x80) {
+		(void) putc((int) (v & 0x7f) | 0x80, recf);
+		v >>= 7;
+	}
+	(void) putc((int) v, recf);
+}
+
+static void
+record_failed()
+{
+	syslog(LOG_ERR, "%s: write failed, no longer recording", recpath);
+	upgrade_forget(fileno(recf));
+	(void) fclose(recf);
+	recf = NULL;
+}
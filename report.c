@@ -0,0 +1,288 @@
+/* Copyright (c) 2009 River Tarnell <river@loreley.flyingparchment.org.uk>. */
+/*
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely. This software is provided 'as-is', without any express or implied
+ * warranty.
+ */
+
+/*
+ * Failure reports from clients.  An application that can't talk to a
+ * server it got from us can send a datagram saying so:
+ *
+ *	fail <server>
+ *
+ * to the socket given with -r, which is either a path (a unix datagram
+ * socket) or a UDP address, which should be on loopback.  Each datagram
+ * can hold several reports, one per line.  What happens to the server
+ * is up to server_report().
+ *
+ * Reports are admitted through a token bucket, REPORT_RATE per second
+ * with bursts of up to REPORT_BURST, so a storm of them (say, every
+ * client of a dead server reporting at once) can't take over the event
+ * loop.  Anything over the limit is dropped and counted.
+ */
+
+#include	<sys/types.h>
+#include	<sys/socket.h>
+#include	<sys/filio.h>
+#include	<sys/un.h>
+
+#include	<stdlib.h>
+#include	<string.h>
+#include	<strings.h>
+#include	<errno.h>
+#include	<netdb.h>
+#include	<unistd.h>
+#include	<syslog.h>
+#include	<assert.h>
+#include	<port.h>
+
+#include	"wita.h"
+
+#define	REPORT_MAX	1024	/* Largest datagram we read */
+#define	REPORT_BATCH	64	/* Datagrams read per wakeup */
+#define	REPORT_RATE	100	/* Reports admitted per second */
+#define	REPORT_BURST	100	/* Reports admitted at once */
+
+#define	REPORT_DROP_INTERVAL	((hrtime_t) 60 * NANOSEC)
+
+typedef struct reportsock {
+	evsource_t	 rs_ev;		/* Must be first */
+	int		 rs_fd;
+} reportsock_t;
+
+static double	 tokens = REPORT_BURST;
+static hrtime_t	 tokens_time;
+static int	 ndropped;
+static hrtime_t	 lastdropreport;
+
+static void	report_event(evsource_t *, port_event_t *);
+static void	report_line(char *);
+static int	report_admit(void);
+static int	report_socket(char const *);
+
+/*
+ * Start accepting failure reports on addr: a path for a unix socket, or
+ * "host:port" for UDP.
+ */
+int
+report_listen(addr)
+	char const	*addr;
+{
+reportsock_t	*rs;
+
+	assert(addr);
+
+	if ((rs = calloc(1, sizeof(*rs))) == NULL) {
+		syslog(LOG_ERR, "out of memory");
+		return -1;
+	}
+	rs->rs_ev.es_handler = report_event;
+
+	if ((rs->rs_fd = upgrade_fd("report", addr)) == -1) {
+		if ((rs->rs_fd = report_socket(addr)) == -1) {
+			free(rs);
+			return -1;
+		}
+		upgrade_keep("report", addr, rs->rs_fd);
+	}
+
+	if (port_associate(port, PORT_SOURCE_FD, rs->rs_fd, POLLIN, &rs->rs_ev) == -1) {
+		syslog(LOG_ERR, "report_listen: cannot associate fd: port_associate: %m");
+		(void) close(rs->rs_fd);
+		free(rs);
+		return -1;
+	}
+
+	syslog(LOG_INFO, "accepting failure reports on %s", addr);
+	return 0;
+}
+
+/*
+ * Create the non-blocking datagram socket for report_listen().
+ */
+static int
+report_socket(addr)
+	char const	*addr;
+{
+int			 fd, i, on = 1;
+struct sockaddr_un	 sun;
+struct addrinfo		 hints, *res;
+char			*host, *sport;
+
+	if (*addr == '/') {
+		if (strlen(addr) >= sizeof sun.sun_path) {
+			syslog(LOG_ERR, "%s: socket path too long", addr);
+			return -1;
+		}
+
+		bzero(&sun, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		(void) strcpy(sun.sun_path, addr);
+
+		if ((fd = socket(AF_UNIX, SOCK_DGRAM, 0)) == -1) {
+			syslog(LOG_ERR, "%s: socket: %m", addr);
+			return -1;
+		}
+
+		/* A socket left over from last time. */
+		(void) unlink(addr);
+
+		if (bind(fd, (struct sockaddr *) &sun, sizeof(sun)) == -1) {
+			syslog(LOG_ERR, "%s: bind: %m", addr);
+			(void) close(fd);
+			return -1;
+		}
+	} else {
+		if ((host = strdup(addr)) == NULL) {
+			syslog(LOG_ERR, "out of memory");
+			return -1;
+		}
+
+		if ((sport = strrchr(host, ':')) == NULL) {
+			syslog(LOG_ERR, "%s: report address needs a port", addr);
+			free(host);
+			return -1;
+		}
+		*sport++ = 0;
+		if (*host == '[' && sport[-2] == ']') {
+			sport[-2] = 0;
+			(void) memmove(host, host + 1, strlen(host + 1) + 1);
+		}
+
+		bzero(&hints, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_DGRAM;
+
+		if ((i = getaddrinfo(host, sport, &hints, &res)) != 0) {
+			syslog(LOG_ERR, "cannot resolve report address %s: %s",
+					addr, gai_strerror(i));
+			free(host);
+			return -1;
+		}
+		free(host);
+
+		if ((fd = socket(res->ai_family, SOCK_DGRAM, 0)) == -1) {
+			syslog(LOG_ERR, "%s: socket: %m", addr);
+			freeaddrinfo(res);
+			return -1;
+		}
+
+		if (bind(fd, res->ai_addr, res->ai_addrlen) == -1) {
+			syslog(LOG_ERR, "%s: bind: %m", addr);
+			(void) close(fd);
+			freeaddrinfo(res);
+			return -1;
+		}
+		freeaddrinfo(res);
+	}
+
+	if (ioctl(fd, FIONBIO, &on) == -1) {
+		syslog(LOG_ERR, "%s: ioctl(FIONBIO): %m", addr);
+		(void) close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/*
+ * Reports are waiting on the socket.
+ */
+static void
+report_event(es, ev)
+	evsource_t	*es;
+	port_event_t	*ev;
+{
+reportsock_t	*rs = (reportsock_t *) es;
+char		 buf[REPORT_MAX + 1];
+char		*line, *next;
+ssize_t		 n;
+int		 i;
+
+	for (i = 0; i < REPORT_BATCH; i++) {
+		if ((n = recv(rs->rs_fd, buf, REPORT_MAX, 0)) == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			if (errno == EINTR)
+				continue;
+			syslog(LOG_ERR, "report_event: recv: %m");
+			break;
+		}
+		buf[n] = 0;
+
+		for (line = buf; line; line = next) {
+			if ((next = strchr(line, '\n')) != NULL)
+				*next++ = 0;
+			if (*line)
+				report_line(line);
+		}
+	}
+
+	if (port_associate(port, PORT_SOURCE_FD, rs->rs_fd, POLLIN, &rs->rs_ev) == -1) {
+		syslog(LOG_ERR, "report_event: cannot associate fd: port_associate: %m");
+		exit(1);
+	}
+}
+
+/*
+ * Handle one report.
+ */
+static void
+report_line(line)
+	char	*line;
+{
+char		*cmd, *name, *last;
+server_t	*sr;
+int		 found = 0;
+
+	if ((cmd = strtok_r(line, " \t\r", &last)) == NULL ||
+	    strcmp(cmd, "fail") != 0 ||
+	    (name = strtok_r(NULL, " \t\r", &last)) == NULL) {
+		wlog(LOG_DEBUG, "ignoring malformed failure report");
+		return;
+	}
+
+	if (!report_admit())
+		return;
+
+	for (sr = NULL; (sr = find_server_report(curconf, name, sr)) != NULL; ) {
+		server_report(sr);
+		found = 1;
+	}
+
+	if (!found)
+		wlog(LOG_DEBUG, "failure report for unknown server %s", name);
+}
+
+/*
+ * Take a token from the bucket, refilling it for the time that's passed.
+ * Returns 0 if the report should be dropped.
+ */
+static int
+report_admit()
+{
+hrtime_t	now = gethrtime();
+
+	if (tokens_time != 0) {
+		tokens += (double) (now - tokens_time) * REPORT_RATE / NANOSEC;
+		if (tokens > REPORT_BURST)
+			tokens = REPORT_BURST;
+	}
+	tokens_time = now;
+
+	if (tokens >= 1) {
+		tokens--;
+		return 1;
+	}
+
+	ndropped++;
+	if (now - lastdropreport >= REPORT_DROP_INTERVAL) {
+		syslog(LOG_WARNING, "too many failure reports; dropped %d "
+				"(limit %d per second)", ndropped, REPORT_RATE);
+		ndropped = 0;
+		lastdropreport = now;
+	}
+	return 0;
+}
@@ -7,58 +7,474 @@
  */
   
 #include	<sys/socket.h>
+#include	<sys/filio.h>
+#include	<sys/time.h>
+#include	<netinet/in.h>
+#include	<arpa/inet.h>
 #include	<stdio.h>
 #include	<errno.h>
 #include	<port.h>
 #include	<netdb.h>
-#include	<fcntl.h>
 #include	<signal.h>
 #include	<stdlib.h>
 #include	<string.h>
 #include	<assert.h>
 #include	<unistd.h>
 #include	<syslog.h>
+#include	<limits.h>
 #include	<strings.h>
+#include	<math.h>
+#include	<ctype.h>
 
 #include	"wita.h"
 
+#ifdef	WITA_SIM
+#include	"sim.h"		/* Simulated sockets and timers */
+#endif
+
 static void	server_up(server_t *);
 static void	server_down(server_t *, int);
 static void	server_cancel_check(server_t *);
 static void	server_start_read_check(server_t *);
+static void	server_connected(server_t *);
+static void	server_connect(server_t *);
+static void	probe_enqueue(server_t *);
+static void	probe_dequeue(server_t *);
+static void	probe_release(void);
+static void	probe_admit(void);
+static void	server_result(server_t *, int, int);
+static void	server_update(server_t *, int);
+static int	server_agreed(server_t *);
+static void	server_flapped(server_t *);
+static void	server_decay_penalty(server_t *);
+static void	server_event(evsource_t *, port_event_t *);
+static void	server_split(char *, char const **);
+static server_t	*new_server_addr(config_t *, char const *, struct addrinfo *);
+static unsigned	 server_hash(char const *);
+static unsigned	 target_hash(char const *, size_t);
+static int	 server_hash_add(config_t *, server_t *);
+static server_t	*find_server_addr(config_t *, char const *, char const *,
+			char const *, server_t *);
+static server_t	*find_target(config_t *, char const *, size_t, int);
+
+/*
+ * Probe admission control.  At most curconf->maxprobes checks may be in
+ * progress (SR_CONNECT, SR_WRITE or SR_READ) at once, since each one
+ * holds a socket.  Checks beyond that wait in a FIFO queue, threaded
+ * through the servers themselves so the queue costs no memory of its
+ * own.  A server re-joins at the tail after each check, so queued
+ * servers are served round-robin.
+ */
+static int	 probes_inflight;
+static server_t	*probeq_head, *probeq_tail;
+
+/*
+ * Queueing delay statistics, logged whenever the queue drains (or at
+ * least once a minute while it stays busy).
+ */
+static int	 probeq_nwaited;
+static hrtime_t	 probeq_totwait, probeq_maxwait;
+static hrtime_t	 probeq_lastreport;
+
+#define	PROBEQ_REPORT_INTERVAL	((hrtime_t) 60 * NANOSEC)
 
 /*
- * Find an existing server.
+ * Flap dampening.  Each time a server changes state it gains FLAP_PENALTY
+ * points, which decay exponentially with a half-life of dampen_halflife
+ * seconds.  Once the penalty reaches dampen_suppress, the server is held
+ * down until it decays below dampen_reuse.  The penalty is capped (see
+ * FLAP_MAXHOLD in wita.h).
+ */
+#define	FLAP_PENALTY	1000.0
+
+/*
+ * Failure reports from clients (see server_report()).  Reports are
+ * counted over REPORT_WINDOW, and a report starts a check early at most
+ * once every REPORT_MINGAP.
+ */
+#define	REPORT_WINDOW	((hrtime_t) 10 * NANOSEC)
+#define	REPORT_MINGAP	((hrtime_t) 1 * NANOSEC)
+
+/*
+ * A check's timeout is only believed if it fires no more than this much
+ * before the deadline we set; anything earlier is a stale timer event.
+ */
+#define	TIMER_SLOP	(NANOSEC / 2)
+
+/*
+ * Find an existing server, by the name it was given in the configuration.
+ * Servers are kept in a hash table by name (their first address only),
+ * so that loading a configuration with many servers isn't quadratic.
  */
 server_t *
 find_server(conf, name)
 	config_t	*conf;
 	char const	*name;
 {
-int	i;
-	for (i = 0; i < conf->nservers; i++)
-		if (strcmp(name, conf->servers[i]->sr_name) == 0)
-			return conf->servers[i];
+server_t	*sr;
+
+	if (conf->hashsize == 0)
+		return NULL;
+
+	for (sr = conf->hosthash[server_hash(name) & (conf->hashsize - 1)];
+	     sr; sr = sr->sr_hashnext)
+		if (strcmp(name, sr->sr_spec) == 0)
+			return sr;
 	return NULL;
 }
 
+static unsigned
+server_hash(name)
+	char const	*name;
+{
+unsigned	h = 0;
+
+	while (*name)
+		h = h * 31 + (unsigned char) *name++;
+	return h;
+}
+
+/*
+ * The same, for DNS names, which are compared ignoring case.
+ */
+static unsigned
+target_hash(name, len)
+	char const	*name;
+	size_t		 len;
+{
+unsigned	h = 0;
+
+	while (len-- > 0)
+		h = h * 31 + (unsigned char) tolower((unsigned char) *name++);
+	return h;
+}
+
+/*
+ * Add a new server to conf's hash tables, by name, by sr_target and (each
+ * of its addresses) by sr_address, doubling them when they're full.
+ */
+static int
+server_hash_add(conf, sr)
+	config_t	*conf;
+	server_t	*sr;
+{
+server_t	**newhash, **newtarget, **newaddr, *next;
+int		  i, size;
+unsigned	  h;
+
+	if (conf->nhosts == conf->hashsize) {
+		size = conf->hashsize ? conf->hashsize * 2 : 64;
+		newtarget = newaddr = NULL;
+		if ((newhash = calloc(size, sizeof(*newhash))) == NULL ||
+		    (newtarget = calloc(size, sizeof(*newtarget))) == NULL ||
+		    (newaddr = calloc(size, sizeof(*newaddr))) == NULL) {
+			free(newhash);
+			free(newtarget);
+			syslog(LOG_ERR, "out of memory (trying to continue anyway)");
+			return -1;
+		}
+
+		for (i = 0; i < conf->hashsize; i++) {
+			for (; conf->hosthash[i]; conf->hosthash[i] = next) {
+				next = conf->hosthash[i]->sr_hashnext;
+				h = server_hash(conf->hosthash[i]->sr_spec) & (size - 1);
+				conf->hosthash[i]->sr_hashnext = newhash[h];
+				newhash[h] = conf->hosthash[i];
+			}
+			for (; conf->targethash[i]; conf->targethash[i] = next) {
+				next = conf->targethash[i]->sr_targetnext;
+				h = target_hash(conf->targethash[i]->sr_target,
+						strlen(conf->targethash[i]->sr_target)) &
+						(size - 1);
+				conf->targethash[i]->sr_targetnext = newtarget[h];
+				newtarget[h] = conf->targethash[i];
+			}
+			for (; conf->addrhash[i]; conf->addrhash[i] = next) {
+				next = conf->addrhash[i]->sr_addrnext;
+				h = server_hash(conf->addrhash[i]->sr_address) & (size - 1);
+				conf->addrhash[i]->sr_addrnext = newaddr[h];
+				newaddr[h] = conf->addrhash[i];
+			}
+		}
+
+		free(conf->hosthash);
+		free(conf->targethash);
+		free(conf->addrhash);
+		conf->hosthash = newhash;
+		conf->targethash = newtarget;
+		conf->addrhash = newaddr;
+		conf->hashsize = size;
+	}
+
+	h = server_hash(sr->sr_spec) & (conf->hashsize - 1);
+	sr->sr_hashnext = conf->hosthash[h];
+	conf->hosthash[h] = sr;
+
+	h = target_hash(sr->sr_target, strlen(sr->sr_target)) &
+			(conf->hashsize - 1);
+	sr->sr_targetnext = conf->targethash[h];
+	conf->targethash[h] = sr;
+
+	for (; sr; sr = sr->sr_nextaddr) {
+		h = server_hash(sr->sr_address) & (conf->hashsize - 1);
+		sr->sr_addrnext = conf->addrhash[h];
+		conf->addrhash[h] = sr;
+	}
+
+	conf->nhosts++;
+	return 0;
+}
+
+/*
+ * Find the servers a client failure report names, one at a time: pass
+ * the previous result as prev to get the next one, or NULL to start.
+ * A report can give the server as it's written in the configuration
+ * (meaning every address it has), or one address, with or without the
+ * port: "10.0.0.1", "10.0.0.1:3306", "[2001:db8::1]:3306".  Each is a
+ * lookup in one of conf's hash tables, which are by name and by address.
+ */
+server_t *
+find_server_report(conf, name, prev)
+	config_t	*conf;
+	char const	*name;
+	server_t	*prev;
+{
+server_t	*sr;
+char		 addr[NI_MAXHOST];
+char const	*p, *start;
+size_t		 len;
+
+	if (conf->hashsize == 0)
+		return NULL;
+
+	/* The name it was given: every address. */
+	if (prev == NULL && (sr = find_server(conf, name)) != NULL)
+		return sr;
+	if (prev != NULL && strcmp(prev->sr_spec, name) == 0) {
+		if (prev->sr_nextaddr)
+			return prev->sr_nextaddr;
+		prev = NULL;
+	}
+
+	/* An address, on any port. */
+	if (prev == NULL || strcmp(prev->sr_address, name) == 0) {
+		if ((sr = find_server_addr(conf, name, name, NULL, prev)) != NULL)
+			return sr;
+		prev = NULL;
+	}
+
+	/* An address and a port. */
+	if (*name == '[') {
+		if ((p = strchr(name, ']')) == NULL || p[1] != ':')
+			return NULL;
+		start = name + 1;
+		len = p - start;
+		p++;
+	} else {
+		if ((p = strrchr(name, ':')) == NULL)
+			return NULL;
+		start = name;
+		len = p - start;
+	}
+	if (len >= sizeof(addr))
+		return NULL;
+	(void) memcpy(addr, start, len);
+	addr[len] = 0;
+
+	return find_server_addr(conf, name, addr, p + 1, prev);
+}
+
+/*
+ * For find_server_report(): the next server after prev (or the first, if
+ * prev is NULL) with address addr and, unless port is NULL, that port.
+ * Servers whose name is name have already been found by it.
+ */
+static server_t *
+find_server_addr(conf, name, addr, port, prev)
+	config_t	*conf;
+	char const	*name, *addr, *port;
+	server_t	*prev;
+{
+server_t	*sr;
+
+	sr = prev ? prev->sr_addrnext :
+		conf->addrhash[server_hash(addr) & (conf->hashsize - 1)];
+	for (; sr; sr = sr->sr_addrnext)
+		if (strcmp(sr->sr_address, addr) == 0 &&
+		    (port == NULL || strcmp(sr->sr_port, port) == 0) &&
+		    strcmp(sr->sr_spec, name) != 0)
+			return sr;
+	return NULL;
+}
+
+/*
+ * Find the server a query is for, when the name is not a group: see
+ * server_target().  Returns the server's first address, or NULL if it's
+ * not one of ours.
+ */
+server_t *
+find_server_host(conf, qname)
+	config_t	*conf;
+	char const	*qname;
+{
+server_t	*sr;
+size_t		 len, zlen;
+char const	*rest;
+
+	len = strlen(qname);
+	if (len > 0 && qname[len - 1] == '.')
+		len--;
+
+	/*
+	 * A fully qualified server name must match exactly.
+	 */
+	if ((sr = find_target(conf, qname, len, 1)) != NULL)
+		return sr;
+
+	/*
+	 * Otherwise, it's the host name in our zone (or, with no zone, in
+	 * whatever zone the query is for).
+	 */
+	if ((rest = memchr(qname, '.', len)) == NULL)
+		return NULL;
+
+	if (conf->zone != NULL) {
+		zlen = strlen(conf->zone);
+		if ((size_t) (rest + 1 - qname) + zlen != len ||
+		    strncasecmp(rest + 1, conf->zone, zlen) != 0)
+			return NULL;
+	}
+
+	return find_target(conf, qname, rest - qname, 0);
+}
+
+/*
+ * Find the server whose sr_target is the len bytes at name, ignoring
+ * case, and which is (if dotted) or isn't fully qualified.  If several
+ * servers have the same name, it's the first in the configuration.
+ */
+static server_t *
+find_target(conf, name, len, dotted)
+	config_t	*conf;
+	char const	*name;
+	size_t		 len;
+	int		 dotted;
+{
+server_t	*sr, *found = NULL;
+
+	if (conf->hashsize == 0)
+		return NULL;
+
+	for (sr = conf->targethash[target_hash(name, len) & (conf->hashsize - 1)];
+	     sr; sr = sr->sr_targetnext)
+		if (strncasecmp(name, sr->sr_target, len) == 0 &&
+		    sr->sr_target[len] == 0 &&
+		    (strchr(sr->sr_target, '.') != NULL) == dotted &&
+		    (found == NULL || sr->sr_index < found->sr_index))
+			found = sr;
+	return found;
+}
+
+/*
+ * Write the name we use as this server's SRV target into buf.  A fully
+ * qualified server name is used as-is; a short name is put in our zone,
+ * where we answer A queries for it (so PowerDNS can add the address to
+ * the SRV response).  A server given as an IP address is named after the
+ * address, with dashes for dots: 10-0-0-1.<zone>.  Returns -1 if it
+ * doesn't fit.
+ */
+int
+server_target(sr, buf, len)
+	server_t	*sr;
+	char		*buf;
+	size_t		 len;
+{
+int	n;
+
+	if (strchr(sr->sr_target, '.') != NULL || curconf->zone == NULL)
+		n = snprintf(buf, len, "%s", sr->sr_target);
+	else
+		n = snprintf(buf, len, "%s.%s", sr->sr_target, curconf->zone);
+
+	return (n < 0 || (size_t) n >= len) ? -1 : 0;
+}
+
+/*
+ * Return the server's port number.
+ */
+int
+server_portnum(sr)
+	server_t	*sr;
+{
+	if (sr->sr_family == AF_INET6)
+		return ntohs(((struct sockaddr_in6 *) &sr->sr_sockaddr)->sin6_port);
+	return ntohs(((struct sockaddr_in *) &sr->sr_sockaddr)->sin_port);
+}
+
+/*
+ * Point *addr at the server's address in network byte order, as it goes
+ * in an A or AAAA record, and return its length.
+ */
+int
+server_addr(sr, addr)
+	server_t	 *sr;
+	void const	**addr;
+{
+	if (sr->sr_family == AF_INET6) {
+		*addr = &((struct sockaddr_in6 *) &sr->sr_sockaddr)->sin6_addr;
+		return sizeof (struct in6_addr);
+	}
+
+	*addr = &((struct sockaddr_in *) &sr->sr_sockaddr)->sin_addr;
+	return sizeof (struct in_addr);
+}
+
 /*
- * Create a new server.
+ * Split a server name into host and port, in place.  The port is
+ * optional, after the last ':'; an IPv6 address with a port must be
+ * written in brackets, "[2001:db8::1]:3306".
+ */
+static void
+server_split(name, port)
+	char		 *name;
+	char const	**port;
+{
+char	*p;
+
+	*port = "3306";
+
+	if (*name == '[') {
+		if ((p = strchr(name, ']')) != NULL) {
+			*p++ = 0;
+			if (*p == ':')
+				*port = p + 1;
+		}
+		(void) memmove(name, name + 1, strlen(name + 1) + 1);
+		return;
+	}
+
+	/* More than one ':' is an IPv6 address without a port. */
+	if ((p = strchr(name, ':')) != NULL && strchr(p + 1, ':') == NULL) {
+		*p++ = 0;
+		*port = p;
+	}
+}
+
+/*
+ * Create a new server.  Every address the name resolves to gets its own
+ * server_t, all linked through sr_nextaddr; the first is returned.
  */
 server_t *
 new_server(conf, name)
 	config_t	*conf;
 	char const	*name;
 {
-server_t	 *sr;
-server_t	**newsr;
+server_t	 *sr, *first = NULL, *last = NULL;
 struct addrinfo	  hints;
-struct addrinfo	 *res = NULL;
+struct addrinfo	 *res = NULL, *ai, *saved;
 int		  i;
-char		  addr[16];
-struct sigevent	  ev;
-port_notify_t	  notf;
-char		 *sport;
+char		 *host;
+char const	 *sport;
 
 	assert(conf);
 	assert(name);
@@ -66,43 +482,106 @@ char		 *sport;
 	if ((sr = find_server(conf, name)) != NULL)
 		return sr;
 
-	if ((sr = calloc(1, sizeof(server_t))) == NULL)
-		goto err;
+	/*
+	 * After an upgrade, use the addresses the old process had (see
+	 * upgrade.c), rather than looking the name up again.
+	 */
+	if ((saved = upgrade_addrs(conf, name)) != NULL)
+		res = saved;
+	else {
+		if ((host = strdup(name)) == NULL) {
+			syslog(LOG_ERR, "out of memory (trying to continue anyway)");
+			return NULL;
+		}
+		server_split(host, &sport);
+
+		bzero(&hints, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+
+		if ((i = getaddrinfo(host, sport, &hints, &res)) != 0) {
+			syslog(LOG_ERR, "cannot resolve %s: %s", name, gai_strerror(i));
+			free(host);
+			errno = EINVAL;
+			return NULL;
+		}
+		free(host);
+	}
+
+	for (ai = res; ai; ai = ai->ai_next) {
+		if (ai->ai_family != AF_INET && ai->ai_family != AF_INET6)
+			continue;
+
+		if ((sr = new_server_addr(conf, name, ai)) == NULL) {
+			/* Any we already made belong to conf now. */
+			if (saved == NULL)
+				freeaddrinfo(res);
+			return NULL;
+		}
+
+		if (last)
+			last->sr_nextaddr = sr;
+		else
+			first = sr;
+		sr->sr_host = first;
+		last = sr;
+	}
+
+	if (saved == NULL)
+		freeaddrinfo(res);
+
+	if (first == NULL) {
+		syslog(LOG_ERR, "cannot resolve %s: no IPv4 or IPv6 addresses", name);
+		errno = EINVAL;
+	} else if (server_hash_add(conf, first) == -1)
+		return NULL;
+	return first;
+}
+
+/*
+ * Create the server_t for one address of a server, and add it to conf.
+ */
+static server_t *
+new_server_addr(conf, name, ai)
+	config_t	*conf;
+	char const	*name;
+	struct addrinfo	*ai;
+{
+server_t	 *sr;
+server_t	**newsr;
+int		  i;
+char		  addr[NI_MAXHOST];
+struct sigevent	  ev;
+port_notify_t	  notf;
+char		 *p;
+struct in6_addr	  a6;
+
+	if ((sr = calloc(1, sizeof(server_t))) == NULL) {
+		syslog(LOG_ERR, "out of memory (trying to continue anyway)");
+		return NULL;
+	}
 
 	ev.sigev_notify = SIGEV_PORT;
 	ev.sigev_signo = 0;
 	ev.sigev_value.sival_ptr = &notf;
 	notf.portnfy_port = port;
-	notf.portnfy_user = sr;
+	notf.portnfy_user = &sr->sr_ev;
+	sr->sr_ev.es_handler = server_event;
 
 	if (timer_create(CLOCK_REALTIME, &ev, &sr->sr_timer) == -1) {
 		syslog(LOG_ERR, "cannot create timer: %m");
+		sr->sr_state = SR_STOPPED;	/* No timer to delete */
 		goto err;
 	}
 
-	if ((sr->sr_name = strdup(name)) == NULL) {
+	if ((sr->sr_spec = strdup(name)) == NULL ||
+	    (sr->sr_name = strdup(name)) == NULL) {
 		syslog(LOG_ERR, "out of memory (trying to continue anyway)");
 		goto err;
 	}
+	server_split(sr->sr_name, &sr->sr_port);
 
-	if ((sport = strchr(sr->sr_name, ':')) != NULL) {
-		*sport++ = 0;
-		sr->sr_port = sport;
-	} else
-		sr->sr_port = "3306";
-
-	bzero(&hints, sizeof(hints));
-	hints.ai_family = AF_INET;
-	hints.ai_socktype = SOCK_STREAM;
-
-	if ((i = getaddrinfo(sr->sr_name, sr->sr_port, &hints, &res)) != 0) {
-		syslog(LOG_ERR, "cannot resolve %s: %s", name, gai_strerror(i));
-		free_server(sr);
-		errno = EINVAL;
-		return NULL;
-	}
-
-	if ((i = getnameinfo(res->ai_addr, res->ai_addrlen, addr, sizeof addr,
+	if ((i = getnameinfo(ai->ai_addr, ai->ai_addrlen, addr, sizeof addr,
 					NULL, 0, NI_NUMERICHOST)) != 0) {
 		syslog(LOG_ERR, "cannot translate %s to IP: %s", name, gai_strerror(i));
 		errno = EINVAL;
@@ -112,16 +591,27 @@ char		 *sport;
 	/*
 	 * Store the address in the server so we can connect to it later.
 	 */
-	assert(res->ai_addrlen == sizeof (sr->sr_sockaddr));
-	(void) memcpy(&sr->sr_sockaddr, res->ai_addr, sizeof (sr->sr_sockaddr));
-	freeaddrinfo(res);
-	res = NULL;
+	assert(ai->ai_addrlen <= sizeof (sr->sr_sockaddr));
+	(void) memcpy(&sr->sr_sockaddr, ai->ai_addr, ai->ai_addrlen);
+	sr->sr_addrlen = ai->ai_addrlen;
+	sr->sr_family = ai->ai_family;
 
 	if ((sr->sr_address = strdup(addr)) == NULL) {
 		syslog(LOG_ERR, "out of memory (trying to continue anyway)");
 		goto err;
 	}
 
+	if ((sr->sr_target = strdup(sr->sr_name)) == NULL) {
+		syslog(LOG_ERR, "out of memory (trying to continue anyway)");
+		goto err;
+	}
+
+	if (inet_pton(AF_INET, sr->sr_name, &a6) == 1 ||
+	    inet_pton(AF_INET6, sr->sr_name, &a6) == 1)
+		for (p = sr->sr_target; *p; p++)
+			if (*p == '.' || *p == ':')
+				*p = '-';
+
 	sr->sr_online = 0;
 
 	if ((newsr = realloc(conf->servers, sizeof(server_t *) * (conf->nservers + 1))) == NULL) {
@@ -131,146 +621,700 @@ char		 *sport;
 
 	conf->servers = newsr;
 	conf->servers[conf->nservers] = sr;
-	conf->nservers++;
+	sr->sr_index = conf->nservers++;
+	history_add(conf, sr);
 
 	return sr;
 
 err:
 	free_server(sr);
-	if (res)
-		freeaddrinfo(res);
 	return NULL;
+}
+
+/*
+ * Start a check of the given server, or queue it if too many checks are
+ * already in progress.
+ */
+void
+server_start_connect_check(server)
+	server_t *server;
+{
+	assert(server);
+	assert(server->sr_state == SR_IDLE);
+
+	if (probes_inflight >= curconf->maxprobes || probeq_head != NULL) {
+		probe_enqueue(server);
+		return;
+	}
+
+	probes_inflight++;
+	server_connect(server);
+}
+
+/*
+ * Initiate a connect() to the given server, and start the timer
+ * for connect timeout.  The caller has already counted this check
+ * in probes_inflight.
+ */
+static void
+server_connect(server)
+	server_t *server;
+{
+int			 on = 1;
+struct itimerspec	 ts;
+
+	server->sr_probe_start = gethrtime();
+	WITA_PROBE_START(server->sr_name, server->sr_address,
+			(char *) server->sr_port);
+
+	if ((server->sr_socket = socket(server->sr_family, SOCK_STREAM, 0)) == -1) {
+		/*
+		 * If we ran out of descriptors, the probe limit is too high
+		 * for this process.  Lower it to what we've managed so far,
+		 * and put the server back in the queue to try again when a
+		 * slot frees up.
+		 */
+		if ((errno == EMFILE || errno == ENFILE) && probes_inflight > 1) {
+			probes_inflight--;
+			syslog(LOG_WARNING, "%s[%s]:%s: out of file descriptors "
+					"with %d probes in progress; lowering probe limit "
+					"from %d to %d",
+					server->sr_name, server->sr_address,
+					server->sr_port, probes_inflight,
+					curconf->maxprobes, probes_inflight);
+			curconf->maxprobes = probes_inflight;
+			probe_enqueue(server);
+			return;
+		}
+
+		syslog(LOG_ERR, "%s[%s]:%s: server_start_connect_check: "
+				"socket() failed: %m",
+				server->sr_name, server->sr_address,
+				server->sr_port);
+		server->sr_socket = -1;
+		server_cancel_check(server);
+		return;
+	}
+
+	/*
+	 * FIONBIO sets non-blocking mode in a single call, rather than the
+	 * two fcntl() calls (F_GETFL, F_SETFL) that would otherwise be needed.
+	 * A fresh socket has no other flags worth preserving.
+	 */
+	if (ioctl(server->sr_socket, FIONBIO, &on) == -1) {
+		syslog(LOG_ERR, "%s[%s]:%s: server_start_connect_check: "
+				"ioctl(FIONBIO) failed: %m",
+				server->sr_name, server->sr_address,
+				server->sr_port);
+		server_cancel_check(server);
+		return;
+	}
+
+	server->sr_state = SR_CONNECT;
+
+	server->sr_nsent = server->sr_nbuf = 0;
+
+	if (connect(server->sr_socket, (struct sockaddr *) &server->sr_sockaddr,
+			server->sr_addrlen) == 0) {
+		server_connected(server);
+		return;
+	}
+
+	switch (errno) {
+	case EINPROGRESS:
+		/*
+		 * Set the timer for 5 seconds.
+		 */
+		bzero(&ts, sizeof(ts));
+		ts.it_value.tv_sec = 5;
+		server->sr_deadline = gethrtime() + 5 * NANOSEC - TIMER_SLOP;
+
+		if (timer_settime(server->sr_timer, 0, &ts, NULL) == -1) {
+			syslog(LOG_ERR, "%s[%s]:%s: server_start_connect_check: "
+					"cannot set connect timer: timer_settime: %m",
+					server->sr_name, server->sr_address,
+					server->sr_port);
+			server_cancel_check(server);
+			return;
+		}
+
+		/*
+		 * And associate the fd so we know when it connected.
+		 */
+		if (port_associate(port, PORT_SOURCE_FD, server->sr_socket, POLLOUT, &server->sr_ev) == -1) {
+			syslog(LOG_ERR, "%s[%s]:%s: server_start_connect_check: "
+					"cannot associate fd: port_associate: %m",
+					server->sr_name, server->sr_address,
+					server->sr_port);
+			server_cancel_check(server);
+		}
+
+		return;
+
+	default:
+		server_down(server, errno);
+		return;
+	}
+}
+
+/*
+ * Add a server to the tail of the probe queue.
+ */
+static void
+probe_enqueue(sr)
+	server_t	*sr;
+{
+	sr->sr_state = SR_QUEUED;
+	sr->sr_qnext = NULL;
+	sr->sr_qprev = probeq_tail;
+	sr->sr_qtime = gethrtime();
+
+	if (probeq_tail)
+		probeq_tail->sr_qnext = sr;
+	else
+		probeq_head = sr;
+	probeq_tail = sr;
+}
+
+/*
+ * Remove a server from the probe queue.
+ */
+static void
+probe_dequeue(sr)
+	server_t	*sr;
+{
+	assert(sr->sr_state == SR_QUEUED);
+
+	if (sr->sr_qprev)
+		sr->sr_qprev->sr_qnext = sr->sr_qnext;
+	else
+		probeq_head = sr->sr_qnext;
+
+	if (sr->sr_qnext)
+		sr->sr_qnext->sr_qprev = sr->sr_qprev;
+	else
+		probeq_tail = sr->sr_qprev;
+
+	sr->sr_qnext = sr->sr_qprev = NULL;
+	sr->sr_state = SR_IDLE;
+}
+
+/*
+ * A check finished (one way or another) and gave up its slot.
+ */
+static void
+probe_release()
+{
+	assert(probes_inflight > 0);
+	probes_inflight--;
+	probe_admit();
+}
+
+/*
+ * Start checks from the head of the queue while there are free slots.
+ * server_connect() can finish a check immediately (e.g. if connect()
+ * fails straight away), which calls back into here through
+ * probe_release(); the outer call keeps going, so we don't recurse
+ * once per queued server.
+ */
+static void
+probe_admit()
+{
+static int	 admitting;
+server_t	*sr;
+hrtime_t	 now, wait;
+
+	if (admitting)
+		return;
+	admitting = 1;
+
+	while (probeq_head && probes_inflight < curconf->maxprobes) {
+		sr = probeq_head;
+		probe_dequeue(sr);
+
+		now = gethrtime();
+		wait = now - sr->sr_qtime;
+		probeq_nwaited++;
+		probeq_totwait += wait;
+		if (wait > probeq_maxwait)
+			probeq_maxwait = wait;
+		hist_add(&metrics.m_probeq_wait, wait);
+
+		probes_inflight++;
+		server_connect(sr);
+	}
+
+	admitting = 0;
+
+	if (probeq_nwaited == 0)
+		return;
+
+	now = gethrtime();
+	if (probeq_head == NULL ||
+	    now - probeq_lastreport >= PROBEQ_REPORT_INTERVAL) {
+		syslog(LOG_INFO, "%d probes waited for a free slot (limit %d): "
+				"mean wait %lld ms, max %lld ms%s",
+				probeq_nwaited, curconf->maxprobes,
+				(long long) (probeq_totwait / probeq_nwaited / MICROSEC),
+				(long long) (probeq_maxwait / MICROSEC),
+				probeq_head ? ", queue still busy" : "");
+		probeq_nwaited = 0;
+		probeq_totwait = probeq_maxwait = 0;
+		probeq_lastreport = now;
+	}
+}
+
+/*
+ * Stop any check in progress or queued for this server without recording
+ * a result, and stop its timer; used when the server is about to be
+ * freed.  Any events for it that are already in hand are ignored.
+ */
+void
+server_stop_check(sr)
+	server_t	*sr;
+{
+	switch (sr->sr_state) {
+	case SR_IDLE:
+	case SR_STOPPED:
+		break;
+
+	case SR_QUEUED:
+		probe_dequeue(sr);
+		break;
+
+	case SR_CONNECT:
+	case SR_WRITE:
+	case SR_READ:
+		/*
+		 * Closing the socket also dissociates it from the port.
+		 * Don't admit anything from the queue here: the caller is
+		 * tearing down the whole configuration.
+		 */
+		(void) close(sr->sr_socket);
+		probes_inflight--;
+		break;
+	}
+
+	if (sr->sr_state != SR_STOPPED)
+		(void) timer_delete(sr->sr_timer);
+	sr->sr_state = SR_STOPPED;
+}
+
+void
+server_schedule_check(server)
+	server_t *server;
+{
+struct itimerspec	ts;
+
+	/*
+	 * Set the timer for the next check.
+	 */
+	bzero(&ts, sizeof(ts));
+	ts.it_value.tv_sec = CHECK_INTERVAL;
+
+	if (timer_settime(server->sr_timer, 0, &ts, NULL) == -1) {
+		syslog(LOG_ERR, "%s[%s]:%s: server_schedule_check: "
+				"cannot set timer for next check: timer_settime: %m",
+				server->sr_name, server->sr_address,
+				server->sr_port);
+		syslog(LOG_ERR, "fatal state inconsistency (lost server), exiting");
+		exit(1);
+	}
+}
+
+void
+server_up(sr)
+	server_t	*sr;
+{
+struct itimerspec	ts;
+	
+	server_result(sr, 1, 0);
+
+	(void) close(sr->sr_socket);
+	sr->sr_state = SR_IDLE;
+	probe_release();
+
+	/* Check again in CHECK_INTERVAL seconds. */
+	bzero(&ts, sizeof(ts));
+	ts.it_value.tv_sec = CHECK_INTERVAL;
+	if (timer_settime(sr->sr_timer, 0, &ts, NULL) == -1) {
+		syslog(LOG_ERR, "%s[%s]:%s: server_up: "
+				"cannot set timer for next check: timer_settime: %m",
+				sr->sr_name, sr->sr_address,
+				sr->sr_port);
+		syslog(LOG_ERR, "fatal state inconsistency (lost server), exiting");
+		exit(1);
+	}
+}
+
+void
+server_down(sr, error)
+	server_t	*sr;
+{
+struct itimerspec	ts;
+
+	server_result(sr, 0, error);
+
+	(void) close(sr->sr_socket);
+	sr->sr_state = SR_IDLE;
+	probe_release();
+
+	/* Check again in CHECK_INTERVAL seconds. */
+	bzero(&ts, sizeof(ts));
+	ts.it_value.tv_sec = CHECK_INTERVAL;
+	if (timer_settime(sr->sr_timer, 0, &ts, NULL) == -1) {
+		syslog(LOG_ERR, "%s[%s]:%s: server_down: "
+				"cannot set timer for next check: timer_settime: %m",
+				sr->sr_name, sr->sr_address,
+				sr->sr_port);
+		syslog(LOG_ERR, "fatal state inconsistency (lost server), exiting");
+		exit(1);
+	}
+}
+
+/*
+ * Record the result of a check.  The server's health only changes after
+ * curconf->rise consecutive successes or curconf->fall consecutive
+ * failures, so a single lost packet doesn't change the answers we give.
+ * The very first result is taken as-is, so we don't start up with every
+ * server down for several check intervals.
+ */
+static void
+server_result(sr, ok, error)
+	server_t	*sr;
+{
+hrtime_t	took = gethrtime() - sr->sr_probe_start;
+int		res = ok ? PROBE_OK : error == ETIMEDOUT ? PROBE_TIMEOUT : PROBE_FAIL;
+
+	WITA_PROBE_DONE(sr->sr_name, sr->sr_address, (char *) sr->sr_port,
+			ok, error);
+
+	sr->sr_nprobes[res]++;
+	sr->sr_probe_time += took;
+	metrics.m_probes[res]++;
+	hist_add(&metrics.m_probe_time, took);
+	history_record(sr, res, error, took);
+
+	if (ok) {
+		sr->sr_nfail = 0;
+		sr->sr_suspect = 0;
+		sr->sr_nreports = 0;
+		if (sr->sr_nsucc < INT_MAX)
+			sr->sr_nsucc++;
+
+		if (!sr->sr_healthy &&
+		    (!sr->sr_checked || sr->sr_nsucc >= curconf->rise)) {
+			sr->sr_healthy = 1;
+			if (sr->sr_checked)
+				server_flapped(sr);
+			gossip_changed(sr);
+		}
+	} else {
+		sr->sr_nsucc = 0;
+		if (sr->sr_nfail < INT_MAX)
+			sr->sr_nfail++;
+
+		if (sr->sr_healthy && sr->sr_nfail >= curconf->fall) {
+			sr->sr_healthy = 0;
+			server_flapped(sr);
+			gossip_changed(sr);
+		}
+	}
+
+	if (!sr->sr_checked)
+		gossip_changed(sr);
+	sr->sr_checked = 1;
+
+	/*
+	 * Let the penalty decay even if the server is stable, so a
+	 * suppressed server is released on time.
+	 */
+	if (curconf->dampen_halflife > 0 && sr->sr_penalty > 0) {
+		server_decay_penalty(sr);
+
+		if (sr->sr_suppressed && sr->sr_penalty < curconf->dampen_reuse) {
+			syslog(LOG_NOTICE, "%s[%s]:%s: no longer flapping, "
+					"releasing from dampening",
+					sr->sr_name, sr->sr_address, sr->sr_port);
+			sr->sr_suppressed = 0;
+		}
+	}
+
+	server_update(sr, error);
+}
+
+/*
+ * Work out whether the server should be handed out, now that something
+ * has changed, and tell its groups if that's different.
+ */
+static void
+server_update(sr, error)
+	server_t	*sr;
+{
+int	ndown, nvotes;
+
+	if (server_agreed(sr) && !sr->sr_suppressed && !sr->sr_suspect &&
+	    !sr->sr_drained) {
+		if (!sr->sr_online) {
+			syslog(LOG_NOTICE, "%s[%s]:%s: state now UP",
+					sr->sr_name,
+					sr->sr_address,
+					sr->sr_port);
+			WITA_SERVER_STATE(sr->sr_name, sr->sr_address,
+					(char *) sr->sr_port, 1, "up");
+			sr->sr_online = 1;
+			sr->sr_nchanges++;
+			group_server_changed(sr);
+		}
+	} else if (sr->sr_online) {
+		if (sr->sr_drained)
+			syslog(LOG_NOTICE, "%s[%s]:%s: state now DOWN: drained",
+					sr->sr_name,
+					sr->sr_address,
+					sr->sr_port);
+		else if (sr->sr_suppressed)
+			syslog(LOG_WARNING, "%s[%s]:%s: state now DOWN: "
+					"suppressed by flap dampening",
+					sr->sr_name,
+					sr->sr_address,
+					sr->sr_port);
+		else if (sr->sr_suspect)
+			syslog(LOG_WARNING, "%s[%s]:%s: state now DOWN: "
+					"%d failures reported by clients",
+					sr->sr_name,
+					sr->sr_address,
+					sr->sr_port,
+					sr->sr_nreports);
+		else if (error == 0) {
+			server_votes(sr, &ndown, &nvotes);
+			syslog(LOG_WARNING, "%s[%s]:%s: state now DOWN: "
+					"%d of %d instances checking it say so",
+					sr->sr_name,
+					sr->sr_address,
+					sr->sr_port,
+					ndown, nvotes);
+		} else
+			syslog(LOG_WARNING, "%s[%s]:%s: state now DOWN: %s",
+					sr->sr_name,
+					sr->sr_address,
+					sr->sr_port,
+					strerror(error));
+		WITA_SERVER_STATE(sr->sr_name, sr->sr_address,
+				(char *) sr->sr_port, 0,
+				sr->sr_drained ? "drained" :
+				sr->sr_suppressed ? "suppressed" :
+				sr->sr_suspect ? "reported" :
+				error == 0 ? "quorum" : strerror(error));
+		sr->sr_online = 0;
+		sr->sr_nchanges++;
+		group_server_changed(sr);
+	}
+}
+
+/*
+ * Is the server healthy?  That's what our own checks say, unless other
+ * instances are checking it too (see gossip.c), in which case it's healthy
+ * unless quorum of those with a verdict say it's down, or all of them do
+ * if there are fewer.
+ */
+static int
+server_agreed(sr)
+	server_t	*sr;
+{
+int	ndown, nvotes;
+
+	server_votes(sr, &ndown, &nvotes);
+	if (nvotes == 0)
+		return 0;
+	return ndown < (curconf->quorum < nvotes ? curconf->quorum : nvotes);
+}
+
+/*
+ * Count the verdicts on sr, ours and our peers', and how many say down.
+ * Those of peers that have gone only count while there are fewer than
+ * quorum of the others.
+ */
+void
+server_votes(sr, ndown, nvotes)
+	server_t	*sr;
+	int		*ndown, *nvotes;
+{
+uint32_t	b;
+
+	*ndown = *nvotes = 0;
+	for (b = sr->sr_peerup & peers_live; b; b &= b - 1)
+		++*nvotes;
+	for (b = sr->sr_peerdown & peers_live; b; b &= b - 1)
+		++*nvotes, ++*ndown;
+
+	if (sr->sr_checked) {
+		++*nvotes;
+		if (!sr->sr_healthy)
+			++*ndown;
+	}
+
+	if (*nvotes >= curconf->quorum)
+		return;
 
+	for (b = sr->sr_peerup & ~peers_live; b; b &= b - 1)
+		++*nvotes;
+	for (b = sr->sr_peerdown & ~peers_live; b; b &= b - 1)
+		++*nvotes, ++*ndown;
 }
 
 /*
- * Initiate a connect() to the given server, and start the timer
- * for connect timeout.
+ * Peer number peer (see gossip.c) has a new verdict on sr.
  */
 void
-server_start_connect_check(server)
-	server_t *server;
+server_peer_vote(sr, peer, vote)
+	server_t	*sr;
+	int		 peer, vote;
 {
-int			 fl;
-struct itimerspec	 ts;
-
-	assert(server);
-	assert(server->sr_state == SR_IDLE);
+uint32_t	bit = (uint32_t) 1 << peer;
+uint32_t	up = sr->sr_peerup, down = sr->sr_peerdown;
 
-	if ((server->sr_socket = socket(PF_INET, SOCK_STREAM, 0)) == -1) {
-		syslog(LOG_ERR, "%s[%s]:%s: server_start_connect_check: "
-				"socket() failed: %m",
-				server->sr_name, server->sr_address,
-				server->sr_port);
-		server_cancel_check(server);
+	if (vote == VOTE_SAME) {
+		/* Unchanged, but it may count differently now. */
+		if ((up | down) & bit && sr->sr_state != SR_STOPPED)
+			server_update(sr, 0);
 		return;
 	}
 
-	if ((fl = fcntl(server->sr_socket, F_GETFL, 0)) == -1) {
-		syslog(LOG_ERR, "%s[%s]:%s: server_start_connect_check: "
-				"fcntl(F_GETFL) failed: %m",
-				server->sr_name, server->sr_address,
-				server->sr_port);
-		server_cancel_check(server);
+	sr->sr_peerup &= ~bit;
+	sr->sr_peerdown &= ~bit;
+	if (vote == VOTE_UP)
+		sr->sr_peerup |= bit;
+	else if (vote == VOTE_DOWN)
+		sr->sr_peerdown |= bit;
+
+	if (sr->sr_peerup != up || sr->sr_peerdown != down)
+		if (sr->sr_state != SR_STOPPED)
+			server_update(sr, 0);
+}
+
+/*
+ * A client has told us (see report.c) that it couldn't use this server.
+ * Check it straight away instead of waiting for the next check, unless
+ * a check is already under way or we did one very recently; further
+ * reports in the meantime are just counted.  Once report-threshold
+ * reports arrive within REPORT_WINDOW, the server is suspect: we stop
+ * handing it out until a check succeeds.
+ */
+void
+server_report(sr)
+	server_t	*sr;
+{
+hrtime_t	now = gethrtime();
+
+	if (sr->sr_state == SR_STOPPED)
 		return;
+
+	if (now - sr->sr_report_start > REPORT_WINDOW) {
+		sr->sr_report_start = now;
+		sr->sr_nreports = 0;
 	}
+	if (sr->sr_nreports < INT_MAX)
+		sr->sr_nreports++;
 
-	if ((fl = fcntl(server->sr_socket, F_SETFL, fl | O_NONBLOCK)) == -1) {
-		syslog(LOG_ERR, "%s[%s]:%s: server_start_connect_check: "
-				"fcntl(F_SETFL) failed: %m",
-				server->sr_name, server->sr_address,
-				server->sr_port);
-		server_cancel_check(server);
-		return;
+	if (curconf->report_threshold > 0 && !sr->sr_suspect &&
+	    sr->sr_nreports >= curconf->report_threshold) {
+		sr->sr_suspect = 1;
+		server_update(sr, 0);
 	}
 
-	if (connect(server->sr_socket, &server->sr_sockaddr, sizeof (server->sr_sockaddr)) == 0) {
-		server_start_read_check(server);
+	if (sr->sr_state != SR_IDLE ||
+	    (sr->sr_lastreport_check != 0 &&
+	     now - sr->sr_lastreport_check < REPORT_MINGAP))
 		return;
-	}
 
-	switch (errno) {
-	case EINPROGRESS:
-		server->sr_state = SR_CONNECT;
+	sr->sr_lastreport_check = now;
+	server_start_connect_check(sr);
+}
 
-		/*
-		 * Set the timer for 5 seconds.
-		 */
-		bzero(&ts, sizeof(ts));
-		ts.it_value.tv_sec = 5;
+/*
+ * Take a server out of every answer (drained), or put it back, by
+ * request of the operator (see ctl.c).  It's still checked while it's
+ * drained, so it comes back in its real state.
+ */
+void
+server_drain(sr, drained)
+	server_t	*sr;
+	int		 drained;
+{
+	if (sr->sr_drained == drained)
+		return;
 
-		if (timer_settime(server->sr_timer, 0, &ts, NULL) == -1) {
-			syslog(LOG_ERR, "%s[%s]:%s: server_start_connect_check: "
-					"cannot set connect timer: timer_settime: %m",
-					server->sr_name, server->sr_address,
-					server->sr_port);
-			server_cancel_check(server);
-			return;
-		}
+	syslog(LOG_NOTICE, "%s[%s]:%s: %s", sr->sr_name, sr->sr_address,
+			sr->sr_port, drained ? "drained" : "undrained");
+	sr->sr_drained = drained;
+	server_update(sr, 0);
+}
 
-		/*
-		 * And associate the fd so we know when it connected.
-		 */
-		if (port_associate(port, PORT_SOURCE_FD, server->sr_socket, POLLOUT, server) == -1) {
-			syslog(LOG_ERR, "%s[%s]:%s: server_start_connect_check: "
-					"cannot associate fd: port_associate: %m",
-					server->sr_name, server->sr_address,
-					server->sr_port);
-			server_cancel_check(server);
-		}
+/*
+ * Check the server with pr from now on.  Only done before its first check.
+ */
+int
+server_set_probe(sr, pr)
+	server_t	*sr;
+	probe_t		*pr;
+{
+	if (sr->sr_probe == pr)
+		return 0;
 
-		return;
+	assert(sr->sr_state == SR_IDLE);
 
-	default:
-		server_down(server, errno);
-		return;
+	free(sr->sr_buf);
+	if ((sr->sr_buf = malloc(pr->pr_readmax + 1)) == NULL) {
+		syslog(LOG_ERR, "out of memory");
+		sr->sr_probe = NULL;
+		return -1;
 	}
+	sr->sr_probe = pr;
+	return 0;
 }
 
-void
-server_schedule_check(server)
-	server_t *server;
+/*
+ * How long until sr's timer fires, or 0 if it isn't set.
+ */
+hrtime_t
+server_next_check(sr)
+	server_t	*sr;
 {
 struct itimerspec	ts;
 
-	/*
-	 * Set the timer for 5 seconds.
-	 */
-	bzero(&ts, sizeof(ts));
-	ts.it_value.tv_sec = 5;
-
-	if (timer_settime(server->sr_timer, 0, &ts, NULL) == -1) {
-		syslog(LOG_ERR, "%s[%s]:%s: server_schedule_check: "
-				"cannot set timer for next check: timer_settime: %m",
-				server->sr_name, server->sr_address,
-				server->sr_port);
-		syslog(LOG_ERR, "fatal state inconsistency (lost server), exiting");
-		exit(1);
-	}
+	if (timer_gettime(sr->sr_timer, &ts) == -1)
+		return 0;
+	return (hrtime_t) ts.it_value.tv_sec * NANOSEC + ts.it_value.tv_nsec;
 }
 
+/*
+ * Carry on checking sr where another process left off (see upgrade.c):
+ * its state has been filled in, and its next check is in delay ns.
+ */
 void
-server_up(sr)
+server_resume(sr, online, delay)
 	server_t	*sr;
+	int		 online;
+	hrtime_t	 delay;
 {
 struct itimerspec	ts;
-	
-	if (!sr->sr_online) {
-		syslog(LOG_NOTICE, "%s[%s]:%s: state now UP",
-				sr->sr_name,
-				sr->sr_address,
-				sr->sr_port);
+
+	assert(sr->sr_state == SR_IDLE);
+
+	if (online) {
 		sr->sr_online = 1;
+		group_server_changed(sr);
 	}
 
-	(void) close(sr->sr_socket);
-	sr->sr_state = SR_IDLE;
+	/* A zero timer would never fire. */
+	if (delay < (hrtime_t) NANOSEC / MILLISEC)
+		delay = (hrtime_t) NANOSEC / MILLISEC;
 
-	/* Check again in 5 seconds. */
 	bzero(&ts, sizeof(ts));
-	ts.it_value.tv_sec = 5;
+	ts.it_value.tv_sec = delay / NANOSEC;
+	ts.it_value.tv_nsec = delay % NANOSEC;
 	if (timer_settime(sr->sr_timer, 0, &ts, NULL) == -1) {
-		syslog(LOG_ERR, "%s[%s]:%s: server_up: "
+		syslog(LOG_ERR, "%s[%s]:%s: server_resume: "
 				"cannot set timer for next check: timer_settime: %m",
 				sr->sr_name, sr->sr_address,
 				sr->sr_port);
@@ -279,34 +1323,60 @@ struct itimerspec	ts;
 	}
 }
 
-void
-server_down(sr, error)
+/*
+ * Check a server now, rather than when its timer next fires.  Returns -1
+ * if a check is already queued or in progress.
+ */
+int
+server_check_now(sr)
 	server_t	*sr;
 {
-struct itimerspec	ts;
+	if (sr->sr_state != SR_IDLE)
+		return -1;
 
-	if (sr->sr_online) {
-		syslog(LOG_WARNING, "%s[%s]:%s: state now DOWN: %s",
-				sr->sr_name,
-				sr->sr_address,
-				sr->sr_port,
-				strerror(error));
-		sr->sr_online = 0;
-	}
+	server_start_connect_check(sr);
+	return 0;
+}
 
-	(void) close(sr->sr_socket);
-	sr->sr_state = SR_IDLE;
+/*
+ * Bring the server's flap penalty up to date.
+ */
+static void
+server_decay_penalty(sr)
+	server_t	*sr;
+{
+hrtime_t	now = gethrtime();
 
-	/* Check again in 5 seconds. */
-	bzero(&ts, sizeof(ts));
-	ts.it_value.tv_sec = 5;
-	if (timer_settime(sr->sr_timer, 0, &ts, NULL) == -1) {
-		syslog(LOG_ERR, "%s[%s]:%s: server_down: "
-				"cannot set timer for next check: timer_settime: %m",
-				sr->sr_name, sr->sr_address,
-				sr->sr_port);
-		syslog(LOG_ERR, "fatal state inconsistency (lost server), exiting");
-		exit(1);
+	if (sr->sr_penalty > 0)
+		sr->sr_penalty *= pow(0.5, (double) (now - sr->sr_penalty_time) /
+				((double) curconf->dampen_halflife * NANOSEC));
+	sr->sr_penalty_time = now;
+}
+
+/*
+ * The server's health just changed; charge it a flap penalty.
+ */
+static void
+server_flapped(sr)
+	server_t	*sr;
+{
+double	maxpenalty;
+
+	if (curconf->dampen_halflife == 0)
+		return;
+
+	server_decay_penalty(sr);
+	sr->sr_penalty += FLAP_PENALTY;
+	maxpenalty = (double) curconf->dampen_reuse * (1 << FLAP_MAXHOLD);
+	if (sr->sr_penalty > maxpenalty)
+		sr->sr_penalty = maxpenalty;
+
+	if (!sr->sr_suppressed && sr->sr_penalty >= curconf->dampen_suppress) {
+		syslog(LOG_WARNING, "%s[%s]:%s: flapping (penalty %.0f), "
+				"suppressing until it settles",
+				sr->sr_name, sr->sr_address, sr->sr_port,
+				sr->sr_penalty);
+		sr->sr_suppressed = 1;
 	}
 }
 
@@ -318,10 +1388,11 @@ struct itimerspec	ts;
 	if (sr->sr_socket != -1)
 		(void) close(sr->sr_socket);
 	sr->sr_state = SR_IDLE;
+	probe_release();
 
-	/* Check again in 5 seconds. */
+	/* Check again in CHECK_INTERVAL seconds. */
 	bzero(&ts, sizeof(ts));
-	ts.it_value.tv_sec = 5;
+	ts.it_value.tv_sec = CHECK_INTERVAL;
 	if (timer_settime(sr->sr_timer, 0, &ts, NULL) == -1) {
 		syslog(LOG_ERR, "%s[%s]:%s: server_cancel_check: "
 				"cannot set timer for next check: timer_settime: %m",
@@ -332,26 +1403,71 @@ struct itimerspec	ts;
 	}
 }
 
+/*
+ * Read the server's reply.  This is called both when connect() completes
+ * (if there's nothing to send) and when the socket later becomes
+ * readable; in either case, read() also reports any error left pending on
+ * the socket by a failed connect(), so we never need a separate
+ * getsockopt(SO_ERROR).  The default check only wants one byte; a probe
+ * reads until its reply passes or fails (see probe_match()).
+ */
 void
 server_start_read_check(sr)
 	server_t *sr;
 {
-struct itimerspec	ts;
+struct itimerspec	 ts;
+probe_t			*pr = sr->sr_probe;
+ssize_t			 n;
 
-	/*
-	 * Connect succeeded, now try reading some data.
-	 */
-	switch (read(sr->sr_socket, &sr->sr_rdbuf, 1)) {
-	case 0:	/* EOF */
-		server_down(sr, ENODATA);
-		return;
+	for (;;) {
+		if (pr)
+			n = read(sr->sr_socket, sr->sr_buf + sr->sr_nbuf,
+					pr->pr_readmax - sr->sr_nbuf);
+		else
+			n = read(sr->sr_socket, &sr->sr_rdbuf, 1);
 
-	case -1: /* Error */
-		if (errno != EAGAIN) {
-			server_down(sr, errno);
+		if (n == -1)
+			break;
+
+		if (n == 0) {	/* EOF */
+			if (pr && probe_match(pr, sr->sr_buf, sr->sr_nbuf, 1) == 1)
+				server_up(sr);
+			else
+				server_down(sr, sr->sr_nbuf ? EPROTO : ENODATA);
+			return;
+		}
+
+		WITA_PROBE_READ(sr->sr_name, sr->sr_address,
+				(char *) sr->sr_port, (int) (sr->sr_nbuf + n));
+
+		if (pr == NULL) {
+			server_up(sr);
+			return;
+		}
+
+		sr->sr_nbuf += n;
+		switch (probe_match(pr, sr->sr_buf, sr->sr_nbuf,
+				sr->sr_nbuf == pr->pr_readmax)) {
+		case 1:
+			server_up(sr);
+			return;
+		case 0:
+			server_down(sr, EPROTO);
 			return;
 		}
+	}
 
+	if (errno != EAGAIN) {
+		server_down(sr, errno);
+		return;
+	}
+
+	/*
+	 * If we were already waiting for the read, this was a spurious
+	 * wakeup (or only part of the reply); leave the existing timeout
+	 * alone.
+	 */
+	if (sr->sr_state != SR_READ) {
 		sr->sr_state = SR_READ;
 
 		/*
@@ -359,31 +1475,141 @@ struct itimerspec	ts;
 		 */
 		bzero(&ts, sizeof(ts));
 		ts.it_value.tv_sec = 5;
+		sr->sr_deadline = gethrtime() + 5 * NANOSEC - TIMER_SLOP;
 
 		if (timer_settime(sr->sr_timer, 0, &ts, NULL) == -1) {
-			syslog(LOG_ERR, "%s[%s]:%s: server_starte_read_check: "
+			syslog(LOG_ERR, "%s[%s]:%s: server_start_read_check: "
 					"cannot set timer for read timeout: timer_settime: %m",
 					sr->sr_name, sr->sr_address, sr->sr_port);
 			server_cancel_check(sr);
 			return;
 		}
+	}
 
-		/*
-		 * And associate the fd so we know when the read returned.
-		 */
-		if (port_associate(port, PORT_SOURCE_FD, sr->sr_socket, POLLIN, sr) == -1) {
-			syslog(LOG_ERR, "%s[%s]:%s: server_start_read_check: "
-					"cannot associate fd with port: port_associate: %m",
+	/*
+	 * And associate the fd so we know when the read returned.
+	 */
+	if (port_associate(port, PORT_SOURCE_FD, sr->sr_socket, POLLIN, &sr->sr_ev) == -1) {
+		syslog(LOG_ERR, "%s[%s]:%s: server_start_read_check: "
+				"cannot associate fd with port: port_associate: %m",
+				sr->sr_name, sr->sr_address, sr->sr_port);
+		server_cancel_check(sr);
+	}
+}
+
+/*
+ * The connection is made; send the probe's request, if it has one, and
+ * then read the reply.  Like read(), write() reports a failed connect().
+ */
+static void
+server_connected(sr)
+	server_t	*sr;
+{
+struct itimerspec	 ts;
+probe_t			*pr = sr->sr_probe;
+ssize_t			 n;
+
+	if (sr->sr_state == SR_CONNECT)
+		WITA_PROBE_CONNECT(sr->sr_name, sr->sr_address,
+				(char *) sr->sr_port);
+
+	if (pr == NULL || pr->pr_sendlen == 0) {
+		server_start_read_check(sr);
+		return;
+	}
+
+	while (sr->sr_nsent < pr->pr_sendlen) {
+		if ((n = write(sr->sr_socket, pr->pr_send + sr->sr_nsent,
+				pr->pr_sendlen - sr->sr_nsent)) == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				break;
+			server_down(sr, errno);
+			return;
+		}
+		sr->sr_nsent += n;
+	}
+
+	if (sr->sr_nsent == pr->pr_sendlen) {
+		server_start_read_check(sr);
+		return;
+	}
+
+	/*
+	 * The socket buffer is full; wait until there's room, with a
+	 * timeout of our own, like connect and read.
+	 */
+	if (sr->sr_state != SR_WRITE) {
+		sr->sr_state = SR_WRITE;
+
+		bzero(&ts, sizeof(ts));
+		ts.it_value.tv_sec = 5;
+		sr->sr_deadline = gethrtime() + 5 * NANOSEC - TIMER_SLOP;
+
+		if (timer_settime(sr->sr_timer, 0, &ts, NULL) == -1) {
+			syslog(LOG_ERR, "%s[%s]:%s: server_connected: "
+					"cannot set timer for write timeout: timer_settime: %m",
 					sr->sr_name, sr->sr_address, sr->sr_port);
 			server_cancel_check(sr);
 			return;
 		}
+	}
+
+	if (port_associate(port, PORT_SOURCE_FD, sr->sr_socket, POLLOUT, &sr->sr_ev) == -1) {
+		syslog(LOG_ERR, "%s[%s]:%s: server_connected: "
+				"cannot associate fd with port: port_associate: %m",
+				sr->sr_name, sr->sr_address, sr->sr_port);
+		server_cancel_check(sr);
+	}
+}
+
+/*
+ * Port event for a server: either its timer fired, or its socket is
+ * ready.
+ *
+ * An fd event can be stale: if the check's timer came earlier in the
+ * same batch and timed it out, the socket it was for is already closed.
+ * So an fd event only counts if the check is still waiting on that
+ * socket for that direction.  If the fd was reused by a new check of
+ * this server in the same batch, the event looks like a spurious wakeup
+ * to it, and write() and read() just return EAGAIN.
+ */
+static void
+server_event(es, ev)
+	evsource_t	*es;
+	port_event_t	*ev;
+{
+server_t	*sr = (server_t *) es;
+
+	if (sr->sr_state == SR_STOPPED)
+		return;
+
+	if (ev->portev_source == PORT_SOURCE_TIMER) {
+		server_handle_timer(sr);
 		return;
+	}
+
+	switch (sr->sr_state) {
+	case SR_CONNECT:
+	case SR_WRITE:
+		if (!(ev->portev_events & (POLLOUT | POLLERR | POLLHUP)))
+			return;
+		break;
+
+	case SR_READ:
+		if (!(ev->portev_events & (POLLIN | POLLERR | POLLHUP)))
+			return;
+		break;
 
-	default: /* Success */
-		server_up(sr);
+	default:
 		return;
 	}
+
+	if ((int) ev->portev_object != sr->sr_socket)
+		return;
+
+	server_handle_fd(sr);
 }
 
 /*
@@ -401,15 +1627,50 @@ server_handle_timer(sr)
 		 * check.
 		 */
 	case SR_IDLE:
+		/*
+		 * If other instances check it for us, our old verdict
+		 * is stale, so it stops counting, and if we take it back
+		 * our first check decides, as at startup.  But until one
+		 * of them has told us its own verdict, we keep checking,
+		 * so the server isn't left with none.  We look again each
+		 * interval, in case they've gone.
+		 */
+		if (!gossip_mine(sr) && gossip_covered(sr)) {
+			if (sr->sr_checked) {
+				sr->sr_checked = 0;
+				sr->sr_healthy = 0;
+				sr->sr_nsucc = sr->sr_nfail = 0;
+				gossip_changed(sr);
+				server_update(sr, 0);
+			}
+			server_schedule_check(sr);
+			break;
+		}
 		server_start_connect_check(sr);
 		break;
 
 		/*
-		 * If the server is currently connecting or reading,
-		 * the operation timed out.
+		 * Already waiting for a slot, or being freed; nothing to do.
+		 */
+	case SR_QUEUED:
+	case SR_STOPPED:
+		break;
+
+		/*
+		 * If the server is currently connecting, writing or reading,
+		 * the operation timed out, unless this is the timer for
+		 * the next check, which fired just before a reported
+		 * failure started this one early.
 		 */
 	case SR_CONNECT:
+	case SR_WRITE:
 	case SR_READ:
+		if (gethrtime() < sr->sr_deadline)
+			break;
+		WITA_PROBE_TIMEOUT(sr->sr_name, sr->sr_address,
+				(char *) sr->sr_port,
+				sr->sr_state == SR_CONNECT ? "connect" :
+				sr->sr_state == SR_WRITE ? "write" : "read");
 		server_down(sr, ETIMEDOUT);
 		break;
 	}
@@ -422,41 +1683,80 @@ void
 server_handle_fd(sr)
 	server_t	*sr;
 {
-int		 error;
-size_t		 errlen = sizeof error;
-
 	assert(sr);
-	assert(sr->sr_state == SR_CONNECT ||
+	assert(sr->sr_state == SR_CONNECT || sr->sr_state == SR_WRITE ||
 		sr->sr_state == SR_READ);
 
-	if (getsockopt(sr->sr_socket, SOL_SOCKET, SO_ERROR, &error, &errlen) == -1) {
-		syslog(LOG_ERR, "%s[%s]:%s: server_handle_fd: cannot retrieve socket error: %m",
-				sr->sr_name, sr->sr_address, sr->sr_port);
-		server_cancel_check(sr);
-		return;
-	}
-
-	if (error != 0) {
-		server_down(sr, error);
-		return;
-	}
-
 	/*
-	 * No error.  If we're in SR_CONNECT, start a read check.
-	 * If we're in SR_READ, the server must be up.
+	 * A failed connect is reported by write() or read() itself.
 	 */
-	if (sr->sr_state == SR_CONNECT) 
+	if (sr->sr_state == SR_READ)
 		server_start_read_check(sr);
 	else
-		server_up(sr);
+		server_connected(sr);
+}
+
+/*
+ * Take back a server that new_server() has only just made, with all its
+ * addresses, before it's in any group or has been checked.  Nothing
+ * else can have been added to conf since, so its addresses are the last
+ * of conf's servers.
+ */
+void
+forget_server(conf, first)
+	config_t	*conf;
+	server_t	*first;
+{
+server_t	**pp, *sr, *next;
+int		  n = 0;
+
+	for (pp = &conf->hosthash[server_hash(first->sr_spec) &
+			(conf->hashsize - 1)];
+	     *pp != first; pp = &(*pp)->sr_hashnext)
+		;
+	*pp = first->sr_hashnext;
+
+	for (pp = &conf->targethash[target_hash(first->sr_target,
+			strlen(first->sr_target)) & (conf->hashsize - 1)];
+	     *pp != first; pp = &(*pp)->sr_targetnext)
+		;
+	*pp = first->sr_targetnext;
+
+	for (sr = first; sr; sr = sr->sr_nextaddr) {
+		for (pp = &conf->addrhash[server_hash(sr->sr_address) &
+				(conf->hashsize - 1)];
+		     *pp != sr; pp = &(*pp)->sr_addrnext)
+			;
+		*pp = sr->sr_addrnext;
+	}
+	conf->nhosts--;
+
+	for (sr = first; sr; sr = sr->sr_nextaddr)
+		n++;
+	assert(first->sr_index == conf->nservers - n);
+	conf->nservers -= n;
+
+	for (sr = first; sr; sr = next) {
+		next = sr->sr_nextaddr;
+		assert(sr->sr_ngroups == 0);
+		free_server(sr);
+	}
 }
 
 void
 free_server(sr)
 	server_t	*sr;
 {
+	if (sr == NULL)
+		return;
+
+	free(sr->sr_spec);
 	free(sr->sr_name);
 	free(sr->sr_address);
-	(void) timer_delete(sr->sr_timer);
+	free(sr->sr_target);
+	free(sr->sr_groups);
+	free(sr->sr_buf);
+	if (sr->sr_state != SR_STOPPED)
+		(void) timer_delete(sr->sr_timer);
 	free(sr);
 }
@@ -0,0 +1,906 @@
+/* Copyright (c) 2009 River Tarnell <river@loreley.flyingparchment.org.uk>. */
+/*
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely. This software is provided 'as-is', without any express or implied
+ * warranty.
+ */
+
+/*
+ * witasim: run wita's checks against a simulated farm, on a virtual
+ * clock, to see how the scheduler and server state machine behave with
+ * more servers, or over longer, than farmbench can manage.
+ *
+ * witasim is built from the same sources as wita with -DWITA_SIM, which
+ * points server.c's timers, sockets and port associations here (see
+ * sim.h) and makes gethrtime() return virtual time.  Everything else,
+ * from loading the configuration to rise/fall, dampening and the probe
+ * queue, is wita's own code.  Events are handled in order of virtual
+ * time, and the clock jumps straight to the next one, so an hour of
+ * checks takes as long as the events in it take to handle.
+ *
+ * The farm is n servers, 10.0.0.1 upwards, in groups "g0", "g1", ...  As
+ * in farmbench, each server behaves in one of four ways:
+ *
+ *	greet		accepts and sends a byte (or what the probe
+ *			expects); the only way to be up
+ *	silent		accepts and says nothing
+ *	refuse		refuses the connection
+ *	blackhole	never answers the connection
+ *
+ * A check sees how its server was behaving when it connected.  Each
+ * packet takes half a round trip, which is -l milliseconds give or take
+ * half, at random.  Everything starts out greeting, and changes on a
+ * schedule (-f, in farmbench's format, with times counted from when wita
+ * first has every server up) or at random (-k, -i and -b).
+ *
+ * It reports, for the -t seconds after startup:
+ *
+ *	- detection latency: from a server changing to wita changing its
+ *	  state, as percentiles, and how many changes wita never saw or
+ *	  that were undone before it did
+ *	- checks, by result, and per second
+ *	- state changes wita made that weren't called for (flaps)
+ *	- answer churn: how many times groups' answers changed
+ *
+ * Random numbers come from the seed (-r) alone, so the same options
+ * always give the same report, apart from the last line, which says how
+ * fast the simulation ran.
+ *
+ * Options:
+ *
+ *	-n <n>		number of servers (10000)
+ *	-g <n>		servers per group (50, at most 60)
+ *	-t <secs>	how long to run after startup (600)
+ *	-f <file>	schedule of changes
+ *	-k <n>		servers to flip at random each interval
+ *	-i <secs>	interval between random flips (10)
+ *	-b <behaviour>	what flipped servers do: silent, refuse,
+ *			blackhole or mixed (mixed)
+ *	-l <ms>		round trip time (1)
+ *	-e <line>	add a line to the configuration, e.g.
+ *			-e "set fall 1" (may be repeated)
+ *	-r <seed>	random seed (1)
+ *	-v		log everything wita would (otherwise, only errors)
+ *
+ * There's no descriptor limit to derive maxprobes from, so it's 1024
+ * unless set with -e.  A probe with send= is answered a round trip after
+ * its request, with its expect= bytes; one that only has expect-re= will
+ * fail.
+ */
+
+#include	<sys/types.h>
+#include	<sys/socket.h>
+#include	<netinet/in.h>
+#include	<arpa/inet.h>
+
+#include	<stdlib.h>
+#include	<stdio.h>
+#include	<string.h>
+#include	<strings.h>
+#include	<errno.h>
+#include	<unistd.h>
+#include	<syslog.h>
+#include	<assert.h>
+#include	<port.h>
+
+#include	"wita.h"
+#include	"bench.h"
+#define	SIM_IMPL
+#include	"sim.h"
+
+#define	BASEADDR	0x0a000001	/* 10.0.0.1, the first server */
+#define	MAXGROUP	60		/* So a group's line fits in 1024 bytes */
+#define	MAXEXTRA	32		/* -e lines */
+#define	STARTUP_MAX	((hrtime_t) 3600 * NANOSEC)
+#define	NEVER		((hrtime_t) -1)
+#define	SIM_FDBASE	(1 << 20)	/* Our sockets, so they look like fds */
+
+/*
+ * A simulated server.
+ */
+typedef struct host {
+	behaviour_t	 h_behaviour;
+	int		 h_seen;	/* Up, as far as wita has it */
+	int		 h_known;	/* Has wita decided at all? */
+	hrtime_t	 h_changed;	/* When it changed, if wita hasn't seen it */
+} host_t;
+
+/*
+ * A timer made by timer_create().  Setting or deleting it makes any
+ * expiry already in the event queue stale.
+ */
+typedef struct simtimer {
+	evsource_t	*st_es;		/* Where its events go */
+	unsigned	 st_gen;
+	hrtime_t	 st_when;	/* When it fires, or 0 if it isn't set */
+	int		 st_free;	/* Deleted; next free one in st_nextfree */
+	int		 st_nextfree;
+} simtimer_t;
+
+/*
+ * A socket made by socket(), for a check.  Closing it makes its events
+ * stale.
+ */
+typedef struct simsock {
+	int		 ss_host;	/* Which server it's connected to, or -1 */
+	int		 ss_refused;	/* Connecting gets ECONNREFUSED */
+	hrtime_t	 ss_connected;	/* When connect() completes, or NEVER */
+	hrtime_t	 ss_reply;	/* When the reply arrives, or NEVER */
+	char const	*ss_data;	/* The reply */
+	size_t		 ss_len, ss_nread;
+	evsource_t	*ss_es;		/* From port_associate() */
+	int		 ss_events;
+	unsigned	 ss_gen;
+	int		 ss_nextfree;	/* If closed, the next closed one */
+} simsock_t;
+
+/*
+ * Something due to happen: a timer expiring, or a socket becoming ready.
+ */
+#define	SE_TIMER	0
+#define	SE_FD		1
+
+typedef struct simev {
+	hrtime_t	 se_when;
+	uint64_t	 se_seq;	/* Ties go in the order they were made */
+	int		 se_kind;
+	int		 se_id;		/* Timer or socket */
+	unsigned	 se_gen;	/* Stale if it's moved on since */
+} simev_t;
+
+static int		 nservers = 10000, groupsize = 50, duration = 600;
+static int		 nflip = 0, flipinterval = 10, rttms = 1;
+static behaviour_t	 flipto = B_MIXED;
+static char const	*extra[MAXEXTRA];
+static int		 nextra;
+
+static host_t		*hosts;
+static schedule_t	*sched;
+static int		 nsched;
+
+static hrtime_t		 simnow = (hrtime_t) 1000 * NANOSEC;
+static uint32_t		 rng;
+
+static simtimer_t	*timers;
+static int		 ntimers, timersize, timerfree = -1;
+static simsock_t	*socks;
+static int		 nsocks, socksize, sockfree = -1;
+static simev_t		*heap;
+static int		 nheap, heapsize;
+static uint64_t		 nextseq, nevents;
+
+/* Results */
+static int		 nup;		/* Servers wita has up */
+static int		 ready;		/* Every server has been up */
+static hrtime_t		*lat;		/* Detection latencies */
+static int		 nlat, latsize, nmissed, nundone, nflips, nspurious;
+
+static void	 usage(void);
+static void	 load_farm(void);
+static void	 set_behaviour(host_t *, behaviour_t);
+static void	 saw(server_t *);
+static void	 run_until(hrtime_t);
+static void	 push(int, int, unsigned, hrtime_t);
+static void	 pop(simev_t *);
+static int	 evcmp(simev_t const *, simev_t const *);
+static simsock_t *getsock(int);
+static hrtime_t	 halfrtt(void);
+static uint32_t	 rnd(void);
+static uint64_t	 nchanges(void);
+
+int	 port;		/* Not used, but server.c refers to it */
+
+int
+main(argc, argv)
+	char	**argv;
+{
+int		 c, i, s = 0, verbose = 0;
+unsigned	 seed = 1;
+char const	*schedfile = NULL;
+hrtime_t	 start, end, nextflip, wall;
+uint64_t	 probes0[NPROBE_RESULTS], nprobes, changes0;
+
+	while ((c = getopt(argc, argv, "n:g:t:f:k:i:b:l:e:r:v")) != -1) {
+		switch (c) {
+		case 'n':	nservers = atoi(optarg); break;
+		case 'g':	groupsize = atoi(optarg); break;
+		case 't':	duration = atoi(optarg); break;
+		case 'f':	schedfile = optarg; break;
+		case 'k':	nflip = atoi(optarg); break;
+		case 'i':	flipinterval = atoi(optarg); break;
+		case 'b':	flipto = bparse("witasim", optarg); break;
+		case 'l':	rttms = atoi(optarg); break;
+		case 'r':	seed = (unsigned) strtoul(optarg, NULL, 10); break;
+		case 'v':	verbose = 1; break;
+		case 'e':
+			if (nextra == MAXEXTRA)
+				usage();
+			extra[nextra++] = optarg;
+			break;
+		default:	usage();
+		}
+	}
+
+	if (optind != argc || nservers < 1 || nservers > 0xfffffe ||
+	    groupsize < 1 || groupsize > MAXGROUP || duration < 1 ||
+	    nflip < 0 || nflip > nservers || flipinterval < 1 || rttms < 0 ||
+	    flipto == B_GREET)
+		usage();
+
+	if (schedfile)
+		sched = read_schedule("witasim", schedfile, "server",
+				nservers, &nsched);
+
+	openlog("witasim", LOG_PID, LOG_DAEMON);
+	if (!verbose)
+		(void) setlogmask(LOG_UPTO(LOG_ERR));
+	rng = seed ? seed : 1;
+
+	if ((hosts = calloc(nservers, sizeof(*hosts))) == NULL) {
+		(void) fprintf(stderr, "witasim: out of memory\n");
+		return 1;
+	}
+
+	wall = (gethrtime)();
+	load_farm();
+	(void) printf("%d servers, %d per group, seed %u\n",
+			nservers, groupsize, seed);
+
+	/*
+	 * As in main.c: start the first check for each server, and wait
+	 * for wita to find the whole farm up.
+	 */
+	start = simnow;
+	for (i = 0; i < curconf->nservers; i++)
+		server_start_connect_check(curconf->servers[i]);
+
+	while (nup < nservers) {
+		if (nheap == 0 || heap[0].se_when - start > STARTUP_MAX) {
+			(void) fprintf(stderr, "witasim: only %d of %d servers "
+					"up after %d seconds\n", nup, nservers,
+					(int) (STARTUP_MAX / NANOSEC));
+			return 1;
+		}
+		run_until(heap[0].se_when);
+	}
+	ready = 1;
+	start = simnow;
+	(void) printf("all servers up after %.2fs\n",
+			(double) (start - (hrtime_t) 1000 * NANOSEC) / NANOSEC);
+
+	(void) memcpy(probes0, metrics.m_probes, sizeof probes0);
+	changes0 = nchanges();
+
+	nextflip = nflip ? start + (hrtime_t) flipinterval * NANOSEC : NEVER;
+	end = start + (hrtime_t) duration * NANOSEC;
+
+	for (;;) {
+	hrtime_t	next = end;
+
+		if (s < nsched && start + sched[s].ev_when < next)
+			next = start + sched[s].ev_when;
+		if (nextflip != NEVER && nextflip < next)
+			next = nextflip;
+
+		run_until(next);
+		if (simnow >= end)
+			break;
+
+		while (s < nsched && start + sched[s].ev_when <= simnow) {
+			for (i = sched[s].ev_first; i <= sched[s].ev_last; i++)
+				set_behaviour(&hosts[i], sched[s].ev_behaviour);
+			s++;
+		}
+
+		if (nextflip != NEVER && simnow >= nextflip) {
+			for (i = 0; i < nflip; i++) {
+			host_t	*h = &hosts[rnd() % nservers];
+				if (h->h_behaviour != B_GREET)
+					set_behaviour(h, B_GREET);
+				else if (flipto == B_MIXED)
+					set_behaviour(h, B_SILENT + rnd() % 3);
+				else
+					set_behaviour(h, flipto);
+			}
+			nextflip += (hrtime_t) flipinterval * NANOSEC;
+		}
+	}
+	wall = (gethrtime)() - wall;
+
+	for (i = 0; i < nservers; i++)
+		if (hosts[i].h_changed)
+			nmissed++;
+
+	(void) printf("%d changes: %d seen, %d not seen, %d undone first\n",
+			nflips, nlat, nmissed, nundone);
+	if (nlat > 0) {
+		qsort(lat, nlat, sizeof(*lat), hrcmp);
+#define	PCT(p)	((double) lat[(int) ((nlat - 1) * (p))] / NANOSEC)
+		(void) printf("detection: p50 %.2fs p90 %.2fs p99 %.2fs "
+				"max %.2fs\n",
+				PCT(0.5), PCT(0.9), PCT(0.99), PCT(1.0));
+#undef	PCT
+	}
+
+	nprobes = 0;
+	for (i = 0; i < NPROBE_RESULTS; i++)
+		nprobes += metrics.m_probes[i] - probes0[i];
+	(void) printf("checks: %llu (%llu ok, %llu failed, %llu timed out), "
+			"%.0f/s\n", (unsigned long long) nprobes,
+			(unsigned long long) (metrics.m_probes[PROBE_OK] -
+				probes0[PROBE_OK]),
+			(unsigned long long) (metrics.m_probes[PROBE_FAIL] -
+				probes0[PROBE_FAIL]),
+			(unsigned long long) (metrics.m_probes[PROBE_TIMEOUT] -
+				probes0[PROBE_TIMEOUT]),
+			(double) nprobes / duration);
+	(void) printf("flaps: %d state changes not called for\n", nspurious);
+	(void) printf("answer changes: %llu in %d groups, %.2f per group "
+			"per minute\n", (unsigned long long) (nchanges() - changes0),
+			curconf->ngroups, (double) (nchanges() - changes0) * 60 /
+			curconf->ngroups / duration);
+	(void) printf("simulated %.0fs in %.2fs (%.0fx), %llu events\n",
+			(double) (simnow - (hrtime_t) 1000 * NANOSEC) / NANOSEC,
+			(double) wall / NANOSEC,
+			(double) (simnow - (hrtime_t) 1000 * NANOSEC) / wall,
+			(unsigned long long) nevents);
+	return 0;
+}
+
+static void
+usage()
+{
+	(void) fprintf(stderr, "usage: witasim [-n servers] [-g groupsize] "
+			"[-t secs] [-f schedule]\n"
+			"\t[-k flips] [-i secs] [-b behaviour] [-l rtt-ms] "
+			"[-e config-line]\n"
+			"\t[-r seed] [-v]\n");
+	exit(1);
+}
+
+/*
+ * Write the farm's configuration and load it, as wita would.
+ */
+static void
+load_farm()
+{
+char		 path[] = "/tmp/witasimXXXXXX";
+FILE		*f;
+int		 fd, i;
+uint32_t	 a;
+
+	if ((fd = mkstemp(path)) == -1 || (f = fdopen(fd, "w")) == NULL) {
+		perror("witasim: mkstemp");
+		exit(1);
+	}
+
+	(void) fprintf(f, "set maxprobes 1024\n");
+	for (i = 0; i < nextra; i++)
+		(void) fprintf(f, "%s\n", extra[i]);
+
+	for (i = 0; i < nservers; i++) {
+		a = BASEADDR + i;
+		if (i % groupsize == 0)
+			(void) fprintf(f, "%sg%d", i ? "\n" : "", i / groupsize);
+		(void) fprintf(f, " %u.%u.%u.%u", (unsigned) (a >> 24),
+				(unsigned) (a >> 16) & 0xff,
+				(unsigned) (a >> 8) & 0xff, (unsigned) a & 0xff);
+	}
+	(void) fputc('\n', f);
+
+	if (fclose(f) == EOF) {
+		perror(path);
+		exit(1);
+	}
+
+	i = load_configuration(path);
+	(void) unlink(path);
+	if (i == -1) {
+		(void) fprintf(stderr, "witasim: cannot load configuration\n");
+		exit(1);
+	}
+}
+
+/*
+ * Change what a server does from now on.
+ */
+static void
+set_behaviour(h, b)
+	host_t		*h;
+	behaviour_t	 b;
+{
+int	wasup = h->h_behaviour == B_GREET;
+
+	h->h_behaviour = b;
+	if (wasup == (b == B_GREET))
+		return;
+
+	nflips++;
+	if (h->h_changed) {
+		/* Changed back before wita noticed. */
+		h->h_changed = 0;
+		nundone++;
+	} else if (h->h_known && h->h_seen != (b == B_GREET))
+		h->h_changed = simnow;
+}
+
+/*
+ * See whether wita has changed its mind about a server.
+ */
+static void
+saw(sr)
+	server_t	*sr;
+{
+host_t	*h;
+
+	h = &hosts[ntohl(((struct sockaddr_in *) &sr->sr_sockaddr)->sin_addr.s_addr)
+			- BASEADDR];
+	if (h->h_known && h->h_seen == sr->sr_online)
+		return;
+
+	nup += sr->sr_online - (h->h_known && h->h_seen);
+	h->h_known = 1;
+	h->h_seen = sr->sr_online;
+
+	if (h->h_changed && h->h_seen == (h->h_behaviour == B_GREET)) {
+		if (nlat == latsize) {
+			latsize = latsize ? latsize * 2 : 1024;
+			if ((lat = realloc(lat, latsize * sizeof(*lat))) == NULL) {
+				(void) fprintf(stderr, "witasim: out of memory\n");
+				exit(1);
+			}
+		}
+		lat[nlat++] = simnow - h->h_changed;
+		h->h_changed = 0;
+	} else if (ready && h->h_seen != (h->h_behaviour == B_GREET))
+		nspurious++;
+}
+
+/*
+ * Handle every event due before until, and leave the clock at until.
+ * Only servers get events, and a server's state only changes when it
+ * gets one, so that's when we look at it.
+ */
+static void
+run_until(until)
+	hrtime_t	until;
+{
+simev_t		 se;
+port_event_t	 pe;
+evsource_t	*es;
+simsock_t	*ss;
+
+	while (nheap > 0 && heap[0].se_when <= until) {
+		pop(&se);
+		simnow = se.se_when;
+
+		bzero(&pe, sizeof(pe));
+		if (se.se_kind == SE_TIMER) {
+			if (timers[se.se_id].st_gen != se.se_gen)
+				continue;
+			timers[se.se_id].st_when = 0;
+			es = timers[se.se_id].st_es;
+			pe.portev_source = PORT_SOURCE_TIMER;
+			pe.portev_object = (uintptr_t) se.se_id;
+		} else {
+			ss = &socks[se.se_id];
+			if (ss->ss_gen != se.se_gen)
+				continue;
+			ss->ss_gen++;	/* One event per association */
+			es = ss->ss_es;
+			pe.portev_source = PORT_SOURCE_FD;
+			pe.portev_object = (uintptr_t) (SIM_FDBASE + se.se_id);
+			pe.portev_events = ss->ss_events;
+		}
+		pe.portev_user = es;
+
+		nevents++;
+		es->es_handler(es, &pe);
+		saw((server_t *) es);
+		config_reap();
+		wlog_flush();
+		zone_serial_done();
+	}
+
+	simnow = until;
+}
+
+/*
+ * The event queue is a binary heap on (se_when, se_seq).
+ */
+static void
+push(kind, id, gen, when)
+	hrtime_t	when;
+	unsigned	gen;
+{
+int	i, parent;
+simev_t	se;
+
+	if (nheap == heapsize) {
+		heapsize = heapsize ? heapsize * 2 : 4096;
+		if ((heap = realloc(heap, heapsize * sizeof(*heap))) == NULL) {
+			(void) fprintf(stderr, "witasim: out of memory\n");
+			exit(1);
+		}
+	}
+
+	se.se_when = when;
+	se.se_seq = nextseq++;
+	se.se_kind = kind;
+	se.se_id = id;
+	se.se_gen = gen;
+
+	for (i = nheap++; i > 0; i = parent) {
+		parent = (i - 1) / 2;
+		if (evcmp(&heap[parent], &se) <= 0)
+			break;
+		heap[i] = heap[parent];
+	}
+	heap[i] = se;
+}
+
+static void
+pop(se)
+	simev_t	*se;
+{
+int	i, child;
+simev_t	last;
+
+	*se = heap[0];
+	last = heap[--nheap];
+
+	for (i = 0; (child = 2 * i + 1) < nheap; i = child) {
+		if (child + 1 < nheap && evcmp(&heap[child + 1], &heap[child]) < 0)
+			child++;
+		if (evcmp(&last, &heap[child]) <= 0)
+			break;
+		heap[i] = heap[child];
+	}
+	heap[i] = last;
+}
+
+static int
+evcmp(a, b)
+	simev_t const	*a, *b;
+{
+	if (a->se_when != b->se_when)
+		return a->se_when < b->se_when ? -1 : 1;
+	return a->se_seq < b->se_seq ? -1 : a->se_seq > b->se_seq;
+}
+
+/*
+ * Half a round trip: -l milliseconds give or take half, halved.
+ */
+static hrtime_t
+halfrtt()
+{
+hrtime_t	rtt = (hrtime_t) rttms * MICROSEC;
+
+	if (rtt == 0)
+		return 0;
+	return (rtt / 2 + (hrtime_t) (rnd() % (uint32_t) (rtt + 1))) / 2;
+}
+
+/*
+ * xorshift32: small, fast, and the same everywhere.
+ */
+static uint32_t
+rnd()
+{
+	rng ^= rng << 13;
+	rng ^= rng >> 17;
+	rng ^= rng << 5;
+	return rng;
+}
+
+static uint64_t
+nchanges()
+{
+uint64_t	n = 0;
+int		i;
+
+	for (i = 0; i < curconf->ngroups; i++)
+		n += curconf->groups[i]->gr_nchanges;
+	return n;
+}
+
+/*
+ * The virtual clock.
+ */
+hrtime_t
+sim_gethrtime()
+{
+	return simnow;
+}
+
+/*
+ * Timers.  server.c only uses one-shot relative timers, whose events go
+ * to the user pointer in the port_notify_t.
+ */
+int
+sim_timer_create(clk, ev, tp)
+	clockid_t	 clk;
+	struct sigevent	*ev;
+	timer_t		*tp;
+{
+int	i;
+
+	if (timerfree != -1) {
+		i = timerfree;
+		timerfree = timers[i].st_nextfree;
+	} else {
+		if (ntimers == timersize) {
+			timersize = timersize ? timersize * 2 : 1024;
+			if ((timers = realloc(timers,
+					timersize * sizeof(*timers))) == NULL) {
+				errno = EAGAIN;
+				return -1;
+			}
+		}
+		i = ntimers++;
+		timers[i].st_gen = 0;
+	}
+
+	timers[i].st_es = ((port_notify_t *) ev->sigev_value.sival_ptr)->portnfy_user;
+	timers[i].st_gen++;
+	timers[i].st_when = 0;
+	timers[i].st_free = 0;
+	*tp = (timer_t) (uintptr_t) i;
+	return 0;
+}
+
+int
+sim_timer_settime(t, flags, value, ovalue)
+	timer_t				 t;
+	int				 flags;
+	struct itimerspec const		*value;
+	struct itimerspec		*ovalue;
+{
+simtimer_t	*st = &timers[(int) (uintptr_t) t];
+
+	assert(!st->st_free && flags == 0 && ovalue == NULL);
+
+	st->st_gen++;
+	st->st_when = 0;
+	if (value->it_value.tv_sec == 0 && value->it_value.tv_nsec == 0)
+		return 0;
+
+	st->st_when = simnow + (hrtime_t) value->it_value.tv_sec * NANOSEC +
+			value->it_value.tv_nsec;
+	push(SE_TIMER, (int) (uintptr_t) t, st->st_gen, st->st_when);
+	return 0;
+}
+
+int
+sim_timer_gettime(t, value)
+	timer_t			 t;
+	struct itimerspec	*value;
+{
+simtimer_t	*st = &timers[(int) (uintptr_t) t];
+hrtime_t	 left;
+
+	assert(!st->st_free);
+
+	bzero(value, sizeof(*value));
+	if (st->st_when == 0)
+		return 0;
+	left = st->st_when - simnow;
+	value->it_value.tv_sec = left / NANOSEC;
+	value->it_value.tv_nsec = left % NANOSEC;
+	return 0;
+}
+
+int
+sim_timer_delete(t)
+	timer_t	t;
+{
+int	i = (int) (uintptr_t) t;
+
+	assert(!timers[i].st_free);
+	timers[i].st_gen++;
+	timers[i].st_free = 1;
+	timers[i].st_nextfree = timerfree;
+	timerfree = i;
+	return 0;
+}
+
+/*
+ * Sockets.
+ */
+static simsock_t *
+getsock(fd)
+{
+	if (fd < SIM_FDBASE || fd - SIM_FDBASE >= nsocks ||
+	    socks[fd - SIM_FDBASE].ss_nextfree != -2) {
+		errno = EBADF;
+		return NULL;
+	}
+	return &socks[fd - SIM_FDBASE];
+}
+
+int
+sim_socket(domain, type, protocol)
+{
+int	i;
+
+	if (sockfree != -1) {
+		i = sockfree;
+		sockfree = socks[i].ss_nextfree;
+	} else {
+		if (nsocks == socksize) {
+			socksize = socksize ? socksize * 2 : 1024;
+			if ((socks = realloc(socks, socksize * sizeof(*socks))) == NULL) {
+				errno = ENOBUFS;
+				return -1;
+			}
+		}
+		i = nsocks++;
+		socks[i].ss_gen = 0;
+	}
+
+	socks[i].ss_nextfree = -2;	/* In use */
+	socks[i].ss_host = -1;
+	return SIM_FDBASE + i;
+}
+
+int
+sim_ioctl(fd, req, arg)
+	int	*arg;
+{
+	return getsock(fd) ? 0 : -1;
+}
+
+/*
+ * Connecting always goes on in the background, and how it ends is
+ * decided now, by how the server is behaving.
+ */
+int
+sim_connect(fd, sa, salen)
+	struct sockaddr const	*sa;
+	socklen_t		 salen;
+{
+simsock_t	*ss;
+host_t		*h;
+server_t	*sr;
+int		 i;
+hrtime_t	 there;
+
+	if ((ss = getsock(fd)) == NULL)
+		return -1;
+
+	i = (int) (ntohl(((struct sockaddr_in const *) sa)->sin_addr.s_addr) -
+			BASEADDR);
+	h = &hosts[i];
+	sr = curconf->servers[i];
+
+	ss->ss_host = i;
+	ss->ss_refused = h->h_behaviour == B_REFUSE;
+	ss->ss_connected = ss->ss_reply = NEVER;
+	ss->ss_nread = 0;
+
+	if (sr->sr_probe && sr->sr_probe->pr_expectlen > 0) {
+		ss->ss_data = sr->sr_probe->pr_expect;
+		ss->ss_len = sr->sr_probe->pr_expectlen;
+	} else {
+		ss->ss_data = "J";
+		ss->ss_len = 1;
+	}
+
+	there = simnow + halfrtt();
+	switch (h->h_behaviour) {
+	case B_GREET:
+		ss->ss_connected = there + halfrtt();
+		if (sr->sr_probe == NULL || sr->sr_probe->pr_sendlen == 0)
+			ss->ss_reply = ss->ss_connected;
+		break;
+
+	case B_SILENT:
+	case B_REFUSE:
+		ss->ss_connected = there + halfrtt();
+		break;
+
+	default:
+		break;
+	}
+
+	errno = EINPROGRESS;
+	return -1;
+}
+
+ssize_t
+sim_read(fd, buf, len)
+	void	*buf;
+	size_t	 len;
+{
+simsock_t	*ss;
+
+	if ((ss = getsock(fd)) == NULL)
+		return -1;
+
+	if (ss->ss_refused && ss->ss_connected <= simnow) {
+		errno = ECONNREFUSED;
+		return -1;
+	}
+
+	if (ss->ss_reply == NEVER || ss->ss_reply > simnow) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	/* All of it, then end of file. */
+	if (len > ss->ss_len - ss->ss_nread)
+		len = ss->ss_len - ss->ss_nread;
+	(void) memcpy(buf, ss->ss_data + ss->ss_nread, len);
+	ss->ss_nread += len;
+	return (ssize_t) len;
+}
+
+ssize_t
+sim_write(fd, buf, len)
+	void const	*buf;
+	size_t		 len;
+{
+simsock_t	*ss;
+
+	if ((ss = getsock(fd)) == NULL)
+		return -1;
+
+	if (ss->ss_refused) {
+		errno = ECONNREFUSED;
+		return -1;
+	}
+
+	if (ss->ss_connected == NEVER || ss->ss_connected > simnow) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	if (hosts[ss->ss_host].h_behaviour == B_GREET)
+		ss->ss_reply = simnow + 2 * halfrtt();
+	return (ssize_t) len;
+}
+
+int
+sim_close(fd)
+{
+simsock_t	*ss;
+
+	if ((ss = getsock(fd)) == NULL)
+		return -1;
+
+	ss->ss_gen++;
+	ss->ss_nextfree = sockfree;
+	sockfree = fd - SIM_FDBASE;
+	return 0;
+}
+
+/*
+ * Queue an event for when the socket will be ready, if it ever will.
+ */
+int
+sim_port_associate(p, source, object, events, user)
+	int		 p, source, events;
+	uintptr_t	 object;
+	void		*user;
+{
+simsock_t	*ss;
+hrtime_t	 when;
+
+	assert(source == PORT_SOURCE_FD);
+	if ((ss = getsock((int) object)) == NULL)
+		return -1;
+
+	if (events & POLLIN)
+		when = ss->ss_refused ? ss->ss_connected : ss->ss_reply;
+	else
+		when = ss->ss_connected;
+
+	ss->ss_gen++;
+	ss->ss_es = user;
+	ss->ss_events = events;
+	if (when != NEVER)
+		push(SE_FD, (int) object - SIM_FDBASE, ss->ss_gen,
+				when > simnow ? when : simnow);
+	return 0;
+}
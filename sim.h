@@ -0,0 +1,53 @@
+/* Copyright (c) 2009 River Tarnell <river@loreley.flyingparchment.org.uk>. */
+/*
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely. This software is provided 'as-is', without any express or implied
+ * warranty.
+ */
+
+/*
+ * The simulator's side of server.c (see sim.c).  When built with
+ * -DWITA_SIM, server.c's timers, sockets and port associations go to
+ * these instead of the system, and run on the virtual clock.  Nothing
+ * else in server.c changes, so what's simulated is the real check
+ * scheduler and state machine.
+ */
+
+#ifndef	SIM_H
+#define	SIM_H
+
+#include	<sys/types.h>
+#include	<sys/socket.h>
+#include	<signal.h>
+#include	<time.h>
+#include	<port.h>
+
+int	sim_timer_create(clockid_t, struct sigevent *, timer_t *);
+int	sim_timer_settime(timer_t, int, struct itimerspec const *,
+		struct itimerspec *);
+int	sim_timer_gettime(timer_t, struct itimerspec *);
+int	sim_timer_delete(timer_t);
+int	sim_socket(int, int, int);
+int	sim_ioctl(int, int, int *);
+int	sim_connect(int, struct sockaddr const *, socklen_t);
+ssize_t	sim_read(int, void *, size_t);
+ssize_t	sim_write(int, void const *, size_t);
+int	sim_close(int);
+int	sim_port_associate(int, int, uintptr_t, int, void *);
+
+#ifndef	SIM_IMPL
+#define	timer_create(c, e, t)		sim_timer_create(c, e, t)
+#define	timer_settime(t, f, v, o)	sim_timer_settime(t, f, v, o)
+#define	timer_gettime(t, v)		sim_timer_gettime(t, v)
+#define	timer_delete(t)			sim_timer_delete(t)
+#define	socket(d, t, p)			sim_socket(d, t, p)
+#define	ioctl(f, r, a)			sim_ioctl(f, r, a)
+#define	connect(f, a, l)		sim_connect(f, a, l)
+#define	read(f, b, n)			sim_read(f, b, n)
+#define	write(f, b, n)			sim_write(f, b, n)
+#define	close(f)			sim_close(f)
+#define	port_associate(p, s, o, e, u)	sim_port_associate(p, s, o, e, u)
+#endif
+
+#endif	/* !SIM_H */
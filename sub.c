@@ -0,0 +1,298 @@
+/* Copyright (c) 2009 River Tarnell <river@loreley.flyingparchment.org.uk>. */
+/*
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely. This software is provided 'as-is', without any express or implied
+ * warranty.
+ */
+
+/*
+ * Subscriptions.  Instead of polling DNS, a client (say, a connection
+ * pool) can connect to the unix socket given with -s and send
+ *
+ *	sub <name>
+ *
+ * where name is anything that would find a group in a query.  It gets
+ * back the group's current answer straight away, and again every time
+ * it changes, as a line with the name and every server in the answer:
+ *
+ *	sql-s1.wita.example.com 10.0.0.1:3306 10.0.0.2:3306 [2001:db8::1]:3306
+ *
+ * (or just the name, when nothing is up).  "unsub <name>" stops them.
+ * A name that doesn't find a group gets an error, but the subscription
+ * stays, in case a reload adds the group.
+ *
+ * Each group has a list of its subscribers.  When a group's answer
+ * changes, group_changed() calls sub_notify(), which only marks it; the
+ * main loop calls sub_flush() at the end of each batch of events, which
+ * writes one line per changed group to each of its subscribers.  So a
+ * burst of changes to a group costs its subscribers one line, and a
+ * change costs nothing for groups nobody subscribes to.
+ */
+
+#include	<stdlib.h>
+#include	<stdio.h>
+#include	<string.h>
+#include	<strings.h>
+#include	<syslog.h>
+#include	<assert.h>
+
+#include	"wita.h"
+
+#define	SUB_MAXOUT	(256 * 1024)	/* Output a client can have waiting */
+
+typedef struct sub {
+	char		*su_name;	/* Name the client subscribed to */
+	uclient_t	*su_client;
+	group_t		*su_group;	/* Group it found, or NULL */
+	struct sub	*su_gnext;	/* Other subscribers to su_group */
+	struct sub	*su_gprev;
+	struct sub	*su_cnext;	/* The client's other subscriptions */
+	struct sub	*su_anext;	/* All subscriptions */
+	struct sub	*su_aprev;
+} sub_t;
+
+static sub_t	*allsubs;
+static group_t	*dirty_groups;
+
+static void	sub_line(uclient_t *, char *);
+static void	sub_closed(uclient_t *);
+static void	sub_link(sub_t *);
+static void	sub_unlink(sub_t *);
+static void	sub_free(sub_t *);
+static void	sub_send(sub_t *);
+
+/*
+ * Start accepting subscribers on a unix socket.
+ */
+int
+sub_listen(path)
+	char const	*path;
+{
+	if (ulisten(path, sub_line, sub_closed, SUB_MAXOUT) == NULL)
+		return -1;
+
+	syslog(LOG_INFO, "accepting subscriptions on %s", path);
+	return 0;
+}
+
+/*
+ * A command from a subscriber.
+ */
+static void
+sub_line(uc, line)
+	uclient_t	*uc;
+	char		*line;
+{
+char	*cmd, *name, *last;
+sub_t	*su, **sp;
+
+	if ((cmd = strtok_r(line, " \t", &last)) == NULL)
+		return;
+
+	if (strcmp(cmd, "sub") != 0 && strcmp(cmd, "unsub") != 0) {
+		uclient_printf(uc, "error unknown command\n");
+		return;
+	}
+
+	if ((name = strtok_r(NULL, " \t", &last)) == NULL) {
+		uclient_printf(uc, "error missing name\n");
+		return;
+	}
+
+	if (strcmp(cmd, "sub") == 0) {
+		for (su = uc->uc_data; su; su = su->su_cnext)
+			if (strcasecmp(su->su_name, name) == 0)
+				break;
+
+		if (su == NULL) {
+			if ((su = calloc(1, sizeof(*su))) == NULL ||
+			    (su->su_name = strdup(name)) == NULL) {
+				syslog(LOG_ERR, "out of memory");
+				free(su);
+				uclient_close(uc);
+				return;
+			}
+
+			su->su_client = uc;
+			su->su_cnext = uc->uc_data;
+			uc->uc_data = su;
+
+			su->su_anext = allsubs;
+			if (allsubs)
+				allsubs->su_aprev = su;
+			allsubs = su;
+
+			sub_link(su);
+		}
+
+		sub_send(su);
+		return;
+	}
+
+	for (sp = (sub_t **) &uc->uc_data; *sp; sp = &(*sp)->su_cnext)
+		if (strcasecmp((*sp)->su_name, name) == 0) {
+			su = *sp;
+			*sp = su->su_cnext;
+			sub_free(su);
+			return;
+		}
+
+	uclient_printf(uc, "error not subscribed to %s\n", name);
+}
+
+/*
+ * A subscriber went away.
+ */
+static void
+sub_closed(uc)
+	uclient_t	*uc;
+{
+sub_t	*su, *next;
+
+	for (su = uc->uc_data; su; su = next) {
+		next = su->su_cnext;
+		sub_free(su);
+	}
+	uc->uc_data = NULL;
+}
+
+static void
+sub_free(su)
+	sub_t	*su;
+{
+	sub_unlink(su);
+
+	if (su->su_aprev)
+		su->su_aprev->su_anext = su->su_anext;
+	else
+		allsubs = su->su_anext;
+	if (su->su_anext)
+		su->su_anext->su_aprev = su->su_aprev;
+
+	free(su->su_name);
+	free(su);
+}
+
+/*
+ * Find the group for a subscription, and add it to the group's list.
+ */
+static void
+sub_link(su)
+	sub_t	*su;
+{
+group_t	*group;
+
+	su->su_gprev = su->su_gnext = NULL;
+	if ((su->su_group = group = find_group_qname(curconf, su->su_name)) == NULL)
+		return;
+
+	su->su_gnext = group->gr_subs;
+	if (group->gr_subs)
+		group->gr_subs->su_gprev = su;
+	group->gr_subs = su;
+}
+
+/*
+ * Remove a subscription from its group's list.
+ */
+static void
+sub_unlink(su)
+	sub_t	*su;
+{
+	if (su->su_group == NULL)
+		return;
+
+	if (su->su_gprev)
+		su->su_gprev->su_gnext = su->su_gnext;
+	else
+		su->su_group->gr_subs = su->su_gnext;
+	if (su->su_gnext)
+		su->su_gnext->su_gprev = su->su_gprev;
+
+	su->su_group = NULL;
+}
+
+/*
+ * Send a subscriber the group's current answer.
+ */
+static void
+sub_send(su)
+	sub_t	*su;
+{
+server_t	*answer[MAXANSWERS];
+int		 i, n, f;
+
+	if (su->su_group == NULL) {
+		uclient_printf(su->su_client, "error no such group %s\n",
+				su->su_name);
+		return;
+	}
+
+	/*
+	 * The client's output buffer grows as needed, so however big the
+	 * group is, the line goes out whole.
+	 */
+	uclient_printf(su->su_client, "%s", su->su_name);
+	for (f = 0; f < NFAMILIES; f++) {
+		n = group_members(su->su_group, f ? AF_INET6 : AF_INET, answer);
+		for (i = 0; i < n; i++)
+			uclient_printf(su->su_client,
+					f ? " [%s]:%d" : " %s:%d",
+					answer[i]->sr_address,
+					server_portnum(answer[i]));
+	}
+	uclient_printf(su->su_client, "\n");
+}
+
+/*
+ * A group's answer changed; tell its subscribers at the end of the batch.
+ */
+void
+sub_notify(group)
+	group_t	*group;
+{
+	if (group->gr_subdirty)
+		return;
+
+	group->gr_subdirty = 1;
+	group->gr_subnext = dirty_groups;
+	dirty_groups = group;
+}
+
+/*
+ * Send the new answer of every group that changed during this batch.
+ */
+void
+sub_flush()
+{
+group_t	*group;
+sub_t	*su;
+
+	while ((group = dirty_groups) != NULL) {
+		dirty_groups = group->gr_subnext;
+		group->gr_subdirty = 0;
+
+		for (su = group->gr_subs; su; su = su->su_gnext)
+			sub_send(su);
+	}
+}
+
+/*
+ * The configuration was reloaded: find every subscription's group again
+ * (the old groups are about to be freed) and send its answer, which may
+ * well be different.
+ */
+void
+sub_reload()
+{
+sub_t	*su;
+
+	dirty_groups = NULL;
+
+	for (su = allsubs; su; su = su->su_anext) {
+		su->su_group = NULL;	/* The old group's list is going away */
+		sub_link(su);
+		sub_send(su);
+	}
+}
@@ -0,0 +1,394 @@
+/* Copyright (c) 2009 River Tarnell <river@loreley.flyingparchment.org.uk>. */
+/*
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely. This software is provided 'as-is', without any express or implied
+ * warranty.
+ */
+
+/*
+ * Line-oriented unix stream sockets, for the local interfaces that talk
+ * to other programs (see sub.c).  Each listener has a callback that's
+ * given every line a client sends, and clients have an output buffer
+ * that the callbacks append to with uclient_printf().  Output is written
+ * by uclient_flush(), which the main loop calls once per batch of
+ * events, so everything written to a client during a batch goes out in
+ * one write().
+ *
+ * A client whose output buffer grows past the listener's limit isn't
+ * keeping up, and is disconnected rather than letting it use unbounded
+ * memory.  Clients are never freed in the middle of a batch; they're
+ * marked as closing and freed by uclient_flush().
+ */
+
+#include	<sys/types.h>
+#include	<sys/socket.h>
+#include	<sys/filio.h>
+#include	<sys/un.h>
+
+#include	<stdlib.h>
+#include	<stdio.h>
+#include	<stdarg.h>
+#include	<string.h>
+#include	<strings.h>
+#include	<errno.h>
+#include	<unistd.h>
+#include	<syslog.h>
+#include	<assert.h>
+#include	<port.h>
+
+#include	"wita.h"
+
+#define	UCLIENT_OUTINIT	1024	/* Initial size of a client's output buffer */
+
+static void	ulistener_event(evsource_t *, port_event_t *);
+static void	uclient_event(evsource_t *, port_event_t *);
+static void	uclient_dirty(uclient_t *);
+static int	uclient_write(uclient_t *);
+static void	uclient_free(uclient_t *);
+
+/*
+ * Clients with output waiting or closing, for uclient_flush().
+ */
+static uclient_t	*dirty_head;
+
+/*
+ * Listen on a unix socket at path.  line is called for each line a client
+ * sends (without the newline), and closed (if not NULL) just before a
+ * client is freed.  maxout limits a client's output buffer.
+ */
+ulistener_t *
+ulisten(path, line, closed, maxout)
+	char const	*path;
+	void		(*line)(uclient_t *, char *);
+	void		(*closed)(uclient_t *);
+	size_t		 maxout;
+{
+ulistener_t		*ul;
+struct sockaddr_un	 sun;
+int			 on = 1;
+
+	assert(path);
+	assert(line);
+
+	if (strlen(path) >= sizeof sun.sun_path) {
+		syslog(LOG_ERR, "%s: socket path too long", path);
+		return NULL;
+	}
+
+	if ((ul = calloc(1, sizeof(*ul))) == NULL) {
+		syslog(LOG_ERR, "out of memory");
+		return NULL;
+	}
+	ul->ul_ev.es_handler = ulistener_event;
+	ul->ul_line = line;
+	ul->ul_closed = closed;
+	ul->ul_maxout = maxout;
+
+	bzero(&sun, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	(void) strcpy(sun.sun_path, path);
+
+	/* After an upgrade, we already have it, still bound to path. */
+	if ((ul->ul_fd = upgrade_fd("unix", path)) != -1)
+		goto have;
+
+	if ((ul->ul_fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+		syslog(LOG_ERR, "%s: socket: %m", path);
+		free(ul);
+		return NULL;
+	}
+
+	/* A socket left over from last time. */
+	(void) unlink(path);
+
+	if (bind(ul->ul_fd, (struct sockaddr *) &sun, sizeof(sun)) == -1) {
+		syslog(LOG_ERR, "%s: bind: %m", path);
+		goto err;
+	}
+
+	if (listen(ul->ul_fd, 128) == -1) {
+		syslog(LOG_ERR, "%s: listen: %m", path);
+		goto err;
+	}
+	upgrade_keep("unix", path, ul->ul_fd);
+
+have:
+
+	if (ioctl(ul->ul_fd, FIONBIO, &on) == -1) {
+		syslog(LOG_ERR, "%s: ioctl(FIONBIO): %m", path);
+		goto err;
+	}
+
+	if (port_associate(port, PORT_SOURCE_FD, ul->ul_fd, POLLIN, &ul->ul_ev) == -1) {
+		syslog(LOG_ERR, "%s: cannot associate fd: port_associate: %m", path);
+		goto err;
+	}
+
+	return ul;
+
+err:
+	(void) close(ul->ul_fd);
+	free(ul);
+	return NULL;
+}
+
+/*
+ * A client is connecting.
+ */
+static void
+ulistener_event(es, ev)
+	evsource_t	*es;
+	port_event_t	*ev;
+{
+ulistener_t	*ul = (ulistener_t *) es;
+uclient_t	*uc;
+int		 fd, on = 1;
+
+	while ((fd = accept(ul->ul_fd, NULL, NULL)) != -1) {
+		if (ioctl(fd, FIONBIO, &on) == -1 ||
+		    (uc = calloc(1, sizeof(*uc))) == NULL) {
+			syslog(LOG_ERR, "ulistener_event: cannot set up client: %m");
+			(void) close(fd);
+			continue;
+		}
+
+		uc->uc_ev.es_handler = uclient_event;
+		uc->uc_fd = fd;
+		uc->uc_listener = ul;
+
+		if (port_associate(port, PORT_SOURCE_FD, fd, POLLIN, &uc->uc_ev) == -1) {
+			syslog(LOG_ERR, "ulistener_event: cannot associate fd: "
+					"port_associate: %m");
+			(void) close(fd);
+			free(uc);
+		}
+	}
+
+	if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR &&
+	    errno != ECONNABORTED)
+		syslog(LOG_ERR, "ulistener_event: accept: %m");
+
+	if (port_associate(port, PORT_SOURCE_FD, ul->ul_fd, POLLIN, &ul->ul_ev) == -1) {
+		syslog(LOG_ERR, "ulistener_event: cannot associate fd: port_associate: %m");
+		exit(1);
+	}
+}
+
+/*
+ * A client sent something, or can take more output.
+ */
+static void
+uclient_event(es, ev)
+	evsource_t	*es;
+	port_event_t	*ev;
+{
+uclient_t	*uc = (uclient_t *) es;
+ssize_t		 n;
+char		*p, *line;
+
+	if (uc->uc_closing)
+		return;
+
+	if (ev->portev_events & POLLOUT)
+		uclient_dirty(uc);
+
+	if (!(ev->portev_events & (POLLIN | POLLHUP | POLLERR))) {
+		uclient_dirty(uc);
+		return;
+	}
+
+	switch (n = read(uc->uc_fd, uc->uc_in + uc->uc_nin,
+			sizeof uc->uc_in - uc->uc_nin)) {
+	case -1:
+		if (errno == EAGAIN || errno == EINTR)
+			break;
+		/*FALLTHROUGH*/
+	case 0:
+		uclient_close(uc);
+		return;
+
+	default:
+		uc->uc_nin += n;
+		break;
+	}
+
+	/*
+	 * Hand over each complete line.
+	 */
+	line = uc->uc_in;
+	while (!uc->uc_closing &&
+	    (p = memchr(line, '\n', uc->uc_nin - (line - uc->uc_in))) != NULL) {
+		*p = 0;
+		if (p > line && p[-1] == '\r')
+			p[-1] = 0;
+		uc->uc_listener->ul_line(uc, line);
+		line = p + 1;
+	}
+
+	if (uc->uc_closing)
+		return;
+
+	uc->uc_nin -= line - uc->uc_in;
+	(void) memmove(uc->uc_in, line, uc->uc_nin);
+
+	if (uc->uc_nin == sizeof uc->uc_in) {
+		wlog(LOG_WARNING, "client sent a line that was too long");
+		uclient_close(uc);
+		return;
+	}
+
+	/* Listen again (and write any replies) at the end of the batch. */
+	uclient_dirty(uc);
+}
+
+/*
+ * Append to a client's output.
+ */
+void
+uclient_printf(uclient_t *uc, char const *fmt, ...)
+{
+va_list	 ap;
+int	 n;
+size_t	 size;
+char	*newout;
+
+	if (uc->uc_closing)
+		return;
+
+	for (;;) {
+		va_start(ap, fmt);
+		n = vsnprintf(uc->uc_out + uc->uc_nout, uc->uc_outsize - uc->uc_nout,
+				fmt, ap);
+		va_end(ap);
+
+		if (n < 0) {
+			uclient_close(uc);
+			return;
+		}
+
+		if ((size_t) n < uc->uc_outsize - uc->uc_nout)
+			break;
+
+		if (uc->uc_nout + n + 1 > uc->uc_listener->ul_maxout) {
+			syslog(LOG_WARNING, "client is not reading its output; "
+					"disconnecting it");
+			uclient_close(uc);
+			return;
+		}
+
+		size = uc->uc_outsize ? uc->uc_outsize * 2 : UCLIENT_OUTINIT;
+		while (size < uc->uc_nout + n + 1)
+			size *= 2;
+		if (size > uc->uc_listener->ul_maxout)
+			size = uc->uc_listener->ul_maxout;
+
+		if ((newout = realloc(uc->uc_out, size)) == NULL) {
+			syslog(LOG_ERR, "out of memory");
+			uclient_close(uc);
+			return;
+		}
+		uc->uc_out = newout;
+		uc->uc_outsize = size;
+	}
+
+	uc->uc_nout += n;
+	uclient_dirty(uc);
+}
+
+/*
+ * Disconnect a client, once this batch of events is done.
+ */
+void
+uclient_close(uc)
+	uclient_t	*uc;
+{
+	if (uc->uc_closing)
+		return;
+
+	uc->uc_closing = 1;
+	uclient_dirty(uc);
+}
+
+/*
+ * Put a client on the list for uclient_flush().
+ */
+static void
+uclient_dirty(uc)
+	uclient_t	*uc;
+{
+	if (uc->uc_isdirty)
+		return;
+
+	uc->uc_isdirty = 1;
+	uc->uc_dirtynext = dirty_head;
+	dirty_head = uc;
+}
+
+/*
+ * Write out whatever clients have waiting, and free the ones that are
+ * closing.  Called by the main loop after each batch of events.
+ */
+void
+uclient_flush()
+{
+uclient_t	*uc;
+
+	while ((uc = dirty_head) != NULL) {
+		dirty_head = uc->uc_dirtynext;
+		uc->uc_isdirty = 0;
+
+		if (!uc->uc_closing && uclient_write(uc) == -1)
+			uc->uc_closing = 1;
+
+		if (uc->uc_closing) {
+			uclient_free(uc);
+			continue;
+		}
+
+		if (port_associate(port, PORT_SOURCE_FD, uc->uc_fd,
+				POLLIN | (uc->uc_nout ? POLLOUT : 0),
+				&uc->uc_ev) == -1) {
+			syslog(LOG_ERR, "uclient_flush: cannot associate fd: "
+					"port_associate: %m");
+			uclient_free(uc);
+		}
+	}
+}
+
+/*
+ * Write as much of a client's output as it will take.
+ */
+static int
+uclient_write(uc)
+	uclient_t	*uc;
+{
+ssize_t	n;
+
+	while (uc->uc_nout > 0) {
+		if ((n = write(uc->uc_fd, uc->uc_out, uc->uc_nout)) == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			return -1;
+		}
+
+		uc->uc_nout -= n;
+		(void) memmove(uc->uc_out, uc->uc_out + n, uc->uc_nout);
+	}
+
+	return 0;
+}
+
+static void
+uclient_free(uc)
+	uclient_t	*uc;
+{
+	if (uc->uc_listener->ul_closed)
+		uc->uc_listener->ul_closed(uc);
+
+	(void) close(uc->uc_fd);
+	free(uc->uc_out);
+	free(uc);
+}
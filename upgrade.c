@@ -0,0 +1,728 @@
+/* Copyright (c) 2009 River Tarnell <river@loreley.flyingparchment.org.uk>. */
+/*
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely. This software is provided 'as-is', without any express or implied
+ * warranty.
+ */
+
+/*
+ * Upgrading in place.  On SIGUSR2, once the current batch of events is
+ * done, wita writes down its state and execs its own binary again (the
+ * new one, if it's been replaced), with the same arguments and "-U <fd>"
+ * to say where the state is.  The process, and so its pipes to PowerDNS,
+ * carries on; PowerDNS doesn't notice.
+ *
+ * What's carried over:
+ *
+ *  - stdin and stdout, which exec keeps anyway, with any part of a
+ *    query we'd read but not answered, and whether HELO has been done;
+ *  - the sockets we listen on (-l, -r, -g, -s, -C), registered with
+ *    upgrade_keep(), so no query or report is refused in between, and
+ *    the file we're recording to (-R);
+ *  - every server's state: whether it's up, its rise/fall counts, its
+ *    flap penalty, whether it's drained, and when its next check is due;
+ *  - how long each group's answer has been stable (for its TTL), and
+ *    the SOA serial.
+ *
+ * The new process reads the configuration file again, as on SIGHUP, but
+ * takes the addresses the old one had for each server rather than
+ * resolving the names again.  Servers that are still configured pick up
+ * where they were, with their next check when it would have been; checks
+ * that were under way are restarted, spread over the check interval, so
+ * there's no burst of them.  New servers are checked straight away.
+ * Changes made through the control socket, other than draining, are lost,
+ * as they would be on a reload, and so are the control and subscription
+ * sockets' connected clients, which must reconnect.
+ *
+ * The state is a text file, deleted as soon as it's made:
+ *
+ *	wita-state 1
+ *	pdns <running> <n>		then n bytes of input, and a newline
+ *	fd <fd> <kind> <name>
+ *	serial <zone_serial>
+ *	server <spec> <address> <port> <online> <healthy> <checked> <succ>
+ *		<fail> <penalty> <penalty age> <suppressed> <drained> <next>
+ *	group <zone or -> <name> <age> <rotor4> <rotor6> <queries> <changes>
+ *
+ * with times in nanoseconds: ages are before the state was written, and
+ * <next> is after it.
+ *
+ * If the exec fails, we log it and carry on as we were.
+ */
+
+#include	<sys/types.h>
+#include	<sys/socket.h>
+#include	<netinet/in.h>
+#include	<arpa/inet.h>
+
+#include	<netdb.h>
+#include	<stdlib.h>
+#include	<stdio.h>
+#include	<string.h>
+#include	<strings.h>
+#include	<errno.h>
+#include	<fcntl.h>
+#include	<unistd.h>
+#include	<syslog.h>
+
+#include	"wita.h"
+
+#define	STATE_MAGIC	"wita-state 1"
+#define	MAXKEEP		64		/* Sockets we can hand over */
+
+/*
+ * A socket to hand over: ours, or one handed to us.
+ */
+typedef struct keep {
+	char	*kp_kind;
+	char	*kp_name;
+	int	 kp_fd;
+	int	 kp_taken;	/* Claimed with upgrade_fd() */
+} keep_t;
+
+/*
+ * A server's state, as the old process left it.
+ */
+typedef struct saved {
+	char			*sv_spec;
+	char			*sv_address;
+	int			 sv_port;
+	int			 sv_online, sv_healthy, sv_checked;
+	int			 sv_nsucc, sv_nfail;
+	double			 sv_penalty;
+	hrtime_t		 sv_penalty_age;
+	int			 sv_suppressed, sv_drained;
+	hrtime_t		 sv_next;
+	struct addrinfo		 sv_ai;		/* For upgrade_addrs() */
+	struct sockaddr_storage	 sv_ss;
+} saved_t;
+
+typedef struct savedgroup {
+	char		*sg_zone;	/* NULL if it isn't in one */
+	char		*sg_name;
+	hrtime_t	 sg_age;
+	unsigned	 sg_rotor[NFAMILIES];
+	uint64_t	 sg_nqueries, sg_nchanges;
+} savedgroup_t;
+
+static char		**saved_argv;
+static int		  saved_argc;
+static int		  requested;
+
+static keep_t		  keeps[MAXKEEP];
+static int		  nkeeps;
+
+static saved_t		 *saved;
+static int		  nsaved;
+static savedgroup_t	 *savedgroups;
+static int		  nsavedgroups;
+static uint32_t		  saved_serial;
+static hrtime_t		  saved_time;	/* When we read the state */
+
+static int	 write_state(FILE *);
+static int	 read_state(FILE *);
+static int	 read_server(char *);
+static int	 read_group(char *);
+static saved_t	*find_saved(char const *, int);
+static int	 saved_addr(saved_t *);
+static void	 free_saved(void);
+static void	*grow(void *, int, size_t);
+static int	 set_cloexec(void *, int);
+
+/*
+ * Remember how we were started, before getopt() sees the arguments.
+ */
+void
+upgrade_init(argc, argv)
+	char	**argv;
+{
+int	i;
+
+	if ((saved_argv = calloc(argc + 3, sizeof(char *))) == NULL)
+		return;
+
+	/* Any "-U" is from the last upgrade, and the next gets its own. */
+	for (i = 0; i < argc; i++) {
+		if (strcmp(argv[i], "-U") == 0 && i + 1 < argc) {
+			i++;
+			continue;
+		}
+		saved_argv[saved_argc++] = argv[i];
+	}
+}
+
+/*
+ * Asked to upgrade; we will at the end of this batch.
+ */
+void
+upgrade_request()
+{
+	requested = 1;
+}
+
+int
+upgrade_requested()
+{
+	return requested;
+}
+
+/*
+ * fd is a socket we listen on, for kind (such as "dns-udp") and name (as
+ * given on the command line), to hand over when we upgrade.
+ */
+void
+upgrade_keep(kind, name, fd)
+	char const	*kind, *name;
+{
+keep_t	*kp;
+
+	if (nkeeps == MAXKEEP) {
+		syslog(LOG_WARNING, "too many sockets to hand over on upgrade; "
+				"%s %s will be opened again", kind, name);
+		return;
+	}
+
+	kp = &keeps[nkeeps];
+	if ((kp->kp_kind = strdup(kind)) == NULL ||
+	    (kp->kp_name = strdup(name)) == NULL) {
+		free(kp->kp_kind);
+		return;
+	}
+	kp->kp_fd = fd;
+	kp->kp_taken = 1;
+	nkeeps++;
+}
+
+/*
+ * fd is about to be closed; don't hand it over.
+ */
+void
+upgrade_forget(fd)
+{
+int	i;
+
+	for (i = 0; i < nkeeps; i++)
+		if (keeps[i].kp_fd == fd) {
+			free(keeps[i].kp_kind);
+			free(keeps[i].kp_name);
+			keeps[i] = keeps[--nkeeps];
+			return;
+		}
+}
+
+/*
+ * The socket the old process had for kind and name, or -1 if there isn't
+ * one (and the caller should make its own).  It's kept for the next
+ * upgrade too.
+ */
+int
+upgrade_fd(kind, name)
+	char const	*kind, *name;
+{
+int	i;
+
+	for (i = 0; i < nkeeps; i++)
+		if (!keeps[i].kp_taken && strcmp(keeps[i].kp_kind, kind) == 0 &&
+		    strcmp(keeps[i].kp_name, name) == 0) {
+			keeps[i].kp_taken = 1;
+			return keeps[i].kp_fd;
+		}
+	return -1;
+}
+
+/*
+ * Write down our state and exec ourselves.  Only returns if that fails.
+ */
+void
+upgrade_exec()
+{
+FILE		*f;
+char		 fdbuf[16];
+char const	*path;
+int		 statefd;
+
+	requested = 0;
+
+	if (saved_argv == NULL) {
+		syslog(LOG_ERR, "cannot upgrade: out of memory at startup");
+		return;
+	}
+
+	if ((path = getexecname()) == NULL) {
+		syslog(LOG_ERR, "cannot upgrade: cannot find our own binary");
+		return;
+	}
+
+	if ((f = tmpfile()) == NULL) {
+		syslog(LOG_ERR, "cannot upgrade: tmpfile: %m");
+		return;
+	}
+
+	if (write_state(f) == -1 || fflush(f) == EOF ||
+	    fseek(f, 0L, SEEK_SET) == -1) {
+		syslog(LOG_ERR, "cannot upgrade: writing state: %m");
+		(void) fclose(f);
+		return;
+	}
+
+	/*
+	 * Nothing but stdin, stdout, stderr, the state and the sockets
+	 * we're handing over goes to the new process.  fdwalk() only visits
+	 * the descriptors that are open, however high the limit is.
+	 */
+	statefd = fileno(f);
+	(void) fdwalk(set_cloexec, &statefd);
+
+	(void) snprintf(fdbuf, sizeof fdbuf, "%d", statefd);
+	saved_argv[saved_argc] = "-U";
+	saved_argv[saved_argc + 1] = fdbuf;
+	saved_argv[saved_argc + 2] = NULL;
+
+	syslog(LOG_NOTICE, "upgrading: executing %s", path);
+	(void) fflush(NULL);
+	closelog();
+
+	(void) execv(path, saved_argv);
+
+	openlog("wita", LOG_PID, LOG_DAEMON);
+	syslog(LOG_ERR, "cannot upgrade: %s: %m", path);
+	saved_argv[saved_argc] = NULL;
+	(void) fclose(f);
+}
+
+/*
+ * fdwalk() callback for upgrade_exec(): fd is open; close it on exec
+ * unless it's the state (*cd) or one we're handing over.
+ */
+static int
+set_cloexec(cd, fd)
+	void	*cd;
+	int	 fd;
+{
+int	i;
+
+	if (fd < 3 || fd == *(int *) cd)
+		return 0;
+	for (i = 0; i < nkeeps; i++)
+		if (keeps[i].kp_fd == fd)
+			break;
+	(void) fcntl(fd, F_SETFD, i < nkeeps ? 0 : FD_CLOEXEC);
+	return 0;
+}
+
+static int
+write_state(f)
+	FILE	*f;
+{
+hrtime_t	 now = gethrtime(), next, busyat = 0;
+char const	*buf;
+int		 i, running, len, nbusy = 0;
+server_t	*sr;
+group_t		*gr;
+
+	(void) fprintf(f, "%s\n", STATE_MAGIC);
+
+	pdns_save(&running, &buf, &len);
+	(void) fprintf(f, "pdns %d %d\n", running, len);
+	(void) fwrite(buf, 1, len, f);
+	(void) putc('\n', f);
+
+	for (i = 0; i < nkeeps; i++)
+		(void) fprintf(f, "fd %d %s %s\n", keeps[i].kp_fd,
+				keeps[i].kp_kind, keeps[i].kp_name);
+
+	(void) fprintf(f, "serial %lu\n", (unsigned long) zone_serial);
+
+	for (i = 0; i < curconf->nservers; i++)
+		if (curconf->servers[i]->sr_state != SR_IDLE)
+			nbusy++;
+
+	for (i = 0; i < curconf->nservers; i++) {
+		sr = curconf->servers[i];
+
+		/* Checks under way start again, but not all at once. */
+		if (sr->sr_state == SR_IDLE)
+			next = server_next_check(sr);
+		else {
+			next = busyat;
+			busyat += (hrtime_t) CHECK_INTERVAL * NANOSEC / nbusy;
+		}
+
+		(void) fprintf(f, "server %s %s %d %d %d %d %d %d %.17g %lld %d %d "
+				"%lld\n",
+				sr->sr_spec, sr->sr_address, server_portnum(sr),
+				sr->sr_online, sr->sr_healthy, sr->sr_checked,
+				sr->sr_nsucc, sr->sr_nfail, sr->sr_penalty,
+				(long long) (now - sr->sr_penalty_time),
+				sr->sr_suppressed, sr->sr_drained, (long long) next);
+	}
+
+	for (i = 0; i < curconf->ngroups; i++) {
+		gr = curconf->groups[i];
+		(void) fprintf(f, "group %s %s %lld %u %u %llu %llu\n",
+				gr->gr_zone ? gr->gr_zone->zn_name : "-",
+				gr->gr_name, (long long) (now - gr->gr_changed),
+				gr->gr_rotor[0], gr->gr_rotor[1],
+				(unsigned long long) gr->gr_nqueries,
+				(unsigned long long) gr->gr_nchanges);
+	}
+
+	return ferror(f) ? -1 : 0;
+}
+
+/*
+ * We've been exec'd by upgrade_exec(); read the state it left on fd.
+ */
+int
+upgrade_load(fdstr)
+	char const	*fdstr;
+{
+FILE	*f;
+int	 fd, ret;
+
+	fd = atoi(fdstr);
+	(void) fcntl(fd, F_SETFD, FD_CLOEXEC);
+	if ((f = fdopen(fd, "r")) == NULL) {
+		syslog(LOG_ERR, "cannot read upgrade state: %m");
+		return -1;
+	}
+
+	saved_time = gethrtime();
+	ret = read_state(f);
+	(void) fclose(f);
+
+	if (ret == -1) {
+		syslog(LOG_ERR, "cannot read upgrade state: it's damaged");
+		free_saved();
+	} else
+		syslog(LOG_NOTICE, "upgraded: carrying on with %d servers and %d "
+				"sockets", nsaved, nkeeps);
+	return ret;
+}
+
+static int
+read_state(f)
+	FILE	*f;
+{
+char	 line[2048], *kind, *p, *buf;
+int	 running, len, fd;
+keep_t	*kp;
+
+	if (fgets(line, sizeof line, f) == NULL ||
+	    strcmp(line, STATE_MAGIC "\n") != 0)
+		return -1;
+
+	if (fgets(line, sizeof line, f) == NULL ||
+	    sscanf(line, "pdns %d %d", &running, &len) != 2 ||
+	    len < 0 || (buf = malloc(len + 1)) == NULL)
+		return -1;
+	if (fread(buf, 1, len + 1, f) != (size_t) len + 1) {
+		free(buf);
+		return -1;
+	}
+	pdns_restore(running, buf, len);
+	free(buf);
+
+	while (fgets(line, sizeof line, f) != NULL) {
+		if ((p = strchr(line, '\n')) == NULL)
+			return -1;
+		*p = 0;
+
+		if (strncmp(line, "fd ", 3) == 0) {
+			fd = (int) strtol(line + 3, &kind, 10);
+			if (*kind++ != ' ' || (p = strchr(kind, ' ')) == NULL ||
+			    nkeeps == MAXKEEP)
+				return -1;
+			*p++ = 0;
+
+			kp = &keeps[nkeeps];
+			if ((kp->kp_kind = strdup(kind)) == NULL ||
+			    (kp->kp_name = strdup(p)) == NULL) {
+				free(kp->kp_kind);
+				return -1;
+			}
+			kp->kp_fd = fd;
+			nkeeps++;
+			(void) fcntl(fd, F_SETFD, FD_CLOEXEC);
+		} else if (strncmp(line, "serial ", 7) == 0)
+			saved_serial = (uint32_t) strtoul(line + 7, NULL, 10);
+		else if (strncmp(line, "server ", 7) == 0) {
+			if (read_server(line + 7) == -1)
+				return -1;
+		} else if (strncmp(line, "group ", 6) == 0) {
+			if (read_group(line + 6) == -1)
+				return -1;
+		} else
+			return -1;
+	}
+
+	return ferror(f) ? -1 : 0;
+}
+
+static int
+read_server(line)
+	char	*line;
+{
+saved_t		*sv;
+char		*spec, *addr, *last;
+long long	 age, next;
+
+	if ((sv = grow(saved, nsaved, sizeof(*saved))) == NULL)
+		return -1;
+	saved = sv;
+	sv = &saved[nsaved];
+	bzero(sv, sizeof(*sv));
+
+	if ((spec = strtok_r(line, " ", &last)) == NULL ||
+	    (addr = strtok_r(NULL, " ", &last)) == NULL ||
+	    sscanf(last, "%d %d %d %d %d %d %lf %lld %d %d %lld",
+		    &sv->sv_port, &sv->sv_online, &sv->sv_healthy,
+		    &sv->sv_checked, &sv->sv_nsucc, &sv->sv_nfail,
+		    &sv->sv_penalty, &age, &sv->sv_suppressed,
+		    &sv->sv_drained, &next) != 11)
+		return -1;
+
+	if ((sv->sv_spec = strdup(spec)) == NULL ||
+	    (sv->sv_address = strdup(addr)) == NULL ||
+	    saved_addr(sv) == -1) {
+		free(sv->sv_spec);
+		free(sv->sv_address);
+		return -1;
+	}
+	sv->sv_penalty_age = (hrtime_t) age;
+	sv->sv_next = (hrtime_t) next;
+	nsaved++;
+	return 0;
+}
+
+static int
+read_group(line)
+	char	*line;
+{
+savedgroup_t	*sg;
+char		*zone, *name, *last;
+long long	 age;
+unsigned long long	nq, nc;
+
+	if ((sg = grow(savedgroups, nsavedgroups, sizeof(*savedgroups))) == NULL)
+		return -1;
+	savedgroups = sg;
+	sg = &savedgroups[nsavedgroups];
+
+	if ((zone = strtok_r(line, " ", &last)) == NULL ||
+	    (name = strtok_r(NULL, " ", &last)) == NULL ||
+	    sscanf(last, "%lld %u %u %llu %llu", &age, &sg->sg_rotor[0],
+		    &sg->sg_rotor[1], &nq, &nc) != 5)
+		return -1;
+
+	sg->sg_zone = NULL;
+	if ((strcmp(zone, "-") != 0 && (sg->sg_zone = strdup(zone)) == NULL) ||
+	    (sg->sg_name = strdup(name)) == NULL) {
+		free(sg->sg_zone);
+		return -1;
+	}
+	sg->sg_age = (hrtime_t) age;
+	sg->sg_nqueries = nq;
+	sg->sg_nchanges = nc;
+	nsavedgroups++;
+	return 0;
+}
+
+/*
+ * Make the addrinfo that new_server() will use for sv.
+ */
+static int
+saved_addr(sv)
+	saved_t	*sv;
+{
+struct sockaddr_in	*sin = (struct sockaddr_in *) &sv->sv_ss;
+struct sockaddr_in6	*sin6 = (struct sockaddr_in6 *) &sv->sv_ss;
+
+	if (inet_pton(AF_INET, sv->sv_address, &sin->sin_addr) == 1) {
+		sin->sin_family = AF_INET;
+		sin->sin_port = htons(sv->sv_port);
+		sv->sv_ai.ai_addrlen = sizeof(*sin);
+	} else if (inet_pton(AF_INET6, sv->sv_address, &sin6->sin6_addr) == 1) {
+		sin6->sin6_family = AF_INET6;
+		sin6->sin6_port = htons(sv->sv_port);
+		sv->sv_ai.ai_addrlen = sizeof(*sin6);
+	} else
+		return -1;
+
+	sv->sv_ai.ai_family = sv->sv_ss.ss_family;
+	sv->sv_ai.ai_socktype = SOCK_STREAM;
+	sv->sv_ai.ai_addr = (struct sockaddr *) &sv->sv_ss;
+	return 0;
+}
+
+/*
+ * Find what we saved for spec, trying where it would be in the same
+ * configuration first.
+ */
+static saved_t *
+find_saved(spec, hint)
+	char const	*spec;
+	int		 hint;
+{
+int	i;
+
+	if (hint >= 0 && hint < nsaved && strcmp(saved[hint].sv_spec, spec) == 0)
+		return &saved[hint];
+
+	for (i = 0; i < nsaved; i++)
+		if (strcmp(saved[i].sv_spec, spec) == 0)
+			return &saved[i];
+	return NULL;
+}
+
+/*
+ * The addresses the old process had for spec, as a list for new_server()
+ * (which mustn't free it), or NULL to look it up.
+ */
+struct addrinfo *
+upgrade_addrs(conf, spec)
+	config_t	*conf;
+	char const	*spec;
+{
+saved_t	*sv, *end;
+
+	if ((sv = find_saved(spec, conf->nservers)) == NULL)
+		return NULL;
+
+	/* Its addresses are together, as new_server() made them. */
+	for (end = sv; end + 1 < saved + nsaved &&
+	    strcmp(end[1].sv_spec, spec) == 0; end++)
+		end->sv_ai.ai_next = &end[1].sv_ai;
+	end->sv_ai.ai_next = NULL;
+	return &sv->sv_ai;
+}
+
+/*
+ * If sr was in the old process, give it the state it had there and start
+ * its timer, and return 1.  Otherwise, return 0 and the caller checks it
+ * as usual.
+ */
+int
+upgrade_resume(sr)
+	server_t	*sr;
+{
+saved_t		*sv;
+hrtime_t	 gone;
+
+	if ((sv = find_saved(sr->sr_spec, sr->sr_index)) == NULL)
+		return 0;
+
+	for (; sv < saved + nsaved && strcmp(sv->sv_spec, sr->sr_spec) == 0; sv++)
+		if (strcmp(sv->sv_address, sr->sr_address) == 0 &&
+		    sv->sv_port == server_portnum(sr))
+			break;
+	if (sv == saved + nsaved || strcmp(sv->sv_spec, sr->sr_spec) != 0)
+		return 0;
+
+	gone = gethrtime() - saved_time;
+	sr->sr_healthy = sv->sv_healthy;
+	sr->sr_checked = sv->sv_checked;
+	sr->sr_nsucc = sv->sv_nsucc;
+	sr->sr_nfail = sv->sv_nfail;
+	sr->sr_penalty = sv->sv_penalty;
+	sr->sr_penalty_time = gethrtime() - sv->sv_penalty_age - gone;
+	sr->sr_suppressed = sv->sv_suppressed;
+	sr->sr_drained = sv->sv_drained;
+	server_resume(sr, sv->sv_online, sv->sv_next - gone);
+	return 1;
+}
+
+/*
+ * Every server is in place; put the groups and serial back as they were,
+ * and forget the rest.
+ */
+void
+upgrade_done()
+{
+savedgroup_t	*sg;
+group_t		*gr;
+zone_t		*zone;
+hrtime_t	 now = gethrtime();
+int		 i, z;
+
+	for (i = 0; i < nsavedgroups; i++) {
+		sg = &savedgroups[i];
+
+		zone = NULL;
+		if (sg->sg_zone) {
+			for (z = 0; z < curconf->nzones; z++)
+				if (strcmp(curconf->zones[z]->zn_name, sg->sg_zone) == 0)
+					zone = curconf->zones[z];
+			if (zone == NULL)
+				continue;
+		}
+
+		if ((gr = find_group(curconf, zone, sg->sg_name)) != NULL &&
+		    gr->gr_zone == zone) {
+			gr->gr_changed = now - sg->sg_age - (now - saved_time);
+			gr->gr_rotor[0] = sg->sg_rotor[0];
+			gr->gr_rotor[1] = sg->sg_rotor[1];
+			gr->gr_nqueries = sg->sg_nqueries;
+			gr->gr_nchanges = sg->sg_nchanges;
+		}
+	}
+
+	/* Never backwards, in case the configuration has changed. */
+	if (saved_serial != 0 && saved_serial >= zone_serial)
+		zone_serial = saved_serial + 1;
+
+	free_saved();
+
+	/* Sockets that nothing asked for this time. */
+	for (i = 0; i < nkeeps; ) {
+		if (keeps[i].kp_taken) {
+			i++;
+			continue;
+		}
+		(void) close(keeps[i].kp_fd);
+		free(keeps[i].kp_kind);
+		free(keeps[i].kp_name);
+		keeps[i] = keeps[--nkeeps];
+	}
+}
+
+/*
+ * Forget the servers and groups we read from the state.
+ */
+static void
+free_saved()
+{
+int	i;
+
+	for (i = 0; i < nsaved; i++) {
+		free(saved[i].sv_spec);
+		free(saved[i].sv_address);
+	}
+	free(saved);
+	saved = NULL;
+	nsaved = 0;
+
+	for (i = 0; i < nsavedgroups; i++) {
+		free(savedgroups[i].sg_zone);
+		free(savedgroups[i].sg_name);
+	}
+	free(savedgroups);
+	savedgroups = NULL;
+	nsavedgroups = 0;
+}
+
+/*
+ * Make room for one more in an array of n.  If there isn't, p is left
+ * as it was.
+ */
+static void *
+grow(p, n, size)
+	void	*p;
+	int	 n;
+	size_t	 size;
+{
+	if (n != 0 && (n < 16 || (n & (n - 1)) != 0))
+		return p;
+	return realloc(p, (n ? n * 2 : 16) * size);
+}
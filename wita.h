@@ -9,30 +9,135 @@
 #ifndef	WITA_H
 #define	WITA_H
 
+#include	<sys/types.h>
 #include	<sys/socket.h>
+#include	<sys/time.h>
+#include	<inttypes.h>
 #include	<time.h>
+#include	<port.h>
+#include	<regex.h>
+
+#include	"wita_provider.h"	/* Generated from wita.d */
+
+/*
+ * In the simulator (sim.c, built with -DWITA_SIM), time is virtual.
+ */
+#ifdef	WITA_SIM
+hrtime_t	sim_gethrtime(void);
+#define	gethrtime()	sim_gethrtime()
+#endif
 
 #define WITA_VERSION "1.1-dev"
 
+/*
+ * Something we receive port events for: a server, or one of our own
+ * sockets.  The port_associate() or timer user pointer always points at
+ * one of these, at the start of the structure that owns it, and the main
+ * loop passes the event to its handler.
+ */
+typedef struct evsource {
+	void	(*es_handler)(struct evsource *, port_event_t *);
+} evsource_t;
+
 /*
  * A single server.
  */
 typedef enum {
 	SR_IDLE,	/* Server is not being checked */
+	SR_QUEUED,	/* Waiting for a free probe slot */
 	SR_CONNECT,	/* connect() in progress */
-	SR_READ		/* read() in progress */
+	SR_WRITE,	/* Sending the probe's request */
+	SR_READ,	/* read() in progress */
+	SR_STOPPED	/* Configuration retired; ignore events */
 } server_state_t;
 
+/*
+ * Seconds from the end of one check of a server to the start of the next.
+ */
+#define	CHECK_INTERVAL	5
+
+/*
+ * How a check ended, for metrics.
+ */
+#define	PROBE_OK	0
+#define	PROBE_FAIL	1
+#define	PROBE_TIMEOUT	2
+#define	NPROBE_RESULTS	3
+
+/*
+ * What to send to a server and what it must reply (see probe.c).
+ */
+typedef struct probe {
+	char		*pr_name;
+	char		*pr_send;	/* Request, if any */
+	size_t		 pr_sendlen;
+	char		*pr_expect;	/* Reply must start with this */
+	size_t		 pr_expectlen;
+	char		*pr_mask;	/* Applied to reply before comparing */
+	size_t		 pr_masklen;
+	regex_t		 pr_re;		/* Reply must match this, */
+	int		 pr_hasre;	/*   if this is set */
+	size_t		 pr_readmax;	/* Most we read of the reply */
+} probe_t;
+
+/*
+ * A server name can resolve to several addresses, in either family.  We
+ * keep one server_t for each address, checked independently, and link
+ * them together: sr_host is the first and sr_nextaddr the next.
+ */
 typedef struct server {
-	char		*sr_name;	/* Name as specified by the user */
-	char		*sr_address;	/* IP address in dotted quad notation */
+	evsource_t	 sr_ev;		/* Must be first */
+	char		*sr_spec;	/* Server as given in the configuration */
+	char		*sr_name;	/* Host name from sr_spec */
+	char		*sr_address;	/* IP address in numeric form */
 	char const	*sr_port;	/* Port to test connection to */
-	int		 sr_online;	/* If the server was working at last check */
+	char		*sr_target;	/* Host name for SRV (see server_target) */
+	int		 sr_online;	/* If the server is considered up */
+	int		 sr_healthy;	/* Up according to rise/fall, ignoring dampening */
+	int		 sr_checked;	/* Has had at least one check result */
+	int		 sr_nsucc;	/* Consecutive successful checks */
+	int		 sr_nfail;	/* Consecutive failed checks */
+	double		 sr_penalty;	/* Flap penalty (see server_flapped) */
+	hrtime_t	 sr_penalty_time; /* When sr_penalty was last decayed */
+	int		 sr_suppressed;	/* Held down by flap dampening */
+	int		 sr_suspect;	/* Held down by client failure reports */
+	int		 sr_drained;	/* Taken out of service by the operator */
+	int		 sr_nreports;	/* Failure reports in this window */
+	hrtime_t	 sr_report_start; /* When this report window began */
+	hrtime_t	 sr_lastreport_check; /* Last check started by a report */
+	hrtime_t	 sr_deadline;	/* When the check in progress times out */
 	timer_t		 sr_timer;	/* Timer for this server */
 	server_state_t	 sr_state;	/* Server state */
 	int		 sr_socket;	/* Connection socket */
-	struct sockaddr	 sr_sockaddr;	/* Address for connect() */
-	char		 sr_rdbuf;	/* One-byte buffer for read check */
+	struct sockaddr_storage sr_sockaddr; /* Address for connect() */
+	socklen_t	 sr_addrlen;	/* Length of sr_sockaddr */
+	int		 sr_family;	/* AF_INET or AF_INET6 */
+	struct server	*sr_host;	/* First address for this server */
+	struct server	*sr_nextaddr;	/* Next address for this server */
+	probe_t		*sr_probe;	/* How to check it, or NULL for the default */
+	char		 sr_rdbuf;	/* One-byte buffer for the default check */
+	char		*sr_buf;	/* Reply buffer for sr_probe */
+	size_t		 sr_nbuf;	/* Bytes of reply read so far */
+	size_t		 sr_nsent;	/* Bytes of the request written so far */
+	int		 sr_ngroups;	/* How many groups this server is in */
+	struct server_group **sr_groups; /* Our entries in those groups */
+	hrtime_t	 sr_probe_start; /* When the current check began */
+	uint64_t	 sr_nprobes[NPROBE_RESULTS]; /* Checks, by result */
+	hrtime_t	 sr_probe_time;	/* Total time spent in checks */
+	uint64_t	 sr_nchanges;	/* Times sr_online has changed */
+	int		 sr_index;	/* Where we are in the config's servers */
+	uint32_t	 sr_peerup;	/* Peers whose checks say we're up, */
+	uint32_t	 sr_peerdown;	/*   and down, by bit (see gossip.c) */
+	struct checkrec	*sr_history;	/* Our last checks (see history.c): */
+	int		 sr_histsize;	/*   room for this many, */
+	int		 sr_histpos;	/*   where the next goes, */
+	int		 sr_histlen;	/*   and how many there are */
+	struct server	*sr_hashnext;	/* Next in its find_server() chain */
+	struct server	*sr_targetnext;	/* Next in its find_server_host() chain */
+	struct server	*sr_addrnext;	/* Next in its find_server_report() chain */
+	struct server	*sr_qnext;	/* Next server in the probe queue */
+	struct server	*sr_qprev;	/* Previous server in the probe queue */
+	hrtime_t	 sr_qtime;	/* When we joined the probe queue */
 } server_t;
 
 /*
@@ -40,45 +145,183 @@ typedef struct server {
  */
 typedef struct server_group {
 	server_t	*sg_server;
+	struct group	*sg_group;	/* The group this entry is in */
 	int		 sg_backup;	/* Is this a backup server */
+	int		 sg_weight;	/* SRV weight */
 } server_group_t;
 
+/*
+ * A zone we serve.  Each group is in one zone, or in none, in which case
+ * it answers for its name in any zone.
+ */
+typedef struct zone {
+	char		*zn_name;	/* Zone name, without the trailing dot */
+	char		*zn_rname;	/* SOA contact (mailbox as a name) */
+	int		 zn_id;		/* Domain ID we give PowerDNS */
+} zone_t;
+
+/*
+ * Address families.  Groups answer A and AAAA queries separately, so they
+ * keep their counts for each.
+ */
+#define	NFAMILIES	2
+#define	FAMILY_INDEX(af)	((af) == AF_INET6 ? 1 : 0)
+
 /*
  * A group of servers.
  */
 typedef struct group {
 	char	 	 *gr_name;	/* Group name in config file */
+	zone_t		 *gr_zone;	/* Zone the group is in, or NULL */
 	int		  gr_nservers;	/* How many servers in the group */
 	server_group_t	**gr_servers;	/* The servers in this group */
+	int		  gr_nup[NFAMILIES]; /* How many primaries are online */
+	int		  gr_nbackup_up[NFAMILIES]; /* How many backups are online */
+	hrtime_t	  gr_changed;	/* When our answer last changed */
+	int		  gr_ttlmin;	/* TTL bounds for this group, or -1 */
+	int		  gr_ttlmax;	/*   to use the global setting */
+	int		  gr_maxanswers; /* Max. records per answer, or -1 */
+	unsigned	  gr_rotor[NFAMILIES]; /* Where the next answer starts */
+	char		 *gr_fallback_names; /* "fallback=" option, until resolved */
+	int		  gr_nfallbacks;
+	struct group	**gr_fallbacks;	/* Groups to answer from if we can't */
+	int		  gr_ndependents;
+	struct group	**gr_dependents; /* Groups with us as a fallback */
+	struct group	 *gr_source[NFAMILIES]; /* Group whose servers we answer
+					   with (us, a fallback, or NULL) */
+	int		  gr_mark;	/* For loop detection in config.c */
+	char		 *gr_probe_name; /* "probe=" option, until resolved */
+	probe_t		 *gr_probe;	/* How to check our servers, or NULL */
+	uint64_t	  gr_nqueries;	/* Queries answered from this group */
+	uint64_t	  gr_nchanges;	/* Times our answer has changed */
+	struct sub	 *gr_subs;	/* Clients subscribed to our changes */
+	int		  gr_subdirty;	/* Changed since subscribers were told */
+	struct group	 *gr_subnext;	/* Next group with gr_subdirty set */
 } group_t;
 
+/*
+ * The most records we will put in one answer.
+ */
+#define	MAXANSWERS	256
+
+/*
+ * The flap penalty is capped at dampen-reuse << FLAP_MAXHOLD (see
+ * server_flapped()), so a server is never held down for more than about
+ * FLAP_MAXHOLD half-lives after it stops flapping.
+ */
+#define	FLAP_MAXHOLD	4
+
 /*
  * Global configuration.
  */
 
-typedef struct {
+typedef struct config {
 	int	  	  nservers;
 	server_t	**servers;
+	int		  nhosts;	/* Servers by name, for find_server() */
+	int		  hashsize;
+	server_t	**hosthash;
+	server_t	**targethash;	/* By sr_target, for find_server_host() */
+	server_t	**addrhash;	/* By sr_address, for find_server_report() */
 
 	int		  ngroups;
 	group_t		**groups;
+
+	int		  nzones;
+	zone_t		**zones;
+
+	int		  nprobes;
+	probe_t		**probes;
+
+	struct qnode	 *qtrie;	/* Zone and group names (see zone.c) */
+	struct qnode	 *qany;		/* Groups not in any zone */
+
+	struct config	 *retired_next;	/* Next retired configuration to free */
+
+	int		  maxprobes;	/* Max. concurrent probes (0 = automatic) */
+	int		  rise;		/* Successes needed to mark a server up */
+	int		  fall;		/* Failures needed to mark a server down */
+	int		  dampen_halflife; /* Flap penalty half-life (s), 0 = off */
+	int		  dampen_suppress; /* Penalty at which a server is held down */
+	int		  dampen_reuse;	/* Penalty below which it's released */
+	int		  ttlmin;	/* Bounds for the TTL we give, which */
+	int		  ttlmax;	/*   grows as a group stays stable */
+	int		  maxanswers;	/* Max. records per answer (0 = fit in 512 bytes) */
+	int		  report_threshold; /* Client reports to mark a server suspect */
+	int		  quorum;	/* Instances that must agree a server is down */
+	int		  history;	/* Checks remembered per server */
+	struct checkrec	 *checkrecs;	/* Every server's history, in one slab */
+	int		  ncheckrecs;	/* Servers there's room for in it */
+
+	char		 *zone;		/* Default zone, for groups and servers */
+	char		 *soa_mname;	/* Primary nameserver for our zones */
+	char		 *soa_rname;	/* Contact for all zones, if set */
+	char		 *serial_file;	/* Where to keep the SOA serial */
 } config_t;
 
 server_t	*new_server(config_t *, char const *name);
 server_t	*find_server(config_t *, char const *name);
+server_t	*find_server_host(config_t *, char const *qname);
+int		 server_target(server_t *, char *buf, size_t len);
+int		 server_portnum(server_t *);
+int		 server_addr(server_t *, void const **addr);
 void		 server_start_connect_check(server_t *);
 void		 server_handle_fd(server_t *);
 void		 server_handle_timer(server_t *);
+void		 server_stop_check(server_t *);
+void		 server_report(server_t *);
+void		 server_drain(server_t *, int drained);
+int		 server_check_now(server_t *);
+server_t	*find_server_report(config_t *, char const *name, server_t *prev);
+int		 server_set_probe(server_t *, probe_t *);
+void		 server_peer_vote(server_t *, int peer, int vote);
+hrtime_t	 server_next_check(server_t *);
+void		 server_resume(server_t *, int online, hrtime_t delay);
+void		 server_votes(server_t *, int *ndown, int *nvotes);
+void		 forget_server(config_t *, server_t *);
 void		 free_server(server_t *);
 
 group_t		*new_group(config_t *, char const *name);
-group_t		*find_group(config_t *, char const *name);
-int		 add_server_to_group(group_t *group, server_t *server, int backup);
+group_t		*find_group(config_t *, zone_t *, char const *name);
+int		 add_group_fallback(group_t *, group_t *fallback);
+int		 add_server_to_group(group_t *group, server_t *server, int backup,
+			int weight);
+int		 remove_server_from_group(group_t *, server_t *);
+void		 group_server_changed(server_t *);
+int		 group_ttl(group_t *);
+int		 group_answer(group_t *, int family, size_t qnamelen, size_t rrsize,
+			server_t **);
+int		 group_srv_answer(group_t *, server_group_t **);
+int		 group_members(group_t *, int family, server_t **);
+group_t		*find_group_srv(config_t *, char const *qname);
 void		 free_group(group_t *group);
 
+zone_t		*new_zone(config_t *, char const *name);
+void		 free_zone(zone_t *);
+int		 compile_qnames(config_t *);
+void		 free_qnames(config_t *);
+group_t		*find_group_qname(config_t *, char const *qname);
+zone_t		*find_zone_qname(config_t *, char const *qname, int *apex);
+
 config_t *curconf;
 
+/*
+ * SOA serial for our zone.  Incremented every time any group's answer
+ * changes, so secondaries know to transfer the zone again.
+ */
+extern uint32_t	zone_serial;
+void	zone_serial_start(char const *file);
+void	zone_serial_bump(void);
+void	zone_serial_done(void);
+
 int load_configuration(char const *file);
+void config_reap(void);
+int parse_int(char const *name, char const *value, int min, int max, int *res);
+
+int		 config_probe(config_t *);
+probe_t		*find_probe(config_t *, char const *name);
+int		 probe_match(probe_t *, char *buf, size_t len, int done);
+void		 free_probe(probe_t *);
 
 extern int	  port;
 
@@ -87,4 +330,173 @@ extern int	  port;
  */
 void	handle_pdns();
 
+/*
+ * Native DNS server.
+ */
+int	dns_listen(char const *addr);
+void	dns_flush(void);
+
+/*
+ * Client failure reports.
+ */
+int	report_listen(char const *addr);
+
+/*
+ * Sharing checks with other instances (gossip.c).
+ */
+#define	MAXPEERS	32	/* Bits in sr_peerup and sr_peerdown */
+
+#define	VOTE_NONE	0	/* A peer's verdict on a server */
+#define	VOTE_UP		1
+#define	VOTE_DOWN	2
+#define	VOTE_SAME	3	/* No change, but the peer has come or gone */
+
+extern uint32_t	peers_live;	/* Peers we've heard from lately, by bit */
+
+int	gossip_peer(char const *addr);
+int	gossip_listen(char const *addr);
+int	gossip_mine(server_t *);
+int	gossip_covered(server_t *);
+void	gossip_changed(server_t *);
+void	gossip_flush(void);
+
+/*
+ * Upgrading by exec'ing a new binary with our state (upgrade.c).
+ */
+void		 upgrade_init(int argc, char **argv);
+int		 upgrade_load(char const *fdstr);
+void		 upgrade_request(void);
+int		 upgrade_requested(void);
+void		 upgrade_exec(void);
+void		 upgrade_keep(char const *kind, char const *name, int fd);
+int		 upgrade_fd(char const *kind, char const *name);
+void		 upgrade_forget(int fd);
+struct addrinfo	*upgrade_addrs(config_t *, char const *spec);
+int		 upgrade_resume(server_t *);
+void		 upgrade_done(void);
+
+void	pdns_save(int *running, char const **buf, int *len);
+void	pdns_restore(int running, char const *buf, int len);
+
+/*
+ * Each server's recent checks (history.c).
+ */
+#define	HISTORY_DEFAULT	64	/* Checks remembered per server */
+#define	HISTORY_MAX	1024
+
+typedef struct checkrec {
+	hrtime_t	cr_when;	/* When it finished */
+	uint32_t	cr_took;	/* How long it took, in microseconds */
+	uint16_t	cr_error;	/* errno if it failed */
+	uint8_t		cr_phase;	/* How far it got (SR_CONNECT etc.) */
+	uint8_t		cr_result;	/* PROBE_OK, PROBE_FAIL or PROBE_TIMEOUT */
+} checkrec_t;
+
+typedef struct checkstats {
+	int		cs_n[NPROBE_RESULTS];	/* Checks by result */
+	hrtime_t	cs_p50, cs_p90, cs_p99;	/* Times of the successful ones */
+	hrtime_t	cs_max;
+} checkstats_t;
+
+int			 history_start(config_t *, config_t *old);
+void			 history_add(config_t *, server_t *);
+void			 history_record(server_t *, int result, int error,
+				hrtime_t took);
+checkrec_t const	*history_get(server_t *, int i);
+void			 history_stats(server_t *, hrtime_t since, checkstats_t *);
+
+/*
+ * Metrics (metrics.c).  Everything runs on one thread, so these are
+ * plain counters, updated in place.
+ */
+#define	HIST_SUBBITS	2		/* Buckets per power of two, */
+#define	HIST_SUB	(1 << HIST_SUBBITS) /*   as a shift and a count */
+#define	HIST_MINSHIFT	10		/* First buckets are 1024ns wide */
+#define	HIST_NBUCKETS	(26 * HIST_SUB)	/* Up to about a minute */
+
+typedef struct hist {
+	uint64_t	h_count[HIST_NBUCKETS];
+	uint64_t	h_n;		/* Values counted */
+	hrtime_t	h_sum;		/* Their total */
+} hist_t;
+
+#define	QUERY_PDNS	0
+#define	QUERY_DNS	1
+#define	NQUERY_SOURCES	2
+
+typedef struct metrics {
+	uint64_t	m_probes[NPROBE_RESULTS];
+	hist_t		m_probe_time;
+	hist_t		m_probeq_wait;
+	hist_t		m_query_time[NQUERY_SOURCES];
+	uint64_t	m_unknown[NQUERY_SOURCES];
+} metrics_t;
+
+extern metrics_t	metrics;
+
+void	hist_add(hist_t *, hrtime_t);
+int	metrics_start(char const *path);
+
+/*
+ * Line-oriented unix stream sockets (unixsock.c).
+ */
+typedef struct uclient	uclient_t;
+
+typedef struct ulistener {
+	evsource_t	 ul_ev;		/* Must be first */
+	int		 ul_fd;
+	void		(*ul_line)(uclient_t *, char *);
+	void		(*ul_closed)(uclient_t *);
+	size_t		 ul_maxout;	/* Largest output buffer for a client */
+} ulistener_t;
+
+struct uclient {
+	evsource_t	 uc_ev;		/* Must be first */
+	int		 uc_fd;
+	ulistener_t	*uc_listener;
+	void		*uc_data;	/* For the listener's use */
+	int		 uc_closing;	/* Free at the end of this batch */
+	int		 uc_isdirty;	/* On the list for uclient_flush() */
+	uclient_t	*uc_dirtynext;
+	size_t		 uc_nin;
+	char		 uc_in[1024];	/* Incomplete line from the client */
+	size_t		 uc_nout, uc_outsize;
+	char		*uc_out;	/* Output not yet written */
+};
+
+ulistener_t	*ulisten(char const *path, void (*)(uclient_t *, char *),
+			void (*)(uclient_t *), size_t maxout);
+void		 uclient_printf(uclient_t *, char const *, ...);
+void		 uclient_close(uclient_t *);
+void		 uclient_flush(void);
+
+/*
+ * Control socket (ctl.c).
+ */
+int	ctl_listen(char const *path);
+
+/*
+ * Subscriptions to group changes (sub.c).
+ */
+int	sub_listen(char const *path);
+void	sub_notify(group_t *);
+void	sub_reload(void);
+void	sub_flush(void);
+
+/*
+ * Logging that clients can cause (log.c): queued, rate limited, and
+ * written out by the main loop between batches of events.
+ */
+void	wlog(int pri, char const *fmt, ...);
+void	wlog_flush(void);
+
+/*
+ * Recording what PowerDNS sends (record.c), for pdnsreplay.
+ */
+#define	REC_MAGIC	"wita-rec 1\n"
+
+int	record_open(char const *path);
+void	record_input(char const *, size_t);
+void	record_flush(void);
+
 #endif	/* !WITA_H */
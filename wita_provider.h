@@ -0,0 +1,35 @@
+/* generated by shim dtrace */
+extern int __shim_wita_enabled;
+extern void __shim_wita_query__start(int);
+#define WITA_QUERY_START(a0) __shim_wita_query__start(a0)
+#define WITA_QUERY_START_ENABLED() (__shim_wita_enabled)
+extern void __shim_wita_query__done(int, char *, char *, int);
+#define WITA_QUERY_DONE(a0, a1, a2, a3) __shim_wita_query__done(a0, a1, a2, a3)
+#define WITA_QUERY_DONE_ENABLED() (__shim_wita_enabled)
+extern void __shim_wita_probe__start(char *, char *, char *);
+#define WITA_PROBE_START(a0, a1, a2) __shim_wita_probe__start(a0, a1, a2)
+#define WITA_PROBE_START_ENABLED() (__shim_wita_enabled)
+extern void __shim_wita_probe__connect(char *, char *, char *);
+#define WITA_PROBE_CONNECT(a0, a1, a2) __shim_wita_probe__connect(a0, a1, a2)
+#define WITA_PROBE_CONNECT_ENABLED() (__shim_wita_enabled)
+extern void __shim_wita_probe__read(char *, char *, char *, int);
+#define WITA_PROBE_READ(a0, a1, a2, a3) __shim_wita_probe__read(a0, a1, a2, a3)
+#define WITA_PROBE_READ_ENABLED() (__shim_wita_enabled)
+extern void __shim_wita_probe__timeout(char *, char *, char *, char *);
+#define WITA_PROBE_TIMEOUT(a0, a1, a2, a3) __shim_wita_probe__timeout(a0, a1, a2, a3)
+#define WITA_PROBE_TIMEOUT_ENABLED() (__shim_wita_enabled)
+extern void __shim_wita_probe__done(char *, char *, char *, int, int);
+#define WITA_PROBE_DONE(a0, a1, a2, a3, a4) __shim_wita_probe__done(a0, a1, a2, a3, a4)
+#define WITA_PROBE_DONE_ENABLED() (__shim_wita_enabled)
+extern void __shim_wita_server__state(char *, char *, char *, int, char *);
+#define WITA_SERVER_STATE(a0, a1, a2, a3, a4) __shim_wita_server__state(a0, a1, a2, a3, a4)
+#define WITA_SERVER_STATE_ENABLED() (__shim_wita_enabled)
+extern void __shim_wita_reload__start(char *);
+#define WITA_RELOAD_START(a0) __shim_wita_reload__start(a0)
+#define WITA_RELOAD_START_ENABLED() (__shim_wita_enabled)
+extern void __shim_wita_reload__parsed(char *);
+#define WITA_RELOAD_PARSED(a0) __shim_wita_reload__parsed(a0)
+#define WITA_RELOAD_PARSED_ENABLED() (__shim_wita_enabled)
+extern void __shim_wita_reload__done(char *, int);
+#define WITA_RELOAD_DONE(a0, a1) __shim_wita_reload__done(a0, a1)
+#define WITA_RELOAD_DONE_ENABLED() (__shim_wita_enabled)
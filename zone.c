@@ -0,0 +1,442 @@
+/* Copyright (c) 2009 River Tarnell <river@loreley.flyingparchment.org.uk>. */
+/*
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely. This software is provided 'as-is', without any express or implied
+ * warranty.
+ */
+
+/*
+ * Zones, and matching query names to groups.
+ *
+ * Once a configuration is loaded, every zone and group name is compiled
+ * into a trie of labels, starting from the root: the group "db" in
+ * example.com is at com -> example -> db.  A query name is matched by
+ * walking it from its last label to its first, without copying it, so
+ * the cost depends only on the length of the name.  A node's children are
+ * kept sorted so each step is a binary search, and a "*" label in a group
+ * name matches any one label.  An exact label is always preferred to a
+ * wildcard.
+ *
+ * Groups that aren't in any zone are matched on the first label of the
+ * query alone, whatever the rest of it is, as they always were.
+ */
+
+#include	<stdlib.h>
+#include	<string.h>
+#include	<strings.h>
+#include	<ctype.h>
+#include	<assert.h>
+#include	<syslog.h>
+
+#include	"wita.h"
+
+typedef struct qnode {
+	char		 *qn_label;	/* Label, in lower case */
+	size_t		  qn_len;	/* Length of qn_label */
+	int		  qn_nchildren;
+	struct qnode	**qn_children;	/* Sorted by label, once compiled */
+	struct qnode	 *qn_wild;	/* Child for a "*" label */
+	zone_t		 *qn_zone;	/* Zone whose apex is here */
+	group_t		 *qn_group;	/* Group with this name */
+} qnode_t;
+
+static qnode_t	*qnode_insert(qnode_t *, char const *, size_t);
+static qnode_t	*qnode_find(qnode_t *, char const *, size_t);
+static group_t	*qnode_match(qnode_t *, char const *, char const *);
+static void	 qnode_sort(qnode_t *);
+static void	 qnode_free(qnode_t *);
+static int	 qnode_cmp(void const *, void const *);
+static int	 label_cmp(char const *, size_t, char const *, size_t);
+
+/*
+ * Find a zone by name, or create it.
+ */
+zone_t *
+new_zone(conf, name)
+	config_t	*conf;
+	char const	*name;
+{
+zone_t	 *zn;
+zone_t	**newzn;
+size_t	  len;
+int	  i;
+
+	assert(conf);
+	assert(name);
+
+	len = strlen(name);
+	if (len > 1 && name[len - 1] == '.')
+		len--;
+
+	for (i = 0; i < conf->nzones; i++)
+		if (strncasecmp(conf->zones[i]->zn_name, name, len) == 0 &&
+		    conf->zones[i]->zn_name[len] == 0)
+			return conf->zones[i];
+
+	if ((zn = calloc(1, sizeof(zone_t))) == NULL) {
+		syslog(LOG_ERR, "out of memory (trying to continue anyway)");
+		return NULL;
+	}
+
+	if ((zn->zn_name = malloc(len + 1)) == NULL) {
+		syslog(LOG_ERR, "out of memory (trying to continue anyway)");
+		free(zn);
+		return NULL;
+	}
+	(void) memcpy(zn->zn_name, name, len);
+	zn->zn_name[len] = 0;
+
+	if ((newzn = realloc(conf->zones, sizeof(zone_t *) * (conf->nzones + 1))) == NULL) {
+		syslog(LOG_ERR, "out of memory (trying to continue anyway)");
+		free_zone(zn);
+		return NULL;
+	}
+
+	conf->zones = newzn;
+	conf->zones[conf->nzones] = zn;
+	conf->nzones++;
+	zn->zn_id = conf->nzones;
+
+	return zn;
+}
+
+void
+free_zone(zn)
+	zone_t	*zn;
+{
+	if (zn == NULL)
+		return;
+
+	free(zn->zn_name);
+	free(zn->zn_rname);
+	free(zn);
+}
+
+/*
+ * Build the query name trie for a configuration.  Fails if a group is
+ * defined twice in the same zone.
+ */
+int
+compile_qnames(conf)
+	config_t	*conf;
+{
+int		 i;
+qnode_t		*node, *root;
+group_t		*gr;
+
+	if ((conf->qtrie = calloc(1, sizeof(qnode_t))) == NULL ||
+	    (conf->qany = calloc(1, sizeof(qnode_t))) == NULL) {
+		syslog(LOG_ERR, "out of memory");
+		return -1;
+	}
+
+	for (i = 0; i < conf->nzones; i++) {
+		if ((node = qnode_insert(conf->qtrie, conf->zones[i]->zn_name,
+				strlen(conf->zones[i]->zn_name))) == NULL)
+			return -1;
+		node->qn_zone = conf->zones[i];
+	}
+
+	for (i = 0; i < conf->ngroups; i++) {
+		gr = conf->groups[i];
+
+		if (gr->gr_zone) {
+			root = qnode_insert(conf->qtrie, gr->gr_zone->zn_name,
+					strlen(gr->gr_zone->zn_name));
+			assert(root);
+			node = qnode_insert(root, gr->gr_name, strlen(gr->gr_name));
+		} else
+			node = qnode_insert(conf->qany, gr->gr_name,
+					strlen(gr->gr_name));
+
+		if (node == NULL)
+			return -1;
+
+		if (node->qn_group) {
+			syslog(LOG_ERR, "group %s is defined more than once%s%s",
+					gr->gr_name,
+					gr->gr_zone ? " in zone " : "",
+					gr->gr_zone ? gr->gr_zone->zn_name : "");
+			return -1;
+		}
+		node->qn_group = gr;
+	}
+
+	qnode_sort(conf->qtrie);
+	qnode_sort(conf->qany);
+	return 0;
+}
+
+void
+free_qnames(conf)
+	config_t	*conf;
+{
+	qnode_free(conf->qtrie);
+	qnode_free(conf->qany);
+	conf->qtrie = conf->qany = NULL;
+}
+
+/*
+ * Find the group a query is for.  Like the rest of DNS, this ignores
+ * case.
+ */
+group_t *
+find_group_qname(conf, qname)
+	config_t	*conf;
+	char const	*qname;
+{
+size_t		 len;
+char const	*p;
+group_t		*group;
+qnode_t		*node;
+
+	assert(conf);
+	assert(qname);
+
+	len = strlen(qname);
+	if (len > 0 && qname[len - 1] == '.')
+		len--;
+
+	if (conf->qtrie && (group = qnode_match(conf->qtrie, qname,
+			len ? qname + len : NULL)) != NULL)
+		return group;
+
+	/*
+	 * Not in any zone; try the groups that aren't either.
+	 */
+	if (conf->qany == NULL || conf->qany->qn_nchildren == 0)
+		return NULL;
+
+	if ((p = memchr(qname, '.', len)) != NULL)
+		len = p - qname;
+
+	if ((node = qnode_find(conf->qany, qname, len)) != NULL)
+		return node->qn_group;
+	return NULL;
+}
+
+/*
+ * Find which of our zones a name is in, if any, and whether it's the
+ * apex of that zone.  If zones are nested, the innermost is returned.
+ */
+zone_t *
+find_zone_qname(conf, qname, apex)
+	config_t	*conf;
+	char const	*qname;
+	int		*apex;
+{
+size_t		 len;
+char const	*p, *end;
+qnode_t		*node;
+zone_t		*zone = NULL;
+
+	*apex = 0;
+	if (conf->qtrie == NULL)
+		return NULL;
+
+	len = strlen(qname);
+	if (len > 0 && qname[len - 1] == '.')
+		len--;
+
+	node = conf->qtrie;
+	for (end = qname + len; len; end = p - 1) {
+		for (p = end; p > qname && p[-1] != '.'; p--)
+			;
+
+		if ((node = qnode_find(node, p, end - p)) == NULL)
+			return zone;
+		if (node->qn_zone)
+			zone = node->qn_zone;
+
+		if (p == qname) {
+			*apex = zone && node->qn_zone == zone;
+			break;
+		}
+	}
+
+	return zone;
+}
+
+/*
+ * Match the part of qname before end (which points just past a label)
+ * against the trie below node.  end is NULL when there's nothing left
+ * to match.
+ */
+static group_t *
+qnode_match(node, qname, end)
+	qnode_t		*node;
+	char const	*qname, *end;
+{
+char const	*p, *next;
+qnode_t		*child;
+group_t		*group;
+
+	if (end == NULL)
+		return node->qn_group;
+
+	for (p = end; p > qname && p[-1] != '.'; p--)
+		;
+	next = p > qname ? p - 1 : NULL;
+
+	if ((child = qnode_find(node, p, end - p)) != NULL &&
+	    (group = qnode_match(child, qname, next)) != NULL)
+		return group;
+
+	if (node->qn_wild && p != end)
+		return qnode_match(node->qn_wild, qname, next);
+
+	return NULL;
+}
+
+/*
+ * Find the child of node for a label.
+ */
+static qnode_t *
+qnode_find(node, label, len)
+	qnode_t		*node;
+	char const	*label;
+	size_t		 len;
+{
+int	lo = 0, hi = node->qn_nchildren - 1, mid, c;
+
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		c = label_cmp(label, len, node->qn_children[mid]->qn_label,
+				node->qn_children[mid]->qn_len);
+		if (c == 0)
+			return node->qn_children[mid];
+		if (c < 0)
+			hi = mid - 1;
+		else
+			lo = mid + 1;
+	}
+
+	return NULL;
+}
+
+/*
+ * Add a dotted name below node, creating any nodes needed, and return the
+ * node for its first label.  The trie must be sorted again afterwards.
+ */
+static qnode_t *
+qnode_insert(node, name, len)
+	qnode_t		*node;
+	char const	*name;
+	size_t		 len;
+{
+char const	*p, *end;
+qnode_t		*child, **newch;
+size_t		 i;
+int		 j;
+
+	for (end = name + len; len; end = p - 1) {
+		for (p = end; p > name && p[-1] != '.'; p--)
+			;
+
+		if (end - p == 1 && *p == '*') {
+			child = node->qn_wild;
+		} else {
+			child = NULL;
+			for (j = 0; j < node->qn_nchildren; j++)
+				if (label_cmp(p, end - p, node->qn_children[j]->qn_label,
+						node->qn_children[j]->qn_len) == 0) {
+					child = node->qn_children[j];
+					break;
+				}
+		}
+
+		if (child == NULL) {
+			if ((child = calloc(1, sizeof(qnode_t))) == NULL ||
+			    (child->qn_label = malloc(end - p + 1)) == NULL) {
+				syslog(LOG_ERR, "out of memory");
+				free(child);
+				return NULL;
+			}
+			child->qn_len = end - p;
+			for (i = 0; i < child->qn_len; i++)
+				child->qn_label[i] = tolower((unsigned char) p[i]);
+			child->qn_label[i] = 0;
+
+			if (end - p == 1 && *p == '*')
+				node->qn_wild = child;
+			else {
+				if ((newch = realloc(node->qn_children,
+						sizeof(qnode_t *) * (node->qn_nchildren + 1))) == NULL) {
+					syslog(LOG_ERR, "out of memory");
+					qnode_free(child);
+					return NULL;
+				}
+				node->qn_children = newch;
+				node->qn_children[node->qn_nchildren++] = child;
+			}
+		}
+
+		node = child;
+		if (p == name)
+			break;
+	}
+
+	return node;
+}
+
+static void
+qnode_sort(node)
+	qnode_t	*node;
+{
+int	i;
+
+	if (node->qn_nchildren > 1)
+		qsort(node->qn_children, node->qn_nchildren, sizeof(qnode_t *),
+				qnode_cmp);
+	for (i = 0; i < node->qn_nchildren; i++)
+		qnode_sort(node->qn_children[i]);
+	if (node->qn_wild)
+		qnode_sort(node->qn_wild);
+}
+
+static void
+qnode_free(node)
+	qnode_t	*node;
+{
+int	i;
+
+	if (node == NULL)
+		return;
+
+	for (i = 0; i < node->qn_nchildren; i++)
+		qnode_free(node->qn_children[i]);
+	qnode_free(node->qn_wild);
+	free(node->qn_children);
+	free(node->qn_label);
+	free(node);
+}
+
+static int
+qnode_cmp(a, b)
+	void const	*a, *b;
+{
+qnode_t const	*x = *(qnode_t * const *) a;
+qnode_t const	*y = *(qnode_t * const *) b;
+
+	return label_cmp(x->qn_label, x->qn_len, y->qn_label, y->qn_len);
+}
+
+/*
+ * Compare a label from a query (in any case) with one from the trie (in
+ * lower case).
+ */
+static int
+label_cmp(q, qlen, l, llen)
+	char const	*q, *l;
+	size_t		 qlen, llen;
+{
+size_t	i;
+int	c;
+
+	for (i = 0; i < qlen && i < llen; i++)
+		if ((c = tolower((unsigned char) q[i]) - (unsigned char) l[i]) != 0)
+			return c;
+
+	return (qlen > llen) - (qlen < llen);
+}